@@ -179,10 +179,86 @@ def virial_radius(sim, cen=None, overden=178, r_max=None, rho_def='matter'):
 
 
 def potential_minimum(sim):
-    i = sim["phi"].argmin()
+    """
+
+    Return the position of the particle with the lowest potential. If the
+    snapshot has no potential on disk, the self-potential of *sim* is
+    calculated instead (see :func:`pynbody.gravity.calc.self_potential`).
+
+    """
+    if 'phi' in sim.keys() or 'phi' in sim.loadable_keys():
+        phi = sim["phi"]
+    else:
+        import pynbody.gravity.calc as gravity
+        try:
+            phi = gravity.self_potential(sim)
+        except RuntimeError as e:
+            raise KeyError("No potential available: %s" % e)
+    i = phi.argmin()
     return sim["pos"][i].copy()
 
 
+def unbind(sim, mode='tree', theta=0.55, max_iterations=100, min_particles=10, num_threads=0):
+    """
+
+    Return the subset of *sim* which is gravitationally self-bound.
+
+    The particles whose kinetic energy (relative to the mass-weighted mean
+    velocity of the bound particles) plus self-potential is positive are
+    removed, and the process repeated for the remainder until none is
+    unbound, *min_particles* or fewer remain, or *max_iterations* is reached.
+    Thermal energy is not included.
+
+    The potential is found with the given *mode* ('direct', 'tree' or 'fmm';
+    see :func:`pynbody.gravity.calc.self_potential`). When fewer particles
+    are removed than remain, it is updated by subtracting the potential of
+    the removed particles, rather than recalculated from scratch.
+
+    """
+    import pynbody.gravity.calc as gravity
+
+    def potential_of(source, targets):
+        # softened pairwise, as in self_potential
+        positions, eps = targets['pos'].view(np.ndarray), util.get_eps(targets)
+        if mode == 'direct':
+            return gravity.direct(source, positions, num_threads=num_threads, ieps=eps)[0]
+        fn = {'tree': gravity.treecalc, 'fmm': gravity.fmm}[mode]
+        return fn(source, positions, theta=theta, num_threads=num_threads, ieps=eps)[0]
+
+    vel_units = sim['vel'].units
+    context = sim.conversion_context()
+    index = np.arange(len(sim))
+    bound = sim
+    phi = gravity.self_potential(sim, mode=mode, theta=theta, num_threads=num_threads)
+    phi = phi.in_units(vel_units ** 2, **context).view(np.ndarray)
+
+    for iteration in range(max_iterations):
+        if len(index) <= min_particles:
+            break
+        mass = bound['mass'].view(np.ndarray)
+        vel = bound['vel'].view(np.ndarray)
+        vcen = (mass[:, np.newaxis] * vel).sum(axis=0) / mass.sum()
+        energy = 0.5 * ((vel - vcen) ** 2).sum(axis=1) + phi
+        keep = energy < 0
+        n_removed = len(keep) - keep.sum()
+        logger.info("Unbinding iteration %d: removing %d of %d particles", iteration, n_removed, len(keep))
+        if n_removed == 0:
+            break
+
+        removed = bound[np.where(~keep)[0]]
+        index = index[keep]
+        bound = sim[index]
+        if n_removed < len(index):
+            phi_removed = potential_of(removed, bound)
+            phi = phi[keep] - phi_removed.in_units(vel_units ** 2, **context).view(np.ndarray)
+        else:
+            phi = potential_of(bound, bound)
+            gravity.remove_self_interaction(bound, phi, util.get_eps(bound))
+            phi = phi.in_units(vel_units ** 2, **context).view(np.ndarray)
+
+    return bound
+
+
 def hybrid_center(sim, r='3 kpc', **kwargs):
     """
 
@@ -94,7 +94,7 @@ class Profile:
     *j_circ*     : angular momentum of particles on circular orbits
 
     *v_circ* : circular velocity, aka rotation curve - calculated from
-     the midplane gravity, so this can be expensive
+     the midplane gravity, by default with a multipole expansion
 
     *E_circ*     : energy of particles on circular orbits in the midplane
 
@@ -669,9 +669,15 @@ def j_circ(p):
 
 
 @Profile.profile_property
-def v_circ(p, grav_sim=None):
+def v_circ(p, mode=None, grav_sim=None):
     """Circular velocity, i.e. rotation curve. Calculated by computing the gravity
-    in the midplane - can be expensive"""
+    in the midplane, with the given gravity *mode* (by default from the configuration
+    file's profile_gravity_calculation_mode, e.g. ``p['v_circ,direct']``), due to the
+    particles of *grav_sim* (by default those of the profile).
+
+    Note that *mode* was added before *grav_sim*, so that it can be given in the
+    ``p['v_circ,mode']`` syntax; this breaks calls passing *grav_sim* by position,
+    such as ``v_circ(p, sim)``, which must now be written ``v_circ(p, grav_sim=sim)``."""
 
     import pynbody.gravity.calc as gravity
 
@@ -694,7 +700,7 @@ def v_circ(p, grav_sim=None):
 
     start = process_time()
     rc = gravity.midplane_rot_curve(
-        grav_sim, p['rbins']).in_units(p.sim['vel'].units)
+        grav_sim, p['rbins'], mode=mode or config['profile_gravity_calculation_mode']).in_units(p.sim['vel'].units)
     end = process_time()
     logger.info("Rotation curve calculated in %5.3g s" % (end - start))
     return rc
@@ -707,11 +713,14 @@ def E_circ(p):
 
 
 @Profile.profile_property
-def pot(p):
-    """Calculates the potential in the midplane - can be expensive"""
+def pot(p, mode=None):
+    """Calculates the potential in the midplane, with the given gravity *mode* (by
+    default from the configuration file's profile_gravity_calculation_mode)"""
     #from . import gravity
     import pynbody.gravity.calc as gravity
 
+    from .. import config
+
     logger.warning(
         "Profile pot -- this routine assumes the disk is in the x-y plane")
 
@@ -722,7 +731,7 @@ def pot(p):
 
     start = process_time()
     pot = gravity.midplane_potential(
-        grav_sim, p['rbins']).in_units(p.sim['vel'].units ** 2)
+        grav_sim, p['rbins'], mode=mode or config['profile_gravity_calculation_mode']).in_units(p.sim['vel'].units ** 2)
     end = process_time()
     logger.info("Potential calculated in %5.3g s" % (end - start))
     return pot
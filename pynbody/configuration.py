@@ -70,6 +70,9 @@ def _get_basic_config_from_parser(config_parser):
 
     config['gravity_calculation_mode'] = config_parser.get(
         'general', 'gravity_calculation_mode')
+    config['profile_gravity_calculation_mode'] = config_parser.get(
+        'general', 'profile_gravity_calculation_mode')
+    config['gravity_softening'] = config_parser.get('general', 'gravity_softening')
     config['disk-fit-function'] = config_parser.get('general', 'disk-fit-function')
 
     return config
@@ -1 +1,46 @@
+import numpy as np
+
+from .. import config, snapshot
 from . import calc
+
+
+def _derived_gravity(sim):
+    """Return the potential and acceleration of the particles in *sim*, calculated (with
+    :func:`calc.treepm` in periodic boxes, or :func:`calc.treecalc` otherwise) once for the
+    whole of its ancestor and kept for as long as the positions, masses and softenings are
+    unchanged"""
+    ancestor = sim.ancestor
+    ipos = ancestor['pos'].view(np.ndarray)
+    mass = ancestor['mass']  # (not used here, but loading it changes the version read below)
+    try:
+        eps = calc.get_eps(ancestor)
+    except RuntimeError:
+        raise KeyError("Gravity cannot be derived without the softening lengths ('eps')")
+
+    # (taken once the arrays are loaded, which itself changes their versions)
+    key = (repr(ancestor.properties.get('boxsize', None)), repr(ancestor.properties.get('eps', None)),
+           config['gravity_softening'], [ancestor._array_version(name) for name in ('pos', 'mass', 'eps')])
+    cached = ancestor._get_persist(ancestor._inclusion_hash, '_derived_gravity')
+
+    if cached is None or cached[0] != key:
+        if 'boxsize' in ancestor.properties:
+            phi, acc = calc.treepm(ancestor, ipos, eps, ieps=eps)
+        else:
+            phi, acc = calc.treecalc(ancestor, ipos, eps, ieps=eps)
+        cached = (key, phi, acc)
+        ancestor._set_persist(ancestor._inclusion_hash, '_derived_gravity', cached)
+
+    index = sim.get_index_list(ancestor)
+    return cached[1][index], cached[2][index]
+
+
+@snapshot.simsnap.SimSnap.derived_quantity
+def phi(self):
+    """Gravitational potential, from the positions and masses of every particle in the snapshot"""
+    return _derived_gravity(self)[0]
+
+
+@snapshot.simsnap.SimSnap.derived_quantity
+def acc(self):
+    """Gravitational acceleration, from the positions and masses of every particle in the snapshot"""
+    return _derived_gravity(self)[1]
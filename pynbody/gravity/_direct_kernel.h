@@ -0,0 +1,117 @@
+/*
+ * Blocked kernels for direct-summation gravity, called from _gravity.pyx.
+ *
+ * The sources are given as separate (structure-of-arrays) x, y, z, mass and
+ * softening arrays. They are taken in blocks small enough to stay in the L1
+ * cache, and each block is applied to DIRECT_TARGETS target positions at a
+ * time, whose potentials and accelerations are kept in registers while the
+ * compiler vectorises the loop over the block's sources.
+ *
+ * A kernel is instantiated for each softening kernel of softening.h, and
+ * direct_block_f64 and direct_block_f32 choose between them. Each pair is
+ * softened according to the rule, given the targets' own softening lengths
+ * (which are zero for positions that are not particles).
+ *
+ * The _f32 kernels read single-precision sources and do the pairwise
+ * arithmetic in single precision (twice as many pairs per vector), but add
+ * the sum over each block into double-precision totals, so that rounding
+ * errors do not grow with the number of sources.
+ */
+
+#ifndef DIRECT_KERNEL_H
+#define DIRECT_KERNEL_H
+
+#include <math.h>
+#include <stddef.h>
+
+#include "softening.h"
+
+#define DIRECT_BLOCK 512
+#define DIRECT_TARGETS 4
+
+#define DIRECT_KERNEL(NAME, REAL, SOFT, PAIR)                                                   \
+static void NAME(const REAL *sx, const REAL *sy, const REAL *sz, const REAL *sm,                \
+                 const REAL *seps, ptrdiff_t nsrc, const double *tpos, const REAL *teps,        \
+                 ptrdiff_t ntarget, int rule, double *pot, double *acc)                         \
+{                                                                                               \
+    ptrdiff_t b, t, j, k, bn;                                                                   \
+    for (t = 0; t < ntarget; ++t) {                                                             \
+        pot[t] = 0;                                                                             \
+        acc[3*t] = acc[3*t+1] = acc[3*t+2] = 0;                                                 \
+    }                                                                                           \
+    for (b = 0; b < nsrc; b += DIRECT_BLOCK) {                                                  \
+        bn = nsrc - b < DIRECT_BLOCK ? nsrc - b : DIRECT_BLOCK;                                 \
+        for (t = 0; t < ntarget; t += DIRECT_TARGETS) {                                         \
+            REAL x[DIRECT_TARGETS], y[DIRECT_TARGETS], z[DIRECT_TARGETS], e[DIRECT_TARGETS];    \
+            REAL p0 = 0, p1 = 0, p2 = 0, p3 = 0;                                                \
+            REAL ax0 = 0, ax1 = 0, ax2 = 0, ax3 = 0;                                            \
+            REAL ay0 = 0, ay1 = 0, ay2 = 0, ay3 = 0;                                            \
+            REAL az0 = 0, az1 = 0, az2 = 0, az3 = 0;                                            \
+            const REAL *bx = sx + b, *by = sy + b, *bz = sz + b, *bm = sm + b, *be = seps + b;  \
+            /* a short final group repeats its last target; the repeats are discarded */        \
+            for (k = 0; k < DIRECT_TARGETS; ++k) {                                              \
+                ptrdiff_t tk = t + k < ntarget ? t + k : ntarget - 1;                           \
+                x[k] = (REAL)tpos[3*tk];                                                        \
+                y[k] = (REAL)tpos[3*tk+1];                                                      \
+                z[k] = (REAL)tpos[3*tk+2];                                                      \
+                e[k] = teps[tk];                                                                \
+            }                                                                                   \
+            _Pragma("omp simd reduction(+:p0,p1,p2,p3,ax0,ax1,ax2,ax3,ay0,ay1,ay2,ay3,az0,az1,az2,az3)") \
+            for (j = 0; j < bn; ++j) {                                                          \
+                REAL dx, dy, dz, dir, dir3, mdir3;                                              \
+                DIRECT_PAIR(0, SOFT, PAIR) DIRECT_PAIR(1, SOFT, PAIR)                           \
+                DIRECT_PAIR(2, SOFT, PAIR) DIRECT_PAIR(3, SOFT, PAIR)                           \
+            }                                                                                   \
+            DIRECT_STORE(0) DIRECT_STORE(1) DIRECT_STORE(2) DIRECT_STORE(3)                     \
+        }                                                                                       \
+    }                                                                                           \
+}
+
+/* the interaction of source j with target k, accumulated in registers */
+#define DIRECT_PAIR(K, SOFT, PAIR)                                                              \
+    dx = bx[j] - x[K];                                                                          \
+    dy = by[j] - y[K];                                                                          \
+    dz = bz[j] - z[K];                                                                          \
+    SOFT(dx*dx + dy*dy + dz*dz, PAIR(be[j], e[K], rule), &dir, &dir3);                          \
+    mdir3 = bm[j]*dir3;                                                                         \
+    p##K -= bm[j]*dir;                                                                          \
+    ax##K += dx*mdir3;                                                                          \
+    ay##K += dy*mdir3;                                                                          \
+    az##K += dz*mdir3;
+
+#define DIRECT_STORE(K)                                                                         \
+    if (t + K < ntarget) {                                                                      \
+        pot[t+K] += p##K;                                                                       \
+        acc[3*(t+K)] += ax##K;                                                                  \
+        acc[3*(t+K)+1] += ay##K;                                                                \
+        acc[3*(t+K)+2] += az##K;                                                                \
+    }
+
+DIRECT_KERNEL(direct_block_plummer_f64, double, softPlummer, softPair)
+DIRECT_KERNEL(direct_block_spline_f64, double, softSpline, softPair)
+DIRECT_KERNEL(direct_block_wendland_f64, double, softWendland, softPair)
+DIRECT_KERNEL(direct_block_plummer_f32, float, softPlummerF, softPairF)
+DIRECT_KERNEL(direct_block_spline_f32, float, softSplineF, softPairF)
+DIRECT_KERNEL(direct_block_wendland_f32, float, softWendlandF, softPairF)
+
+#define DIRECT_DISPATCH(NAME, REAL, PLUMMER, SPLINE, WENDLAND)                                  \
+static void NAME(int kernel, const REAL *sx, const REAL *sy, const REAL *sz, const REAL *sm,    \
+                 const REAL *seps, ptrdiff_t nsrc, const double *tpos, const REAL *teps,        \
+                 ptrdiff_t ntarget, int rule, double *pot, double *acc)                         \
+{                                                                                               \
+    switch (kernel) {                                                                           \
+    case SOFT_SPLINE:                                                                           \
+        SPLINE(sx, sy, sz, sm, seps, nsrc, tpos, teps, ntarget, rule, pot, acc); break;         \
+    case SOFT_WENDLAND:                                                                         \
+        WENDLAND(sx, sy, sz, sm, seps, nsrc, tpos, teps, ntarget, rule, pot, acc); break;       \
+    default:                                                                                    \
+        PLUMMER(sx, sy, sz, sm, seps, nsrc, tpos, teps, ntarget, rule, pot, acc);               \
+    }                                                                                           \
+}
+
+DIRECT_DISPATCH(direct_block_f64, double, direct_block_plummer_f64, direct_block_spline_f64,
+                direct_block_wendland_f64)
+DIRECT_DISPATCH(direct_block_f32, float, direct_block_plummer_f32, direct_block_spline_f32,
+                direct_block_wendland_f32)
+
+#endif
@@ -7,27 +7,56 @@ import numpy as np
 from pynbody import array, config, openmp, units
 from pynbody.util import get_eps
 
+from pynbody.gravity import softening as softening_kernels
+
 cimport numpy as np
+from cython.parallel cimport prange
+
+cdef extern from "math.h" nogil:
+    double floor(double)
 
-DTYPE = np.double
+cdef extern from "_direct_kernel.h" nogil:
+    void direct_block_f64(int kernel, const double *sx, const double *sy, const double *sz, const double *sm,
+                          const double *seps, Py_ssize_t nsrc, const double *tpos, const double *teps,
+                          Py_ssize_t ntarget, int rule, double *pot, double *acc)
+    void direct_block_f32(int kernel, const float *sx, const float *sy, const float *sz, const float *sm,
+                          const float *seps, Py_ssize_t nsrc, const double *tpos, const float *teps,
+                          Py_ssize_t ntarget, int rule, double *pot, double *acc)
 
-ctypedef fused DTYPE_t:
-    np.float32_t
-    np.float64_t
+# number of target positions handed to a thread at once; each block of sources is
+# reused for all of them while it is in the cache
+cdef Py_ssize_t TARGET_CHUNK = 64
 
-cdef extern from "math.h" nogil:
-      double sqrt(double)
-      float sqrt(float)
+
+def _power_of_two_scale(*values):
+    """Return the power of two nearest above the largest of *values*, or 1 if they are all zero"""
+    largest = max(values)
+    if not np.isfinite(largest) or largest <= 0:
+        return 1.0
+    return float(np.ldexp(1.0, np.frexp(largest)[1]))
 
 
 @cython.cdivision(True)
 @cython.boundscheck(False)
-def direct(f, np.ndarray[DTYPE_t, ndim=2] ipos, eps=None, int num_threads = 0):
+@cython.wraparound(False)
+def direct(f, ipos, eps=None, int num_threads = 0, mixed_precision = False, softening = None, ieps = None,
+           softening_rule = 'max'):
+    """Calculate the potential and acceleration at positions *ipos* by direct summation over the particles in *f*.
 
-    from cython.parallel cimport prange
+    Each particle is softened with the *softening* kernel ('plummer', 'spline' or 'wendland'; default from
+    the configuration file) on the scale *eps* (default from the snapshot). If the positions are themselves
+    particles with softening lengths *ieps*, each pair is softened with the larger of the two or their mean,
+    according to *softening_rule* (see :mod:`pynbody.gravity.softening`).
+    Returns (phi, acc) in units derived from the snapshot's, in the precision of *ipos*.
 
-    global config
+    The particles are summed in blocks which stay in cache while they are applied to
+    groups of target positions, using vectorised arithmetic. If *mixed_precision* is True,
+    the pairwise interactions are evaluated in single precision (roughly twice as fast)
+    while the sums over each block are accumulated in double precision; the resulting
+    relative errors are around 1e-7.
+    """
 
+    global config
 
     if num_threads == 0 :
         num_threads = int(config["number_of_threads"])
@@ -43,38 +72,251 @@ def direct(f, np.ndarray[DTYPE_t, ndim=2] ipos, eps=None, int num_threads = 0):
     if eps is None:
         eps = get_eps(f)
 
-    cdef unsigned int nips = len(ipos)
-    cdef np.ndarray[DTYPE_t, ndim=2] m_by_r2 = np.zeros((nips,3), dtype = ipos.dtype)
-    cdef np.ndarray[DTYPE_t, ndim=1] m_by_r = np.zeros(nips, dtype = ipos.dtype)
-    cdef np.ndarray[DTYPE_t, ndim=2] pos = f['pos'].view(np.ndarray)
-    cdef np.ndarray[DTYPE_t, ndim=1] mass = f['mass'].view(np.ndarray)
-    cdef unsigned int n = len(mass)
-    cdef np.ndarray[DTYPE_t, ndim=1] epssq = eps * eps
+    ipos = np.asarray(ipos)
+    out_dtype = np.float32 if ipos.dtype == np.float32 else np.float64
+
+    pos = f['pos'].view(np.ndarray)
+    mass = f['mass'].view(np.ndarray)
+    cdef Py_ssize_t n = len(mass)
+    cdef Py_ssize_t nips = len(ipos)
+
+    cdef np.ndarray[np.float64_t, ndim=2] tpos = np.array(ipos, dtype=np.float64, order='C').reshape((nips, 3))
+
+    cdef int kernel, rule
+    kernel, rule = softening_kernels.parameters(softening, softening_rule)
+
+    eps = np.broadcast_to(np.asarray(eps, dtype=np.float64), (n,))
+    if ieps is None:
+        teps = np.zeros(nips)
+    else:
+        teps = np.broadcast_to(np.asarray(ieps, dtype=np.float64), (nips,))
+
+    cdef bint single = bool(mixed_precision)
+    length = mass_scale = 1.0
+    if single and nips > 0:
+        # single precision positions are only accurate relative to a nearby origin, and
+        # the units are changed so that positions and masses are of order unity, keeping
+        # every intermediate within single precision range (powers of two make this exact)
+        centre = 0.5 * (tpos.min(axis=0) + tpos.max(axis=0))
+        tpos -= centre
+        pos = pos - centre
+        length = _power_of_two_scale(np.abs(pos).max(initial=0), np.abs(tpos).max(initial=0),
+                                     eps.max(initial=0), teps.max(initial=0))
+        mass_scale = _power_of_two_scale(np.abs(mass).max(initial=0))
+        tpos /= length
+
+    # sources in structure-of-arrays form: x, y, z, mass, softening
+    src = np.empty((5, n), dtype=np.float32 if single else np.float64)
+    src[:3] = pos.T / length
+    src[3] = mass / mass_scale
+    src[4] = eps / length
+    tsoft = np.ascontiguousarray(teps / length, dtype=src.dtype)
+
+    cdef np.ndarray[np.float64_t, ndim=1] pot = np.empty(nips)
+    cdef np.ndarray[np.float64_t, ndim=2] acc = np.empty((nips, 3))
+
+    cdef char *src_data = np.PyArray_BYTES(src)
+    cdef const double *s64 = <const double *> src_data
+    cdef const float *s32 = <const float *> src_data
+    cdef const double *tpos_data = &tpos[0, 0] if nips > 0 else NULL
+    cdef char *tsoft_data = np.PyArray_BYTES(tsoft)
+    cdef const double *t64 = <const double *> tsoft_data
+    cdef const float *t32 = <const float *> tsoft_data
+    cdef double *pot_data = &pot[0] if nips > 0 else NULL
+    cdef double *acc_data = &acc[0, 0] if nips > 0 else NULL
+
+    cdef Py_ssize_t nchunk = (nips + TARGET_CHUNK - 1) // TARGET_CHUNK
+    cdef Py_ssize_t c, start, count
+
+    for c in prange(nchunk, nogil=True, schedule='dynamic'):
+        start = c * TARGET_CHUNK
+        count = nips - start
+        if count > TARGET_CHUNK:
+            count = TARGET_CHUNK
+        if single:
+            direct_block_f32(kernel, s32, s32 + n, s32 + 2*n, s32 + 3*n, s32 + 4*n, n,
+                             tpos_data + 3*start, t32 + start, count, rule, pot_data + start, acc_data + 3*start)
+        else:
+            direct_block_f64(kernel, s64, s64 + n, s64 + 2*n, s64 + 3*n, s64 + 4*n, n,
+                             tpos_data + 3*start, t64 + start, count, rule, pot_data + start, acc_data + 3*start)
+
+    pot *= mass_scale / length
+    acc *= mass_scale / length**2
+
+    phi = pot.astype(out_dtype).view(array.SimArray)
+    accel = acc.astype(out_dtype).view(array.SimArray)
+    phi.units = f['mass'].units/f['pos'].units
+    accel.units = f['mass'].units/f['pos'].units**2
+
+    phi*=units.G
+    accel*=units.G
+
+    return phi, accel
+
+
+@cython.cdivision(True)
+cdef inline long mesh_weights(double x, double x0, double dx_inv, int order, double *w) noexcept nogil:
+    """Set w[0..order-1] to the weights of a particle at x in the mesh cells starting from the returned index.
+
+    order is 1, 2 or 3 for nearest grid point, cloud-in-cell or triangular-shaped cloud assignment;
+    cell i is centred on x0 + (i+0.5)/dx_inv."""
+    cdef double u = (x - x0)*dx_inv - 0.5, d
+    cdef long i
+    if order == 1:
+        i = <long>floor(u + 0.5)
+        w[0] = 1
+    elif order == 2:
+        i = <long>floor(u)
+        d = u - i
+        w[0] = 1 - d
+        w[1] = d
+    else:
+        i = <long>floor(u + 0.5)
+        d = u - i
+        w[0] = 0.5*(0.5 - d)*(0.5 - d)
+        w[1] = 0.75 - d*d
+        w[2] = 0.5*(0.5 + d)*(0.5 + d)
+        i -= 1
+    return i
+
+
+@cython.cdivision(True)
+cdef inline long wrap_cell(long i, long n) noexcept nogil:
+    i = i % n
+    return i + n if i < 0 else i
+
 
-    cdef unsigned int pi, i
-    cdef double dx, dy, dz, mass_i, epssq_i, drsoft, drsoft3
+@cython.boundscheck(False)
+@cython.cdivision(True)
+cdef void mesh_assign_items(double *grid, long ng, const np.int64_t *items, Py_ssize_t n_items,
+                            const double *pos, const double *mass, const double *x0, double dx_inv,
+                            int order) noexcept nogil:
+    cdef double wx[3]
+    cdef double wy[3]
+    cdef double wz[3]
+    cdef long ix, iy, iz, a, b, c, ia, ib
+    cdef Py_ssize_t j, p
+    cdef double m
+
+    for j in range(n_items):
+        p = items[j]
+        m = mass[p]
+        ix = mesh_weights(pos[3*p], x0[0], dx_inv, order, wx)
+        iy = mesh_weights(pos[3*p+1], x0[1], dx_inv, order, wy)
+        iz = mesh_weights(pos[3*p+2], x0[2], dx_inv, order, wz)
+        for a in range(order):
+            ia = wrap_cell(ix + a, ng)
+            for b in range(order):
+                ib = wrap_cell(iy + b, ng)
+                for c in range(order):
+                    grid[(ia*ng + ib)*ng + wrap_cell(iz + c, ng)] += m*wx[a]*wy[b]*wz[c]
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def mesh_assign(pos, mass, int ng, x0, double dx, int order, int num_threads=1):
+    """Return the ng^3 grid of the masses assigned to cells of size dx with lower corner x0.
+
+    Particle footprints that extend beyond the grid wrap around periodically. The grid is divided
+    into x-slabs at least three cells thick, so that a footprint starting in one slab only reaches
+    the next. Even and then odd slabs are filled in parallel (with a final pass for the last slab
+    if the count is odd), visiting particles in serial order, so the result does not depend on the
+    number of threads."""
 
-    for pi in prange(nips, nogil=True, schedule='static'):
+    cdef np.ndarray[np.float64_t, ndim=2] pos_c = np.ascontiguousarray(pos, dtype=np.float64)
+    cdef np.ndarray[np.float64_t, ndim=1] mass_c = np.ascontiguousarray(mass, dtype=np.float64)
+    cdef np.ndarray[np.float64_t, ndim=1] x0_c = np.asarray(x0, dtype=np.float64)
+    cdef Py_ssize_t n = len(mass_c), i
+    cdef double dx_inv = 1.0/dx
+    cdef double w[3]
+    cdef long n_slabs = max(1, ng // 3), slab, colour
+
+    assert pos_c.shape[1] == 3 and len(pos_c) == n, "Inconsistent array shapes passed to mesh_assign"
+
+    cdef np.ndarray[np.int64_t, ndim=1] slab_of_cell = (np.arange(ng, dtype=np.int64) * n_slabs) // ng
+    cdef np.ndarray[np.int64_t, ndim=1] particle_slab = np.empty(n, dtype=np.int64)
+    cdef np.ndarray[np.int64_t, ndim=1] slab_colour = np.arange(n_slabs, dtype=np.int64) % 2
+    if n_slabs % 2 and n_slabs > 1:
+        # the last slab neighbours slab 0 across the periodic boundary
+        slab_colour[n_slabs - 1] = 2
+    cdef np.ndarray[np.float64_t, ndim=3] grid = np.zeros((ng, ng, ng))
+
+    with nogil:
         for i in range(n):
-            mass_i = mass[i]
-            epssq_i = epssq[i]
-            dx = ipos[pi,0] - pos[i,0]
-            dy = ipos[pi,1] - pos[i,1]
-            dz = ipos[pi,2] - pos[i,2]
-            drsoft = 1.0/sqrt(dx*dx + dy*dy + dz*dz + epssq_i)
-            drsoft3 = drsoft*drsoft*drsoft
-            m_by_r[pi] += mass_i * drsoft
-            m_by_r2[pi,0] += mass_i*dx * drsoft3
-            m_by_r2[pi,1] += mass_i*dy * drsoft3
-            m_by_r2[pi,2] += mass_i*dz * drsoft3
-
-
-    m_by_r = m_by_r.view(array.SimArray)
-    m_by_r2 = m_by_r2.view(array.SimArray)
-    m_by_r.units = f['mass'].units/f['pos'].units
-    m_by_r2.units = f['mass'].units/f['pos'].units**2
-
-    m_by_r*=units.G
-    m_by_r2*=units.G
-
-    return -m_by_r, -m_by_r2
+            particle_slab[i] = slab_of_cell[wrap_cell(mesh_weights(pos_c[i, 0], x0_c[0], dx_inv, order, w), ng)]
+
+    # counting sort by slab, which keeps each slab's particles in their original order
+    cdef np.ndarray[np.int64_t, ndim=1] slab_start = np.zeros(n_slabs + 1, dtype=np.int64)
+    slab_start[1:] = np.cumsum(np.bincount(particle_slab, minlength=n_slabs))
+    cdef np.ndarray[np.int64_t, ndim=1] items = np.argsort(particle_slab, kind='stable')
+
+    cdef double *grid_p = &grid[0, 0, 0]
+    cdef np.int64_t *items_p = <np.int64_t *> items.data
+    cdef np.int64_t *slab_start_p = <np.int64_t *> slab_start.data
+    cdef np.int64_t *slab_colour_p = <np.int64_t *> slab_colour.data
+    cdef double *pos_p = <double *> pos_c.data
+    cdef double *mass_p = <double *> mass_c.data
+    cdef double *x0_p = <double *> x0_c.data
+
+    with nogil:
+        for colour in range(3):
+            for slab in prange(n_slabs, schedule='dynamic', chunksize=1, num_threads=num_threads):
+                if slab_colour_p[slab] == colour:
+                    mesh_assign_items(grid_p, ng, &items_p[slab_start_p[slab]],
+                                      slab_start_p[slab + 1] - slab_start_p[slab],
+                                      pos_p, mass_p, x0_p, dx_inv, order)
+
+    return grid
+
+
+@cython.boundscheck(False)
+@cython.cdivision(True)
+cdef void mesh_interpolate_one(const double *grids, long k, long ng, const double *pos, const double *x0,
+                               double dx_inv, int order, double *result) noexcept nogil:
+    cdef double wx[3]
+    cdef double wy[3]
+    cdef double wz[3]
+    cdef double w
+    cdef long ix, iy, iz, a, b, c, q, cell, ng3 = ng*ng*ng
+
+    ix = mesh_weights(pos[0], x0[0], dx_inv, order, wx)
+    iy = mesh_weights(pos[1], x0[1], dx_inv, order, wy)
+    iz = mesh_weights(pos[2], x0[2], dx_inv, order, wz)
+    for q in range(k):
+        result[q] = 0
+    for a in range(order):
+        for b in range(order):
+            for c in range(order):
+                w = wx[a]*wy[b]*wz[c]
+                cell = (wrap_cell(ix + a, ng)*ng + wrap_cell(iy + b, ng))*ng + wrap_cell(iz + c, ng)
+                for q in range(k):
+                    result[q] += w*grids[q*ng3 + cell]
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def mesh_interpolate(grids, pos, x0, double dx, int order, int num_threads=1):
+    """Interpolate each of the k ng^3 grids in grids (shape (k, ng, ng, ng)) to the positions pos,
+    with the same weights as mesh_assign, returning an array of shape (len(pos), k)"""
+
+    cdef np.ndarray[np.float64_t, ndim=4] grids_c = np.ascontiguousarray(grids, dtype=np.float64)
+    cdef np.ndarray[np.float64_t, ndim=2] pos_c = np.ascontiguousarray(pos, dtype=np.float64)
+    cdef np.ndarray[np.float64_t, ndim=1] x0_c = np.asarray(x0, dtype=np.float64)
+    cdef Py_ssize_t n = len(pos_c), p
+    cdef long k = grids_c.shape[0], ng = grids_c.shape[1]
+    cdef np.ndarray[np.float64_t, ndim=2] result = np.empty((n, k))
+
+    assert grids_c.shape[2] == grids_c.shape[3] == ng, "Interpolation grids must be cubic"
+    assert pos_c.shape[1] == 3, "Positions must have shape (n, 3)"
+
+    cdef double *grids_p = <double *> grids_c.data
+    cdef double *pos_p = <double *> pos_c.data
+    cdef double *x0_p = <double *> x0_c.data
+    cdef double *result_p = <double *> result.data
+
+    for p in prange(n, nogil=True, schedule='static', num_threads=num_threads):
+        mesh_interpolate_one(grids_p, k, ng, pos_p + 3*p, x0_p, 1.0/dx, order, result_p + k*p)
+
+    return result
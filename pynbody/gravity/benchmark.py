@@ -0,0 +1,349 @@
+"""
+
+gravity.benchmark
+=================
+
+Accuracy and throughput benchmark for the gravity solvers.
+
+Three kinds of particle set are generated: an isolated Hernquist sphere, an
+isolated NFW halo holding an exponential disc, and a clustered periodic
+cosmological box (see :func:`pynbody.sph.benchmark.cosmological_box`). For
+each, reference accelerations are found at a random sample of the particles:
+by double precision direct summation for the isolated sets, and by Ewald
+summation for the periodic box, both with the same Plummer softening as the
+solvers.
+
+Every gravity mode that applies to a set (``direct``, ``tree``, ``tree_f32``
+(the tree in mixed precision), ``fmm``, ``multipole`` and ``pm`` for isolated
+sets; ``pm`` and ``treepm`` for periodic boxes) is then timed calculating the forces on all the particles, for each
+particle number, opening angle and thread count requested. The percentiles of
+the relative force errors are reported along with the wall time and the peak
+memory used, and can be written to a JSON file for tracking between releases.
+
+Run from the command line, e.g.::
+
+  python -m pynbody.gravity.benchmark --n 10000,100000 --theta 0.3,0.55,0.8 --threads 1,8 --json gravity.json
+
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import sys
+import threading
+import time
+
+import numpy as np
+import scipy.special
+
+from .. import __version__, config, new, openmp
+from ..sph.benchmark import cosmological_box
+from . import calc
+from . import multipole as multipole_solver
+
+#: Names of the particle sets, and whether each is periodic
+SETS = {'hernquist': False, 'nfw_disc': False, 'cosmological': True}
+
+#: For each gravity mode, the kinds of set it applies to (periodic or not) and whether it takes an opening
+#: angle and a thread count
+MODES = {'direct': {'periodic': (False,), 'theta': False, 'threads': True},
+         'tree': {'periodic': (False,), 'theta': True, 'threads': True},
+         'tree_f32': {'periodic': (False,), 'theta': True, 'threads': True},
+         'fmm': {'periodic': (False,), 'theta': True, 'threads': True},
+         'multipole': {'periodic': (False,), 'theta': False, 'threads': False},
+         'pm': {'periodic': (False, True), 'theta': False, 'threads': True},
+         'treepm': {'periodic': (True,), 'theta': True, 'threads': True}}
+
+#: Percentiles of the relative force error that are reported
+PERCENTILES = (50, 90, 99)
+
+
+def _softening(n, scale):
+    """A softening length for *n* particles in a system of the given *scale*, shrinking with the mean spacing"""
+    return 0.5 * scale * n ** (-1.0 / 3)
+
+
+def hernquist(n, a=1.0, r_max=100.0, seed=0):
+    """Return positions, masses and softening lengths for *n* particles sampling a Hernquist sphere of unit mass
+    and scale radius *a*, truncated at *r_max* scale radii"""
+    rng = np.random.default_rng(seed)
+    u = np.sqrt(rng.uniform(0, (r_max / (1 + r_max)) ** 2, size=n))
+    r = a * u / (1 - u)
+    direction = rng.normal(size=(n, 3))
+    direction /= np.linalg.norm(direction, axis=1)[:, np.newaxis]
+    return direction * r[:, np.newaxis], np.full(n, 1.0 / n), np.full(n, _softening(n, a))
+
+
+def nfw_disc(n, r_s=1.0, concentration=10.0, disc_fraction=0.1, r_d=0.2, z_d=0.02, seed=0):
+    """Return positions, masses and softening lengths for *n* equal-mass particles sampling an NFW halo with scale
+    radius *r_s*, truncated at *concentration* scale radii, holding an exponential disc in the x-y plane with
+    scale length *r_d*, sech^2 scale height *z_d* and a fraction *disc_fraction* of the total mass"""
+    rng = np.random.default_rng(seed)
+    n_disc = int(round(disc_fraction * n))
+    n_halo = n - n_disc
+
+    # the halo radii, by inverting the cumulative mass profile
+    x = np.linspace(0, concentration, 4097)
+    mass_profile = np.log1p(x) - x / (1 + x)
+    r = r_s * np.interp(rng.uniform(0, mass_profile[-1], size=n_halo), mass_profile, x)
+    direction = rng.normal(size=(n_halo, 3))
+    direction /= np.linalg.norm(direction, axis=1)[:, np.newaxis]
+    halo = direction * r[:, np.newaxis]
+
+    # surface density exp(-R/r_d) makes R gamma-distributed; sech^2 in z has an arctanh quantile function
+    radius = rng.gamma(2.0, r_d, size=n_disc)
+    azimuth = rng.uniform(0, 2 * np.pi, size=n_disc)
+    z = z_d * np.arctanh(rng.uniform(-1 + 1e-12, 1 - 1e-12, size=n_disc))
+    disc = np.stack((radius * np.cos(azimuth), radius * np.sin(azimuth), z), axis=1)
+
+    return np.concatenate((halo, disc)), np.full(n, 1.0 / n), np.full(n, _softening(n, r_s))
+
+
+def cosmological(n, seed=0):
+    """Return positions, masses and softening lengths for about *n* particles in a clustered periodic unit box"""
+    grid = max(int(round(n ** (1.0 / 3))), 2)
+    pos, mass = cosmological_box(grid, seed=seed)
+    return pos, mass, np.full(len(mass), 0.02 / grid)
+
+
+def _ewald_sum(pos, mass, eps, ipos, boxsize, chunk=4096):
+    """Potential and acceleration (G=1) at *ipos* of Plummer-softened particles in a periodic box, with zero mean
+    potential, by Ewald summation. The real-space sum covers the nearest 27 images and the Fourier sum the modes
+    with wavenumbers up to 5 in each direction, which is accurate to about 1e-9 with the splitting used here."""
+    alpha = 3.0 / boxsize
+    root_pi = np.sqrt(np.pi)
+    images = np.arange(-1, 2)
+    shifts = boxsize * np.stack(np.meshgrid(images, images, images, indexing='ij'), axis=-1).reshape((-1, 3))
+
+    phi = np.full(len(ipos), np.pi * mass.sum() / (boxsize ** 3 * alpha ** 2))
+    acc = np.zeros((len(ipos), 3))
+
+    # real space: the softened potential of each image less that of a Gaussian cloud, finite as r -> 0
+    targets_per_chunk = max(chunk * 64 // len(mass), 1)
+    for start in range(0, len(ipos), targets_per_chunk):
+        sep = ipos[start:start + targets_per_chunk, np.newaxis, :] - pos[np.newaxis, :, :]
+        sep -= boxsize * np.round(sep / boxsize)
+        for shift in shifts:
+            s = sep + shift
+            r = np.sqrt((s ** 2).sum(axis=2))
+            x = alpha * r
+            small = x < 1e-4
+            r_safe = np.where(small, 1.0, r)
+            erf_by_r = np.where(small, 2 * alpha / root_pi, scipy.special.erf(x) / r_safe)
+            cloud_force = np.where(small, -4 * alpha ** 3 / (3 * root_pi),
+                                   (2 * alpha / root_pi * np.exp(-x ** 2) - erf_by_r) / r_safe ** 2)
+            softened = 1 / np.sqrt(r ** 2 + eps ** 2)
+            phi[start:start + targets_per_chunk] -= (mass * (softened - erf_by_r)).sum(axis=1)
+            acc[start:start + targets_per_chunk] -= ((mass * (softened ** 3 + cloud_force))[:, :, np.newaxis]
+                                                     * s).sum(axis=1)
+
+    # Fourier space, from the structure factor of the particles built up one dimension at a time
+    modes = np.arange(-5, 6)
+    k1 = 2 * np.pi / boxsize * modes
+    structure = np.zeros((len(modes),) * 3, dtype=np.complex128)
+    for start in range(0, len(mass), chunk):
+        phase = np.exp(-1j * pos[start:start + chunk, :, np.newaxis] * k1)
+        structure += np.einsum('j,ja,jb,jc->abc', mass[start:start + chunk],
+                               phase[:, 0], phase[:, 1], phase[:, 2])
+    kx, ky, kz = np.meshgrid(k1, k1, k1, indexing='ij')
+    k = np.stack((kx, ky, kz), axis=-1).reshape((-1, 3))
+    k2 = (k ** 2).sum(axis=1)
+    nonzero = k2 > 0
+    k, k2 = k[nonzero], k2[nonzero]
+    weight = 4 * np.pi / boxsize ** 3 * np.exp(-k2 / (4 * alpha ** 2)) / k2 * structure.ravel()[nonzero]
+
+    for start in range(0, len(ipos), chunk):
+        wave = weight * np.exp(1j * ipos[start:start + chunk] @ k.T)
+        phi[start:start + chunk] -= wave.real.sum(axis=1)
+        acc[start:start + chunk] -= wave.imag @ k
+
+    return phi, acc
+
+
+class _PeakMemory:
+    """Context manager sampling the resident memory of the process in a background thread, recording the peak
+    above its value on entry (in MB), or None where the resident memory cannot be read"""
+
+    _statm = '/proc/self/statm'
+
+    def __init__(self, interval=1e-3):
+        self.interval = interval
+        self.peak = None
+
+    def _resident(self):
+        with open(self._statm) as f:
+            return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+
+    def _sample(self):
+        while not self._done.wait(self.interval):
+            self._max = max(self._max, self._resident())
+
+    def __enter__(self):
+        if not os.path.exists(self._statm):
+            return self
+        self._baseline = self._max = self._resident()
+        self._done = threading.Event()
+        self._thread = threading.Thread(target=self._sample, daemon=True)
+        self._thread.start()
+        return self
+
+    def __exit__(self, *exc):
+        if os.path.exists(self._statm):
+            self._done.set()
+            self._thread.join()
+            self._max = max(self._max, self._resident())
+            self.peak = (self._max - self._baseline) / 2 ** 20
+        return False
+
+
+def _snapshot(pos, mass, eps, periodic):
+    f = new(dm=len(mass))
+    f['pos'] = pos
+    f['mass'] = mass
+    f['eps'] = eps
+    f['pos'].units = 'kpc'
+    f['mass'].units = 'Msol'
+    f['eps'].units = 'kpc'
+    if periodic:
+        f.properties['boxsize'] = 1.0 * f['pos'].units
+    return f
+
+
+def _calculate(f, mode, theta, threads):
+    """Return the potential and acceleration (with G=1) of every particle in *f* with the given *mode*"""
+    ipos = f['pos'].view(np.ndarray)
+    eps = f['eps'].view(np.ndarray)
+    if mode == 'multipole':
+        # built directly, rather than through calc.multipole, which would keep it between repeats
+        acc, phi = multipole_solver.MultipoleExpansion(ipos, f['mass'].view(np.ndarray)).calc(ipos)
+        return phi, acc
+
+    kwargs = {'num_threads': threads}
+    if theta is not None:
+        kwargs['theta'] = theta
+    if mode == 'tree_f32':
+        kwargs['mixed_precision'] = True
+    fn = {'direct': calc.direct, 'tree': calc.treecalc, 'tree_f32': calc.treecalc, 'fmm': calc.fmm, 'pm': calc.pm,
+          'treepm': calc.treepm}[mode]
+    # the solvers all return values with G=1, in units which carry the G
+    phi, acc = fn(f, ipos, eps, **kwargs)
+    return phi.view(np.ndarray), acc.view(np.ndarray)
+
+
+def _errors(phi, acc, phi_ref, acc_ref):
+    """Percentiles of the force errors relative to the reference force, and the median potential error relative to
+    the rms reference potential (since a periodic potential can pass through zero)"""
+    force_error = np.linalg.norm(acc - acc_ref, axis=1) / np.linalg.norm(acc_ref, axis=1)
+    result = {'force_error_p%d' % p: float(v) for p, v in zip(PERCENTILES, np.percentile(force_error, PERCENTILES))}
+    result['force_error_max'] = float(force_error.max())
+    result['potential_error_p50'] = float(np.median(np.abs(phi - phi_ref)) / np.sqrt(np.mean(phi_ref ** 2)))
+    return result
+
+
+def run(sets=tuple(SETS), n=(10000, 100000), modes=tuple(MODES), thetas=(0.3, 0.55, 0.8), threads=(1, 4),
+        n_reference=1000, max_direct=50000, repeat=1, seed=0, out=sys.stdout):
+    """Benchmark each of the gravity *modes* on each of the particle *sets*, for each particle number in *n*.
+
+    Modes that take an opening angle are run for each of *thetas*, and threaded modes for each thread count in
+    *threads*. The errors are measured at *n_reference* particles chosen at random, and direct summation is
+    skipped for more than *max_direct* particles. Returns a list of dictionaries, one per run, holding the best
+    wall time over *repeat* runs, the peak memory above that before the run (in MB, None where it cannot be
+    measured) and the percentiles of the relative force error."""
+
+    unknown = set(modes) - set(MODES)
+    if unknown:
+        raise ValueError("Unknown gravity modes %s; use some of %s" % (", ".join(unknown), ", ".join(MODES)))
+
+    generators = {'hernquist': hernquist, 'nfw_disc': nfw_disc, 'cosmological': cosmological}
+    rng = np.random.default_rng(seed)
+    results = []
+
+    print(f"# {'set':>12s} {'n':>8s} {'mode':>9s} {'theta':>5s} {'thr':>3s} {'time/s':>8s} {'mem/MB':>7s} "
+          f"{'err50':>8s} {'err90':>8s} {'err99':>8s}", file=out)
+
+    for set_name in sets:
+        periodic = SETS[set_name]
+        for n_particles in n:
+            pos, mass, eps = generators[set_name](n_particles, seed=seed)
+            f = _snapshot(pos, mass, eps, periodic)
+            sample = np.sort(rng.choice(len(mass), size=min(n_reference, len(mass)), replace=False))
+
+            start = time.perf_counter()
+            if periodic:
+                phi_ref, acc_ref = _ewald_sum(pos, mass, eps, pos[sample], 1.0)
+            else:
+                phi_ref, acc_ref = calc.direct(f, pos[sample], eps, num_threads=-1)
+                phi_ref, acc_ref = phi_ref.view(np.ndarray), acc_ref.view(np.ndarray)
+            print(f"# {set_name}: {len(mass)} particles, reference forces at {len(sample)} "
+                  f"in {time.perf_counter() - start:.3f}s", file=out)
+
+            for mode in modes:
+                properties = MODES[mode]
+                if periodic not in properties['periodic'] or (mode == 'direct' and len(mass) > max_direct):
+                    continue
+                for theta in (thetas if properties['theta'] else (None,)):
+                    for n_threads in (threads if properties['threads'] else (None,)):
+                        wall = np.inf
+                        memory = None
+                        for _ in range(repeat):
+                            with _PeakMemory() as peak:
+                                start = time.perf_counter()
+                                phi, acc = _calculate(f, mode, theta, n_threads)
+                                wall = min(wall, time.perf_counter() - start)
+                            if peak.peak is not None:
+                                memory = max(memory or 0.0, peak.peak)
+
+                        result = {'set': set_name, 'n': len(mass), 'mode': mode, 'theta': theta,
+                                  'threads': n_threads, 'time': wall, 'memory': memory}
+                        result.update(_errors(phi[sample], acc[sample], phi_ref, acc_ref))
+                        results.append(result)
+
+                        print(f"  {set_name:>12s} {len(mass):8d} {mode:>9s} "
+                              f"{'-' if theta is None else format(theta, '.2f'):>5s} "
+                              f"{'-' if n_threads is None else str(n_threads):>3s} {wall:8.3f} "
+                              f"{'-' if memory is None else format(memory, '.1f'):>7s} "
+                              f"{result['force_error_p50']:8.2e} {result['force_error_p90']:8.2e} "
+                              f"{result['force_error_p99']:8.2e}", file=out)
+
+    return results
+
+
+def metadata():
+    """Return a dictionary describing the software and machine on which the benchmark runs"""
+    return {'pynbody': __version__, 'numpy': np.__version__, 'python': platform.python_version(),
+            'machine': platform.machine(), 'platform': platform.platform(), 'cpus': openmp.get_cpus(),
+            'number_of_threads': config['number_of_threads'],
+            'date': datetime.datetime.now(datetime.timezone.utc).isoformat(timespec='seconds')}
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Accuracy and throughput benchmark for pynbody gravity")
+    parser.add_argument("--sets", type=str, default=",".join(SETS),
+                        help="comma-separated list of particle sets, from " + ", ".join(SETS))
+    parser.add_argument("--n", type=str, default="10000,100000", help="comma-separated list of particle numbers")
+    parser.add_argument("--modes", type=str, default=",".join(MODES),
+                        help="comma-separated list of gravity modes, from " + ", ".join(MODES))
+    parser.add_argument("--theta", type=str, default="0.3,0.55,0.8",
+                        help="comma-separated list of opening angles for tree, fmm and treepm")
+    parser.add_argument("--threads", type=str, default="1,4", help="comma-separated list of thread counts")
+    parser.add_argument("--nref", type=int, default=1000, help="number of particles at which errors are measured")
+    parser.add_argument("--max-direct", type=int, default=50000,
+                        help="largest number of particles for which direct summation is run")
+    parser.add_argument("--repeat", type=int, default=1, help="runs per configuration; the fastest is reported")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--json", type=str, default=None, help="also write the results to this file")
+    args = parser.parse_args(argv)
+
+    results = run(args.sets.split(","), [int(n) for n in args.n.split(",")], args.modes.split(","),
+                  [float(t) for t in args.theta.split(",")], [int(t) for t in args.threads.split(",")],
+                  args.nref, args.max_direct, args.repeat, args.seed)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({'metadata': metadata(), 'results': results}, f, indent=1)
+
+
+if __name__ == "__main__":
+    main()
@@ -5,69 +5,284 @@ import numpy as np
 
 from .. import array, config, units
 from ..util import eps_as_simarray, get_eps
+from . import multipole as multipole_solver
+from . import pm as pm_solver
 from . import tree
 from ._gravity import direct
 
 
-def all_direct(f, eps=None):
-    phi, acc = direct(f, f['pos'].view(np.ndarray), eps)
+def all_direct(f, eps=None, **kwargs):
+    """Calculate the potential and acceleration of every particle by direct summation (see
+    :func:`direct`), with each pair softened symmetrically, storing them in f['phi'] and f['acc']"""
+    if eps is None:
+        eps = get_eps(f)
+    phi, acc = direct(f, f['pos'].view(np.ndarray), eps, ieps=eps, **kwargs)
+    f['phi'] = phi
+    f['acc'] = acc
+
+
+def all_tree(f, eps=None, theta=0.55, **kwargs):
+    """Calculate the potential and acceleration of every particle using the Barnes-Hut
+    tree (see :func:`treecalc`), with each pair softened symmetrically, storing them in
+    f['phi'] and f['acc']"""
+    if eps is None:
+        eps = get_eps(f)
+    phi, acc = treecalc(f, f['pos'].view(np.ndarray), eps, theta=theta, ieps=eps, **kwargs)
+    f['phi'] = phi
+    f['acc'] = acc
+
+
+def all_fmm(f, eps=None, theta=0.5, **kwargs):
+    """Calculate the potential and acceleration of every particle using the fast
+    multipole method (see :func:`fmm`), with each pair softened symmetrically, storing them
+    in f['phi'] and f['acc']"""
+    if eps is None:
+        eps = get_eps(f)
+    phi, acc = fmm(f, f['pos'].view(np.ndarray), eps, theta=theta, ieps=eps, **kwargs)
     f['phi'] = phi
     f['acc'] = acc
 
 
-def all_pm(f, eps=None, ngrid=10):
-    phi, acc = pm(f, f['pos'].view(np.ndarray), eps, ngrid=ngrid)
+def all_treepm(f, eps=None, **kwargs):
+    """Calculate the potential and acceleration of every particle in a periodic box using the
+    TreePM method (see :func:`treepm`), with each pair softened symmetrically, storing them
+    in f['phi'] and f['acc']"""
+    if eps is None:
+        eps = get_eps(f)
+    phi, acc = treepm(f, f['pos'].view(np.ndarray), eps, ieps=eps, **kwargs)
     f['phi'] = phi
     f['acc'] = acc
 
 
-def pm(f, ipos, eps=None, ngrid=10, x0=-1, x1=1):
-    dx = float(x1 - x0) / ngrid
-    grid, edges = np.histogramdd(f['pos'],
-                                 bins=ngrid,
-                                 range=[(x0, x1), (x0, x1), (x0, x1)],
-                                 normed=False,
-                                 weights=f['mass'])
-    grid /= dx ** 3
-    recip_rho_grid = np.fft.rfftn(grid)
+def all_pm(f, eps=None, ngrid=64, **kwargs):
+    """Calculate the potential and acceleration of every particle with the particle-mesh
+    solver (see :func:`pm`), storing them in f['phi'] and f['acc']"""
+    phi, acc = pm(f, f['pos'].view(np.ndarray), eps, ngrid=ngrid, **kwargs)
+    f['phi'] = phi
+    f['acc'] = acc
 
-    freqs = np.fft.fftfreq(ngrid, d=dx)
 
-    kvecs = np.zeros((ngrid, ngrid, ngrid / 2 + 1, 3))
-    kvecs[:, :,:, 0] = freqs.reshape((1, ngrid, 1, 1))
-    kvecs[:, :,:, 1] = freqs.reshape((1, 1, ngrid, 1))
-    kvecs[:, :,:, 2] = abs(freqs[:ngrid/2+1].reshape((1, 1, 1, ngrid/2+1)))
+def pm(f, ipos, eps=None, ngrid=64, periodic=None, assignment='cic', num_threads=0):
+    """Calculate the potential and acceleration at positions *ipos* due to the particles
+    in *f*, with a particle-mesh solver. Returns the same as :func:`direct`.
 
-    k = (kvecs ** 2).sum(axis=3)
-    assert k.shape == recip_rho_grid.shape
+    The masses are assigned to a mesh of *ngrid* cells per side with the *assignment* scheme
+    ('ngp', 'cic' or 'tsc'), so that forces are softened on the scale of a few cells and *eps*
+    is ignored. If *periodic* is True (the default when the snapshot has a boxsize), the mesh
+    spans the periodic box and the potential of the mean density is removed; otherwise the
+    boundaries are isolated and the mesh covers the particles and *ipos*.
 
-    recip_phi_grid = 4 * math.pi * recip_rho_grid / k ** 2
-    recip_phi_grid[np.where(k == 0)] = 0
+    Mass assignment and interpolation are shared between *num_threads* threads (default from
+    the configuration file)."""
 
-    phi_grid = np.fft.irfftn(recip_phi_grid, grid.shape)
-    grad_phi_grid = np.concatenate((np.fft.irfftn(-1.j*kvecs[:, :,:, 0]*recip_phi_grid, grid.shape)[:,:,:, np.newaxis],
-                                    np.fft.irfftn(-1.j*kvecs[:, :,:, 1]*recip_phi_grid, grid.shape)[:,:,:, np.newaxis],
-                                    np.fft.irfftn(-1.j*kvecs[:, :,:, 2]*recip_phi_grid, grid.shape)[:,:,:, np.newaxis]),
-                                   axis=3)
+    if periodic is None:
+        periodic = 'boxsize' in f.properties
 
-    ipos_I = np.array((ipos - x0) / dx, dtype=int)
+    boxsize = _boxsize(f) if periodic else None
 
-    phi = np.array([phi_grid[x, y, z] for x, y, z in ipos_I])
-    grad_phi = np.array([grad_phi_grid[x, y, z, :] for x, y, z in ipos_I])
+    solver = pm_solver.PMSolver(ngrid, boxsize, assignment=assignment, num_threads=num_threads)
+    acc, phi = solver.calc(f['pos'].view(np.ndarray), f['mass'].view(np.ndarray), ipos)
 
-    phi = phi.view(array.SimArray)
-    phi.units = units.G * f['mass'].units / f['pos'].units
+    return _with_units(f, ipos, phi, acc)
+
+
+def treepm(f, ipos, eps=None, ngrid=None, theta=0.3, split_cells=1.25, cut_factor=4.5,
+           assignment='cic', num_threads=0, softening=None, softening_rule='max', ieps=None,
+           mixed_precision=False):
+    """Calculate the potential and acceleration at positions *ipos* due to the particles in
+    the periodic box of *f*, with the TreePM method. Returns the same as :func:`direct`.
 
-    grad_phi = grad_phi.view(array.SimArray)
-    grad_phi.units = units.G * f['mass'].units / f['pos'].units ** 2
+    The potential of each particle is split into a long-range part, that of a Gaussian cloud
+    of width *split_cells* mesh cells, found with a periodic particle-mesh solve (see :func:`pm`),
+    and a short-range remainder (1/r scaled by erfc(r/2r_s)) summed with a Barnes-Hut tree (see
+    :func:`treecalc`) out to *cut_factor* times the split scale, beyond which it is below 2% of
+    the full force of each particle. The forces are those of the Ewald sum, and the potential is
+    zero on average across the box.
 
-    return phi, -grad_phi
+    The mesh has *ngrid* cells per side (by default the power of two nearest above the cube
+    root of the number of particles, up to 256), so that memory use is bounded independently
+    of the particle count. Both parts are shared between *num_threads* threads (default from
+    the configuration file). The short-range forces are softened, and if *mixed_precision* is
+    True evaluated in single precision, as in :func:`treecalc`. The short-range cells are
+    represented by their monopoles alone, so *theta* defaults lower than for :func:`treecalc`;
+    with it, forces are typically accurate to 0.5% and to 3% in the worst percent of particles."""
+
+    if 'boxsize' not in f.properties:
+        raise ValueError("TreePM gravity needs a periodic box; set f.properties['boxsize']")
+    boxsize = _boxsize(f)
+
+    if eps is None:
+        eps = get_eps(f)
+    if ngrid is None:
+        ngrid = 2 ** int(math.ceil(math.log2(max(len(f), 1)) / 3))
+        ngrid = min(max(ngrid, 16), 256)
+
+    split_scale = split_cells * boxsize / ngrid
+    cutoff = cut_factor * split_scale
+    if cutoff >= boxsize / 2:
+        raise ValueError("The short-range cutoff must be less than half the box; use a larger ngrid")
+
+    pos = np.mod(f['pos'].view(np.ndarray), boxsize)
+    mass = f['mass'].view(np.ndarray)
+
+    solver = pm_solver.PMSolver(ngrid, boxsize, assignment=assignment, num_threads=num_threads,
+                                split_scale=split_scale)
+    acc, phi = solver.calc(pos, mass, ipos)
+
+    gtree = tree.GravTree(pos, mass, np.asarray(eps), theta=theta, boxsize=boxsize,
+                          split_scale=split_scale, cutoff=cutoff, softening=softening,
+                          softening_rule=softening_rule)
+    acc_short, phi_short = gtree.calc(ipos, num_threads=num_threads, eps=ieps, mixed_precision=mixed_precision)
+    acc += acc_short
+    # the mean of the short-range potential, which the zero mode of the mesh leaves out
+    phi += phi_short + 4 * np.pi * split_scale ** 2 * mass.sum(dtype=np.float64) / boxsize ** 3
+
+    return _with_units(f, ipos, phi, acc)
+
+
+def treecalc(f, ipos, eps=None, theta=0.55, num_threads=0, softening=None, softening_rule='max', ieps=None,
+             mixed_precision=False):
+    """Calculate the potential and acceleration at positions *ipos* due to the particles
+    in *f*, with a Barnes-Hut tree. Returns the same as :func:`direct`, to which the
+    result converges as the opening angle *theta* (in radians) is reduced, with the same
+    *softening* kernel and, for positions which are softened particles (with softening
+    lengths *ieps*), the same *softening_rule*.
+
+    The tree is walked once for each group of nearby positions, and the groups are
+    shared between *num_threads* threads (default from the configuration file). If
+    *mixed_precision* is True, the interactions found by each walk are evaluated in single
+    precision, relative to the centre of the group, and summed in double precision; this
+    halves the memory traffic of the interaction lists and doubles the width of the
+    vectorised arithmetic, for relative errors of around 1e-6."""
+
+    if eps is None:
+        eps = get_eps(f)
 
-def treecalc(f, rs, eps=None):
-    gtree = tree.GravTree(
-        f['pos'].view(np.ndarray), f['mass'].view(np.ndarray), eps=f['eps'], rs=rs)
-    a, p = gtree.calc(rs, eps=eps)
-    return p, a
+    gtree = tree.GravTree(f['pos'].view(np.ndarray), f['mass'].view(np.ndarray),
+                          np.asarray(eps), theta=theta, softening=softening, softening_rule=softening_rule)
+    acc, phi = gtree.calc(ipos, num_threads=num_threads, eps=ieps, mixed_precision=mixed_precision)
+
+    return _with_units(f, ipos, phi, acc)
+
+
+def fmm(f, ipos, eps=None, theta=0.5, num_threads=0, softening=None, softening_rule='max', ieps=None):
+    """Calculate the potential and acceleration at positions *ipos* due to the particles
+    in *f*, with the fast multipole method. Returns the same as :func:`direct`.
+
+    The particles and the positions are each given a tree, and the two are traversed
+    together. A pair of cells interacts through the source cell's hexadecapole moments,
+    expanded about the target cell, when the sum of their sizes is less than *theta* times
+    their separation; otherwise the larger is opened.
+
+    In principle the cost then grows only linearly with the number of particles, but in
+    practice this implementation does not beat :func:`treecalc` at equal accuracy. Its errors
+    are larger and have a heavier tail: at the default *theta* the median force error is a few
+    times, and the worst percent up to forty times, that of :func:`treecalc` at its default
+    (around 1e-4 and 5e-3 against 5e-5 and 6e-4), in a quarter to a third of the time with 1e5
+    particles. Matching the accuracy of :func:`treecalc` needs *theta* near 0.2, at which it is
+    the slower of the two for at least 1e5 particles, so :func:`treecalc` is usually the better
+    choice. Groups of positions are shared between *num_threads* threads (default from the
+    configuration file). The particles are softened as in :func:`treecalc`."""
+
+    if eps is None:
+        eps = get_eps(f)
+
+    gtree = tree.GravTree(f['pos'].view(np.ndarray), f['mass'].view(np.ndarray),
+                          np.asarray(eps), theta=theta, softening=softening, softening_rule=softening_rule)
+    acc, phi = gtree.calc(ipos, num_threads=num_threads, fmm=True, eps=ieps)
+
+    return _with_units(f, ipos, phi, acc)
+
+
+def multipole(f, ipos, eps=None, lmax=8, nshells=None):
+    """Calculate the potential and acceleration at positions *ipos* due to the particles
+    in *f*, from a spherical-harmonic expansion of their mass about the origin up to order
+    *lmax*, tabulated on *nshells* radial shells (see
+    :class:`~pynbody.gravity.multipole.MultipoleExpansion`). Returns the same as :func:`direct`.
+
+    The expansion is built in one pass over the particles and kept until their positions or
+    masses change, after which each position costs only O(lmax^2). It suits smooth, centred
+    systems, e.g. for rotation curves; *eps* is ignored, since the expansion is already smooth
+    on the scale of the shells."""
+
+    pos = f['pos'].view(np.ndarray)
+    mass = f['mass'].view(np.ndarray)
+    key = (lmax, nshells, [f._array_version(name) for name in ('pos', 'mass')])
+    cached = f.ancestor._get_persist(f._inclusion_hash, '_multipole_expansion')
+    if cached is not None and cached[0] == key:
+        expansion = cached[1]
+    else:
+        expansion = multipole_solver.MultipoleExpansion(pos, mass, lmax=lmax, nshells=nshells)
+        f.ancestor._set_persist(f._inclusion_hash, '_multipole_expansion', (key, expansion))
+
+    acc, phi = expansion.calc(ipos)
+
+    return _with_units(f, ipos, phi, acc)
+
+
+def self_potential(f, eps=None, mode='tree', theta=0.55, num_threads=0):
+    """Return the gravitational potential of each particle in *f* due only to the particles in
+    *f* (and not the rest of its ancestor snapshot), with zero potential at infinity.
+
+    This is the potential relevant to a halo in isolation, e.g. for finding its centre or the
+    particles bound to it. It is calculated with the given *mode* ('direct', 'tree' or 'fmm',
+    with opening angle *theta* for the latter two), softening each pair of particles with the
+    larger of their softening lengths, and excludes the interaction of each particle with itself
+    (see :func:`remove_self_interaction`), so that a lone particle has zero potential. Unless
+    *eps* is given, the result is kept until the positions, masses or softenings of *f* change,
+    so that repeated calls for the same halo are free."""
+
+    ipos = f['pos'].view(np.ndarray)
+    mass = f['mass']  # (not used here, but loading it changes the version read below)
+    cache = eps is None
+    if cache:
+        eps = get_eps(f)
+
+    # (taken once the arrays are loaded, which itself changes their versions)
+    key = (mode, theta, config['gravity_softening'], repr(f.properties.get('eps', None)),
+           [f._array_version(name) for name in ('pos', 'mass', 'eps')])
+    cached = f.ancestor._get_persist(f._inclusion_hash, '_self_potential')
+    if cache and cached is not None and cached[0] == key:
+        return cached[1]
+
+    if mode == 'direct':
+        phi, _ = direct(f, ipos, eps, num_threads=num_threads, ieps=eps)
+    else:
+        fn = {'tree': treecalc, 'fmm': fmm}[mode]
+        phi, _ = fn(f, ipos, eps, theta=theta, num_threads=num_threads, ieps=eps)
+    remove_self_interaction(f, phi, eps)
+    phi.sim = f
+
+    if cache:
+        f.ancestor._set_persist(f._inclusion_hash, '_self_potential', (key, phi))
+    return phi
+
+
+def remove_self_interaction(f, phi, eps):
+    """Remove from *phi*, the potential at the positions of the particles in *f* due to those same
+    particles (as returned by e.g. :func:`direct` with *ieps* set), the softened potential of each
+    particle at its own position, -m/eps for every softening kernel. *phi* is changed in place."""
+    eps = np.broadcast_to(np.asarray(eps, dtype=np.float64), (len(f),))
+    phi += (f['mass'].view(np.ndarray) / eps).astype(phi.dtype)
+
+
+def _boxsize(f):
+    """The side of the periodic box of *f*, in the units of its positions"""
+    boxsize = f.properties['boxsize']
+    if isinstance(boxsize, units.UnitBase):
+        boxsize = boxsize.in_units(f['pos'].units, **f.conversion_context())
+    return float(boxsize)
+
+
+def _with_units(f, ipos, phi, acc):
+    """Convert a potential and acceleration found with G=1 to SimArrays with the dtype of *ipos*"""
+    dtype = np.asarray(ipos).dtype
+    phi = phi.astype(dtype).view(array.SimArray)
+    acc = acc.astype(dtype).view(array.SimArray)
+    phi.units = units.G * f['mass'].units / f['pos'].units
+    acc.units = units.G * f['mass'].units / f['pos'].units ** 2
+
+    return phi, acc
 
 
 def midplane_rot_curve(f, rxy_points, eps=None, mode=config['gravity_calculation_mode']):
@@ -79,7 +294,7 @@ def midplane_rot_curve(f, rxy_points, eps=None, mode=config['gravity_calculation
         warnings.warn(
             "OpenMP module is now selected at install time", DeprecationWarning)
 
-    if eps is None:
+    if eps is None and mode != 'multipole':
         eps = get_eps(f)
     elif isinstance(eps, (str, units.UnitBase)):
         eps = eps_as_simarray(f, eps)
@@ -93,6 +308,10 @@ def midplane_rot_curve(f, rxy_points, eps=None, mode=config['gravity_calculation
     try:
         fn = {'direct': direct,
               'tree': treecalc,
+              'fmm': fmm,
+              'multipole': multipole,
+              'pm': pm,
+              'treepm': treepm,
               }[mode]
     except KeyError:
         fn = mode
@@ -134,7 +353,7 @@ def midplane_potential(f, rxy_points, eps=None, mode=config['gravity_calculation
         except ImportError:
             mode = 'direct'
 
-    if eps is None:
+    if eps is None and mode != 'multipole':
         eps = get_eps(f)
     elif isinstance(eps, (str, units.UnitBase)):
         eps = eps_as_simarray(f, eps)
@@ -144,7 +363,11 @@ def midplane_potential(f, rxy_points, eps=None, mode=config['gravity_calculation
     try:
         fn = {'direct': direct,
               'direct_omp': direct_omp,
-              'tree': tree,
+              'tree': treecalc,
+              'fmm': fmm,
+              'multipole': multipole,
+              'pm': pm,
+              'treepm': treepm,
               }[mode]
     except KeyError:
         fn = mode
@@ -0,0 +1,222 @@
+/*
+ * Fast multipole gravity, built on the multipole (MOMR) and local (LOCR)
+ * expansions of moments.c which pkdgrav2 uses in its cell-cell walk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "kd.h"
+#include "moments.h"
+
+/*
+** Target cells with no more than this fraction of the positions are walked
+** independently, and are shared between the threads. The division does not
+** depend on the number of threads, so neither do the results.
+*/
+#define FMM_TASK_FRACTION 256
+
+/*
+** A stack of (target cell, source cell) pairs still to be processed.
+*/
+typedef struct fmmPair {
+    int iTarget;
+    int iSource;
+    } FMMPAIR;
+
+typedef struct fmmStack {
+    FMMPAIR *pair;
+    int n, nMax;
+    } FMMSTACK;
+
+static void fmmPush(FMMSTACK *s, int iTarget, int iSource) {
+    if (s->n == s->nMax) {
+	s->nMax *= 2;
+	s->pair = (FMMPAIR *)realloc(s->pair,s->nMax*sizeof(FMMPAIR));
+	assert(s->pair != NULL);
+	}
+    s->pair[s->n].iTarget = iTarget;
+    s->pair[s->n].iSource = iSource;
+    ++s->n;
+    }
+
+/*
+** Adds the softened forces of the source bucket kdc to each position in
+** the target bucket kdt, as in the direct summation.
+*/
+static void fmmBucketInteract(KD kd, KDN *kdc, KD kdTest, KDN *kdt) {
+    PARTICLE *p,*q;
+    double x,y,z,dir,dir3;
+    int pi,pj;
+
+    for (pi=kdt->pLower;pi<=kdt->pUpper;++pi) {
+	p = kdParticle(kdTest,pi);
+	for (pj=kdc->pLower;pj<=kdc->pUpper;++pj) {
+	    q = kdParticle(kd,pj);
+	    x = p->r[0] - q->r[0];
+	    y = p->r[1] - q->r[1];
+	    z = p->r[2] - q->r[2];
+	    softKernel(kd->iSoftKernel,x*x + y*y + z*z,kdPairSoft(kd,p,q),&dir,&dir3);
+	    dir3 *= q->fMass;
+	    p->fPot -= q->fMass*dir;
+	    p->a[0] -= x*dir3;
+	    p->a[1] -= y*dir3;
+	    p->a[2] -= z*dir3;
+	    }
+	}
+    }
+
+/*
+** Processes every interaction of the target cell iTask (and its descendants)
+** with the source tree, then passes the local expansions down to its buckets.
+**
+** A pair of cells interacts through the local expansion of the source's
+** multipoles about the target's centre when both lie within an angle theta
+** of each other's centres, and (as in the tree walk) every pair of their
+** particles is further apart than the reach of the largest softening length
+** in either. Pairs
+** which fail are split, opening the larger of the two cells, until they are
+** accepted or are both buckets, which are summed particle by particle.
+*/
+static void fmmTask(KD kd, KD kdTest, LOCR *loc, int iTask, FMMSTACK *s, int *Stack) {
+    KDN *kdt,*kdc,*kdl;
+    PARTICLE *p;
+    LOCR L;
+    momFloat fPot,ax,ay,az;
+    double x,y,z,d2,dir,gap,fSoftMax2,tax,tay,taz;
+    int iTarget,iSource,nStack,i,pj;
+
+    s->n = 0;
+    fmmPush(s,iTask,ROOT);
+    while (s->n) {
+	--s->n;
+	iTarget = s->pair[s->n].iTarget;
+	iSource = s->pair[s->n].iSource;
+	kdt = kdTreeNode(kdTest,iTarget);
+	kdc = kdTreeNode(kd,iSource);
+	x = kdt->r[0] - kdc->r[0];
+	y = kdt->r[1] - kdc->r[1];
+	z = kdt->r[2] - kdc->r[2];
+	d2 = x*x + y*y + z*z;
+	gap = sqrt(d2) - kdt->bMax - kdc->bMax;
+	fSoftMax2 = kdc->fSoftMax2 > kdt->fSoftMax2 ? kdc->fSoftMax2 : kdt->fSoftMax2;
+	if (kd->dTheta2 > 0 && (kdt->bMax + kdc->bMax)*(kdt->bMax + kdc->bMax) < kd->dTheta2*d2
+	    && gap > 0 && gap*gap > kd->dSoftReach2*fSoftMax2) {
+	    dir = 1/sqrt(d2 + kdCellSoft2(kd,sqrt(kdt->fSoft2),kdc));
+	    momLocrAddMomr5cm(&loc[iTarget],&kdc->mom,dir,x,y,z,&tax,&tay,&taz);
+	    }
+	else if (kdc->iLower == 0 && kdt->iLower == 0) {
+	    fmmBucketInteract(kd,kdc,kdTest,kdt);
+	    }
+	else if (kdc->iLower == 0 || (kdt->iLower != 0 && kdt->bMax > kdc->bMax)) {
+	    fmmPush(s,kdt->iLower,iSource);
+	    fmmPush(s,kdt->iLower+1,iSource);
+	    }
+	else {
+	    fmmPush(s,iTarget,kdc->iLower);
+	    fmmPush(s,iTarget,kdc->iLower+1);
+	    }
+	}
+
+    /*
+    ** Shift each cell's local expansion to its children, and evaluate it
+    ** for the positions in each bucket.
+    */
+    nStack = 0;
+    Stack[nStack++] = iTask;
+    while (nStack) {
+	iTarget = Stack[--nStack];
+	kdt = kdTreeNode(kdTest,iTarget);
+	if (kdt->iLower) {
+	    for (i=kdt->iLower;i<=kdt->iLower+1;++i) {
+		kdl = kdTreeNode(kdTest,i);
+		L = loc[iTarget];
+		momShiftLocr(&L,kdl->r[0] - kdt->r[0],kdl->r[1] - kdt->r[1],kdl->r[2] - kdt->r[2]);
+		momAddLocr(&loc[i],&L);
+		Stack[nStack++] = i;
+		}
+	    }
+	else {
+	    for (pj=kdt->pLower;pj<=kdt->pUpper;++pj) {
+		p = kdParticle(kdTest,pj);
+		fPot = ax = ay = az = 0;
+		momEvalLocr(&loc[iTarget],p->r[0] - kdt->r[0],p->r[1] - kdt->r[1],p->r[2] - kdt->r[2],
+			    &fPot,&ax,&ay,&az);
+		p->fPot += fPot;
+		p->a[0] += ax;
+		p->a[1] += ay;
+		p->a[2] += az;
+		}
+	    }
+	}
+    }
+
+/*
+** Calculates the acceleration and potential from the particles in kd on
+** each of the (test) particles in kdTest, with the fast multipole method.
+** Unlike kdGravWalk, whole cells of test particles share each interaction.
+** This is less accurate than kdGravWalk at the same opening angle, and
+** measured no faster at equal accuracy, so the linear scaling of the method
+** is not realised in practice.
+*/
+void kdGravFmm(KD kd, KD kdTest, int nThreads) {
+    LOCR *loc;
+    KDN *kdt;
+    int *tasks,*Stack;
+    int nTasks = 0, nStack = 0, nTaskMax;
+    int i;
+
+    for (i=0;i<kdTest->nStore;++i) {
+	PARTICLE *p = kdParticle(kdTest,i);
+	p->a[0] = p->a[1] = p->a[2] = p->fPot = 0;
+	}
+    if (kdTest->nStore == 0 || kd->nStore == 0) return;
+
+    loc = (LOCR *)malloc(kdTest->nNodes*sizeof(LOCR));
+    tasks = (int *)malloc(kdTest->nNodes*sizeof(int));
+    Stack = (int *)malloc(kdTest->nNodes*sizeof(int));
+    assert(loc != NULL && tasks != NULL && Stack != NULL);
+    for (i=0;i<kdTest->nNodes;++i) momClearLocr(&loc[i]);
+
+    nTaskMax = kdTest->nStore/FMM_TASK_FRACTION;
+    Stack[nStack++] = ROOT;
+    while (nStack) {
+	i = Stack[--nStack];
+	kdt = kdTreeNode(kdTest,i);
+	if (kdt->iLower == 0 || kdt->pUpper - kdt->pLower < nTaskMax) tasks[nTasks++] = i;
+	else {
+	    Stack[nStack++] = kdt->iLower;
+	    Stack[nStack++] = kdt->iLower+1;
+	    }
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nThreads)
+#endif
+    {
+	FMMSTACK s;
+	int *TaskStack;
+	int iTask;
+
+	s.nMax = 1000;
+	s.pair = (FMMPAIR *)malloc(s.nMax*sizeof(FMMPAIR));
+	TaskStack = (int *)malloc(kdTest->nNodes*sizeof(int));
+	assert(s.pair != NULL && TaskStack != NULL);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+	for (iTask=0;iTask<nTasks;++iTask) {
+	    fmmTask(kd,kdTest,loc,tasks[iTask],&s,TaskStack);
+	    }
+	free(s.pair);
+	free(TaskStack);
+    }
+
+    free(Stack);
+    free(tasks);
+    free(loc);
+    }
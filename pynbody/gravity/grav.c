@@ -6,186 +6,323 @@
  * Andrew Pontzen.
  */
 
-#include "config.h"
-
 #include <math.h>
 #include <stdlib.h>
-#if defined(__APPLE__)
-#undef HAVE_MALLOC_H
-#endif
-#ifdef HAVE_MALLOC_H
-#include <malloc.h>
-#endif
 #include <stddef.h>
 #include <assert.h>
-#include <time.h>
-#include <sys/time.h>
 #include "kd.h"
 #include "moments.h"
 
-#define SQRT1(d2,dir)				\
-    {						\
-	dir = 1/sqrt(d2);			\
-	}
+#define SQRT_PI 1.7724538509055160273
 
 /*
-** This version of grav.c does all the operations inline, including
-** v_sqrt's and such.
-** Returns nActive.
+** The factors by which the short-range part of a TreePM split, on the scale
+** rs, reduces the potential (g) and radial force (g + h*d) of a point mass at
+** distance r, where d is the softened distance. The long-range part, which is
+** found on the mesh, is the potential of a Gaussian cloud of width rs.
 */
-void kdGravInteract(KD kd,KDN *pBucket, ILP *ilp,int nPart,
-		   ILC *ilc,int nCell, int bEwald, PARTICLE *p)
-{
-    KDN *kdn = pBucket;
-    pBND kbnd;
-    const double onethird = 1.0/3.0;
-    float fPot;
-    double ax,ay,az;
-    double x,y,z,d2,dir,dir2,g2,g3,g4;
-    double xx,xy,xz,yy,yz,zz;
-    double xxx,xxz,yyy,yyz,xxy,xyy,xyz;
-    double tx,ty,tz;
-    double fourh2;
-    momFloat tax,tay,taz;
-#ifdef SOFTSQUARE
-    double ptwoh2;
-#endif
-    int j, nSoft;
-    double three_eighths = 3.0/8.0;
-    double ffbytt = 45.0/32.0;
-    double otfbysixteen = 135.0/16.0;
-    kdNodeBnd(kd, kdn, &kbnd);
-
-    printf("nPart: %d, nCell: %d\n",nPart,nCell);
-    /*
-    ** Now process the two interaction lists for each active particle.
-    */
-    nSoft = 0;
-    ax = 0;
-    ay = 0;
-    az = 0;
+static inline void kdShortRange(double rs, double r2, double d, double *g, double *h) {
+    double u = 0.5*sqrt(r2)/rs;
+    *g = erfc(u);
+    *h = exp(-u*u)/(SQRT_PI*rs)*d;
+    }
+
+/*
+** Sums the interactions on the list for particle p, setting its
+** acceleration and potential (with G=1).
+**
+** Cells contribute their multipoles up to hexadecapole order, with the
+** monopole softened by the cell's mean Plummer softening (or unsoftened for
+** the compact kernels, which are Newtonian wherever cells are accepted).
+** Particles are summed exactly, with the softening kernel and each pair's
+** softening length, as in the direct summation.
+**
+** For short-range forces (kd->dRsplit > 0) every separation is taken to the
+** nearest periodic image, cells contribute only their (softened) monopoles,
+** and particles beyond the cutoff are skipped.
+*/
+void kdGravInteract(KD kd, ILP *ilp, int nPart, ILC *ilc, int nCell, PARTICLE *p) {
+    KDN *kdc;
+    PARTICLE *q;
+    momFloat fPot,tax,tay,taz,magai;
+    double ax = 0, ay = 0, az = 0, pot = 0;
+    double x,y,z,r2,d2,dir,dir3,g,h;
+    double rs = kd->dRsplit;
+    int i,pj;
 
     /*
-     * Process cell interaction list
-     */
-    for (j=0;j<nCell;++j) {
-	x = p->r[0] - ilc[j].x;
-	y = p->r[1] - ilc[j].y;
-	z = p->r[2] - ilc[j].z;
+    ** Process cell interaction list
+    */
+    for (i=0;i<nCell;++i) {
+	kdc = kdTreeNode(kd,ilc[i].iCell);
+	if (rs > 0) {
+	    x = kdPeriodicDelta(kd,p->r[0] - kdc->r[0]);
+	    y = kdPeriodicDelta(kd,p->r[1] - kdc->r[1]);
+	    z = kdPeriodicDelta(kd,p->r[2] - kdc->r[2]);
+	    r2 = x*x + y*y + z*z;
+	    dir = 1/sqrt(r2 + kdCellSoft2(kd,p->fSoft,kdc));
+	    kdShortRange(rs,r2,1/dir,&g,&h);
+	    dir3 = kdc->mom.m*(g + h)*dir*dir*dir;
+	    pot -= kdc->mom.m*g*dir;
+	    ax -= x*dir3;
+	    ay -= y*dir3;
+	    az -= z*dir3;
+	    continue;
+	    }
+	x = p->r[0] - kdc->r[0];
+	y = p->r[1] - kdc->r[1];
+	z = p->r[2] - kdc->r[2];
 	d2 = x*x + y*y + z*z;
-	SQRT1(d2,dir);
-	dir2 = dir*dir;
-	g2 = 3*dir*dir2*dir2;
-	g3 = 5*g2*dir2;
-	g4 = 7*g3*dir2;
-	/*
-	** Calculate the funky distance terms.
-	*/
-	xx = 0.5*x*x;
-	xy = x*y;
-	xz = x*z;
-	yy = 0.5*y*y;
-	yz = y*z;
-	zz = 0.5*z*z;
-	xxx = x*(onethird*xx - zz);
-	xxz = z*(xx - onethird*zz);
-	yyy = y*(onethird*yy - zz);
-	yyz = z*(yy - onethird*zz);
-	xx -= zz;
-	yy -= zz;
-	xxy = y*xx;
-	xyy = x*yy;
-	xyz = xy*z;
-	/*
-	** Now calculate the interaction up to Hexadecapole order.
-	*/
-	tx = g4*(ilc[j].mom.xxxx*xxx + ilc[j].mom.xyyy*yyy + ilc[j].mom.xxxy*xxy + ilc[j].mom.xxxz*xxz + ilc[j].mom.xxyy*xyy + ilc[j].mom.xxyz*xyz + ilc[j].mom.xyyz*yyz);
-	ty = g4*(ilc[j].mom.xyyy*xyy + ilc[j].mom.xxxy*xxx + ilc[j].mom.yyyy*yyy + ilc[j].mom.yyyz*yyz + ilc[j].mom.xxyy*xxy + ilc[j].mom.xxyz*xxz + ilc[j].mom.xyyz*xyz);
-	tz = g4*(-ilc[j].mom.xxxx*xxz - (ilc[j].mom.xyyy + ilc[j].mom.xxxy)*xyz - ilc[j].mom.yyyy*yyz + ilc[j].mom.xxxz*xxx + ilc[j].mom.yyyz*yyy - ilc[j].mom.xxyy*(xxz + yyz) + ilc[j].mom.xxyz*xxy + ilc[j].mom.xyyz*xyy);
-	g4 = 0.25*(tx*x + ty*y + tz*z);
-	xxx = g3*(ilc[j].mom.xxx*xx + ilc[j].mom.xyy*yy + ilc[j].mom.xxy*xy + ilc[j].mom.xxz*xz + ilc[j].mom.xyz*yz);
-	xxy = g3*(ilc[j].mom.xyy*xy + ilc[j].mom.xxy*xx + ilc[j].mom.yyy*yy + ilc[j].mom.yyz*yz + ilc[j].mom.xyz*xz);
-	xxz = g3*(-(ilc[j].mom.xxx + ilc[j].mom.xyy)*xz - (ilc[j].mom.xxy + ilc[j].mom.yyy)*yz + ilc[j].mom.xxz*xx + ilc[j].mom.yyz*yy + ilc[j].mom.xyz*xy);
-	g3 = onethird*(xxx*x + xxy*y + xxz*z);
-	xx = g2*(ilc[j].mom.xx*x + ilc[j].mom.xy*y + ilc[j].mom.xz*z);
-	xy = g2*(ilc[j].mom.yy*y + ilc[j].mom.xy*x + ilc[j].mom.yz*z);
-	xz = g2*(-(ilc[j].mom.xx + ilc[j].mom.yy)*z + ilc[j].mom.xz*x + ilc[j].mom.yz*y);
-	g2 = 0.5*(xx*x + xy*y + xz*z);
-	dir *= ilc[j].mom.m;
-	dir2 *= dir + 5*g2 + 7*g3 + 9*g4;
-	fPot -= dir + g2 + g3 + g4;
-	tax = xx + xxx + tx - x*dir2;
-	tay = xy + xxy + ty - y*dir2;
-	taz = xz + xxz + tz - z*dir2;
+	dir = 1/sqrt(d2 + kdCellSoft2(kd,p->fSoft,kdc));
+	momEvalMomr(&kdc->mom,dir,x,y,z,&fPot,&tax,&tay,&taz,&magai);
+	pot += fPot;
 	ax += tax;
 	ay += tay;
 	az += taz;
-	} /* end of cell list gravity loop */
+	}
 
-    printf("after cells:  ax: %g ay: %g az: %g fPot: %g\n", ax, ay, az, fPot);
     /*
-     * Process particle interaction list
-     */
-#ifdef SOFTSQUARE
-    ptwoh2 = 2*kdSoft(kd,p)*kdSoft(kd,p);
-#endif
-    for (j=0;j<nPart;++j) {
-	x = p->r[0] - ilp[j].x;
-	y = p->r[1] - ilp[j].y;
-	z = p->r[2] - ilp[j].z;
-	d2 = x*x + y*y + z*z;
-#ifdef SOFTLINEAR
-	fourh2 = kdSoft(kd,p) + ilp[j].h;
-	fourh2 *= fourh2;
-#endif
-#if !defined(SOFTLINEAR) && !defined(SOFTSQUARE)
-#ifdef SOFTENING_NOT_MASS_WEIGHTED
-	fourh2 = ilp[j].fourh2;
-#else
-	fourh2 = softmassweight(p->fMass,4*p->fSoft*p->fSoft,ilp[j].m,ilp[j].fourh2);
-#endif
-#endif
-	if (d2 > fourh2) {
-	    SQRT1(d2,dir);
-	    dir2 = dir*dir*dir;
-	    }
-	else {
-	    /*
-	    ** This uses the Dehnen K1 kernel function now, it's fast!
-	    */
-	    SQRT1(fourh2,dir);
-	    dir2 = dir*dir;
-	    d2 *= dir2;
-	    dir2 *= dir;
-	    d2 = 1.0 - d2;
-	    dir *= 1.0 + d2*(0.5 + d2*(three_eighths + d2*(ffbytt)));
-	    dir2 *= 1.0 + d2*(1.5 + d2*(otfbysixteen));
-	    ++nSoft;
+    ** Process particle interaction list
+    */
+    for (i=0;i<nPart;++i) {
+	for (pj=ilp[i].pLower;pj<=ilp[i].pUpper;++pj) {
+	    q = kdParticle(kd,pj);
+	    if (rs > 0) {
+		x = kdPeriodicDelta(kd,p->r[0] - q->r[0]);
+		y = kdPeriodicDelta(kd,p->r[1] - q->r[1]);
+		z = kdPeriodicDelta(kd,p->r[2] - q->r[2]);
+		r2 = x*x + y*y + z*z;
+		if (r2 > kd->dRcut2) continue;
+		softKernel(kd->iSoftKernel,r2,kdPairSoft(kd,p,q),&dir,&dir3);
+		kdShortRange(rs,r2,1/dir,&g,&h);
+		dir3 = q->fMass*(g + h)*dir3;
+		pot -= q->fMass*g*dir;
+		}
+	    else {
+		x = p->r[0] - q->r[0];
+		y = p->r[1] - q->r[1];
+		z = p->r[2] - q->r[2];
+		d2 = x*x + y*y + z*z;
+		softKernel(kd->iSoftKernel,d2,kdPairSoft(kd,p,q),&dir,&dir3);
+		dir3 *= q->fMass;
+		pot -= q->fMass*dir;
+		}
+	    ax -= x*dir3;
+	    ay -= y*dir3;
+	    az -= z*dir3;
 	    }
+	}
 
-	dir2 *= ilp[j].m;
-	tax = -x*dir2;
-	tay = -y*dir2;
-	taz = -z*dir2;
-	fPot -= ilp[j].m*dir;
-	ax += tax;
-	ay += tay;
-	az += taz;
-	} /* end of particle list gravity loop */
-    printf("after particles:  ax: %g ay: %g az: %g fPot: %g\n", ax, ay, az, fPot);
-    /*
-    ** Finally set new acceleration and potential.
-    */
-    p->fPot = fPot;
+    p->fPot = pot;
     p->a[0] = ax;
     p->a[1] = ay;
     p->a[2] = az;
-    /*
-    ** Now finally calculate the Ewald correction for this particle, if it is
-    ** required.
-    if (bEwald) {
-	*pdEwFlop += kdParticleEwald(kd,uRungLo,uRungHi,p);
+    }
+
+/*
+** The mixed precision equivalents of the above, for interaction lists
+** gathered into single precision tiles (see ilp.h).
+*/
+static inline void kdShortRangeF(float rs, float r2, float d, float *g, float *h) {
+    float u = 0.5f*sqrtf(r2)/rs;
+    *g = erfcf(u);
+    *h = expf(-u*u)/((float)SQRT_PI*rs)*d;
+    }
+
+/*
+** The separation d reduced to its nearest periodic image, for a box of side
+** 1/boxinv, or unchanged if boxinv is zero.
+*/
+static inline float kdPeriodicDeltaF(float d, float box, float boxinv) {
+    return d - box*floorf(d*boxinv + 0.5f);
+    }
+
+/*
+** Sums one tile of particles for a target at (px,py,pz), relative to the
+** bucket centre, with softening length fSoft. The short-range sum of a
+** TreePM split (rs > 0) zeroes the particles beyond the cutoff, rather than
+** skipping them, so that its loop has no branches.
+*/
+#define ILP_TILE_KERNEL(NAME, SOFT)                                                     \
+static void NAME(const ILPTILE *t, float px, float py, float pz, float fSoft, int rule, \
+		 float rs, float rcut2, float box, float boxinv, double *pot,            \
+		 double *ax, double *ay, double *az) {                                   \
+    float tpot = 0, tax = 0, tay = 0, taz = 0;                                      \
+    int j;                                                                          \
+    if (rs > 0) {                                                                   \
+	_Pragma("omp simd reduction(+:tpot,tax,tay,taz)")                           \
+	for (j=0;j<t->nPart;++j) {                                                  \
+	    float x,y,z,r2,dir,dir3,g,h,m;                                          \
+	    x = kdPeriodicDeltaF(px - t->dx[j],box,boxinv);                         \
+	    y = kdPeriodicDeltaF(py - t->dy[j],box,boxinv);                         \
+	    z = kdPeriodicDeltaF(pz - t->dz[j],box,boxinv);                         \
+	    r2 = x*x + y*y + z*z;                                                   \
+	    SOFT(r2,softPairF(t->fSoft[j],fSoft,rule),&dir,&dir3);                  \
+	    kdShortRangeF(rs,r2,1/dir,&g,&h);                                       \
+	    m = r2 > rcut2 ? 0 : t->m[j];                                           \
+	    dir3 = m*(g + h)*dir3;                                                  \
+	    tpot -= m*g*dir;                                                        \
+	    tax -= x*dir3;                                                          \
+	    tay -= y*dir3;                                                          \
+	    taz -= z*dir3;                                                          \
+	    }                                                                       \
+	}                                                                           \
+    else {                                                                          \
+	_Pragma("omp simd reduction(+:tpot,tax,tay,taz)")                           \
+	for (j=0;j<t->nPart;++j) {                                                  \
+	    float x,y,z,dir,dir3;                                                   \
+	    x = px - t->dx[j];                                                      \
+	    y = py - t->dy[j];                                                      \
+	    z = pz - t->dz[j];                                                      \
+	    SOFT(x*x + y*y + z*z,softPairF(t->fSoft[j],fSoft,rule),&dir,&dir3);     \
+	    dir3 *= t->m[j];                                                        \
+	    tpot -= t->m[j]*dir;                                                    \
+	    tax -= x*dir3;                                                          \
+	    tay -= y*dir3;                                                          \
+	    taz -= z*dir3;                                                          \
+	    }                                                                       \
+	}                                                                           \
+    *pot += tpot;                                                                   \
+    *ax += tax;                                                                     \
+    *ay += tay;                                                                     \
+    *az += taz;                                                                     \
+    }
+
+ILP_TILE_KERNEL(ilpTilePlummer, softPlummerF)
+ILP_TILE_KERNEL(ilpTileSpline, softSplineF)
+ILP_TILE_KERNEL(ilpTileWendland, softWendlandF)
+
+/*
+** Sums one tile of cells, as momEvalMomr does for each cell (or, for short
+** range forces, with their softened monopoles).
+*/
+static void ilcTileInteract(const ILCTILE *t, float px, float py, float pz, float fSoft, int rule, int bSoft,
+			    float rs, float box, float boxinv, double *pot, double *ax, double *ay, double *az) {
+    const float onethird = 1.0f/3.0f;
+    float tpot = 0, tax = 0, tay = 0, taz = 0;
+    int j;
+
+    if (rs > 0) {
+#pragma omp simd reduction(+:tpot,tax,tay,taz)
+	for (j=0;j<t->nCell;++j) {
+	    float x,y,z,r2,s,dir,dir3,g,h;
+	    x = kdPeriodicDeltaF(px - t->dx[j],box,boxinv);
+	    y = kdPeriodicDeltaF(py - t->dy[j],box,boxinv);
+	    z = kdPeriodicDeltaF(pz - t->dz[j],box,boxinv);
+	    r2 = x*x + y*y + z*z;
+	    s = bSoft ? softPairF(t->fSoft[j],fSoft,rule) : 0;
+	    dir = 1/sqrtf(r2 + s*s);
+	    kdShortRangeF(rs,r2,1/dir,&g,&h);
+	    dir3 = t->m[j]*(g + h)*dir*dir*dir;
+	    tpot -= t->m[j]*g*dir;
+	    tax -= x*dir3;
+	    tay -= y*dir3;
+	    taz -= z*dir3;
+	    }
 	}
-    */
+    else {
+#pragma omp simd reduction(+:tpot,tax,tay,taz)
+	for (j=0;j<t->nCell;++j) {
+	    float x,y,z,s,dir,g0,g2,g3,g4,tx,ty,tz;
+	    float xx,xy,xz,yy,yz,zz,xxx,xxy,xxz,xyy,yyy,yyz,xyz;
+	    x = px - t->dx[j];
+	    y = py - t->dy[j];
+	    z = pz - t->dz[j];
+	    s = bSoft ? softPairF(t->fSoft[j],fSoft,rule) : 0;
+	    dir = 1/sqrtf(x*x + y*y + z*z + s*s);
+	    g0 = dir;
+	    g2 = 3*dir*dir*dir;
+	    g3 = 5*g2*dir;
+	    g4 = 7*g3*dir;
+	    x *= dir;
+	    y *= dir;
+	    z *= dir;
+	    xx = 0.5f*x*x;
+	    xy = x*y;
+	    xz = x*z;
+	    yy = 0.5f*y*y;
+	    yz = y*z;
+	    zz = 0.5f*z*z;
+	    xxx = x*(onethird*xx - zz);
+	    xxz = z*(xx - onethird*zz);
+	    yyy = y*(onethird*yy - zz);
+	    yyz = z*(yy - onethird*zz);
+	    xx -= zz;
+	    yy -= zz;
+	    xxy = y*xx;
+	    xyy = x*yy;
+	    xyz = xy*z;
+	    tx = g4*(t->xxxx[j]*xxx + t->xyyy[j]*yyy + t->xxxy[j]*xxy + t->xxxz[j]*xxz + t->xxyy[j]*xyy
+		     + t->xxyz[j]*xyz + t->xyyz[j]*yyz);
+	    ty = g4*(t->xyyy[j]*xyy + t->xxxy[j]*xxx + t->yyyy[j]*yyy + t->yyyz[j]*yyz + t->xxyy[j]*xxy
+		     + t->xxyz[j]*xxz + t->xyyz[j]*xyz);
+	    tz = g4*(-t->xxxx[j]*xxz - (t->xyyy[j] + t->xxxy[j])*xyz - t->yyyy[j]*yyz + t->xxxz[j]*xxx
+		     + t->yyyz[j]*yyy - t->xxyy[j]*(xxz + yyz) + t->xxyz[j]*xxy + t->xyyz[j]*xyy);
+	    g4 = 0.25f*(tx*x + ty*y + tz*z);
+	    xxx = g3*(t->xxx[j]*xx + t->xyy[j]*yy + t->xxy[j]*xy + t->xxz[j]*xz + t->xyz[j]*yz);
+	    xxy = g3*(t->xyy[j]*xy + t->xxy[j]*xx + t->yyy[j]*yy + t->yyz[j]*yz + t->xyz[j]*xz);
+	    xxz = g3*(-(t->xxx[j] + t->xyy[j])*xz - (t->xxy[j] + t->yyy[j])*yz + t->xxz[j]*xx + t->yyz[j]*yy
+		      + t->xyz[j]*xy);
+	    g3 = onethird*(xxx*x + xxy*y + xxz*z);
+	    xx = g2*(t->xx[j]*x + t->xy[j]*y + t->xz[j]*z);
+	    xy = g2*(t->yy[j]*y + t->xy[j]*x + t->yz[j]*z);
+	    xz = g2*(-(t->xx[j] + t->yy[j])*z + t->xz[j]*x + t->yz[j]*y);
+	    g2 = 0.5f*(xx*x + xy*y + xz*z);
+	    g0 *= t->m[j];
+	    tpot -= g0 + g2 + g3 + g4;
+	    g0 += 5*g2 + 7*g3 + 9*g4;
+	    tax += dir*(xx + xxx + tx - x*g0);
+	    tay += dir*(xy + xxy + ty - y*g0);
+	    taz += dir*(xz + xxz + tz - z*g0);
+	    }
+	}
+    *pot += tpot;
+    *ax += tax;
+    *ay += tay;
+    *az += taz;
+    }
+
+/*
+** As kdGravInteract, for lists gathered into tiles by the mixed precision
+** walk. The pairwise interactions within each tile are evaluated in single
+** precision, and the sums over tiles accumulated in double precision.
+*/
+void kdGravInteractTiles(KD kd, ILTILES *il, PARTICLE *p) {
+    double ax = 0, ay = 0, az = 0, pot = 0;
+    double L = il->dLength;
+    float px = (float)((p->r[0] - il->r[0])*L);
+    float py = (float)((p->r[1] - il->r[1])*L);
+    float pz = (float)((p->r[2] - il->r[2])*L);
+    float fSoft = (float)(p->fSoft*L);
+    float rs = (float)(kd->dRsplit*L);
+    float rcut2 = (float)(kd->dRcut2*L*L);
+    float box = (float)(kd->dBox*L);
+    float boxinv = box > 0 ? 1/box : 0;
+    int rule = kd->iSoftRule;
+    int i;
 
+    for (i=0;i<il->nCellTiles;++i) {
+	ilcTileInteract(&il->ilc[i],px,py,pz,fSoft,rule,kd->iSoftKernel == SOFT_PLUMMER,
+			rs,box,boxinv,&pot,&ax,&ay,&az);
+	}
+    for (i=0;i<il->nPartTiles;++i) {
+	switch (kd->iSoftKernel) {
+	case SOFT_SPLINE:
+	    ilpTileSpline(&il->ilp[i],px,py,pz,fSoft,rule,rs,rcut2,box,boxinv,&pot,&ax,&ay,&az);
+	    break;
+	case SOFT_WENDLAND:
+	    ilpTileWendland(&il->ilp[i],px,py,pz,fSoft,rule,rs,rcut2,box,boxinv,&pot,&ax,&ay,&az);
+	    break;
+	default:
+	    ilpTilePlummer(&il->ilp[i],px,py,pz,fSoft,rule,rs,rcut2,box,boxinv,&pot,&ax,&ay,&az);
+	    }
+	}
+
+    /*
+    ** Undo the scaling of the lengths and masses
+    */
+    p->fPot = pot*L/il->dMass;
+    p->a[0] = ax*L*L/il->dMass;
+    p->a[1] = ay*L*L/il->dMass;
+    p->a[2] = az*L*L/il->dMass;
     }
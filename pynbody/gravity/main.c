@@ -1,4 +1,6 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include <numpy/arrayobject.h>
 
 #ifdef NDEBUG
@@ -11,182 +13,187 @@
 #include <math.h>
 #include <assert.h>
 
-#include <time.h>
-#include <unistd.h>
-#include <sys/times.h>
-#include <signal.h>
-
-#include <sched.h>
-#include <errno.h>
-
 #include "kd.h"
 
-/*==========================================================================*/
-/* Debugging tools                                                          */
-/*==========================================================================*/
-#define DBG_LEVEL 0
-#define DBG(lvl) if (DBG_LEVEL >= lvl)
-
-/*==========================================================================*/
-/* Memory allocation wrappers.                                              */
-/*==========================================================================*/
-
-#if DBG_LEVEL >= 10000
-long total_alloc = 0;
-#define CALLOC(type, num) \
-    (total_alloc += sizeof(type) * (num), \
-    fprintf(stderr, "c'allocating %ld bytes [already alloc'd: %ld].\n", sizeof(type) * (num), total_alloc), \
-    ((type *)calloc((num), sizeof(type))))
-#else
-#define CALLOC(type, num) ((type *)calloc((num), sizeof(type)))
-#endif
-
-#define MALLOC(type, num) ((type *)malloc((num) * sizeof(type)))
-
-
 /*==========================================================================*/
 /* Prototypes.                                                              */
 /*==========================================================================*/
 
-PyObject *treeinit(PyObject *self, PyObject *args);
-PyObject *kdfree(PyObject *self, PyObject *args);
-
-PyObject *calculate(PyObject *self, PyObject *args);
+static PyObject *treeinit(PyObject *self, PyObject *args);
+static PyObject *calculate(PyObject *self, PyObject *args);
 
 static PyMethodDef grav_methods[] =
 {
-    {"treeinit", treeinit, METH_VARARGS, "treeinit"},
-    {"free", kdfree, METH_VARARGS, "free"},
+    {"treeinit", treeinit, METH_VARARGS, "treeinit(pos, mass, eps, leafsize, theta, box=0, rsplit=0, rcut=0, kernel=0, rule=0)\n\n"
+     "Build a tree of the given (float64) particles, returning an opaque handle to it. If rsplit > 0,\n"
+     "only the short-range TreePM forces within rcut are calculated, in a periodic box if box > 0.\n"
+     "The particles are softened with the given kernel, and pairs with the given rule (see softening.h)"},
 
-    {"calculate",  calculate,  METH_VARARGS, "calculate"},
+    {"calculate",  calculate,  METH_VARARGS, "calculate(tree, pos, acc, pot, leafsize, num_threads, fmm=0, eps=None, single=0)\n\n"
+     "Fill acc and pot with the acceleration and potential (G=1) at the positions pos, walking the\n"
+     "tree for each group of positions or, if fmm is true, with the fast multipole method. If the\n"
+     "positions are particles with softening lengths eps, each pair is softened by the tree's rule.\n"
+     "If single is true, the tree walk evaluates its interactions in single precision (see ilp.h)"},
 
     {NULL, NULL, 0, NULL}
 };
 
-PyMODINIT_FUNC initgrav()
+static struct PyModuleDef ourdef = {
+  PyModuleDef_HEAD_INIT,
+  "pkdgrav",
+  "Barnes-Hut tree gravity module for pynbody",
+  -1,
+  grav_methods,
+  NULL, NULL, NULL, NULL };
+
+PyMODINIT_FUNC
+PyInit_pkdgrav(void)
 {
-    (void)Py_InitModule("grav", grav_methods);
+    PyObject *module = PyModule_Create(&ourdef);
+    import_array();
+    return module;
 }
 
 /*==========================================================================*/
-/* kdinit                                                                   */
+/* Argument checking                                                        */
 /*==========================================================================*/
-PyObject *treeinit(PyObject *self, PyObject *args)
+static int checkArray(PyObject *ar, const char *name, int ndim, npy_intp n, int writeable)
+{
+    if(!PyArray_Check(ar) || PyArray_TYPE((PyArrayObject*)ar)!=NPY_DOUBLE ||
+       !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)ar) || PyArray_NDIM((PyArrayObject*)ar)!=ndim ||
+       PyArray_DIM((PyArrayObject*)ar,0)!=n || (ndim==2 && PyArray_DIM((PyArrayObject*)ar,1)!=3)) {
+        PyErr_Format(PyExc_ValueError, "%s must be a C-contiguous float64 array of shape (%ld%s)",
+                     name, (long)n, ndim==2 ? ", 3" : ",");
+        return 1;
+    }
+    if(writeable && !PyArray_ISWRITEABLE((PyArrayObject*)ar)) {
+        PyErr_Format(PyExc_ValueError, "%s must be writeable", name);
+        return 1;
+    }
+    return 0;
+}
+
+static void kdCapsuleDestructor(PyObject *kdobj)
 {
-    int nBucket, nbodies, nTreeBitsLo=14, nTreebitsHi=18;
-    int i, j;
-    KD kd = (KD)malloc(sizeof(struct kdContext));
+    KD kd = (KD)PyCapsule_GetPointer(kdobj, NULL);
+    if(kd!=NULL) kdFinish(kd);
+}
 
-    PyObject *pos;  // Nx3 Numpy array of positions
-    PyObject *mass; // Nx1 Numpy array of masses
-    double dTheta=0.7 * 2.0/sqrt(3.0);
-    float fPeriod[3], fTemp, fSoft;
-    for (i=0; i<3; i++) fPeriod[i] = 1.0;
+/*==========================================================================*/
+/* treeinit                                                                 */
+/*==========================================================================*/
+static PyObject *treeinit(PyObject *self, PyObject *args)
+{
+    PyObject *pos, *mass, *eps;
+    int nBucket, iKernel = SOFT_PLUMMER, iRule = SOFT_RULE_MAX;
+    double dTheta, dBox = 0, dRsplit = 0, dRcut = 0;
+    npy_intp nbodies, i;
+    int j;
+    KD kd;
 
-    if (!PyArg_ParseTuple(args, "OOiif", &pos, &mass, &nBucket, &nbodies, &fSoft))
+    if (!PyArg_ParseTuple(args, "OOOid|dddii", &pos, &mass, &eps, &nBucket, &dTheta, &dBox, &dRsplit, &dRcut,
+                          &iKernel, &iRule))
         return NULL;
 
-    /*nbodies = PyArray_DIM(mass, 0);*/
-    kdInitialize(kd, nbodies, nBucket, dTheta, nTreeBitsLo, nTreebitsHi, fPeriod);
-    /*
-    ** Allocate particles.
-    */
+    if(!PyArray_Check(mass)) {
+        PyErr_SetString(PyExc_ValueError, "mass must be a numpy array");
+        return NULL;
+    }
+    nbodies = PyArray_DIM((PyArrayObject*)mass, 0);
+    if(checkArray(pos, "pos", 2, nbodies, 0) || checkArray(mass, "mass", 1, nbodies, 0) ||
+       checkArray(eps, "eps", 1, nbodies, 0))
+        return NULL;
+    if(nbodies > INT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "Too many particles for the gravity tree");
+        return NULL;
+    }
 
-    kd->pStorePRIVATE = (PARTICLE *)malloc(nbodies*kd->iParticleSize);
-    assert(kd->pStorePRIVATE != NULL);
+    kd = kdInitialize((int)nbodies, nBucket, dTheta);
+    kdSetShortRange(kd, dBox, dRsplit, dRcut);
+    kdSetSoftening(kd, iKernel, iRule);
 
     Py_BEGIN_ALLOW_THREADS
 
     for (i=0; i < nbodies; i++)
     {
-	for (j=0; j < 3; j++) {
-	    fTemp = (float)*((double *)PyArray_GETPTR2(pos, i, j));
-	    kd->pStorePRIVATE[i].r[j] = fTemp;
-	    kd->pStorePRIVATE[i].a[j] = 0;
-	    }
-	fTemp = (float)*((double *)PyArray_GETPTR1(mass, i));
-        kd->pStorePRIVATE[i].fMass = fTemp;
-        kd->pStorePRIVATE[i].fPot = 0;
-        kd->pStorePRIVATE[i].fSoft = fSoft;
+        PARTICLE *p = kdParticle(kd, (int)i);
+        for (j=0; j < 3; j++)
+            p->r[j] = *((double *)PyArray_GETPTR2((PyArrayObject*)pos, i, j));
+        p->fMass = *((double *)PyArray_GETPTR1((PyArrayObject*)mass, i));
+        p->fSoft = *((double *)PyArray_GETPTR1((PyArrayObject*)eps, i));
+        p->iOrder = i;
     }
 
-    kdTreeBuild(kd, nBucket);
-
+    kdTreeBuild(kd);
 
     Py_END_ALLOW_THREADS
 
-    return PyCObject_FromVoidPtr((void *)kd, NULL);
+    return PyCapsule_New((void *)kd, NULL, kdCapsuleDestructor);
 }
 
 /*==========================================================================*/
-/* kdfree                                                                   */
+/* calculate                                                                */
 /*==========================================================================*/
-PyObject *kdfree(PyObject *self, PyObject *args)
+static PyObject *calculate(PyObject *self, PyObject *args)
 {
-    KD kd;
-    PyObject *kdobj;
-
-    PyArg_ParseTuple(args, "O", &kdobj);
-    kd = PyCObject_AsVoidPtr(kdobj);
-
-    kdFinish(kd);
-
-    return Py_None;
-}
-
-
-/*==========================================================================*/
-/* calculate                                                                 */
-/*==========================================================================*/
-PyObject *calculate(PyObject *self, PyObject *args)
-{
-    long i, j;
+    PyObject *kdobj, *acc, *pot, *pos, *eps = Py_None;
+    int nBucket, nThreads, bFmm = 0, bSingle = 0;
+    npy_intp nPos, i;
+    int j;
+    KD kd, kdTest;
+
+    if(!PyArg_ParseTuple(args, "OOOOii|iOi", &kdobj, &pos, &acc, &pot, &nBucket, &nThreads, &bFmm, &eps,
+                         &bSingle))
+        return NULL;
 
-    KD kd;
-    int nReps=0, bPeriodic=0, bEwald=0;
-    float fSoft;
-    int nPos;
-    PyObject *kdobj, *acc, *pot, *pos;
-    PARTICLE *testParticles;
-
-    PyArg_ParseTuple(args, "OOOOdi", &kdobj, &pos, &acc, &pot, &fSoft, &nPos);
-    kd  = PyCObject_AsVoidPtr(kdobj);
+    kd = (KD)PyCapsule_GetPointer(kdobj, NULL);
     if (kd == NULL) return NULL;
 
-    testParticles = (PARTICLE *)malloc(nPos*sizeof(PARTICLE));
-    assert(testParticles != NULL);
-    for (i=0; i< nPos; i++) {
-	for (j=0; j < 3; j++) {
-	    testParticles[i].r[j] =
-		(float)*((double *)PyArray_GETPTR2(pos, i, j));
-	    testParticles[i].a[j] = 0;
-	    }
-	    testParticles[i].fMass = 0;
-	    testParticles[i].fPot = 0;
-	    testParticles[i].fSoft = fSoft;
-	    testParticles[i].iOrder = i;
-	}
+    if(!PyArray_Check(pot)) {
+        PyErr_SetString(PyExc_ValueError, "pot must be a numpy array");
+        return NULL;
+    }
+    nPos = PyArray_DIM((PyArrayObject*)pot, 0);
+    if(checkArray(pos, "pos", 2, nPos, 0) || checkArray(acc, "acc", 2, nPos, 1) ||
+       checkArray(pot, "pot", 1, nPos, 1) || (eps != Py_None && checkArray(eps, "eps", 1, nPos, 0)))
+        return NULL;
+    if(nPos > INT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "Too many positions for the gravity tree");
+        return NULL;
+    }
+    if(nThreads < 1) nThreads = 1;
+
     Py_BEGIN_ALLOW_THREADS
 
-	kdGravWalk(kd, nReps, bPeriodic && bEwald, testParticles, nPos);
+    /*
+    ** The test positions get a (massless) tree of their own, whose buckets
+    ** group nearby positions so that they can share a single walk. Positions
+    ** without softening lengths take those of the sources.
+    */
+    kdTest = kdInitialize((int)nPos, nBucket, 0.0);
+    for (i=0; i < nPos; i++) {
+        PARTICLE *p = kdParticle(kdTest, (int)i);
+        for (j=0; j < 3; j++)
+            p->r[j] = *((double *)PyArray_GETPTR2((PyArrayObject*)pos, i, j));
+        p->fMass = 0;
+        p->fSoft = eps == Py_None ? 0 : *((double *)PyArray_GETPTR1((PyArrayObject*)eps, i));
+        p->iOrder = i;
+    }
+    kdTreeBuild(kdTest);
 
-    Py_END_ALLOW_THREADS
+    if (bFmm) kdGravFmm(kd, kdTest, nThreads);
+    else kdGravWalk(kd, kdTest, nThreads, bSingle);
 
     for (i=0; i < nPos; i++) {
-	PyArray_SETITEM(pot, PyArray_GETPTR1(pot,i), PyFloat_FromDouble(testParticles[i].fPot));
-	for (j=0; j < 3; j++) {
-	    PyArray_SETITEM(acc, PyArray_GETPTR2(acc, i, j),
-			    PyFloat_FromDouble(testParticles[i].a[j]));
-	    }
-	}
+        PARTICLE *p = kdParticle(kdTest, (int)i);
+        *((double *)PyArray_GETPTR1((PyArrayObject*)pot, p->iOrder)) = p->fPot;
+        for (j=0; j < 3; j++)
+            *((double *)PyArray_GETPTR2((PyArrayObject*)acc, p->iOrder, j)) = p->a[j];
+    }
 
+    kdFinish(kdTest);
 
-    Py_DECREF(kd);
-    /*
-    Py_DECREF(pos);
-    Py_DECREF(pot);
-    Py_DECREF(acc);
-    */
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
 }
@@ -0,0 +1,185 @@
+"""Multipole-expansion gravity. The potential of the particles is expanded in spherical harmonics
+about the origin, with coefficients tabulated on radial shells, so that once it is built the
+potential and acceleration can be evaluated cheaply at any number of positions"""
+
+import math
+from time import process_time
+
+import numpy as np
+
+from .. import config
+
+# particles are summed in chunks of this many, bounding the memory used by the harmonics
+_CHUNK = 65536
+
+
+def _real_harmonics(lmax, x, y, z, derivatives=False):
+    """Return the (l, m) pairs and the orthonormal real spherical harmonics of the directions (x, y, z),
+    as an array of shape (n_lm, n), and the radii. If *derivatives*, also return the harmonics' derivatives
+    with respect to the polar and azimuthal angles, and the sines and cosines of the polar angles and the
+    azimuthal angles themselves."""
+    r = np.sqrt(x ** 2 + y ** 2 + z ** 2)
+    cos_theta = np.divide(z, r, out=np.ones_like(r), where=r > 0)
+    sin_theta = np.sqrt(np.maximum(1 - cos_theta ** 2, 0))
+    phi = np.arctan2(y, x)
+
+    # associated Legendre functions, without the Condon-Shortley phase
+    legendre = {}
+    for m in range(lmax + 1):
+        pmm = math.prod(range(1, 2 * m, 2)) * sin_theta ** m
+        legendre[m, m] = pmm
+        if m < lmax:
+            legendre[m + 1, m] = cos_theta * (2 * m + 1) * pmm
+        for l in range(m + 2, lmax + 1):
+            legendre[l, m] = ((2 * l - 1) * cos_theta * legendre[l - 1, m]
+                              - (l + m - 1) * legendre[l - 2, m]) / (l - m)
+
+    lm = [(l, m) for l in range(lmax + 1) for m in range(-l, l + 1)]
+    harmonics = np.empty((len(lm), len(r)))
+    if derivatives:
+        d_theta = np.empty_like(harmonics)
+        d_phi = np.empty_like(harmonics)
+        safe_sin = np.maximum(sin_theta, 1e-12)
+
+    for i, (l, m) in enumerate(lm):
+        am = abs(m)
+        norm = math.sqrt((2 * l + 1) / (4 * math.pi) * math.factorial(l - am) / math.factorial(l + am))
+        if m > 0:
+            norm *= math.sqrt(2)
+            angular, d_angular = np.cos(m * phi), -m * np.sin(m * phi)
+        elif m < 0:
+            norm *= math.sqrt(2)
+            angular, d_angular = np.sin(am * phi), am * np.cos(am * phi)
+        else:
+            angular, d_angular = 1.0, 0.0
+        harmonics[i] = norm * legendre[l, am] * angular
+        if derivatives:
+            # (x^2 - 1) dP_l^m/dx = l x P_l^m - (l + m) P_(l-1)^m, and dx/dtheta = -sin(theta)
+            lower = legendre[l - 1, am] if l > am else 0.0
+            d_legendre = (l * cos_theta * legendre[l, am] - (l + am) * lower) / safe_sin
+            d_theta[i] = norm * d_legendre * angular
+            d_phi[i] = norm * legendre[l, am] * d_angular
+
+    if derivatives:
+        return lm, harmonics, d_theta, d_phi, r, sin_theta, cos_theta, phi
+    return lm, harmonics, r
+
+
+class MultipoleExpansion:
+    """Gravitational potential and acceleration (with G=1, in the units of the input arrays) from a
+    spherical-harmonic expansion of the particles' mass about the origin."""
+
+    def __init__(self, pos, mass, lmax=8, nshells=None):
+        """Build the expansion up to order *lmax*, in a single pass over the particles.
+
+        The interior and exterior multipole moments are summed over *nshells* radial shells, each holding
+        the same number of particles (by default one shell per hundred particles, between 10 and 1000),
+        and interpolated in radius between the shell boundaries. The expansion is exact at the boundaries
+        except for softening, which it omits; with *lmax* = 0 it is the spherically averaged potential."""
+
+        pos = np.asarray(pos, dtype=np.float64).reshape((-1, 3))
+        mass = np.asarray(mass, dtype=np.float64)
+        if nshells is None:
+            nshells = min(max(len(mass) // 100, 10), 1000)
+        self.lmax = int(lmax)
+
+        start = process_time()
+        r = np.sqrt((pos ** 2).sum(axis=1))
+        self.edges = np.concatenate(([0.0], np.quantile(r, np.linspace(0, 1, nshells + 1)[1:])))
+        self.edges = np.maximum.accumulate(self.edges)
+
+        n_lm = (self.lmax + 1) ** 2
+        inner = np.zeros((n_lm, nshells + 1))
+        outer = np.zeros((n_lm, nshells + 1))
+        l_of = None
+        for chunk in range(0, len(mass), _CHUNK):
+            p = pos[chunk:chunk + _CHUNK]
+            m = mass[chunk:chunk + _CHUNK]
+            lm, harmonics, rc = _real_harmonics(self.lmax, p[:, 0], p[:, 1], p[:, 2])
+            if l_of is None:
+                l_of = np.array([l for l, _ in lm])[:, np.newaxis]
+            # a particle exactly at the origin is inside every shell boundary, so its outer moments never count
+            shell = np.clip(np.searchsorted(self.edges, rc, side='left'), 1, nshells)
+            r_pow = rc[np.newaxis, :] ** l_of
+            inv_pow = np.divide(1.0, rc[np.newaxis, :] ** (l_of + 1), out=np.zeros_like(r_pow),
+                                where=rc[np.newaxis, :] > 0)
+            for i in range(n_lm):
+                inner[i] += np.bincount(shell, m * r_pow[i] * harmonics[i], minlength=nshells + 1)
+                outer[i] += np.bincount(shell, m * inv_pow[i] * harmonics[i], minlength=nshells + 1)
+
+        # the moments of the particles inside (or outside) each shell boundary; the exterior moments are
+        # summed from the outside in, since those of the innermost particles can be larger by many orders
+        self.inner = np.cumsum(inner, axis=1)
+        self.outer = np.zeros_like(outer)
+        self.outer[:, :-1] = np.cumsum(outer[:, :0:-1], axis=1)[:, ::-1]
+        self.l = l_of if l_of is not None else np.zeros((n_lm, 1), dtype=int)
+
+        end = process_time()
+        if config['verbose']:
+            print('Multipole expansion built in %5.3g s' % (end - start))
+
+    def _moments_at(self, r):
+        """Interpolate the interior and exterior moments to radii r, returning arrays of shape (n_lm, len(r)).
+
+        Within each shell the moments vary as they would for a uniform density, so that the interior
+        moments grow as r^(l+3) (keeping the acceleration finite at the centre), and the exterior moments
+        of the innermost particles, which would diverge, are only reached at the centre itself."""
+        n = len(self.edges) - 1
+        j = np.clip(np.searchsorted(self.edges, r, side='right'), 1, n)
+        hi = self.edges[j]
+        scale = np.where(hi > 0, hi, 1)
+        q = self.edges[j - 1] / scale
+        s = np.clip(r / scale, q, 1)
+        l = self.l
+
+        # the fraction of the shell's interior moment inside r ...
+        q_in = q ** (l + 3)
+        w_inner = np.divide(s ** (l + 3) - q_in, 1 - q_in, out=np.ones_like(q_in), where=q_in < 1)
+
+        # ... and of its exterior moment outside r, from the integral of r^(1-l) across the shell
+        with np.errstate(divide='ignore', invalid='ignore'):
+            k = np.abs(l - 2)
+            w_below = (1 - s ** (2 - l)) / (1 - q ** (2 - l))
+            w_log = np.log(s) / np.log(q)
+            w_above = (q / s) ** k * (1 - s ** k) / (1 - q ** k)
+            w_outer = np.where(l < 2, w_below, np.where(l == 2, w_log, w_above))
+        w_outer = np.where(np.isfinite(w_outer), w_outer, q < s)
+        w_outer = np.where(q < 1, w_outer, 0)
+
+        inner = self.inner[:, j - 1] + w_inner * (self.inner[:, j] - self.inner[:, j - 1])
+        outer = self.outer[:, j] + w_outer * (self.outer[:, j - 1] - self.outer[:, j])
+        return inner, outer
+
+    def calc(self, ipos):
+        """Return the acceleration and potential at each of the positions *ipos*"""
+        ipos = np.asarray(ipos, dtype=np.float64).reshape((-1, 3))
+        acc = np.empty((len(ipos), 3))
+        pot = np.empty(len(ipos))
+        l = self.l
+        factor = -4 * np.pi / (2 * l + 1)
+
+        for chunk in range(0, len(ipos), _CHUNK):
+            p = ipos[chunk:chunk + _CHUNK]
+            _, harmonics, d_theta, d_phi, r, sin_theta, cos_theta, azimuth = \
+                _real_harmonics(self.lmax, p[:, 0], p[:, 1], p[:, 2], derivatives=True)
+            inner, outer = self._moments_at(r)
+            origin = r == 0
+            r = np.where(origin, 1, r)
+
+            radial = factor * (inner * r ** -(l + 1.0) + outer * r ** l)
+            d_radial = factor * (-(l + 1) * inner * r ** -(l + 2.0) + l * outer * r ** (l - 1.0))
+            # at the origin only the l = 0 exterior moment contributes to the potential, and nothing to the force
+            radial[:, origin] *= (l == 0)
+            d_radial[:, origin] = 0
+
+            pot[chunk:chunk + _CHUNK] = (radial * harmonics).sum(axis=0)
+            g_r = (d_radial * harmonics).sum(axis=0)
+            g_theta = (radial * d_theta).sum(axis=0) / r
+            g_phi = (radial * d_phi).sum(axis=0) / (r * np.maximum(sin_theta, 1e-12))
+
+            cos_phi, sin_phi = np.cos(azimuth), np.sin(azimuth)
+            acc[chunk:chunk + _CHUNK, 0] = -(g_r * sin_theta * cos_phi + g_theta * cos_theta * cos_phi - g_phi * sin_phi)
+            acc[chunk:chunk + _CHUNK, 1] = -(g_r * sin_theta * sin_phi + g_theta * cos_theta * sin_phi + g_phi * cos_phi)
+            acc[chunk:chunk + _CHUNK, 2] = -(g_r * cos_theta - g_theta * sin_theta)
+
+        return acc, pot
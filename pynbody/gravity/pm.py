@@ -0,0 +1,151 @@
+"""Particle-mesh gravity. Mass is assigned to a cubic mesh, Poisson's equation solved with FFTs and
+the resulting accelerations and potential interpolated back to arbitrary positions"""
+
+from time import process_time
+
+import numpy as np
+
+from .. import config, openmp
+from . import _gravity
+
+#: Mass assignment schemes, by the number of cells a particle's weight spans in each direction
+ASSIGNMENT_ORDER = {'ngp': 1, 'cic': 2, 'tsc': 3}
+
+# mean of 1/r over a unit cube about its centre, for the self-potential of a cell
+_CELL_MEAN_INVERSE_DISTANCE = 2.3800774
+
+# cells kept between the particles (or positions) and the edge of an isolated mesh, beyond which
+# the 4-point gradient stencil and the interpolation weights would reach past the valid potential
+_ISOLATED_MARGIN = 4
+
+
+class PMSolver:
+    """Gravitational potential and acceleration (with G=1, in the units of the input arrays) from
+    the particle-mesh method, at arbitrary positions."""
+
+    def __init__(self, ngrid=64, boxsize=None, assignment='cic', num_threads=0, split_scale=None):
+        """Set up the solver.
+
+        The mesh has *ngrid* cells along each side. If *boxsize* is given, the particles are treated as
+        periodic in a cube of that side (with the potential of the mean density removed); otherwise the
+        boundaries are isolated, and the mesh is sized to cover the particles and positions supplied to
+        :meth:`calc`.
+
+        *assignment* is 'ngp', 'cic' or 'tsc'; the same weights are used to interpolate back to the
+        positions, and for periodic meshes their smoothing is deconvolved from the solution. The
+        particles are shared between *num_threads* threads (default from the configuration file).
+
+        If *split_scale* is given (periodic meshes only), only the long-range part of a TreePM force
+        split is found: the potential of each particle is that of a Gaussian cloud with that width."""
+
+        if assignment not in ASSIGNMENT_ORDER:
+            raise ValueError("Unknown mass assignment scheme %r; use one of %s"
+                             % (assignment, ", ".join(ASSIGNMENT_ORDER)))
+        if ngrid < 2 * _ISOLATED_MARGIN + 1 and boxsize is None:
+            raise ValueError("Isolated particle-mesh gravity needs ngrid > %d" % (2 * _ISOLATED_MARGIN))
+        if split_scale is not None and boxsize is None:
+            raise ValueError("A long-range force split is only available for periodic meshes")
+
+        if num_threads == 0:
+            num_threads = int(config["number_of_threads"])
+        if num_threads < 0 or num_threads > openmp.get_cpus():
+            num_threads = openmp.get_cpus()
+
+        self.ngrid = int(ngrid)
+        self.boxsize = None if boxsize is None else float(boxsize)
+        self.order = ASSIGNMENT_ORDER[assignment]
+        self.num_threads = num_threads
+        self.split_scale = None if split_scale is None else float(split_scale)
+
+    def _mesh_geometry(self, pos, ipos):
+        """Return the lower corner and cell size of the mesh"""
+        if self.boxsize is not None:
+            return np.zeros(3), self.boxsize / self.ngrid
+
+        points = np.concatenate((pos, ipos))
+        lo, hi = points.min(axis=0), points.max(axis=0)
+        extent = (hi - lo).max()
+        if extent == 0:
+            extent = 1.0
+        dx = extent / (self.ngrid - 2 * _ISOLATED_MARGIN)
+        return 0.5 * (lo + hi) - 0.5 * self.ngrid * dx, dx
+
+    def _window_squared(self, dx):
+        """Return the squared Fourier transform of the assignment weights on the real-FFT mesh"""
+        n = self.ngrid
+        sinc = [np.sinc(np.fft.fftfreq(n, d=dx) * dx), np.sinc(np.fft.rfftfreq(n, d=dx) * dx)]
+        window = (sinc[0][:, np.newaxis, np.newaxis] * sinc[0][np.newaxis, :, np.newaxis]
+                  * sinc[1][np.newaxis, np.newaxis, :]) ** self.order
+        return window ** 2
+
+    def _periodic_potential(self, mass_grid, dx):
+        n = self.ngrid
+        k = [2 * np.pi * np.fft.fftfreq(n, d=dx), 2 * np.pi * np.fft.rfftfreq(n, d=dx)]
+        k2 = (k[0][:, np.newaxis, np.newaxis] ** 2 + k[0][np.newaxis, :, np.newaxis] ** 2
+              + k[1][np.newaxis, np.newaxis, :] ** 2)
+        k2[0, 0, 0] = 1.0
+
+        green = -4 * np.pi / (k2 * self._window_squared(dx))
+        if self.split_scale is not None:
+            green *= np.exp(-k2 * self.split_scale ** 2)
+        green[0, 0, 0] = 0.0  # the mean density does not contribute
+
+        return np.fft.irfftn(np.fft.rfftn(mass_grid / dx ** 3) * green, mass_grid.shape)
+
+    def _isolated_potential(self, mass_grid, dx):
+        # zero-padding to twice the size makes the cyclic convolution with -1/r exact on the original mesh
+        n = 2 * self.ngrid
+        r_cells = np.minimum(np.arange(n), n - np.arange(n))
+        r = dx * np.sqrt(r_cells[:, np.newaxis, np.newaxis] ** 2 + r_cells[np.newaxis, :, np.newaxis] ** 2
+                         + r_cells[np.newaxis, np.newaxis, :] ** 2)
+        r[0, 0, 0] = dx / _CELL_MEAN_INVERSE_DISTANCE
+        # the sampled 1/r already describes point masses, so (unlike the periodic case) the
+        # assignment smoothing is left in: deconvolving it makes the forces ring near each particle
+        green = np.fft.rfftn(-1.0 / r)
+        del r
+
+        padded = np.zeros((n, n, n))
+        padded[:self.ngrid, :self.ngrid, :self.ngrid] = mass_grid
+        phi = np.fft.irfftn(np.fft.rfftn(padded) * green, padded.shape)
+        return np.ascontiguousarray(phi[:self.ngrid, :self.ngrid, :self.ngrid])
+
+    @staticmethod
+    def _gradient(phi, dx, axis):
+        """Return the 4-point finite-difference derivative of phi along *axis*, with periodic wrapping"""
+        return (8 * (np.roll(phi, -1, axis) - np.roll(phi, 1, axis))
+                - (np.roll(phi, -2, axis) - np.roll(phi, 2, axis))) / (12 * dx)
+
+    def calc(self, pos, mass, ipos):
+        """Return the acceleration and potential at each of the positions *ipos* due to particles with
+        positions *pos* and masses *mass*"""
+
+        pos = np.ascontiguousarray(pos, dtype=np.float64).reshape((-1, 3))
+        ipos = np.ascontiguousarray(ipos, dtype=np.float64).reshape((-1, 3))
+        mass = np.ascontiguousarray(mass, dtype=np.float64)
+        if self.boxsize is not None:
+            pos = np.mod(pos, self.boxsize)
+            ipos = np.mod(ipos, self.boxsize)
+
+        x0, dx = self._mesh_geometry(pos, ipos)
+
+        start = process_time()
+        mass_grid = _gravity.mesh_assign(pos, mass, self.ngrid, x0, dx, self.order, self.num_threads)
+        if self.boxsize is not None:
+            phi = self._periodic_potential(mass_grid, dx)
+        else:
+            phi = self._isolated_potential(mass_grid, dx)
+        del mass_grid
+
+        # one component at a time, so that no more than two extra meshes are held at once
+        pot = _gravity.mesh_interpolate(phi[np.newaxis], ipos, x0, dx, self.order, self.num_threads)[:, 0]
+        acc = np.empty((len(ipos), 3))
+        for axis in range(3):
+            grad = -self._gradient(phi, dx, axis)
+            acc[:, axis] = _gravity.mesh_interpolate(grad[np.newaxis], ipos, x0, dx, self.order,
+                                                     self.num_threads)[:, 0]
+            del grad
+        end = process_time()
+        if config['verbose']:
+            print('Particle-mesh gravity calculated in %5.3g s' % (end - start))
+
+        return acc, pot
@@ -0,0 +1,107 @@
+/*
+ * Gravitational softening kernels, shared by the direct summation kernels
+ * and the tree code.
+ *
+ * Each kernel gives, for a source of unit mass at squared separation r2 with
+ * softening length eps, dir = -phi and dir3 = |acc|/r, which for a point
+ * mass would be 1/r and 1/r^3. The compact kernels are Newtonian beyond
+ * their support, SOFT_SPLINE_SUPPORT (Monaghan's cubic spline, as in
+ * Gadget) or SOFT_WENDLAND_SUPPORT (Wendland C2) times eps. All are scaled
+ * so that eps is the Plummer-equivalent softening, with the same potential
+ * -1/eps at zero separation.
+ *
+ * The branches are written as selections between values which are all
+ * computed, so that loops over sources still vectorise; the values in the
+ * unselected branches may be infinite.
+ *
+ * When the target also has a softening length, the pair is softened with
+ * the larger of the two (SOFT_RULE_MAX) or their mean (SOFT_RULE_MEAN), so
+ * that the forces between two particles are equal and opposite. A target
+ * with no softening is a position rather than a particle, and the source's
+ * softening is used.
+ */
+
+#ifndef SOFTENING_H
+#define SOFTENING_H
+
+#include <math.h>
+
+#define SOFT_PLUMMER 0
+#define SOFT_SPLINE 1
+#define SOFT_WENDLAND 2
+
+#define SOFT_RULE_MAX 0
+#define SOFT_RULE_MEAN 1
+
+#define SOFT_SPLINE_SUPPORT 2.8
+#define SOFT_WENDLAND_SUPPORT 3.0
+
+/*
+ * The separation, in units of eps, beyond which a cell's (Plummer-softened)
+ * multipoles are used in place of its particles.
+ */
+#define SOFT_PLUMMER_REACH 2.0
+
+#define SOFT_KERNELS(SUFFIX, REAL, SQRT)                                                        \
+static inline REAL softPair##SUFFIX(REAL eps_source, REAL eps_target, int rule)                 \
+{                                                                                               \
+    REAL larger = eps_source > eps_target ? eps_source : eps_target;                            \
+    REAL pair = rule == SOFT_RULE_MEAN ? (REAL)0.5*(eps_source + eps_target) : larger;          \
+    return eps_target > 0 ? pair : eps_source;                                                  \
+}                                                                                               \
+                                                                                                \
+static inline void softPlummer##SUFFIX(REAL r2, REAL eps, REAL *dir, REAL *dir3)                \
+{                                                                                               \
+    REAL d = 1/SQRT(r2 + eps*eps);                                                              \
+    *dir = d;                                                                                   \
+    *dir3 = d*d*d;                                                                              \
+}                                                                                               \
+                                                                                                \
+static inline void softSpline##SUFFIX(REAL r2, REAL eps, REAL *dir, REAL *dir3)                 \
+{                                                                                               \
+    REAL r = SQRT(r2), h = (REAL)SOFT_SPLINE_SUPPORT*eps;                                       \
+    REAL rinv = 1/r, hinv = 1/h, hinv3 = hinv*hinv*hinv;                                        \
+    REAL u = r*hinv, u2 = u*u;                                                                  \
+    REAL inner = hinv*((REAL)2.8 - u2*((REAL)(16.0/3) + u2*((REAL)6.4*u - (REAL)9.6)));         \
+    REAL inner3 = hinv3*((REAL)(32.0/3) + u2*(32*u - (REAL)38.4));                              \
+    REAL outer = hinv*((REAL)3.2 - 1/(15*u)                                                     \
+                       - u2*((REAL)(32.0/3) + u*(-16 + u*((REAL)9.6 - (REAL)(32.0/15)*u))));    \
+    REAL outer3 = hinv3*((REAL)(64.0/3) - 48*u + (REAL)38.4*u2 - (REAL)(32.0/3)*u2*u            \
+                         - 1/(15*u2*u));                                                        \
+    *dir = r >= h ? rinv : (u < (REAL)0.5 ? inner : outer);                                     \
+    *dir3 = r >= h ? rinv*rinv*rinv : (u < (REAL)0.5 ? inner3 : outer3);                        \
+}                                                                                               \
+                                                                                                \
+static inline void softWendland##SUFFIX(REAL r2, REAL eps, REAL *dir, REAL *dir3)               \
+{                                                                                               \
+    REAL r = SQRT(r2), h = (REAL)SOFT_WENDLAND_SUPPORT*eps;                                     \
+    REAL rinv = 1/r, hinv = 1/h, hinv3 = hinv*hinv*hinv;                                        \
+    REAL q = r*hinv, q2 = q*q;                                                                  \
+    REAL inner = hinv*(3 + q2*(-7 + q2*(21 + q*(-28 + q*(15 - 3*q)))));                         \
+    REAL inner3 = hinv3*(14 + q2*(-84 + q*(140 + q*(-90 + 21*q))));                             \
+    *dir = r >= h ? rinv : inner;                                                               \
+    *dir3 = r >= h ? rinv*rinv*rinv : inner3;                                                   \
+}                                                                                               \
+                                                                                                \
+static inline void softKernel##SUFFIX(int kernel, REAL r2, REAL eps, REAL *dir, REAL *dir3)     \
+{                                                                                               \
+    switch (kernel) {                                                                           \
+    case SOFT_SPLINE: softSpline##SUFFIX(r2, eps, dir, dir3); break;                            \
+    case SOFT_WENDLAND: softWendland##SUFFIX(r2, eps, dir, dir3); break;                        \
+    default: softPlummer##SUFFIX(r2, eps, dir, dir3);                                           \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+static inline REAL softReach##SUFFIX(int kernel)                                                \
+{                                                                                               \
+    switch (kernel) {                                                                           \
+    case SOFT_SPLINE: return (REAL)SOFT_SPLINE_SUPPORT;                                         \
+    case SOFT_WENDLAND: return (REAL)SOFT_WENDLAND_SUPPORT;                                     \
+    default: return (REAL)SOFT_PLUMMER_REACH;                                                   \
+    }                                                                                           \
+}
+
+SOFT_KERNELS(, double, sqrt)
+SOFT_KERNELS(F, float, sqrtf)
+
+#endif
@@ -0,0 +1,59 @@
+"""Gravitational softening kernels for the direct summation and tree gravity (see softening.h).
+
+The softening length eps of each particle is Plummer-equivalent: every kernel gives the potential -m/eps at
+zero separation. The Plummer kernel softens the force at all separations, while the spline (Monaghan's cubic
+spline, as used by Gadget) and Wendland C2 kernels are exactly Newtonian beyond their support of
+:data:`SUPPORT` times eps, so that forces just outside the softening length are not biased.
+
+When both particles of a pair have softening lengths, the pair is softened with the larger of the two ('max')
+or with their mean ('mean'), so that the forces between them are equal and opposite."""
+
+import numpy as np
+
+from .. import config
+
+#: Softening kernels, by their index in softening.h
+KERNELS = {'plummer': 0, 'spline': 1, 'wendland': 2}
+
+#: Rules for softening a pair of particles, by their index in softening.h
+RULES = {'max': 0, 'mean': 1}
+
+#: Separations, in units of eps, beyond which the compact kernels are Newtonian
+SUPPORT = {'spline': 2.8, 'wendland': 3.0}
+
+
+def parameters(softening=None, rule='max'):
+    """Return the indices of the *softening* kernel (default from the configuration file) and of the pairwise
+    softening *rule*, for passing to the compiled gravity code"""
+    if softening is None:
+        softening = config['gravity_softening']
+    if softening not in KERNELS:
+        raise ValueError("Unknown softening kernel %r; use one of %s" % (softening, ", ".join(KERNELS)))
+    if rule not in RULES:
+        raise ValueError("Unknown pairwise softening rule %r; use one of %s" % (rule, ", ".join(RULES)))
+    return KERNELS[softening], RULES[rule]
+
+
+def potential_and_force(r, eps, softening='plummer'):
+    """Return -phi and |acc|/r of a unit mass at separations *r* with softening length *eps* (for a point mass
+    these would be 1/r and 1/r^3). This is a separate numpy implementation of the kernels in softening.h, for
+    reference and plotting; the compiled code does not use it."""
+    r, eps = np.broadcast_arrays(np.asarray(r, dtype=np.float64), np.asarray(eps, dtype=np.float64))
+    if softening == 'plummer':
+        dir = 1 / np.sqrt(r ** 2 + eps ** 2)
+        return dir, dir ** 3
+
+    parameters(softening)
+    h = SUPPORT[softening] * eps
+    with np.errstate(divide='ignore', invalid='ignore'):
+        u = r / h
+        if softening == 'spline':
+            inner = (2.8 - u ** 2 * (16 / 3 + u ** 2 * (6.4 * u - 9.6))) / h
+            inner3 = (32 / 3 + u ** 2 * (32 * u - 38.4)) / h ** 3
+            outer = (3.2 - 1 / (15 * u) - u ** 2 * (32 / 3 + u * (-16 + u * (9.6 - 32 / 15 * u)))) / h
+            outer3 = (64 / 3 - 48 * u + 38.4 * u ** 2 - 32 / 3 * u ** 3 - 1 / (15 * u ** 3)) / h ** 3
+            inner, inner3 = np.where(u < 0.5, inner, outer), np.where(u < 0.5, inner3, outer3)
+        else:
+            inner = (3 - 7 * u ** 2 + 21 * u ** 4 - 28 * u ** 5 + 15 * u ** 6 - 3 * u ** 7) / h
+            inner3 = (14 - 84 * u ** 2 + 140 * u ** 3 - 90 * u ** 4 + 21 * u ** 5) / h ** 3
+        return np.where(r >= h, 1 / r, inner), np.where(r >= h, 1 / r ** 3, inner3)
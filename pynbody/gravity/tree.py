@@ -1,49 +1,100 @@
-"""Gravity Tree. Builds tree based on pkdgrav2"""
-
-try:
-    from .. import pkdgrav
-except ImportError:
-    # pkdgrav2 never works at the moment, and the warning below
-    # confuses/annoys people
-    pass
-    #import warnings
-    #warnings.warn("Unable to import PKDGrav gravity solver. Most likely this means either that your installation is broken, or that you are running python inside the pynbody distribution directory, in which case python cannot see the installed version. However, it also doesn't matter unless you want to use the tree gravity solver.",RuntimeWarning)
+"""Gravity Tree. Barnes-Hut tree and fast multipole method with hexadecapole cell moments, based on pkdgrav2"""
 
 from time import process_time
 
 import numpy as np
 
-from .. import config
+from .. import config, openmp
+from . import pkdgrav
+from . import softening as softening_kernels
 
 
 class GravTree:
+    """A tree of source particles, from which the gravitational acceleration and potential
+    (with G=1, in the units of the input arrays) can be calculated at arbitrary positions."""
+
+    def __init__(self, pos, mass, eps, leafsize=16, theta=0.55, boxsize=None, split_scale=None, cutoff=None,
+                 softening=None, softening_rule='max'):
+        """Build the tree.
+
+        *pos*, *mass* and *eps* are the positions, masses and softening lengths (a single
+        length, or one per particle) of the source particles, which are softened with the *softening* kernel (default from the
+        configuration file; see :mod:`pynbody.gravity.softening`). Cells are opened when seen
+        within an angle *theta* (in radians) of their centre of mass, so that *theta* = 0
+        reproduces direct summation exactly.
+
+        When the positions at which forces are calculated are themselves softened particles,
+        each pair is softened according to *softening_rule*, 'max' or 'mean'.
+
+        If *split_scale* is given, only the short-range part of a TreePM force split on that
+        scale is calculated (see :func:`pynbody.gravity.calc.treepm`), neglecting particles
+        beyond *cutoff*. If *boxsize* is also given, each interaction is with the nearest
+        periodic image."""
+
+        self.leafsize = int(leafsize)
+        self.theta = float(theta)
+        self.short_range = split_scale is not None
+
+        kernel, rule = softening_kernels.parameters(softening, softening_rule)
+
+        short_range = (0.0, 0.0, 0.0)
+        if split_scale is not None:
+            if cutoff is None:
+                raise ValueError("A short-range tree needs a cutoff radius")
+            short_range = (float(boxsize or 0), float(split_scale), float(cutoff))
 
-    def __init__(self, pos, mass, rs, eps=None, leafsize=16):
+        mass = np.ascontiguousarray(mass, dtype=np.float64)
+        eps = np.ascontiguousarray(np.broadcast_to(np.asarray(eps, dtype=np.float64), mass.shape))
 
         start = process_time()
-        self.tree = pkdgrav.pkdPythonInitialize(
-            pos, mass, eps, rs, int(leafsize))
+        self.tree = pkdgrav.treeinit(np.ascontiguousarray(pos, dtype=np.float64), mass, eps,
+                                     self.leafsize, self.theta, *short_range, kernel, rule)
         end = process_time()
         if config['verbose']:
             print('Tree build done in %5.3g s' % (end - start))
 
-        self.derived = True
-        self.flags = {'WRITEABLE': False}
+    def calc(self, vec_pos, num_threads=0, fmm=False, eps=None, mixed_precision=False):
+        """Return the acceleration and potential at each of the positions *vec_pos*.
 
-    def calc(self, vec_pos, eps=None):
+        If the positions are particles with softening lengths *eps*, each pair is softened
+        according to the tree's rule; otherwise the sources' softening lengths are used.
+
+        The tree is walked once for every group of nearby positions, and the groups are
+        shared between *num_threads* threads (default from the configuration file).
+
+        If *fmm* is True, the positions are instead given a tree of their own, and each pair of
+        well-separated cells interacts through a local expansion of the source cell's multipoles
+        about the target cell (the fast multipole method). This is less accurate than the tree
+        walk at the same opening angle, and no faster at equal accuracy (see
+        :func:`~pynbody.gravity.calc.fmm`).
+
+        If *mixed_precision* is True, the tree walk evaluates its interactions in single precision,
+        relative to the centre of each group of positions, and accumulates them in double precision;
+        the resulting relative errors are around 1e-6."""
+
+        if fmm and self.short_range:
+            raise ValueError("The fast multipole method does not support short-range forces")
+        if fmm and mixed_precision:
+            raise ValueError("The fast multipole method does not support mixed precision")
+
+        if num_threads == 0:
+            num_threads = int(config["number_of_threads"])
+        if num_threads < 0 or num_threads > openmp.get_cpus():
+            num_threads = openmp.get_cpus()
+
+        vec_pos = np.ascontiguousarray(vec_pos, dtype=np.float64).reshape((-1, 3))
         accel = np.zeros((len(vec_pos), 3))
         pot = np.zeros(len(vec_pos))
+        if eps is not None:
+            eps = np.ascontiguousarray(np.broadcast_to(np.asarray(eps, dtype=np.float64), (len(vec_pos),)))
         if config['verbose']:
             print('Calculating Gravity')
 
         start = process_time()
-        pkdgrav.pkdPythonDoGravity(self.tree, accel, pot, theta=0.55)
+        pkdgrav.calculate(self.tree, vec_pos, accel, pot, self.leafsize, num_threads, int(fmm), eps,
+                          int(bool(mixed_precision)))
         end = process_time()
         if config['verbose']:
             print('Gravity calculated in %5.3g s' % (end - start))
 
         return accel, pot
-
-    def __del__(self):
-        if hasattr(self, 'tree'):
-            pkdgrav.free(self.tree)
@@ -6,280 +6,299 @@
  * Andrew Pontzen.
  */
 
-#include "config.h"
-
 #include <stdio.h>
 #include <stdlib.h>
-#if defined(__APPLE__)
-#undef HAVE_MALLOC_H
-#endif
-#ifdef HAVE_MALLOC_H
-#include <malloc.h>
-#endif
 #include <math.h>
-#include <time.h>
 #include <assert.h>
-#include "kd.h"
-#ifndef HAVE_CONFIG_H
-#include "floattype.h"
+#ifdef _OPENMP
+#include <omp.h>
 #endif
+#include "kd.h"
 
-#define WALK_MINMULTIPOLE	4
+/*
+** Interaction lists and the check stack for one thread's walks, and the
+** tiles into which the lists are gathered for the mixed precision walk.
+*/
+typedef struct walkBuffers {
+    ILP *ilp;
+    ILC *ilc;
+    int *Check;
+    int nMaxPart, nMaxCell, nMaxCheck;
+    ILTILES tiles;
+    } WALKBUF;
+
+static void walkBufInit(WALKBUF *w) {
+    w->nMaxPart = 1000;
+    w->nMaxCell = 1000;
+    w->nMaxCheck = 1000;
+    w->ilp = (ILP *)malloc(w->nMaxPart*sizeof(ILP));
+    w->ilc = (ILC *)malloc(w->nMaxCell*sizeof(ILC));
+    w->Check = (int *)malloc(w->nMaxCheck*sizeof(int));
+    assert(w->ilp != NULL && w->ilc != NULL && w->Check != NULL);
+    w->tiles.nPartTiles = w->tiles.nCellTiles = 0;
+    w->tiles.nMaxPartTiles = w->tiles.nMaxCellTiles = 0;
+    w->tiles.ilp = NULL;
+    w->tiles.ilc = NULL;
+    }
+
+static void walkBufFree(WALKBUF *w) {
+    free(w->ilp);
+    free(w->ilc);
+    free(w->Check);
+    free(w->tiles.ilp);
+    free(w->tiles.ilc);
+    }
 
 /*
-** Returns total number of active particles for which gravity was calculated.
+** The power of two nearest the reciprocal of x, or 1 if x is not positive.
 */
-void kdGravWalk(KD kd, int nReps,int bEwald, PARTICLE *testParticles, int nPos){
-    PARTICLE *p;
-    PARTICLE q;
-    KDN *kdn;
-    KDN *kdc;
-    pBND kbnd, cbnd;
-    FLOAT dMin,min2;
-    FLOAT rCheck[3];
-    FLOAT rOffset[3];
-    int ix,iy,iz,bRep;
-    int nMaxInitCheck,nCheck, iCheckCell;
-    int i,ii,j,n,pj,nTotActive;
-    int iOpen, iPos;
-    int nPart;
-    int nCell;
-    double start_time;
+static double kdScale(double x) {
+    return x > 0 ? ldexp(1.0,-ilogb(x)) : 1.0;
+    }
 
-    assert(kd->oNodeMom);
-    /*
-    ** Allocate initial interaction lists.
-    */
-    nMaxInitCheck = 2*nReps+1;
-    nMaxInitCheck = nMaxInitCheck*nMaxInitCheck*nMaxInitCheck;	/* all replicas */
-    assert(nMaxInitCheck < kd->nMaxCheck);
-    ii=0;
-    for (iPos = 0; iPos < nPos; iPos++) {
-	start_time = kdTime();
-	q = testParticles[iPos];
-	kdn = kdNodeInit(kd, &q);
-	free(kd->ilp);
-	kd->ilp = malloc(kd->nMaxPart*sizeof(ILP));
-	assert(kd->ilp != NULL);
-	nPart = 0;
-	free(kd->ilc);
-	kd->ilc = malloc(kd->nMaxCell*sizeof(ILC));
-	assert(kd->ilc != NULL);
-	nCell = 0;
+/*
+** As MINDIST, but to the nearest periodic image of pos.
+*/
+static double kdMinDist2(KD kd, BND *bnd, double *pos) {
+    double d, min2 = 0;
+    int j;
 
-	nCheck = 0;
-	/*
-	** First we add any replicas of the entire box
-	** to the Checklist.
-	*/
-	for (ix=-nReps;ix<=nReps;++ix) {
-	    rOffset[0] = ix*kd->fPeriod[0];
-	    for (iy=-nReps;iy<=nReps;++iy) {
-		rOffset[1] = iy*kd->fPeriod[1];
-		for (iz=-nReps;iz<=nReps;++iz) {
-		    rOffset[2] = iz*kd->fPeriod[2];
-		    /*
-		      bRep = ix || iy || iz;
-		      if (bRep) {
-		    */
-		    kd->Check[nCheck].iCell = ROOT;
-		    for (j=0;j<3;++j) kd->Check[nCheck].rOffset[j] = rOffset[j];
-		    ++nCheck;
-		    /*
-		      }
-		    */
-		    }
+    for (j=0;j<3;++j) {
+	d = fabs(kdPeriodicDelta(kd,bnd->fCenter[j] - pos[j])) - bnd->fMax[j];
+	if (d > 0) min2 += d*d;
+	}
+    return min2;
+    }
+
+/*
+** The square of the smallest separation between the two bounds, or of any
+** of their periodic images.
+*/
+static double kdBoundsDist2(KD kd, BND *a, BND *b) {
+    double d, min2 = 0;
+    int j;
+
+    for (j=0;j<3;++j) {
+	d = fabs(kdPeriodicDelta(kd,a->fCenter[j] - b->fCenter[j])) - a->fMax[j] - b->fMax[j];
+	if (d > 0) min2 += d*d;
+	}
+    return min2;
+    }
+
+/*
+** Walks the source tree kd for the bucket kdb of test particles, building the
+** lists of cells whose multipoles can be used for every particle in the
+** bucket and of source buckets which must be summed particle by particle.
+**
+** A cell's multipole is accepted when the bucket's bounds lie outside the
+** sphere of radius bMax/theta about the cell's centre of mass, and the gap
+** between the bounds and the sphere of radius bMax holding the cell's
+** particles is also beyond the reach of the largest softening length in the
+** cell or the bucket: its support for the compact kernels, or twice it for the Plummer
+** kernel (beyond which the Plummer-softened multipole is a good
+** approximation). For short-range forces, cells lying wholly beyond the
+** cutoff are dropped.
+*/
+static void kdWalkBucket(KD kd, KDN *kdb, WALKBUF *w, int *pnPart, int *pnCell) {
+    KDN *kdc;
+    double min2,gap,fSoftMax2;
+    int nCheck, nPart = 0, nCell = 0;
+    int iCell;
+
+    nCheck = 0;
+    w->Check[nCheck++] = ROOT;
+    while (nCheck) {
+	iCell = w->Check[--nCheck];
+	kdc = kdTreeNode(kd,iCell);
+	if (kd->dRsplit > 0 && kdBoundsDist2(kd,&kdb->bnd,&kdc->bnd) > kd->dRcut2) continue;
+	min2 = kdMinDist2(kd,&kdb->bnd,kdc->r);
+	gap = sqrt(min2) - kdc->bMax;
+	fSoftMax2 = kdc->fSoftMax2 > kdb->fSoftMax2 ? kdc->fSoftMax2 : kdb->fSoftMax2;
+	if (kd->dTheta2 > 0 && min2*kd->dTheta2 > kdc->bMax*kdc->bMax
+	    && gap > 0 && gap*gap > kd->dSoftReach2*fSoftMax2) {
+	    /*
+	    ** No intersection, accept multipole!
+	    */
+	    if (nCell == w->nMaxCell) {
+		w->nMaxCell *= 2;
+		w->ilc = (ILC *)realloc(w->ilc,w->nMaxCell*sizeof(ILC));
+		assert(w->ilc != NULL);
 		}
+	    w->ilc[nCell++].iCell = iCell;
 	    }
-	while (1) {
+	else if (kdc->iLower) {
 	    /*
-	    ** Process the Checklist.
-	    ii = 0;
+	    ** Open the cell.
 	    */
-	    for (i=0;i<nCheck;++i) {
-		kdc = kdTreeNode(kd,kd->Check[i].iCell);
-		n = kdc->pUpper - kdc->pLower + 1;
-		/*
-		printf("node %d, upper: %d, lower: %d, n:
-		%d\n",kd->Check[i].iCell,kdc->pUpper,
-		kdc->pLower,kdc->pUpper - kdc->pLower + 1);
-		*/
-		kdNodeBnd(kd, kdc, &cbnd);
-		/*printf("%d rCheck",kd->Check[i].iCell);*/
-		for (j=0;j<3;++j) {
-		    rCheck[j] = cbnd.fCenter[j] + kd->Check[i].rOffset[j];
-		    /*rCheck[j] = kdc->r[j] + kd->Check[i].rOffset[j];*/
-		    /*printf("[%d]: %g ",j,rCheck[j]);*/
-		    }
-		/*printf("\n");*/
+	    if (nCheck + 2 > w->nMaxCheck) {
+		w->nMaxCheck *= 2;
+		w->Check = (int *)realloc(w->Check,w->nMaxCheck*sizeof(int));
+		assert(w->Check != NULL);
+		}
+	    w->Check[nCheck++] = kdc->iLower;
+	    w->Check[nCheck++] = kdc->iLower+1;
+	    }
+	else {
+	    /*
+	    ** Bucket interaction: every particle goes on the interaction list.
+	    */
+	    if (nPart == w->nMaxPart) {
+		w->nMaxPart *= 2;
+		w->ilp = (ILP *)realloc(w->ilp,w->nMaxPart*sizeof(ILP));
+		assert(w->ilp != NULL);
+		}
+	    w->ilp[nPart].pLower = kdc->pLower;
+	    w->ilp[nPart].pUpper = kdc->pUpper;
+	    ++nPart;
+	    }
+	}
+    *pnPart = nPart;
+    *pnCell = nCell;
+    }
 
-		kdNodeBnd(kd, kdn, &kbnd);
-		/*
-		** If this cell is a bucket we have to either open the checkcell
-		** and get the particles, or accept the multipole. For this
-		** reason we only need to calculate min2.
-		*/
-		min2 = 0;
-		for (j=0;j<3;++j) {
-		    dMin = fabs(rCheck[j] - kbnd.fCenter[j]);
-		    dMin -= kbnd.fMax[j];
-		    if (dMin > 0) min2 += dMin*dMin;
+/*
+** Gathers the interaction lists of the bucket kdb into single precision
+** tiles, with offsets from the bucket's centre (reduced to their nearest
+** periodic image) and lengths and masses scaled by w->tiles.dLength and
+** w->tiles.dMass.
+*/
+static void kdWalkTiles(KD kd, KDN *kdb, WALKBUF *w, int nPart, int nCell) {
+    ILTILES *il = &w->tiles;
+    ILPTILE *tp = NULL;
+    ILCTILE *tc = NULL;
+    PARTICLE *q;
+    KDN *kdc;
+    MOMR *m;
+    double L = il->dLength, M = il->dMass;
+    double L2 = L*L, L3 = L2*L, L4 = L3*L;
+    int i,j,n,pj;
+
+    for (j=0;j<3;++j) il->r[j] = kdb->bnd.fCenter[j];
+
+    il->nPartTiles = 0;
+    for (i=0;i<nPart;++i) {
+	for (pj=w->ilp[i].pLower;pj<=w->ilp[i].pUpper;++pj) {
+	    if (tp == NULL || tp->nPart == ILP_TILE_SIZE) {
+		if (il->nPartTiles == il->nMaxPartTiles) {
+		    il->nMaxPartTiles = il->nMaxPartTiles ? 2*il->nMaxPartTiles : 4;
+		    il->ilp = (ILPTILE *)realloc(il->ilp,il->nMaxPartTiles*sizeof(ILPTILE));
+		    assert(il->ilp != NULL);
 		    }
-		/*
-		** By default we open the cell!
-		*/
-		printf("min2: %g fOpen: %g\n",6.8e4*sqrt(min2),6.8e4*kdc->bMax);
-		if (min2 > kdc->bMax*kdc->bMax/kd->dTheta2) {
+		tp = &il->ilp[il->nPartTiles++];
+		tp->nPart = 0;
+		}
+	    q = kdParticle(kd,pj);
+	    n = tp->nPart++;
+	    tp->dx[n] = (ilpFloat)(kdPeriodicDelta(kd,q->r[0] - il->r[0])*L);
+	    tp->dy[n] = (ilpFloat)(kdPeriodicDelta(kd,q->r[1] - il->r[1])*L);
+	    tp->dz[n] = (ilpFloat)(kdPeriodicDelta(kd,q->r[2] - il->r[2])*L);
+	    tp->m[n] = (ilpFloat)(q->fMass*M);
+	    tp->fSoft[n] = (ilpFloat)(q->fSoft*L);
+	    }
+	}
+
+    il->nCellTiles = 0;
+    for (i=0;i<nCell;++i) {
+	if (tc == NULL || tc->nCell == ILC_TILE_SIZE) {
+	    if (il->nCellTiles == il->nMaxCellTiles) {
+		il->nMaxCellTiles = il->nMaxCellTiles ? 2*il->nMaxCellTiles : 4;
+		il->ilc = (ILCTILE *)realloc(il->ilc,il->nMaxCellTiles*sizeof(ILCTILE));
+		assert(il->ilc != NULL);
+		}
+	    tc = &il->ilc[il->nCellTiles++];
+	    tc->nCell = 0;
+	    }
+	kdc = kdTreeNode(kd,w->ilc[i].iCell);
+	m = &kdc->mom;
+	n = tc->nCell++;
+	tc->dx[n] = (ilpFloat)(kdPeriodicDelta(kd,kdc->r[0] - il->r[0])*L);
+	tc->dy[n] = (ilpFloat)(kdPeriodicDelta(kd,kdc->r[1] - il->r[1])*L);
+	tc->dz[n] = (ilpFloat)(kdPeriodicDelta(kd,kdc->r[2] - il->r[2])*L);
+	tc->fSoft[n] = (ilpFloat)(sqrt(kdc->fSoft2)*L);
+	tc->m[n] = (ilpFloat)(m->m*M);
+	tc->xx[n] = (ilpFloat)(m->xx*M*L2);
+	tc->yy[n] = (ilpFloat)(m->yy*M*L2);
+	tc->xy[n] = (ilpFloat)(m->xy*M*L2);
+	tc->xz[n] = (ilpFloat)(m->xz*M*L2);
+	tc->yz[n] = (ilpFloat)(m->yz*M*L2);
+	tc->xxx[n] = (ilpFloat)(m->xxx*M*L3);
+	tc->xyy[n] = (ilpFloat)(m->xyy*M*L3);
+	tc->xxy[n] = (ilpFloat)(m->xxy*M*L3);
+	tc->yyy[n] = (ilpFloat)(m->yyy*M*L3);
+	tc->xxz[n] = (ilpFloat)(m->xxz*M*L3);
+	tc->yyz[n] = (ilpFloat)(m->yyz*M*L3);
+	tc->xyz[n] = (ilpFloat)(m->xyz*M*L3);
+	tc->xxxx[n] = (ilpFloat)(m->xxxx*M*L4);
+	tc->xyyy[n] = (ilpFloat)(m->xyyy*M*L4);
+	tc->xxxy[n] = (ilpFloat)(m->xxxy*M*L4);
+	tc->yyyy[n] = (ilpFloat)(m->yyyy*M*L4);
+	tc->xxxz[n] = (ilpFloat)(m->xxxz*M*L4);
+	tc->yyyz[n] = (ilpFloat)(m->yyyz*M*L4);
+	tc->xxyy[n] = (ilpFloat)(m->xxyy*M*L4);
+	tc->xxyz[n] = (ilpFloat)(m->xxyz*M*L4);
+	tc->xyyz[n] = (ilpFloat)(m->xyyz*M*L4);
+	}
+    }
+
+/*
+** Calculates the acceleration and potential from the particles in kd on
+** each of the (test) particles in kdTest. The tree is walked once for each
+** bucket of kdTest, and the buckets are shared dynamically between nThreads
+** threads. If bSingle is set, the interactions are evaluated in single
+** precision from tiled lists (see ilp.h), with lengths and masses scaled to
+** the size and mass of the source tree.
+*/
+void kdGravWalk(KD kd, KD kdTest, int nThreads, int bSingle) {
+    int *buckets;
+    int nBuckets = 0;
+    int i;
 
-#if !defined(SOFTLINEAR) && !defined(SOFTSQUARE)
-		    if (min2 > 4*kdc->fSoft2) {
-			printf("Open cell?  n: %d",n);
-			if (n >= WALK_MINMULTIPOLE) iOpen = -1;
-			else iOpen = 1;
-			}
-		    else iOpen = -2; /* means we treat this cell as a softened monopole */
+    if (kdTest->nStore == 0) return;
+    if (kd->nStore == 0) {
+	for (i=0;i<kdTest->nStore;++i) {
+	    PARTICLE *p = kdParticle(kdTest,i);
+	    p->a[0] = p->a[1] = p->a[2] = p->fPot = 0;
+	    }
+	return;
+	}
+
+    buckets = (int *)malloc(kdTest->nNodes*sizeof(int));
+    assert(buckets != NULL);
+    for (i=ROOT;i<kdTest->nNodes;++i) {
+	if (!kdTreeNode(kdTest,i)->iLower) buckets[nBuckets++] = i;
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nThreads)
 #endif
+    {
+	WALKBUF w;
+	KDN *kdb;
+	int iBucket, pj, nPart, nCell;
+
+	walkBufInit(&w);
+	w.tiles.dLength = kdScale(kdTreeNode(kd,ROOT)->bMax);
+	w.tiles.dMass = kdScale(kdTreeNode(kd,ROOT)->mom.m);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+	for (iBucket=0;iBucket<nBuckets;++iBucket) {
+	    kdb = kdTreeNode(kdTest,buckets[iBucket]);
+	    kdWalkBucket(kd,kdb,&w,&nPart,&nCell);
+	    if (bSingle) {
+		kdWalkTiles(kd,kdb,&w,nPart,nCell);
+		for (pj=kdb->pLower;pj<=kdb->pUpper;++pj) {
+		    kdGravInteractTiles(kd,&w.tiles,kdParticle(kdTest,pj));
 		    }
-		else {
-		    iOpen = 1;
-		    }
-		/*
-		  printf("   i:%6d iCheck:%6d iOpen:%2d\n",i,kd->Check[i].iCell,iOpen);
-		*/
-		if (iOpen > 0) {
-		    /*
-		    ** Contained! (or intersected in the case of reaching the bucket)
-		    */
-		    iCheckCell = kdc->iLower;
-		    if (iCheckCell) {
-			/*
-			** Open the cell.
-			** Here we ASSUME that the children of
-			** kdc are all in sequential memory order!
-			** (the new tree build assures this)
-			** We could do a prefetch here for non-local
-			** cells.
-			*/
-			if (nCheck + 2 > kd->nMaxCheck) {
-			    kd->nMaxCheck += 1000;
-			    kd->Check = realloc(kd->Check,kd->nMaxCheck*sizeof(CELT));
-			    assert(kd->Check != NULL);
-			    }
-			kd->Check[nCheck] = kd->Check[i];
-			kd->Check[nCheck+1] = kd->Check[i];
-			kd->Check[nCheck].iCell = iCheckCell;
-			kd->Check[nCheck+1].iCell = iCheckCell+1;
-			nCheck += 2;
-			}
-		    else {
-			/*
-			** Now I am trying to open a bucket, which means I place particles on the kd->ilp
-			** interaction list. I also have to make sure that I place the
-			** particles in time synchronous positions.
-			*/
-			/*
-			** Local Bucket Interaction.
-			** Interact += Pacticles(kdc);
-			*/
-			if (nPart + n > kd->nMaxPart) {
-			    kd->nMaxPart += 500 + n;
-			    kd->ilp = realloc(kd->ilp,kd->nMaxPart*sizeof(ILP));
-			    assert(kd->ilp != NULL);
-			    }
-			for (pj=kdc->pLower;pj<=kdc->pUpper;++pj) {
-			    p = kdParticle(kd,pj);
-			    /*
-			    ilpAppend(kd->ilp,
-				      p->r[0] + kd->Check[i].rOffset[0],
-				      p->r[1] + kd->Check[i].rOffset[1],
-				      p->r[2] + kd->Check[i].rOffset[2],
-				      p->fMass,4*p->fSoft*p->fSoft,p->iOrder);
-			    */
-			    kd->ilp[nPart].iOrder = p->iOrder;
-			    kd->ilp[nPart].m = p->fMass;
-			    kd->ilp[nPart].x = p->r[0] + kd->Check[i].rOffset[0];
-			    kd->ilp[nPart].y = p->r[1] + kd->Check[i].rOffset[1];
-			    kd->ilp[nPart].z = p->r[2] + kd->Check[i].rOffset[2];
-			    kd->ilp[nPart].fourh2 = 4*p->fSoft*p->fSoft;
-			    ++nPart;
-			    }
-			}  /* end of opening a bucket */
-		    }
-		else if (iOpen == -1) {
-		    /*
-		    ** No intersection, accept multipole!
-		    ** Interact += Moment(kdc);
-		    */
-		    if (nCell == kd->nMaxCell) {
-			kd->nMaxCell += 500;
-			kd->ilc = realloc(kd->ilc,kd->nMaxCell*sizeof(ILC));
-			assert(kd->ilc != NULL);
-			}
-		    kd->ilc[nCell].x = rCheck[0];
-		    kd->ilc[nCell].y = rCheck[1];
-		    kd->ilc[nCell].z = rCheck[2];
-		    kd->ilc[nCell].mom = *kdNodeMom(kd,kdc);
-		    /*
-		    ilcAppend(kd->ilc,rCheck[0],rCheck[1],rCheck[2],
-			      kdNodeMom(kd,kdc),kdc->bMax);
-		    */
-		    ++nCell;
-		    }
-		else if (iOpen == -2) {
-		    /*
-		    ** We accept this multipole from the opening criterion, but it is a softened
-		    ** interaction, so we need to treat is as a softened monopole by putting it
-		    ** on the particle interaction list.
-		    */
-		    if (nPart == kd->nMaxPart) {
-			kd->nMaxPart += 500;
-			kd->ilp = realloc(kd->ilp,kd->nMaxPart*sizeof(ILP));
-			assert(kd->ilp != NULL);
-			}
-		    /*
-		    ilpAppend(kd->ilp,rCheck[0],rCheck[1],rCheck[2],
-			      kdNodeMom(kd,kdc)->m,4*kdc->fSoft2,-1);
-		    */
-		    kd->ilp[nPart].iOrder = -1; /* set iOrder to negative value for time step criterion */
-		    kd->ilp[nPart].m = kdNodeMom(kd,kdc)->m;
-		    kd->ilp[nPart].x = rCheck[0];
-		    kd->ilp[nPart].y = rCheck[1];
-		    kd->ilp[nPart].z = rCheck[2];
-		    kd->ilp[nPart].fourh2 = 4*kdc->fSoft2;
-		    /* set iOrder to negative value for time step criterion */
-		    ++nPart;
-		    }
-		else {
-		    kd->Check[ii++] = kd->Check[i];
+		}
+	    else {
+		for (pj=kdb->pLower;pj<=kdb->pUpper;++pj) {
+		    kdGravInteract(kd,w.ilp,nPart,w.ilc,nCell,kdParticle(kdTest,pj));
 		    }
 		}
-	    printf("checklist length: %d\n",nCheck);
-	    nCheck = ii;
-	    /*
-	    ** Done processing of the Checklist.
-	    */
-	    if (!kdn->iLower) break;
 	    }
-	/*
-	** Now the interaction list should be complete and the
-	** Checklist should be empty! Calculate gravity on this
-	** Bucket!
-	*/
-	assert(nCheck == 0);
-	/*
-	** We no longer add *this bucket to any interaction list, this is now done with an
-	** N(N-1)/2 loop in kdBucketInteract().
-	*/
-	kdc = kdn;
-	/*
-	** Now calculate gravity on this bucket!
-	*/
-	printf("iPos: %d, tree walked: %g s\n",iPos,kdTime()-start_time);
-	start_time=kdTime();
-	kdGravInteract(kd,kdc,kd->ilp,nPart,kd->ilc,nCell, bEwald,&q);
-	testParticles[iPos].fPot = q.fPot;
-	for (j=0; j<3; j++) testParticles[iPos].a[j] = q.a[j];
-	printf("gravity calculated: %g s\n",kdTime()-start_time);
-	free(kdn);
-	}
+	walkBufFree(&w);
+    }
+
+    free(buckets);
     }
@@ -392,40 +392,23 @@ def image(sim, qty='rho', width="10 kpc", resolution=500, units=None, log=True,
                 "Units already imply projected image; can't also average over line-of-sight!")
         else:
             kernel = sph.Kernel2D(kernel)
-            if units is not None:
-                aunits = units * sim['z'].units
-            else:
-                aunits = None
 
             if isinstance(av_z, str):
-                if units is not None:
-                    aunits = units * sim[av_z].units * sim['z'].units
-                sim["__prod"] = sim[av_z] * sim[qty]
-                qty = "__prod"
-
+                weight = av_z
             else:
-                av_z = "__one"
+                weight = "__one"
                 sim["__one"] = np.ones_like(sim[qty])
                 sim["__one"].units = "1"
 
-            im = sph.render_image(sim, qty, width / 2, resolution, out_units=aunits, kernel=kernel,
-                                  z_camera=z_camera, **kwargs)
-            im2 = sph.render_image(sim, av_z, width / 2, resolution, kernel=kernel,
-                                   z_camera=z_camera, **kwargs)
-
-            top = sim.ancestor
-
+            # the weighted quantity and its normalisation are rendered in one pass
             try:
-                del top["__one"]
-            except KeyError:
-                pass
-
-            try:
-                del top["__prod"]
-            except KeyError:
-                pass
-
-            im = im / im2
+                im = sph.render_image_multi(sim, [qty], weight, width / 2, resolution, out_units=units,
+                                            kernel=kernel, z_camera=z_camera, **kwargs)[0]
+            finally:
+                try:
+                    del sim.ancestor["__one"]
+                except KeyError:
+                    pass
 
     else:
         im = sph.render_image(sim, qty, width / 2, resolution, out_units=units,
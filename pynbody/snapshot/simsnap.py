@@ -159,6 +159,9 @@ class SimSnap(ContainerWithPhysicalUnitsOption):
 
         self._persistent_objects = {}
 
+        # counts modifications to each array, so that cached results can tell when they are stale
+        self._array_versions = {}
+
         self._unifamily = None
 
         # If True, when new arrays are created they are in shared memory by
@@ -311,6 +314,8 @@ class SimSnap(ContainerWithPhysicalUnitsOption):
                 del self._derived_array_names[
                     self._derived_array_names.index(name)]
 
+        self._increment_array_version(name)
+
 
     def _get_subsnap_from_mask_array(self,mask_array):
         if len(mask_array.shape) > 1 or mask_array.shape[0] > len(self):
@@ -1180,6 +1185,8 @@ class SimSnap(ContainerWithPhysicalUnitsOption):
         if array_name in derive_track:
             del derive_track[derive_track.index(array_name)]
 
+        self._increment_array_version(array_name)
+
     def _get_from_immediate_cache(self, name, fn):
         """Retrieves the named numpy array from the immediate cache associated
         with this snapshot. If the array does not exist in the immediate
@@ -1476,10 +1483,13 @@ class SimSnap(ContainerWithPhysicalUnitsOption):
         quantities which depend on it"""
 
         name = self._array_name_1D_to_ND(name) or name
-        if name=='pos':
-            for v in self.ancestor._persistent_objects.values():
-                if 'kdtree' in v:
+        self._increment_array_version(name)
+        for v in self.ancestor._persistent_objects.values():
+            if 'kdtree' in v:
+                if name=='pos':
                     del v['kdtree']
+                elif hasattr(v['kdtree'], 'array_changed'):
+                    v['kdtree'].array_changed(name)
 
         if not self.auto_propagate_off:
             for d_ar in self._dependency_tracker.get_dependents(name):
@@ -1497,6 +1507,17 @@ class SimSnap(ContainerWithPhysicalUnitsOption):
                         self._dirty(d_ar)
 
 
+    def _increment_array_version(self, name):
+        versions = self.ancestor._array_versions
+        versions[name] = versions.get(name, 0) + 1
+
+    def _array_version(self, name):
+        """Returns a counter which changes whenever the named array is modified, replaced
+        or deleted (in this snapshot or any other view of the same ancestor). Compare the
+        values before and after to tell whether a result computed from the array is stale."""
+        name = self._array_name_1D_to_ND(name) or name
+        return self.ancestor._array_versions.get(name, 0)
+
     def is_derived_array(self, name, fam=None):
         """Returns True if the array or family array of given name is
         auto-derived (and therefore read-only)."""
@@ -12,7 +12,7 @@ For most users, the function of interest will be :func:`~pynbody.sph.render_imag
 
 """
 
-import copy
+import itertools
 import logging
 import math
 import os
@@ -30,7 +30,7 @@ import pynbody.snapshot.simsnap
 logger = logging.getLogger('pynbody.sph')
 
 from .. import array, config, config_parser, snapshot, units, util
-from . import _render
+from . import _render, cache, lod
 
 try:
     from . import kdtree
@@ -261,7 +261,7 @@ class TopHatKernel:
 
 def render_spherical_image(snap, qty='rho', nside=8, distance=10.0, kernel=Kernel(),
                            kstep=0.5, denoise=None, out_units=None, threaded=None):
-    """Render an SPH image on a spherical surface. Requires healpy libraries.
+    """Render an SPH image on a spherical surface, returning a HEALPix map in the RING scheme.
 
     **Keyword arguments:**
 
@@ -282,8 +282,8 @@ def render_spherical_image(snap, qty='rho', nside=8, distance=10.0, kernel=Kerne
       useful to reduce noise.
 
     *threaded*: if False, render on a single core. Otherwise, the number of threads to use.
-      Defaults to a value specified in your configuration files. *Currently multi-threaded
-      rendering is slower than single-threaded because healpy does not release the gil*.
+      Defaults to a value specified in your configuration files. Each thread owns whole
+      rings of the map, so the result is the same for any number of threads.
     """
 
     if denoise is None:
@@ -292,22 +292,16 @@ def render_spherical_image(snap, qty='rho', nside=8, distance=10.0, kernel=Kerne
     if denoise and not _kernel_suitable_for_denoise(kernel):
         raise ValueError("Denoising not supported with this kernel type. Re-run with denoise=False")
 
-    renderer = _render_spherical_image
-
     if threaded is None:
         threaded = _get_threaded_image()
 
-    if threaded:
-        im = _threaded_render_image(
-            renderer, snap, qty, nside, distance, kernel, kstep, denoise, out_units, num_threads=threaded)
-    else:
-        im = renderer(
-            snap, qty, nside, distance, kernel, kstep, denoise, out_units)
-    return im
+    return _render_spherical_image(snap, qty, nside, distance, kernel, kstep, denoise, out_units,
+                                   num_threads=max(int(threaded), 1))
 
 
 def _render_spherical_image(snap, qty='rho', nside=8, distance=10.0, kernel=Kernel(),
-                            kstep=0.5, denoise=None, out_units=None, __threaded=False, snap_slice=None):
+                            kstep=0.5, denoise=None, out_units=None, __threaded=False, snap_slice=None,
+                            num_threads=1):
 
     if denoise is None:
         denoise = _auto_denoise(snap, kernel)
@@ -319,6 +313,8 @@ def _render_spherical_image(snap, qty='rho', nside=8, distance=10.0, kernel=Kern
         conv_ratio = (snap[qty].units * snap['mass'].units / (snap['rho'].units * snap['smooth'].units ** kernel.h_power)).ratio(out_units,
                                                                                                                                  **snap.conversion_context())
 
+    if snap_slice is None:
+        snap_slice = _particles_overlapping_shell(snap, distance, kernel)
     if snap_slice is None:
         snap_slice = slice(len(snap))
     with snap.immediate_mode:
@@ -340,25 +336,17 @@ def _render_spherical_image(snap, qty='rho', nside=8, distance=10.0, kernel=Kern
 
     weights[:-1] -= weights[1:]
 
+    # the angular radius of each kernel step, taken at the distance of the particle, is
+    # worked out by render_spherical_image_core
     if kernel.h_power == 3:
         ind = np.where(np.abs(D - distance) < h * kernel.max_d)[0]
-
-        # angular radius subtended by the intersection of the boundary
-        # of the SPH particle with the boundary surface of the calculation:
-        rad = np.arctan(np.sqrt(
-            h[ind, np.newaxis] ** 2 - (D[ind, np.newaxis] - distance) ** 2) / distance)
-
     elif kernel.h_power == 2:
         ind = np.where(D < distance)[0]
-
-        # angular radius taken at distance of particle:
-        rad = np.arctan(
-            h[ind, np.newaxis] * ds[np.newaxis, :] / D[ind, np.newaxis])
     else:
         raise ValueError("render_spherical_image doesn't know how to handle this kernel")
 
     im, im2 = _render.render_spherical_image_core(
-        rho, mass, qtyar, pos, D, h, ind, ds, weights, nside)
+        rho, mass, qtyar, pos, D, h, ind, ds, weights, nside, num_threads)
 
     im = im.view(array.SimArray)
     if denoise:
@@ -373,52 +361,30 @@ def _render_spherical_image(snap, qty='rho', nside=8, distance=10.0, kernel=Kern
     return im
 
 
-def _threaded_render_image(fn, s, *args, **kwargs):
-    """
-    Render an SPH image using multiple threads.
-
-    The arguments are exactly the same as those to render_image, but
-    additionally you can specify the number of threads using the
-    keyword argument *num_threads*. The default is given by your configuration
-    file, probably 4. It should probably match the number of cores on your
-    machine. """
-
-    with s.immediate_mode:
-        num_threads = kwargs['num_threads']
-        del kwargs['num_threads']
-
-        verbose = kwargs.get('verbose', True)
-
-        kwargs['__threaded'] = True  # will pass into render_image
-
-        ts = []
+def _particles_overlapping_shell(snap, distance, kernel):
+    """Find the particles that may contribute to render_spherical_image, using the kd-tree.
 
-        # isolate each output in its own list so we can
-        # sum them in a predictable order. This prevents
-        # FP-accuracy introducing random noise at each
-        # rendering, but of course doesn't really fix the
-        # underlying issue that FP errors can build to percent
-        # level errors
-        outputs = [[] for i in range(num_threads)]
+    For a 3D kernel these are the particles whose kernel overlaps the sphere of radius *distance* about
+    the origin; for a 2D kernel, those within it. Returns a sorted index array, or None (meaning all
+    particles must be considered) under the same conditions as _particles_overlapping_region."""
 
-        if verbose:
-            logger.info("Rendering image on %d threads..." % num_threads)
+    if not config_parser.getboolean('sph', 'tree-culling') or not hasattr(snap, 'kdtree'):
+        return None
 
-        for i in range(num_threads):
-            kwargs_local = copy.copy(kwargs)
-            kwargs_local['snap_slice'] = slice(i, None, num_threads)
-            args_local = [outputs[i], s] + list(args)
-            ts.append(threading.Thread(
-                target=_render_image_bridge(fn), args=args_local, kwargs=kwargs_local))
-            ts[-1].start()
+    if kernel.h_power == 3:
+        r_min, r_max, smooth_scale = distance, distance, kernel.max_d
+    else:
+        r_min, r_max, smooth_scale = 0.0, distance, 0.0
 
-        for t in ts:
-            t.join()
+    try:
+        # as in _render_spherical_image, smoothing lengths are compared directly with distances
+        visible = snap.kdtree.particles_in_shell(snap['smooth'], (0.0, 0.0, 0.0), r_min, r_max,
+                                                 smooth_scale, 'smooth')
+    except (TypeError, ValueError):
+        # e.g. smoothing array with a different dtype to the tree's positions
+        return None
 
-    # Each output is a 1-element list with a numpy array. Sum them.
-    if any([len(o)==0 for o in outputs]):
-        raise RuntimeError("There was a problem with the multi-threaded image render. Try running again with threaded=False to debug the underlying error.")
-    return sum(o[0] for o in outputs)
+    return np.sort(visible)
 
 
 def _interpolated_renderer(fn, levels):
@@ -447,15 +413,7 @@ def _interpolated_renderer(fn, levels):
     return render_fn
 
 
-def _render_image_bridge(fn):
-    """Helper function for threaded_render_image; do not call directly"""
-    def bridge(*args, **kwargs):
-        output_list = args[0]
-        X = fn(*args[1:], **kwargs)
-        output_list.append(X)
-    return bridge
-
-
+@cache.cached_render
 def render_image(snap, qty='rho', x2=100, nx=500, y2=None, ny=None, x1=None,
                  y1=None, z_plane=0.0, out_units=None, xy_units=None,
                  kernel=Kernel(),
@@ -465,7 +423,8 @@ def render_image(snap, qty='rho', x2=100, nx=500, y2=None, ny=None, x1=None,
                  force_quiet=False,
                  approximate_fast=_approximate_image,
                  threaded=None,
-                 denoise=None):
+                 denoise=None,
+                 level_of_detail=False):
     """
     Render an SPH image using a typical (mass/rho)-weighted 'scatter'
     scheme.
@@ -521,7 +480,20 @@ def render_image(snap, qty='rho', x2=100, nx=500, y2=None, ny=None, x1=None,
 
      *threaded*: if False (or None), render on a single core. Otherwise,
       the number of threads to use (defaults to a value specified in your
-      configuration files).
+      configuration files). Each thread renders whole tiles of the image, so
+      the result is identical to the single-core render.
+
+     *level_of_detail*: if True, draw groups of particles which are smaller than a
+      pixel as single pseudo-particles taken from a hierarchy built on the snapshot's
+      kd-tree (see :mod:`pynbody.sph.lod`). The hierarchy is built on first use and
+      then reused for any image width, which makes sequences of frames at different
+      zooms much cheaper. Mass and the volume integral of *qty* are conserved, but
+      sub-pixel detail is approximate. Overrides *approximate_fast*, and has no
+      effect on perspective (*z_camera*) renders or with *smooth_in_pixels*.
+
+    If the ``render-cache`` configuration option is switched on, the image is stored and
+    returned again by later calls with the same parameters, until any of the arrays it was
+    rendered from changes (see :mod:`pynbody.sph.cache`).
     """
 
     if denoise is None:
@@ -531,7 +503,7 @@ def render_image(snap, qty='rho', x2=100, nx=500, y2=None, ny=None, x1=None,
         raise ValueError("Denoising not supported with this kernel type. Re-run with denoise=False")
 
 
-    if approximate_fast:
+    if approximate_fast and not level_of_detail:
         base_renderer = _interpolated_renderer(
             _render_image, int(np.floor(np.log2(nx / 20))))
     else:
@@ -540,22 +512,18 @@ def render_image(snap, qty='rho', x2=100, nx=500, y2=None, ny=None, x1=None,
     if threaded is None:
         threaded = _get_threaded_image()
 
-    if threaded:
-        im = _threaded_render_image(base_renderer, snap, qty, x2, nx, y2, ny, x1, y1, z_plane,
-                                    out_units, xy_units, kernel, z_camera, smooth,
-                                    smooth_in_pixels, True,
-                                    num_threads=threaded)
-    else:
-        im = base_renderer(snap, qty, x2, nx, y2, ny, x1, y1, z_plane,
-                           out_units, xy_units, kernel, z_camera, smooth,
-                           smooth_in_pixels, False)
+    im = base_renderer(snap, qty, x2, nx, y2, ny, x1, y1, z_plane,
+                       out_units, xy_units, kernel, z_camera, smooth,
+                       smooth_in_pixels, False,
+                       num_threads=int(threaded) if threaded else None,
+                       level_of_detail=level_of_detail)
 
     if denoise:
         # call self to render a 'flat field'
         snap['__denoise_one'] = 1
         im2 = render_image(snap, '__denoise_one', x2, nx, y2, ny, x1, y1, z_plane, None,
                            xy_units, kernel, z_camera, smooth, smooth_in_pixels,
-                           force_quiet, approximate_fast, threaded, False)
+                           force_quiet, approximate_fast, threaded, False, level_of_detail)
         del snap.ancestor['__denoise_one']
         im2 = im / im2
         im2.units = im.units
@@ -565,22 +533,222 @@ def render_image(snap, qty='rho', x2=100, nx=500, y2=None, ny=None, x1=None,
         return im
 
 
+def render_image_multi(snap, qtys, weight=None, x2=100, nx=500, y2=None, ny=None, x1=None,
+                       y1=None, z_plane=0.0, out_units=None, xy_units=None,
+                       kernel=Kernel(),
+                       z_camera=None,
+                       smooth='smooth',
+                       smooth_in_pixels=False,
+                       force_quiet=False,
+                       approximate_fast=_approximate_image,
+                       threaded=None,
+                       denoise=None):
+    """
+    Render SPH images of several quantities at once, returning an array
+    of shape (len(qtys), ny, nx).
+
+    All the images are accumulated in a single pass over the particles,
+    sharing the work of finding and evaluating each particle's kernel, so
+    this is much faster than calling :func:`render_image` for each
+    quantity in turn. Each unweighted channel is identical to the
+    corresponding :func:`render_image` result.
+
+    **Keyword arguments:**
+
+    *qtys*: A list of the names of the arrays to render
+
+    *weight* (None): If set, the name of an array by which to weight
+     every quantity. Each channel is then the kernel-weighted average
+     sum(weight*qty)/sum(weight), with the normalisation accumulated in
+     the same pass; for example, weight='rho' with a Kernel2D gives
+     mass-weighted projections.
+
+    *out_units* (no conversion): The units to convert the output into;
+     either one unit for all channels, or a list with one per quantity.
+     The returned array only carries units if they are the same for all
+     channels.
+
+    *denoise*: if True, divide each channel through by an estimate of
+     the discreteness noise (see :func:`render_image`). Ignored for
+     weighted images, which are already normalised.
+
+    The remaining arguments are as for :func:`render_image`.
+    """
+
+    if denoise is None:
+        denoise = _auto_denoise(snap, kernel)
+
+    if denoise and not _kernel_suitable_for_denoise(kernel):
+        raise ValueError("Denoising not supported with this kernel type. Re-run with denoise=False")
+
+    qtys = list(qtys)
+
+    if weight is None and denoise:
+        # dividing through by a rendered 'flat field' is the same as a volume-weighted average
+        snap['__denoise_one'] = 1
+        try:
+            return render_image_multi(snap, qtys, '__denoise_one', x2, nx, y2, ny, x1, y1, z_plane, out_units,
+                                      xy_units, kernel, z_camera, smooth, smooth_in_pixels,
+                                      force_quiet, approximate_fast, threaded, False)
+        finally:
+            del snap.ancestor['__denoise_one']
+
+    if approximate_fast:
+        base_renderer = _interpolated_renderer(
+            _render_image, int(np.floor(np.log2(nx / 20))))
+    else:
+        base_renderer = _render_image
+
+    if threaded is None:
+        threaded = _get_threaded_image()
+
+    im = base_renderer(snap, qtys, x2, nx, y2, ny, x1, y1, z_plane,
+                       out_units if weight is None else None, xy_units, kernel, z_camera, smooth,
+                       smooth_in_pixels, False,
+                       num_threads=int(threaded) if threaded else None,
+                       weight=weight)
+
+    if weight is None:
+        return im
+
+    # the units of the numerator and normalisation images combine to give those of each quantity
+    result = (np.asarray(im[:-1]) / np.asarray(im[-1])).view(array.SimArray)
+    result_units = [snap[q].units for q in qtys]
+    if out_units is not None:
+        if isinstance(out_units, (str, units.UnitBase)):
+            out_units = [out_units] * len(qtys)
+        for c, channel_units in enumerate(out_units):
+            result[c] *= result_units[c].ratio(channel_units, **snap.conversion_context())
+            result_units[c] = units.Unit(channel_units)
+
+    if all(u == result_units[0] for u in result_units):
+        result.units = result_units[0]
+    else:
+        result.units = units.NoUnit()
+    result.sim = snap
+    return result
+
+
+def render_frames(snap, rotations=None, centres=None, qty='rho', x2=100, nx=500, y2=None, ny=None,
+                  x1=None, y1=None, z_plane=0.0, out_units=None, xy_units=None,
+                  kernel=Kernel(),
+                  z_camera=None,
+                  smooth='smooth',
+                  threaded=None):
+    """
+    Render a sequence of SPH images from different viewpoints, e.g. the frames of a
+    rotation or fly-through movie, returning an array of shape (nframes, ny, nx).
+
+    The particle arrays are fetched and converted once, and all the frames are then
+    rendered in a single native call, with whole frames shared out between threads.
+    This is much faster than transforming the snapshot and calling
+    :func:`render_image` for each frame.
+
+    **Keyword arguments:**
+
+    *rotations*: An (nframes, 3, 3) array of rotation matrices (default: the identity
+     for every frame)
+
+    *centres*: An (nframes, 3) array of positions, in *xy_units* (default: the origin
+     for every frame)
+
+    Frame k is the image that :func:`render_image` would make with every position
+    transformed to ``rotations[k] @ (pos - centres[k])``. So for a fly-through,
+    *centres* follows the camera's target and, with *z_camera* set, the camera sits
+    *z_camera* away from it along the rotated z axis.
+
+    *threaded*: if False, render on a single core. Otherwise, the number of threads
+     to use (defaults to a value specified in your configuration files).
+
+    The remaining arguments are as for :func:`render_image`. Periodic images of the
+    box are not rendered, since they do not survive a general rotation.
+    """
+
+    if rotations is None and centres is None:
+        raise ValueError("At least one of rotations or centres must be given")
+    if rotations is None:
+        rotations = np.broadcast_to(np.eye(3), (len(centres), 3, 3))
+    if centres is None:
+        centres = np.zeros((len(rotations), 3))
+    rotations = np.ascontiguousarray(rotations, dtype=np.float64)
+    centres = np.ascontiguousarray(centres, dtype=np.float64)
+
+    if y2 is None:
+        if ny is not None:
+            y2 = x2 * float(ny) / nx
+        else:
+            y2 = x2
+    if ny is None:
+        ny = nx
+    if x1 is None:
+        x1 = -x2
+    if y1 is None:
+        y1 = -y2
+
+    if threaded is None:
+        threaded = _get_threaded_image()
+
+    pos = snap['pos']
+    if xy_units is None:
+        xy_units = pos.units
+    pos = pos.in_units(xy_units)
+
+    sm = snap[smooth]
+    if sm.units != pos.units:
+        sm = sm.in_units(pos.units)
+
+    qty_ar = snap[qty]
+    mass = snap['mass']
+    rho = snap['rho']
+    ratio, result_units = _image_scaling(snap, qty_ar, mass, rho, sm, snap['pos'].units, kernel, out_units)
+
+    logger.info("Rendering %d frames" % len(rotations))
+
+    result = _render.render_frames(int(nx + .5), int(ny + .5), pos[:, 0], pos[:, 1], pos[:, 2], sm,
+                                   float(x1), float(x2), float(y1), float(y2), float(z_camera or 0.0),
+                                   float(z_plane), qty_ar, mass, rho, 0.0, 100000.0, kernel,
+                                   rotations, centres, num_threads=int(threaded) if threaded else 1)
+    result *= ratio
+    result = result.view(array.SimArray)
+    result.units = result_units
+    result.sim = snap
+    return result
+
+
 def _render_image(snap, qty, x2, nx, y2, ny, x1,
                   y1, z_plane, out_units, xy_units, kernel, z_camera,
                   smooth, smooth_in_pixels,  force_quiet,
                   smooth_range=None, res_downgrade=None, snap_slice=None,
-                  __threaded=False):
-    """The single-threaded image rendering core function. External calls
-    should be made to the render_image function."""
+                  __threaded=False, num_threads=None, level_of_detail=False, weight=None):
+    """The image rendering core function. External calls should be made to the
+    render_image or render_image_multi functions.
+
+    If qty is a list of array names rather than a single name, all of them are
+    rendered in one pass over the particles and a (len(qty), ny, nx) array is
+    returned; out_units may then be a list with one entry per quantity. If weight
+    is also given, each quantity is multiplied by that array and the weight itself
+    is rendered as an extra, final channel, so that the caller can normalise.
+
+    If num_threads is given, the image is split into tiles which are rendered in
+    parallel by _render.render_image_tiled; otherwise it is rendered on a single core.
+
+    If level_of_detail is True, sub-pixel structure is drawn from the snapshot's
+    cached ParticleHierarchy (see pynbody.sph.lod) rather than particle by particle."""
 
     global config
 
     verbose = config["verbose"] and not force_quiet
 
+    multi_channel = not isinstance(qty, str)
+    qtys = list(qty) if multi_channel else [qty]
+
+    if level_of_detail and (multi_channel or weight is not None):
+        raise ValueError("Level-of-detail rendering supports only a single, unweighted quantity")
+
     snap_proxy = {}
 
     # cache the arrays and take a slice of them if we've been asked to
-    for arname in 'x', 'y', 'z', 'pos', smooth, qty, 'rho', 'mass':
+    for arname in ['x', 'y', 'z', 'pos', smooth] + qtys + ([weight] if weight is not None else []) + ['rho', 'mass']:
         snap_proxy[arname] = snap[arname]
         if snap_slice is not None:
             snap_proxy[arname] = snap_proxy[arname][snap_slice]
@@ -639,6 +807,27 @@ def _render_image(snap, qty, x2, nx, y2, ny, x1,
     if xy_units is None:
         xy_units = snap_proxy['x'].units
 
+    wrap_x = _calculate_wrapping_repeat_array(snap, x1, x2, xy_units)
+    wrap_y = _calculate_wrapping_repeat_array(snap, y1, y2, xy_units)
+
+    if snap_slice is None and not smooth_in_pixels and not z_camera:
+        # particles are only rendered if within 2h of the image in x and y, and (for
+        # 3D kernels) within max_d*h of the image plane
+        if kernel.h_power == 3:
+            z_range, z_scale = (z1, z1), kernel.max_d
+        else:
+            z_range, z_scale = (-np.inf, np.inf), 0.0
+        region = ((x1, y1, z_range[0]), (x2, y2, z_range[1]), (2.0, 2.0, z_scale), (wrap_x, wrap_y, [0.0]))
+
+        if level_of_detail:
+            snap_proxy.update(_level_of_detail_arrays(snap, qty, smooth, xy_units, kernel,
+                                                      min((x2 - x1) / nx, (y2 - y1) / ny), *region))
+        else:
+            visible = _particles_overlapping_region(snap, smooth, xy_units, *region)
+            if visible is not None:
+                for arname in snap_proxy:
+                    snap_proxy[arname] = snap_proxy[arname][visible]
+
     x = snap_proxy['x'].in_units(xy_units)
     y = snap_proxy['y'].in_units(xy_units)
     z = snap_proxy['z'].in_units(xy_units)
@@ -648,45 +837,142 @@ def _render_image(snap, qty, x2, nx, y2, ny, x1,
     if sm.units != x.units and not smooth_in_pixels:
         sm = sm.in_units(x.units)
 
-    qty_s = qty
-    qty = snap_proxy[qty]
+    channels = [snap_proxy[q] for q in qtys]
     mass = snap_proxy['mass']
     rho = snap_proxy['rho']
 
-    if out_units is not None:
-        # Calculate the ratio now so we don't waste time calculating
-        # the image only to throw a UnitsException later
-        conv_ratio = (qty.units * mass.units / (rho.units * sm.units ** kernel.h_power)).ratio(out_units,
-                                                                                               **snap.conversion_context())
+    if weight is not None:
+        channels = [q * snap_proxy[weight] for q in channels] + [snap_proxy[weight]]
+
+    if out_units is None or isinstance(out_units, (str, units.UnitBase)):
+        out_units = [out_units] * len(channels)
+
+    # Calculate the scalings now so we don't waste time calculating
+    # the image only to throw a UnitsException later
+    scalings = [_image_scaling(snap, q, mass, rho, sm, snap_proxy['x'].units, kernel, channel_units)
+                for q, channel_units in zip(channels, out_units)]
 
     if z_camera is None:
         z_camera = 0.0
 
-    result = _render.render_image(nx, ny, x, y, z, sm, x1, x2, y1, y2, z_camera, 0.0, qty, mass, rho,
-                                  smooth_lo, smooth_hi, kernel,
-                                  _calculate_wrapping_repeat_array(snap, x1, x2, xy_units),
-                                  _calculate_wrapping_repeat_array(snap, y1, y2, xy_units))
+    qty_stack = np.stack(channels)
+    if not np.issubdtype(qty_stack.dtype, np.floating):
+        qty_stack = qty_stack.astype(np.float64)
+
+    render_args = (nx, ny, x, y, z, sm, x1, x2, y1, y2, z_camera, z1, qty_stack, mass, rho,
+                   smooth_lo, smooth_hi, kernel, wrap_x, wrap_y)
+
+    if num_threads:
+        result = _render.render_image_tiled(*render_args, num_threads=num_threads)
+    else:
+        result = _render.render_image(*render_args)
+
+    for channel_result, (ratio, _) in zip(result, scalings):
+        channel_result *= ratio
+    result_units = [channel_units for _, channel_units in scalings]
+
+    if not multi_channel and weight is None:
+        result = result[0]
 
     result = result.view(array.SimArray)
 
-    # The weighting works such that there is a factor of (M_u/rho_u)h_u^3
-    # where M-u, rho_u and h_u are mass, density and smoothing units
-    # respectively. This is dimensionless, but may not be 1 if the units
-    # have been changed since load-time.
+    # a stack of channels can only carry units if they all agree
+    if all(u == result_units[0] for u in result_units):
+        result.units = result_units[0]
+    else:
+        result.units = units.NoUnit()
+
+    result.sim = snap
+    return result
+
+
+def _image_scaling(snap, qty, mass, rho, sm, pos_units, kernel, out_units):
+    """Return the factor by which to multiply a raw image of qty from the _render module, and the
+    units of the result; pos_units are the snapshot's own position units."""
     if out_units is None:
-        result *= (snap_proxy['mass'].units / (snap_proxy['rho'].units)).ratio(
-            snap_proxy['x'].units ** 3, **snap_proxy['x'].conversion_context())
+        # The weighting works such that there is a factor of (M_u/rho_u)h_u^3
+        # where M-u, rho_u and h_u are mass, density and smoothing units
+        # respectively. This is dimensionless, but may not be 1 if the units
+        # have been changed since load-time.
+        ratio = (mass.units / rho.units).ratio(pos_units ** 3, **snap.conversion_context())
 
         # The following will be the units of outputs after the above conversion
         # is applied
-        result.units = snap_proxy[qty_s].units * \
-            snap_proxy['x'].units ** (3 - kernel.h_power)
+        return ratio, qty.units * pos_units ** (3 - kernel.h_power)
     else:
-        result *= conv_ratio
-        result.units = out_units
+        ratio = (qty.units * mass.units / (rho.units * sm.units ** kernel.h_power)).ratio(out_units,
+                                                                                        **snap.conversion_context())
+        return ratio, units.Unit(out_units)
 
-    result.sim = snap
-    return result
+
+def _culling_boxes(snap, smooth, xy_units, fmin, fmax, smooth_scale, wrap_offsets):
+    """Convert the region fmin..fmax (in xy_units), and its periodic images shifted by -wrap_offsets,
+    into boxes in the units of the snapshot's positions.
+
+    Returns the list of (box_min, box_max) pairs, and smooth_scale converted so that it multiplies
+    smoothing lengths in their own units to give lengths in position units; or None if the units
+    cannot be converted."""
+
+    try:
+        pos_units = snap['pos'].units
+        to_tree_units = units.Unit(xy_units).ratio(pos_units, **snap.conversion_context())
+        smooth_to_tree_units = snap[smooth].units.ratio(pos_units, **snap.conversion_context())
+    except units.UnitsException:
+        return None
+
+    boxes = [([(lo - offset) * to_tree_units for lo, offset in zip(fmin, offsets)],
+              [(hi - offset) * to_tree_units for hi, offset in zip(fmax, offsets)])
+             for offsets in itertools.product(*wrap_offsets)]
+    return boxes, [s * smooth_to_tree_units for s in smooth_scale]
+
+
+def _particles_overlapping_region(snap, smooth, xy_units, fmin, fmax, smooth_scale, wrap_offsets):
+    """Find the particles that may contribute to a render of the region fmin..fmax (in xy_units).
+
+    A particle is included if, along each axis j, its position +/- smooth_scale[j] times its
+    smoothing length overlaps the region, or any periodic image of the region shifted by
+    -wrap_offsets[j]. Whole subtrees of the snapshot's kd-tree are culled at once, so only
+    the visible particles are touched.
+
+    Returns a sorted index array, so that particles are rendered in their usual order.
+    Returns None, meaning all particles must be rendered, if tree culling is switched off or
+    if the snapshot has no kd-tree yet (building one just for this would cost more than it saves)."""
+
+    if not config_parser.getboolean('sph', 'tree-culling') or not hasattr(snap, 'kdtree'):
+        return None
+
+    region = _culling_boxes(snap, smooth, xy_units, fmin, fmax, smooth_scale, wrap_offsets)
+    if region is None:
+        return None
+    boxes, smooth_scale = region
+
+    visible = []
+    try:
+        for box_min, box_max in boxes:
+            visible.append(snap.kdtree.particles_in_box(snap[smooth], box_min, box_max, smooth_scale, smooth))
+    except (TypeError, ValueError):
+        # e.g. smoothing array with a different dtype to the tree's positions
+        return None
+
+    if len(visible) == 1:
+        return np.sort(visible[0])
+    else:
+        return np.unique(np.concatenate(visible))
+
+
+def _level_of_detail_arrays(snap, qty, smooth, xy_units, kernel, pixel_size, fmin, fmax, smooth_scale, wrap_offsets):
+    """Return the arrays to render from the snapshot's particle hierarchy, cut at pixel_size (in xy_units)
+    and culled to the region as for _particles_overlapping_region."""
+
+    build_tree(snap)
+    region = _culling_boxes(snap, smooth, xy_units, fmin, fmax, smooth_scale, wrap_offsets)
+    if region is None:
+        raise units.UnitsException("Level-of-detail rendering requires the image units to be convertible to the snapshot's")
+    boxes = region[0]
+    pixel_size *= units.Unit(xy_units).ratio(snap['pos'].units, **snap.conversion_context())
+
+    # the hierarchy's smoothing lengths are already in position units, so smooth_scale needs no conversion
+    return lod.particle_hierarchy(snap, qty, smooth).select(pixel_size, boxes, smooth_scale, kernel.max_d)
 
 
 def _calculate_wrapping_repeat_array(snap, x1, x2, xy_units):
@@ -703,9 +989,56 @@ def _calculate_wrapping_repeat_array(snap, x1, x2, xy_units):
     return repeat_array
 
 
+class SparseGrid:
+    """A 3D grid in which only the cubic blocks containing non-zero cells are stored, as returned by
+    :func:`to_3d_grid` when *sparse_block_size* is given.
+
+    *blocks* maps the index (i, j, k) of each stored block to an array of its b x b x b cells, which are
+    cells [i*b:(i+1)*b, j*b:(j+1)*b, k*b:(k+1)*b] of the grid; blocks at the upper edges of the grid are
+    padded with zeros. All other cells are zero."""
+
+    def __init__(self, shape, block_size, units=None, sim=None):
+        self.shape = tuple(shape)
+        self.block_size = block_size
+        self.units = units
+        self.sim = sim
+        self.blocks = {}
+
+    def _add_slab(self, x_lo, cells):
+        """Store the non-zero blocks of cells, which are the grid cells [x_lo:x_lo+len(cells)]; x_lo must
+        be a multiple of the block size"""
+        b = self.block_size
+        n_blocks_x = -(-len(cells) // b)
+        n_blocks_y, n_blocks_z = (-(-n // b) for n in self.shape[1:])
+        padded = np.zeros((n_blocks_x * b, n_blocks_y * b, n_blocks_z * b), dtype=cells.dtype)
+        padded[:len(cells), :self.shape[1], :self.shape[2]] = cells
+        # axes are (block x, block y, block z, cell x, cell y, cell z)
+        by_block = padded.reshape(n_blocks_x, b, n_blocks_y, b, n_blocks_z, b).transpose(0, 2, 4, 1, 3, 5)
+        for i, j, k in zip(*np.nonzero(by_block.any(axis=(3, 4, 5)))):
+            self.blocks[(x_lo // b + int(i), int(j), int(k))] = by_block[i, j, k].copy()
+
+    @property
+    def nbytes(self):
+        """The memory used by the stored blocks"""
+        return sum(block.nbytes for block in self.blocks.values())
+
+    def to_dense(self):
+        """Return the whole grid as a SimArray"""
+        b = self.block_size
+        n_blocks = [-(-n // b) for n in self.shape]
+        result = np.zeros([n * b for n in n_blocks], dtype=np.float32)
+        for (i, j, k), block in self.blocks.items():
+            result[i * b:(i + 1) * b, j * b:(j + 1) * b, k * b:(k + 1) * b] = block
+        result = result[:self.shape[0], :self.shape[1], :self.shape[2]].view(array.SimArray)
+        result.units = self.units
+        result.sim = self.sim
+        return result
+
+
 def to_3d_grid(snap, qty='rho', nx=None, ny=None, nz=None, x2=None, out_units=None,
                xy_units=None, kernel=Kernel(), smooth='smooth', approximate_fast=_approximate_image,
-               threaded=None, snap_slice=None, denoise=None):
+               threaded=None, snap_slice=None, denoise=None, out_file=None, sparse_block_size=None,
+               max_memory=2**30):
     """
 
     Project SPH onto a grid using a typical (mass/rho)-weighted 'scatter'
@@ -730,10 +1063,25 @@ def to_3d_grid(snap, qty='rho', nx=None, ny=None, nz=None, x2=None, out_units=No
     *smooth*: The name of the array which contains the smoothing lengths
       (default 'smooth')
 
+    *threaded*: The number of threads to use (default from the configuration file).
+      Each thread fills whole slabs of the grid, so the result does not depend on this.
+
     *denoise*: if True, divide through by an estimate of the discreteness noise.
       The returned image is then not strictly an SPH estimate, but this option
       can be useful to reduce noise especially when rendering AMR grids which
-      often introduce problematic edge effects.
+      often introduce problematic edge effects. Cells outside every particle's
+      kernel are 0.
+
+    *out_file*: if given, the grid is computed a slab at a time and written to this
+      .npy file, and a read/write memory-mapped SimArray of the file is returned.
+
+    *sparse_block_size*: if given, the grid is computed a slab at a time and only the
+      cubic blocks of this many cells on a side which contain non-zero cells are kept;
+      a :class:`SparseGrid` is returned. This suits zoom regions, where most of the grid is empty.
+
+    *max_memory* (1 GiB): with *out_file* or *sparse_block_size*, the number of bytes of the
+      grid to compute at once. The approximate_fast option does not apply to these outputs,
+      which are always exact.
 
     """
     global config
@@ -770,42 +1118,97 @@ def to_3d_grid(snap, qty='rho', nx=None, ny=None, nz=None, x2=None, out_units=No
     x1, x2, y1, y2, z1, z2 = (float(q) for q in (x1, x2, y1, y2, z1, z2))
     nx, ny, nz = (int(q) for q in (nx, ny, nz))
 
+    if threaded is None:
+        threaded = _get_threaded_image()
+    num_threads = max(int(threaded), 1)
+
+    if out_file is not None or sparse_block_size is not None:
+        im = _to_3d_grid_slabs(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units, xy_units, kernel, smooth,
+                               num_threads, denoise, out_file, sparse_block_size, max_memory)
+        logger.info("Render done at %.2f s" % (time.time() - in_time))
+        return im
+
     if approximate_fast:
         renderer = _interpolated_renderer(
             _to_3d_grid, int(np.floor(np.log2(nx / 20))))
     else:
         renderer = _to_3d_grid
 
-    if threaded is None:
-        threaded = _get_threaded_image()
-
-    if threaded:
-        im = _threaded_render_image(renderer, snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
-                                    xy_units, kernel, smooth, num_threads=threaded)
-    else:
-        im = renderer(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
-                      xy_units, kernel, smooth, False)
+    im = renderer(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
+                  xy_units, kernel, smooth, num_threads=num_threads)
 
     logger.info("Render done at %.2f s" % (time.time() - in_time))
 
     if denoise:
         # call self to render a 'flat field'
         snap['__one'] = 1
-        im2 = to_3d_grid(snap, '__one', nx, ny, nz, x2, None, xy_units, kernel, smooth,
-                         approximate_fast, threaded, snap_slice, False)
+        flat = to_3d_grid(snap, '__one', nx, ny, nz, x2, None, xy_units, kernel, smooth,
+                          approximate_fast, threaded, snap_slice, False).view(np.ndarray)
         del snap.ancestor['__one']
-        im2 = im / im2
+        # cells outside every kernel are left empty, rather than becoming 0/0, as in _to_3d_grid_slabs
+        im2 = np.divide(im.view(np.ndarray), flat, out=np.zeros(im.shape, dtype=im.dtype),
+                        where=flat != 0).view(array.SimArray)
         im2.units = im.units
+        im2.sim = im.sim
         return im2
 
     else:
         return im
 
 
+def _to_3d_grid_slabs(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units, xy_units, kernel, smooth,
+                      num_threads, denoise, out_file, sparse_block_size, max_memory):
+    """Compute the grid for to_3d_grid in slabs of constant x, writing each to out_file or keeping its
+    non-zero blocks of sparse_block_size cells, so that at most max_memory bytes of grid are held at once."""
+
+    block_size = sparse_block_size or 1
+    bytes_per_plane = ny * nz * np.dtype(np.float32).itemsize * (2 if denoise else 1)
+    slab_width = max(1, int(max_memory) // bytes_per_plane)
+    slab_width = max(block_size, slab_width - slab_width % block_size)
+
+    if out_file is not None:
+        output = np.lib.format.open_memmap(out_file, mode='w+', dtype=np.float32, shape=(nx, ny, nz))
+    else:
+        output = SparseGrid((nx, ny, nz), sparse_block_size, sim=snap)
+
+    if denoise:
+        snap['__one'] = 1
+
+    try:
+        for x_lo in range(0, nx, slab_width):
+            x_pix_range = (x_lo, min(x_lo + slab_width, nx))
+            slab = _to_3d_grid(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
+                               xy_units, kernel, smooth, num_threads=num_threads, x_pix_range=x_pix_range)
+            slab_units = slab.units
+            slab = slab.view(np.ndarray)
+            if denoise:
+                flat = _to_3d_grid(snap, '__one', nx, ny, nz, x1, x2, y1, y2, z1, z2, None,
+                                   xy_units, kernel, smooth, num_threads=num_threads,
+                                   x_pix_range=x_pix_range).view(np.ndarray)
+                # cells outside every kernel are left empty, rather than becoming 0/0
+                slab = np.divide(slab, flat, out=np.zeros_like(slab), where=flat != 0)
+
+            if out_file is not None:
+                output[x_pix_range[0]:x_pix_range[1]] = slab
+                output.flush()
+            else:
+                output._add_slab(x_lo, slab)
+            logger.info("Gridded slab %d-%d of %d" % (x_pix_range + (nx,)))
+    finally:
+        if denoise:
+            del snap.ancestor['__one']
+
+    if out_file is not None:
+        output = output.view(array.SimArray)
+        output.sim = snap
+    output.units = slab_units
+    return output
+
+
 def _to_3d_grid(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
                 xy_units, kernel, smooth, __threaded=False, res_downgrade=None,
                 snap_slice=None,
-                smooth_range=None):
+                smooth_range=None, num_threads=1, x_pix_range=None):
 
     snap_proxy = {}
 
@@ -835,12 +1238,27 @@ def _to_3d_grid(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
         y2 += sy
         z2 += sz
 
-    result = np.zeros((nx, ny, nz), dtype=np.float32)
-    n_part = len(snap)
+    if x_pix_range is None:
+        x_pix_range = (0, nx)
 
     if xy_units is None:
         xy_units = snap_proxy['x'].units
 
+    wrap_x = _calculate_wrapping_repeat_array(snap, x1, x2, xy_units)
+    wrap_y = _calculate_wrapping_repeat_array(snap, y1, y2, xy_units)
+    wrap_z = _calculate_wrapping_repeat_array(snap, z1, z2, xy_units)
+
+    if snap_slice is None:
+        # particles are only gridded if within 2h of the requested cells along each axis
+        pixel_dx = (x2 - x1) / nx
+        visible = _particles_overlapping_region(snap, smooth, xy_units,
+                                                (x1 + x_pix_range[0] * pixel_dx, y1, z1),
+                                                (x1 + x_pix_range[1] * pixel_dx, y2, z2),
+                                                (2.0, 2.0, 2.0), (wrap_x, wrap_y, wrap_z))
+        if visible is not None:
+            for arname in snap_proxy:
+                snap_proxy[arname] = snap_proxy[arname][visible]
+
     x = snap_proxy['x'].in_units(xy_units)
     y = snap_proxy['y'].in_units(xy_units)
     z = snap_proxy['z'].in_units(xy_units)
@@ -850,16 +1268,13 @@ def _to_3d_grid(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
     if sm.units != x.units:
         sm = sm.in_units(x.units)
 
-    qty_s = qty
     qty = snap_proxy[qty]
     mass = snap_proxy['mass']
     rho = snap_proxy['rho']
 
-    if out_units is not None:
-        # Calculate the ratio now so we don't waste time calculating
-        # the image only to throw a UnitsException later
-        conv_ratio = (qty.units * mass.units / (rho.units * sm.units ** kernel.h_power)).ratio(out_units,
-                                                                                               **x.conversion_context())
+    # Calculate the scaling now so we don't waste time calculating
+    # the grid only to throw a UnitsException later
+    ratio, result_units = _image_scaling(snap, qty, mass, rho, sm, snap_proxy['x'].units, kernel, out_units)
 
     if smooth_range is not None:
         smooth_lo = float(smooth_range[0])
@@ -872,144 +1287,162 @@ def _to_3d_grid(snap, qty, nx, ny, nz, x1, x2, y1, y2, z1, z2, out_units,
 
     result = _render.to_3d_grid(nx,ny,nz,x,y,z,sm,x1,x2,y1,y2,z1,z2,
                                 qty,mass,rho,smooth_lo,smooth_hi,kernel,
-                                _calculate_wrapping_repeat_array(snap, x1, x2, xy_units),
-                                _calculate_wrapping_repeat_array(snap, y1, y2, xy_units),
-                                _calculate_wrapping_repeat_array(snap, z1, z2, xy_units))
+                                wrap_x, wrap_y, wrap_z, num_threads=num_threads,
+                                x_pix_lo=x_pix_range[0], x_pix_hi=x_pix_range[1])
     result = result.view(array.SimArray)
+    result *= ratio
+    result.units = result_units
+    result.sim = snap
+    return result
 
-    # The weighting works such that there is a factor of (M_u/rho_u)h_u^3
-    # where M_u, rho_u and h_u are mass, density and smoothing units
-    # respectively. This is dimensionless, but may not be 1 if the units
-    # have been changed since load-time.
-    if out_units is None:
-        result *= (snap_proxy['mass'].units / (snap_proxy['rho'].units)).ratio(
-            snap_proxy['x'].units ** 3, **snap_proxy['x'].conversion_context())
+# Rest wavelength (Angstrom), oscillator strength and damping constant (s^-1) of the strongest
+# transition of each ion, from Morton (2003, ApJS 149, 205)
+_spectral_lines = {('H', 'I'): (1215.6701, 0.4164, 6.265e8),
+                   ('He', 'II'): (303.7822, 0.4162, 1.003e10),
+                   ('C', 'IV'): (1548.204, 0.1899, 2.642e8),
+                   ('N', 'V'): (1238.821, 0.1560, 3.391e8),
+                   ('O', 'VI'): (1031.9261, 0.1325, 4.163e8),
+                   ('Mg', 'II'): (2796.354, 0.6155, 2.625e8),
+                   ('Si', 'IV'): (1393.755, 0.5280, 8.80e8)}
 
-        # The following will be the units of outputs after the above conversion
-        # is applied
-        result.units = snap_proxy[qty_s].units * \
-            snap_proxy['x'].units ** (3 - kernel.h_power)
-    else:
-        result *= conv_ratio
-        result.units = out_units
+_nucleons = {'H':1, 'He':4, 'Li':6, 'Ne':10, 'C':12, 'N':14, 'O':16, 'Mg':24, 'Si':28,
+             'S':32, 'Ca':40, 'Fe':56}
 
-    result.sim = snap
-    return result
 
 def spectra(snap, qty='rho', x1=0.0, y1=0.0, v2=400, nvel=200, v1=None,
             element='H', ion='I',
             xy_units=units.Unit('kpc'), vel_units = units.Unit('km s^-1'),
-            smooth='smooth', __threaded=False) :
+            smooth='smooth', profile='gaussian', line=None, threaded=None) :
 
     """
 
-    Render an SPH spectrum using a (mass/rho)-weighted 'scatter'
-    scheme of all the particles that have a smoothing length within
-    2 h_sm of the position.
+    Render SPH absorption spectra along sightlines parallel to the z axis, using a
+    (mass/rho)-weighted 'scatter' scheme of all the particles that have a smoothing
+    length within 2 h_sm of each sightline. Each particle's absorption is spread
+    over a thermally-broadened line profile centred on its z velocity.
 
     **Keyword arguments:**
 
-    *qty* ('rho'): The name of the array within the simulation to render
+    *qty* ('rho'): The name of the array giving the mass density of the absorbing ion
 
-    *x1* (0.0): The x-coordinate of the line of sight.
+    *x1* (0.0): The x-coordinate of the line of sight, or an array of them
 
-    *y1* (0.0): The y-coordinate of the line of sight.
+    *y1* (0.0): The y-coordinate of the line of sight, or an array of them
 
-    *v1* (-400.0): The minimum velocity of the spectrum
+    *v1* (-v2): The minimum velocity of the spectrum
 
     *v2* (400.0): The maximum velocity of the spectrum
 
-    *nvel* (500): The number of resolution elements in spectrum
+    *nvel* (200): The number of resolution elements in spectrum
+
+    *element*, *ion* ('H', 'I'): The absorbing species, which sets the mass of the
+      absorbers and (unless *line* is given) the transition
 
     *xy_units* ('kpc'): The units for the x and y axes
 
+    *vel_units* ('km s^-1'): The units for the velocities
+
     *smooth*: The name of the array which contains the smoothing lengths
       (default 'smooth')
 
-    """
+    *profile* ('gaussian'): 'gaussian' for thermal broadening only, averaged over each
+      velocity bin, or 'voigt' to include the natural damping wings
 
-    global config
+    *line*: (wavelength in Angstrom, oscillator strength, damping constant in s^-1) of
+      the transition, if it is not one of those in sph._spectral_lines
+
+    *threaded*: The number of threads to use (default from the configuration file)
 
-    if config["tracktime"] :
-        import time
-        in_time = time.time()
+    **Returns:** the velocity bin centres and the optical depths, with shape (nvel,) for a
+    single sightline or (len(x1), nvel) for an array of them.
+
+    """
+
+    in_time = time.time()
 
     kernel=Kernel2D()
 
     if v1 is None:
         v1 = -v2
     dvel = (v2 - v1) / nvel
-    v1, v2, dvel, nvel = (float(q) for q in (v1,v2,dvel,nvel))
-    vels = np.arange(v1+0.5*dvel, v2, dvel)
-
-    tau = np.zeros((nvel),dtype=np.float32)
-
-    n_part = len(snap)
+    v1, v2, dvel = (float(q) for q in (v1,v2,dvel))
+    nvel = int(nvel)
+    vels = np.arange(v1+0.5*dvel, v2, dvel)[:nvel]
+
+    if line is None:
+        try:
+            line = _spectral_lines[(element, ion)]
+        except KeyError:
+            raise ValueError("No line data for %s %s; specify it with the line keyword" % (element, ion))
+    wavelength, oscillator_strength, damping_constant = line
+    if profile not in ('gaussian', 'voigt'):
+        raise ValueError("Unknown line profile %r" % profile)
+
+    single_sightline = np.ndim(x1) == 0
+    los_x = np.atleast_1d(np.asarray(x1, dtype=np.float64))
+    los_y = np.atleast_1d(np.asarray(y1, dtype=np.float64))
 
     if xy_units is None :
         xy_units = snap['x'].units
 
-    x = snap['x'].in_units(xy_units) - x1
-    y = snap['y'].in_units(xy_units) - y1
-    vz = snap['vz'].in_units(vel_units)
-    temp = snap['temp'].in_units(units.Unit('K'))
+    # particles are only projected if within 2h of a sightline's x and y
+    visible = _particles_overlapping_region(snap, smooth, xy_units, (los_x.min(), los_y.min(), -np.inf),
+                                            (los_x.max(), los_y.max(), np.inf), (2.0, 2.0, 0.0),
+                                            ([0.0], [0.0], [0.0]))
+    if visible is None:
+        visible = slice(None)
 
-    sm = snap[smooth]
+    x = snap['x'][visible].in_units(xy_units)
+    y = snap['y'][visible].in_units(xy_units)
+    vz = snap['vz'][visible].in_units(vel_units)
+    temp = snap['temp'][visible].in_units(units.Unit('K'))
+
+    sm = snap[smooth][visible]
 
     if sm.units!=x.units :
         sm = sm.in_units(x.units)
 
-    nucleons = {'H':1, 'He':4, 'Li':6, 'Ne':10, 'C':12, 'N':14, 'O':16, 'Mg':24, 'Si':28,
-                'S':32, 'Ca':40, 'Fe':56}
+    nnucleons = _nucleons[element]
 
-    nnucleons = nucleons[element]
-
-    qty_s = qty
-    qty = snap[qty]
-    mass = snap['mass']
-    rho = snap['rho']
+    qty = snap[qty][visible]
+    mass = snap['mass'][visible]
+    rho = snap['rho'][visible]
 
     conv_ratio = (qty.units*mass.units/(rho.units*sm.units**kernel.h_power)).ratio(str(nnucleons)+' m_p cm^-2', **x.conversion_context())
 
-    try :
-        kernel.safe.acquire(True)
-        code = kernel.get_c_code()
-    finally :
-        kernel.safe.release()
-
-    if __threaded :
-        code+="#define THREAD 1\n"
-
-
-    code+=file(os.path.join(os.path.dirname(__file__),'sph_spectra.c')).read()
+    # thermal Doppler parameter and, for Voigt profiles, the damping in velocity units
+    to_cgs = units.Unit(vel_units).ratio('cm s^-1', **x.conversion_context())
+    k_B = 1.3806503e-16
+    m_p = 1.67262158e-24
+    b = np.sqrt(2 * k_B * np.asarray(temp, dtype=np.float64) / (nnucleons * m_p)) / to_cgs
+    if profile == 'voigt':
+        damping = damping_constant * wavelength * 1e-8 / (4 * np.pi) / to_cgs
+    else:
+        damping = 0.0
 
-    # before inlining, the views on the arrays must be standard np.ndarray
-    # otherwise the normal numpy macros are not generated
-    x,y,vz,temp,sm,qty, mass, rho = (q.view(np.ndarray) for q in (x,y,vz,temp,sm,qty, mass, rho))
+    if threaded is None:
+        threaded = _get_threaded_image()
 
-    if config['verbose']: print("Constructing SPH spectrum", file=sys.stderr)
+    logger.info("Constructing SPH spectra for %d sightlines" % len(los_x))
 
-    if config["tracktime"] :
-        print("Beginning SPH render at %.2f s"%(time.time()-in_time), file=sys.stderr)
-    #import pdb; pdb.set_trace()
-    util.threadsafe_inline( code, ['tau', 'nvel', 'x', 'y', 'vz', 'temp', 'sm', 'v1', 'v2',
-                   'nnucleons','qty', 'mass', 'rho'],verbose=2)
+    # the kernel-weighted column per unit velocity, in nucleon column units per vel_units
+    column = _render.render_spectra(x.view(np.ndarray), y.view(np.ndarray), vz.view(np.ndarray),
+                                    sm.view(np.ndarray), qty.view(np.ndarray), mass.view(np.ndarray),
+                                    rho.view(np.ndarray), b, los_x, los_y, v1, v2, nvel, damping, kernel,
+                                    num_threads=max(int(threaded), 1))
 
-    if config["tracktime"] :
-        print("Render done at %.2f s"%(time.time()-in_time), file=sys.stderr)
+    logger.info("Spectra done at %.2f s" % (time.time() - in_time))
 
     mass_e = 9.10938188e-28
     e = 4.803206e-10
     c = 2.99792458e10
     pi = 3.14159267
-    tauconst = pi*e*e / mass_e / c / np.sqrt(pi)
-    oscwav0 = 1031.9261*0.13250*1e-8
-    tau = tauconst*oscwav0*tau*conv_ratio
-    #tau = tau*conv_ratio
-    print("tauconst: %g oscwav0: %g"%(tauconst,oscwav0))
-    print("tauconst*oscwav0: %g"%(tauconst*oscwav0))
-    print("conv_ratio: %g"%conv_ratio)
-    print("max(N): %g"%(np.max(tau)))
+    # the line profile in render_spectra already includes its 1/sqrt(pi) normalisation
+    tauconst = pi*e*e / mass_e / c
+    oscwav0 = wavelength*oscillator_strength*1e-8
+    tau = (tauconst*oscwav0*conv_ratio/to_cgs*column).astype(np.float32)
+    if single_sightline:
+        tau = tau[0]
     tau = tau.view(array.SimArray)
 
     tau.sim = snap
@@ -3,6 +3,7 @@ import numpy as np
 cimport cython
 cimport libc.math as cmath
 cimport numpy as np
+from cython.parallel cimport prange
 from libc.math cimport atan, pow
 from libc.stdlib cimport free, malloc
 
@@ -41,58 +42,184 @@ ctypedef np.float64_t fixed_input_type
 
 
 
+@cython.cdivision(True)
+cdef inline long healpix_ring_above(long nside, double z) noexcept nogil :
+    """The number of the HEALPix ring at or north of colatitude arccos(z), numbering rings from 1 at the
+    north pole to 4*nside-1 at the south pole (0 if z is north of the first ring)"""
+    cdef double az = cmath.fabs(z)
+    cdef long ring
+    if az<=2.0/3 :
+        return <long>(nside*(2-1.5*z))
+    ring = <long>(nside*cmath.sqrt(3*(1-az)))
+    return ring if z>0 else 4*nside-ring-1
+
+
+@cython.cdivision(True)
+cdef inline void healpix_ring(long nside, long ring, double *z, long *first_pixel, long *n_pixels,
+                              double *phi_shift) noexcept nogil :
+    """Geometry of a HEALPix ring in the RING scheme: its z=cos(colatitude), the index of its first pixel,
+    its number of pixels and the offset of its pixel centres, in units of the pixel width in phi"""
+    cdef long northern = ring if ring<2*nside else 4*nside-ring
+    if northern<nside :
+        # polar cap
+        z[0] = 1.0-<double>(northern*northern)/(3*nside*nside)
+        n_pixels[0] = 4*northern
+        phi_shift[0] = 0.5
+        if ring==northern :
+            first_pixel[0] = 2*northern*(northern-1)
+        else :
+            z[0] = -z[0]
+            first_pixel[0] = 12*nside*nside-2*northern*(northern+1)
+    else :
+        # equatorial belt
+        z[0] = (2*nside-ring)*2.0/(3*nside)
+        n_pixels[0] = 4*nside
+        phi_shift[0] = 0.5 if (ring+nside)%2==0 else 0.0
+        first_pixel[0] = 2*nside*(nside-1)+(ring-nside)*4*nside
+
+
+@cython.cdivision(True)
+cdef void add_to_healpix_disc(image_output_type *im, image_output_type *im_norm, long nside,
+                              long ring_lo, long ring_hi, double z0, double phi0, double radius,
+                              image_output_type den, image_output_type norm) noexcept nogil :
+    """Add den to im and norm to im_norm for every RING-scheme HEALPix pixel, on rings ring_lo to ring_hi,
+    whose centre lies within radius of the direction (z0=cos(colatitude), phi0), as for healpy.query_disc
+    with inclusive=False"""
+    cdef double theta0 = cmath.acos(z0), sin_theta0 = cmath.sqrt((1-z0)*(1+z0))
+    cdef double cos_radius = cmath.cos(radius)
+    cdef double z, sin_theta, cos_dphi, dphi, phi_shift, pixel_dphi
+    cdef long ring, ring_start, ring_stop, first_pixel, n_pixels, j, j_start, j_stop, pixel
+
+    ring_start = healpix_ring_above(nside, cmath.cos(max(theta0-radius, 0.0)))
+    ring_stop = healpix_ring_above(nside, cmath.cos(min(theta0+radius, cmath.M_PI)))+1
+    ring_start = max(ring_start, ring_lo)
+    ring_stop = min(ring_stop, ring_hi)
+
+    for ring in range(ring_start, ring_stop+1) :
+        healpix_ring(nside, ring, &z, &first_pixel, &n_pixels, &phi_shift)
+        sin_theta = cmath.sqrt((1-z)*(1+z))
+
+        # pixel centres on this ring within radius are those within dphi of phi0
+        if sin_theta*sin_theta0==0 :
+            cos_dphi = -1.0 if z*z0>=cos_radius else 2.0
+        else :
+            cos_dphi = (cos_radius-z*z0)/(sin_theta*sin_theta0)
+        if cos_dphi>1 :
+            continue
+
+        if cos_dphi<=-1 :
+            j_start = 0
+            j_stop = n_pixels
+        else :
+            dphi = cmath.acos(cos_dphi)
+            pixel_dphi = 2*cmath.M_PI/n_pixels
+            j_start = <long>cmath.ceil((phi0-dphi)/pixel_dphi-phi_shift)
+            j_stop = <long>cmath.floor((phi0+dphi)/pixel_dphi-phi_shift)+1
+            if j_stop-j_start>n_pixels :
+                j_start = 0
+                j_stop = n_pixels
+
+        for j in range(j_start, j_stop) :
+            pixel = first_pixel+((j%n_pixels)+n_pixels)%n_pixels
+            im[pixel]+=den
+            im_norm[pixel]+=norm
+
+
 @cython.boundscheck(False)
 @cython.wraparound(False)
 @cython.cdivision(True)
-def render_spherical_image_core(np.ndarray[fused_input_type_1, ndim=1] rho, # array of particle densities
-                                np.ndarray[fused_input_type_2, ndim=1] mass, # array of particle masses
-                                np.ndarray[fused_input_type_3, ndim=1] qtyar, # array of quantity to make image of
-                                np.ndarray[fused_input_type_2, ndim=2] pos, # array of particle positions
-                                np.ndarray[fused_input_type_4, ndim=1] r, # particle radius
-                                np.ndarray[fused_input_type_4, ndim=1] h, # particle smoothing length
-                                np.ndarray[np.int64_t, ndim=1] ind, # which of the above particles to use
-                                np.ndarray[fused_input_type_5, ndim=1] ds, # what distances to sample at (in units of smoothing)
-                                np.ndarray[fused_input_type_5, ndim=1] weights, # what kernel weighting to use at these samples
-                                unsigned int nside) :
-
-    cdef unsigned int i,i0,j,n=len(ind),m=len(ds),num_pix
-    cdef long k
+cdef void render_spherical_band(image_output_type *im, image_output_type *im_norm, long nside,
+                                long ring_lo, long ring_hi, long n, const np.int64_t *ind,
+                                const fused_input_type_1[:] rho, const fused_input_type_2[:] mass,
+                                const fused_input_type_3[:] qtyar, const fused_input_type_2[:, :] pos,
+                                const fused_input_type_4[:] r, const fused_input_type_4[:] h,
+                                const fused_input_type_5[:] ds, const fused_input_type_5[:] weights,
+                                double ds_max) noexcept nogil :
+    """Add the particles ind[:n] to the pixels of the map on rings ring_lo to ring_hi"""
+    cdef long i0, i
+    cdef int j
     cdef float angle, norm, den
     cdef unsigned int h_power = 2 # to update
-    cdef np.ndarray[np.int64_t,ndim=1] healpix_pixels, buff
-    cdef np.ndarray[image_output_type,ndim=1] im, im_norm
-
-    import healpy as hp
-    n = len(ind)
-    im = np.zeros(hp.nside2npix(nside), dtype=np_image_output_type)
-    im_norm = np.zeros_like(im)
-    buff = np.empty(len(im), dtype=np.int64)
+    cdef double z0, phi0, theta0, max_angle
 
-    if not hp.isnsideok(nside):
-        raise ValueError('Wrong nside value, must be a power of 2')
-
-    # go through each particle
     for i0 in range(n) :
         i = ind[i0]
-        # go through each kernel step
-        for j in range(m) :
+        if r[i]==0 :
+            continue
+        z0 = pos[i,2]/cmath.sqrt(pos[i,0]*pos[i,0]+pos[i,1]*pos[i,1]+pos[i,2]*pos[i,2])
+        z0 = min(max(z0, -1.0), 1.0)
 
+        # skip particles whose largest disc (with a margin for its single precision angle) misses the band
+        theta0 = cmath.acos(z0)
+        max_angle = cmath.atan(h[i]*ds_max/r[i])*(1+1e-5)
+        if healpix_ring_above(nside, cmath.cos(max(theta0-max_angle, 0.0)))>ring_hi or \
+           healpix_ring_above(nside, cmath.cos(min(theta0+max_angle, cmath.M_PI)))+1<ring_lo :
+            continue
+
+        phi0 = cmath.atan2(pos[i,1], pos[i,0])
+
+        # go through each kernel step
+        for j in range(ds.shape[0]) :
             angle = atan(h[i]*ds[j]/r[i])
             norm = weights[j]*mass[i]/rho[i]/h[i]**h_power
             den = qtyar[i]*norm
+            add_to_healpix_disc(im, im_norm, nside, ring_lo, ring_hi, z0, phi0, angle, den, norm)
 
-            # find the pixels affected
-            healpix_pixels = hp.query_disc(nside, pos[i], angle , inclusive=False, buff=buff)
-            num_pix = len(healpix_pixels)
 
-            with nogil :
-                # add the required amount to those particles
-                for k in range(num_pix) :
-                    im[healpix_pixels[k]]+=den
-                    im_norm[healpix_pixels[k]]+=norm
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def render_spherical_image_core(np.ndarray[fused_input_type_1, ndim=1] rho, # array of particle densities
+                                np.ndarray[fused_input_type_2, ndim=1] mass, # array of particle masses
+                                np.ndarray[fused_input_type_3, ndim=1] qtyar, # array of quantity to make image of
+                                np.ndarray[fused_input_type_2, ndim=2] pos, # array of particle positions
+                                np.ndarray[fused_input_type_4, ndim=1] r, # particle radius
+                                np.ndarray[fused_input_type_4, ndim=1] h, # particle smoothing length
+                                np.ndarray[np.int64_t, ndim=1] ind, # which of the above particles to use
+                                np.ndarray[fused_input_type_5, ndim=1] ds, # what distances to sample at (in units of smoothing)
+                                np.ndarray[fused_input_type_5, ndim=1] weights, # what kernel weighting to use at these samples
+                                long nside,
+                                int num_threads=1) :
+    """Render the particles onto a RING-scheme HEALPix map, returning the map and its normalisation.
+
+    The rings of the map are divided into bands, and each thread owns whole bands, visiting every
+    particle but adding only to the pixels of its own band. Each pixel therefore receives its
+    contributions in particle order, and the result is identical for any number of threads."""
+
+    cdef long n = len(ind), npix = 12*nside*nside, n_rings = 4*nside-1
+    cdef long band, n_bands
+    cdef double ds_max
+    cdef np.ndarray[np.int64_t,ndim=1] ind_c = np.ascontiguousarray(ind)
+    cdef np.int64_t *ind_ptr = <np.int64_t*>ind_c.data
+    cdef np.ndarray[image_output_type,ndim=2] maps
+    cdef image_output_type *maps_c
+
+    # typed views are needed to hand the arrays to render_spherical_band without the GIL
+    cdef const fused_input_type_1[:] rho_view = rho
+    cdef const fused_input_type_2[:] mass_view = mass
+    cdef const fused_input_type_3[:] qty_view = qtyar
+    cdef const fused_input_type_2[:, :] pos_view = pos
+    cdef const fused_input_type_4[:] r_view = r, h_view = h
+    cdef const fused_input_type_5[:] ds_view = ds, weights_view = weights
+
+    if nside<1 :
+        raise ValueError('Wrong nside value, must be a power of 2')
 
+    num_threads = max(1, num_threads)
+    # several bands per thread, since the rings near the poles have few pixels
+    n_bands = min(n_rings, 4*num_threads) if num_threads>1 else 1
+    ds_max = np.max(ds) if len(ds)>0 else 0.0
+    maps = np.zeros((2, npix), dtype=np_image_output_type)
+    maps_c = <image_output_type*>maps.data
 
-    return im, im_norm
+    with nogil:
+        for band in prange(n_bands, schedule='dynamic', chunksize=1, num_threads=num_threads) :
+            render_spherical_band(maps_c, &maps_c[npix], nside,
+                                  1+(n_rings*band)//n_bands, (n_rings*(band+1))//n_bands, n, ind_ptr,
+                                  rho_view, mass_view, qty_view, pos_view, r_view, h_view,
+                                  ds_view, weights_view, ds_max)
+
+    return maps[0], maps[1]
 
 
 
@@ -119,6 +246,225 @@ cdef image_output_type get_kernel_xyz(fixed_input_type x, fixed_input_type y, fi
 
 
 
+cdef struct render_geometry:
+    int nx, ny
+    fixed_input_type x1, x2, y1, y2, z0, z_camera
+    fixed_input_type pixel_dx, pixel_dy, x_start, y_start
+    fixed_input_type smooth_lo, smooth_hi, max_d_over_h
+    int kernel_dim, use_z
+
+    # following are only used for "perspective" rendering
+    float per_z_dx, per_z_dy, mid_x, mid_y
+
+
+cdef struct particle_footprint:
+    # pixel geometry at the particle's depth (differs from the image
+    # geometry only for perspective renders)
+    fixed_input_type pixel_dx, pixel_dy, x_start, y_start
+    fixed_input_type kernel_max_2
+    image_output_type sm_to_kdim
+    # range of pixels touched by the particle, clipped to the image
+    int x_pix_start, x_pix_stop, y_pix_start, y_pix_stop
+
+
+cdef render_geometry get_render_geometry(int nx, int ny,
+                                         fixed_input_type x1, fixed_input_type x2,
+                                         fixed_input_type y1, fixed_input_type y2,
+                                         fixed_input_type z_camera, fixed_input_type z0,
+                                         fixed_input_type smooth_lo, fixed_input_type smooth_hi,
+                                         kernel):
+    cdef render_geometry g
+    g.nx = nx
+    g.ny = ny
+    g.x1 = x1
+    g.x2 = x2
+    g.y1 = y1
+    g.y2 = y2
+    g.z0 = z0
+    g.z_camera = z_camera
+    g.pixel_dx = (x2-x1)/nx
+    g.pixel_dy = (y2-y1)/ny
+    g.x_start = x1+g.pixel_dx/2
+    g.y_start = y1+g.pixel_dy/2
+    g.smooth_lo = smooth_lo
+    g.smooth_hi = smooth_hi
+    g.max_d_over_h = kernel.max_d
+    g.kernel_dim = kernel.h_power
+    g.use_z = 1 if g.kernel_dim>=3 else 0
+    g.per_z_dx = (x2-x1)/(2*z_camera) if z_camera!=0 else 0
+    g.per_z_dy = (y2-y1)/(2*z_camera) if z_camera!=0 else 0
+    g.mid_x = (x2+x1)/2
+    g.mid_y = (y2+y1)/2
+
+    assert g.kernel_dim==2 or g.kernel_dim==3, "Only kernels of dimension 2 or 3 currently supported"
+    return g
+
+
+@cython.cdivision(True)
+cdef inline bint get_particle_footprint(const render_geometry *g,
+                                        fixed_input_type x_i, fixed_input_type y_i,
+                                        fixed_input_type z_i, fixed_input_type sm_i,
+                                        particle_footprint *fp) noexcept nogil :
+    """Work out which pixels particle i contributes to, returning False if it is not rendered at all"""
+    cdef fixed_input_type x1 = g.x1, x2 = g.x2, y1 = g.y1, y2 = g.y2
+    cdef fixed_input_type pixel_dx = g.pixel_dx, pixel_dy = g.pixel_dy
+    cdef fixed_input_type max_d_over_h = g.max_d_over_h
+    cdef float dz_i
+    cdef int x_pos, y_pos
+
+    fp.x_start = g.x_start
+    fp.y_start = g.y_start
+
+    if g.z_camera!=0.0 :
+        # perspective image -
+        # update image bounds for the current z
+        if (z_i>g.z_camera and g.z_camera>0) or (z_i<g.z_camera and g.z_camera<0) :
+            # behind camera
+            return False
+        dz_i = g.z_camera-z_i
+        x1 = g.mid_x - g.per_z_dx*dz_i
+        x2 = g.mid_x + g.per_z_dx*dz_i
+        y1 = g.mid_y - g.per_z_dy*dz_i
+        y2 = g.mid_y + g.per_z_dy*dz_i
+        pixel_dx = (x2-x1)/g.nx
+        pixel_dy = (y2-y1)/g.ny
+        fp.x_start = x1+pixel_dx/2
+        fp.y_start = y1+pixel_dy/2
+
+    fp.pixel_dx = pixel_dx
+    fp.pixel_dy = pixel_dy
+
+    # check particle smoothing is within specified range
+    if sm_i<pixel_dx*g.smooth_lo or sm_i>pixel_dx*g.smooth_hi :
+        return False
+
+    # check particle is within bounds
+    if not ((g.use_z*cmath.fabs(z_i-g.z0)<max_d_over_h*sm_i)
+            and x_i>x1-2*sm_i and x_i<x2+2*sm_i and y_i>y1-2*sm_i and y_i<y2+2*sm_i) :
+        return False
+
+    # pre-cache sm^kdim and (sm*max_d_over_h)**2; tests showed massive speedups when doing this
+    if g.kernel_dim==2 :
+        fp.sm_to_kdim = sm_i*sm_i
+    else :
+        fp.sm_to_kdim = sm_i*sm_i*sm_i
+        # only 2, 3 supported
+
+    fp.kernel_max_2 = (sm_i*sm_i)*(max_d_over_h*max_d_over_h)
+
+    # decide whether this is a single pixel or a multi-pixel particle
+    if (max_d_over_h*sm_i/pixel_dx<1 and max_d_over_h*sm_i/pixel_dy<1) :
+        # single pixel, get pixel location
+        x_pos = <int>((x_i-x1)/pixel_dx)
+        y_pos = <int>((y_i-y1)/pixel_dy)
+
+        # final bounds check
+        if not (x_pos>=0 and x_pos<g.nx and y_pos>=0 and y_pos<g.ny) :
+            return False
+        fp.x_pix_start = x_pos
+        fp.x_pix_stop = x_pos+1
+        fp.y_pix_start = y_pos
+        fp.y_pix_stop = y_pos+1
+    else :
+        # multi-pixel
+        fp.x_pix_start = <int>((x_i-max_d_over_h*sm_i-x1)/pixel_dx)
+        fp.x_pix_stop =  <int>((x_i+max_d_over_h*sm_i-x1)/pixel_dx)
+        fp.y_pix_start = <int>((y_i-max_d_over_h*sm_i-y1)/pixel_dy)
+        fp.y_pix_stop =  <int>((y_i+max_d_over_h*sm_i-y1)/pixel_dy)
+        if fp.x_pix_start<0 : fp.x_pix_start = 0
+        if fp.x_pix_stop>g.nx : fp.x_pix_stop = g.nx
+        if fp.y_pix_start<0 : fp.y_pix_start = 0
+        if fp.y_pix_stop>g.ny : fp.y_pix_stop = g.ny
+
+    return fp.x_pix_start<fp.x_pix_stop and fp.y_pix_start<fp.y_pix_stop
+
+
+cdef enum:
+    # Pixels per batch in add_particle_to_row; the batch's kernel table indices live on the stack
+    SPLAT_CHUNK = 256
+
+    # Rows narrower than this are cheaper to render pixel by pixel
+    SPLAT_MIN_VECTOR_WIDTH = 8
+
+
+cdef inline void add_weighted(image_output_type *pixel, long channel_stride, int n_channels,
+                              const fixed_input_type *qty_i, image_output_type weight) noexcept nogil :
+    """Add a kernel weight times each channel's qty_i to a pixel of a (channel, y, x) image"""
+    cdef int c
+    if n_channels==1 :
+        pixel[0]+=qty_i[0]*weight
+    else :
+        for c in range(n_channels) :
+            pixel[c*channel_stride]+=qty_i[c]*weight
+
+
+@cython.cdivision(True)
+cdef inline void add_particle_to_row(image_output_type *row, long channel_stride, int n_channels,
+                                     int x_pix_start, int x_pix_stop,
+                                     const particle_footprint *fp, fixed_input_type x_i,
+                                     fixed_input_type dy2, fixed_input_type dz2, const fixed_input_type *qty_i,
+                                     int num_samples, image_output_type *samples_c) noexcept nogil :
+    """Add a particle's contribution to a run of pixels in one image row, in every channel.
+
+    The kernel table indices for a batch of pixels are computed first, in a loop with no branches or
+    table lookups so that the compiler can vectorise it, and the table is then read in a second pass.
+    The arithmetic is the same as in get_kernel_xyz, so the result is identical to adding up the pixels
+    one at a time."""
+    cdef int index[SPLAT_CHUNK]
+    cdef int chunk_start, chunk_len, k
+    cdef fixed_input_type dx, q
+
+    chunk_start = x_pix_start
+    while chunk_start<x_pix_stop :
+        chunk_len = min(<int>SPLAT_CHUNK, x_pix_stop-chunk_start)
+        for k in range(chunk_len) :
+            dx = x_i-(fp.pixel_dx*<fixed_input_type>(chunk_start+k)+fp.x_start)
+            q = num_samples*(((dx*dx+dy2)+dz2)/fp.kernel_max_2)
+            index[k] = <int>q if q<num_samples else num_samples
+        for k in range(chunk_len) :
+            if index[k]<num_samples :
+                add_weighted(&row[chunk_start+k], channel_stride, n_channels, qty_i,
+                             samples_c[index[k]]/fp.sm_to_kdim)
+        chunk_start+=chunk_len
+
+
+@cython.cdivision(True)
+cdef inline void add_particle_to_image(image_output_type *result, int n_channels,
+                                       const render_geometry *g, const particle_footprint *fp,
+                                       int x_pix_start, int x_pix_stop, int y_pix_start, int y_pix_stop,
+                                       fixed_input_type x_i, fixed_input_type y_i, fixed_input_type z_i,
+                                       const fixed_input_type *qty_i, int num_samples,
+                                       image_output_type *samples_c) noexcept nogil :
+    """Add the kernel-weighted qty_i[c] of a particle to channel c of a (channel, y, x) image, over the
+    given (already clipped) range of pixels"""
+    cdef int x_pos, y_pos
+    cdef fixed_input_type x_pixel, y_pixel, dy
+    cdef fixed_input_type z_offset = (z_i-g.z0)*g.use_z
+    cdef long channel_stride = <long>g.nx*g.ny
+
+    if x_pix_stop-x_pix_start==1 and y_pix_stop-y_pix_start==1 :
+        # single pixel
+        x_pixel = fp.pixel_dx*<fixed_input_type>(x_pix_start)+fp.x_start
+        y_pixel = fp.pixel_dy*<fixed_input_type>(y_pix_start)+fp.y_start
+        add_weighted(&result[y_pix_start*g.nx+x_pix_start], channel_stride, n_channels, qty_i,
+                     get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, z_offset, fp.kernel_max_2, fp.sm_to_kdim,
+                                    num_samples, samples_c))
+    elif x_pix_stop-x_pix_start<SPLAT_MIN_VECTOR_WIDTH :
+        # footprint too narrow to be worth batching
+        for y_pos in range(y_pix_start, y_pix_stop) :
+            y_pixel = fp.pixel_dy*<fixed_input_type>(y_pos)+fp.y_start
+            for x_pos in range(x_pix_start, x_pix_stop) :
+                x_pixel = fp.pixel_dx*<fixed_input_type>(x_pos)+fp.x_start
+                add_weighted(&result[y_pos*g.nx+x_pos], channel_stride, n_channels, qty_i,
+                             get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, z_offset, fp.kernel_max_2, fp.sm_to_kdim,
+                                            num_samples, samples_c))
+    else :
+        for y_pos in range(y_pix_start, y_pix_stop) :
+            dy = y_i-(fp.pixel_dy*<fixed_input_type>(y_pos)+fp.y_start)
+            add_particle_to_row(&result[y_pos*g.nx], channel_stride, n_channels, x_pix_start, x_pix_stop,
+                                fp, x_i, dy*dy, z_offset*z_offset, qty_i, num_samples, samples_c)
+
+
 @cython.boundscheck(False)
 @cython.wraparound(False)
 @cython.cdivision(True)
@@ -129,54 +475,38 @@ def render_image(int nx, int ny,
                  np.ndarray[fused_input_type_2,ndim=1] sm,
                  fixed_input_type x1,fixed_input_type x2,fixed_input_type y1,
                  fixed_input_type y2,fixed_input_type z_camera, fixed_input_type z0,
-                 np.ndarray[fused_input_type_3,ndim=1] qty,
+                 np.ndarray[fused_input_type_3,ndim=2] qty,
                  np.ndarray[fused_input_type_4,ndim=1] mass,
                  np.ndarray[fused_input_type_5,ndim=1] rho,
                  fixed_input_type smooth_lo, fixed_input_type smooth_hi,
                  kernel,
                  wrap_offsets_x=[0], wrap_offsets_y=[0]) :
+    """Render an SPH image of each of the quantities qty[c], returning an array of shape (len(qty), ny, nx).
 
-    cdef fixed_input_type pixel_dx = (x2-x1)/nx
-    cdef fixed_input_type pixel_dy = (y2-y1)/ny
-    cdef fixed_input_type x_start = x1+pixel_dx/2
-    cdef fixed_input_type y_start = y1+pixel_dy/2
+    All the channels are accumulated in a single pass over the particles, sharing the footprint and
+    kernel calculations, and each is identical to what a render of that quantity alone would give."""
+
+    cdef render_geometry g = get_render_geometry(nx, ny, x1, x2, y1, y2, z_camera, z0,
+                                                 smooth_lo, smooth_hi, kernel)
+    cdef particle_footprint fp
     cdef int n_part = len(x)
-    cdef int nn=0, i=0
-    cdef fixed_input_type x_i, y_i, z_i, sm_i, qty_i
-    cdef fixed_input_type x_pixel, y_pixel, z_pixel
-    cdef int x_pos, y_pos
-    cdef int x_pix_start, x_pix_stop, y_pix_start, y_pix_stop
+    cdef int i=0, c
+    cdef int n_channels = qty.shape[0]
+    cdef fixed_input_type x_i, y_i, z_i, sm_i
 
-    # following are only used for "perspective" rendering
-    cdef float per_z_dx = (x2-x1)/(2*z_camera)
-    cdef float per_z_dy = (y2-y1)/(2*z_camera)
-    cdef float mid_x = (x2+x1)/2
-    cdef float mid_y = (y2+y1)/2
-    cdef float dz_i
+    cdef np.ndarray[fixed_input_type,ndim=1] qty_i_buf = np.empty(n_channels)
+    cdef fixed_input_type* qty_i = <fixed_input_type*>qty_i_buf.data
 
     cdef float wrap_offset_x, wrap_offset_y
 
-
-    cdef int kernel_dim = kernel.h_power
-    cdef fixed_input_type max_d_over_h = kernel.max_d
-
-
     cdef np.ndarray[image_output_type,ndim=1] samples = kernel.get_samples(dtype=np_image_output_type)
     cdef int num_samples = len(samples)
     cdef image_output_type* samples_c = <image_output_type*>samples.data
-    cdef image_output_type sm_to_kdim   # minimize casting when same type as output
-
-    cdef fixed_input_type kernel_max_2 # minimize casting when same type as input
-
-    cdef np.ndarray[image_output_type,ndim=2] result = np.zeros((ny,nx),dtype=np_image_output_type)
 
-    z_pixel = z0
-    cdef int total_ptcls = 0
+    cdef np.ndarray[image_output_type,ndim=3] result = np.zeros((n_channels,ny,nx),dtype=np_image_output_type)
+    cdef image_output_type* result_c = <image_output_type*>result.data
 
-    cdef int use_z = 1 if kernel_dim>=3 else 0
-
-    assert kernel_dim==2 or kernel_dim==3, "Only kernels of dimension 2 or 3 currently supported"
-    assert len(x) == len(y) == len(z) == len(sm) == len(qty) == len(mass) == len(rho), "Inconsistent array lengths passed to render_image_core"
+    assert len(x) == len(y) == len(z) == len(sm) == qty.shape[1] == len(mass) == len(rho), "Inconsistent array lengths passed to render_image_core"
 
     for wrap_offset_x in wrap_offsets_x :
         for wrap_offset_y in wrap_offsets_y :
@@ -184,91 +514,403 @@ def render_image(int nx, int ny,
                 for i in range(n_part) :
                     # load particle details
                     x_i = x[i]+wrap_offset_x; y_i=y[i]+wrap_offset_y;
-                    z_i=z[i]; sm_i = sm[i]; qty_i = qty[i]*mass[i]/rho[i]
-
-                    if z_camera!=0.0 :
-                        # perspective image -
-                        # update image bounds for the current z
-                        if (z_i>z_camera and z_camera>0) or (z_i<z_camera and z_camera<0) :
-                            # behind camera
-                            continue
-                        dz_i = z_camera-z_i
-                        x1 = mid_x - per_z_dx*dz_i
-                        x2 = mid_x + per_z_dx*dz_i
-                        y1 = mid_y - per_z_dy*dz_i
-                        y2 = mid_y + per_z_dy*dz_i
-                        pixel_dx = (x2-x1)/nx
-                        pixel_dy = (y2-y1)/ny
-                        x_start = x1+pixel_dx/2
-                        y_start = y1+pixel_dy/2
-
-
-                    # check particle smoothing is within specified range
-                    if sm_i<pixel_dx*smooth_lo or sm_i>pixel_dx*smooth_hi : continue
-
-                    total_ptcls+=1
-
-                    # check particle is within bounds
-                    if not ((use_z*cmath.fabs(z_i-z0)<max_d_over_h*sm_i)
-                            and x_i>x1-2*sm_i and x_i<x2+2*sm_i and y_i>y1-2*sm_i and y_i<y2+2*sm_i) :
-                        continue
-
-                    # pre-cache sm^kdim and (sm*max_d_over_h)**2; tests showed massive speedups when doing this
-                    if kernel_dim==2 :
-                        sm_to_kdim = sm_i*sm_i
-                    else :
-                        sm_to_kdim = sm_i*sm_i*sm_i
-                        # only 2, 3 supported
-
-                    kernel_max_2 = (sm_i*sm_i)*(max_d_over_h*max_d_over_h)
-
-                    # decide whether this is a single pixel or a multi-pixel particle
-                    if (max_d_over_h*sm_i/pixel_dx<1 and max_d_over_h*sm_i/pixel_dy<1) :
-                        # single pixel, get pixel location
-                        x_pos = int((x_i-x1)/pixel_dx)
-                        y_pos = int((y_i-y1)/pixel_dy)
-
-                        # work out pixel centre
-                        x_pixel = (pixel_dx*<fixed_input_type>(x_pos)+x_start)
-                        y_pixel = (pixel_dy*<fixed_input_type>(y_pos)+y_start)
-
-                        # final bounds check
-                        if x_pos>=0 and x_pos<nx and y_pos>=0 and y_pos<ny :
-                            result[y_pos,x_pos]+=qty_i*get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, (z_i-z_pixel)*use_z, kernel_max_2 ,sm_to_kdim,num_samples,samples_c)
-                    else :
-                        # multi-pixel
-                        x_pix_start = int((x_i-max_d_over_h*sm_i-x1)/pixel_dx)
-                        x_pix_stop =  int((x_i+max_d_over_h*sm_i-x1)/pixel_dx)
-                        y_pix_start = int((y_i-max_d_over_h*sm_i-y1)/pixel_dy)
-                        y_pix_stop =  int((y_i+max_d_over_h*sm_i-y1)/pixel_dy)
-                        if x_pix_start<0 : x_pix_start = 0
-                        if x_pix_stop>nx : x_pix_stop = nx
-                        if y_pix_start<0 : y_pix_start = 0
-                        if y_pix_stop>ny : y_pix_stop = ny
-                        for x_pos in range(x_pix_start, x_pix_stop) :
-                            x_pixel = pixel_dx*<fixed_input_type>(x_pos)+x_start
-                            for y_pos in range(y_pix_start, y_pix_stop) :
-                                y_pixel = pixel_dy*<fixed_input_type>(y_pos)+y_start
-
-                                # could accessing the buffer manually be
-                                # faster? It seems to be FAR faster (x10!) but
-                                # only when using stack-allocated memory for
-                                # c_result, and when writing to memory, not
-                                # also reading (i.e. = instead of +=).  The
-                                # instruction that, according to Instruments,
-                                # holds everything up and disappears is
-                                # cvtss2sd, but it's not clear to me why this
-                                # disappears from the compiled version in the
-                                # instance described above.  Anyway for now, there
-                                # is no advantage to the manual approach -
-
-                                #c_result[x_pos+nx*y_pos]+=qty_i*get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, (z_i-z_pixel)*use_z, kernel_max_2 ,sm_to_kdim,num_samples,samples_c)
-
-                                result[y_pos,x_pos]+=qty_i*get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, (z_i-z_pixel)*use_z, kernel_max_2 ,sm_to_kdim,num_samples,samples_c)
+                    z_i=z[i]; sm_i = sm[i]
+
+                    if get_particle_footprint(&g, x_i, y_i, z_i, sm_i, &fp) :
+                        for c in range(n_channels) :
+                            qty_i[c] = qty[c,i]*mass[i]/rho[i]
+                        add_particle_to_image(result_c, n_channels, &g, &fp,
+                                              fp.x_pix_start, fp.x_pix_stop, fp.y_pix_start, fp.y_pix_stop,
+                                              x_i, y_i, z_i, qty_i, num_samples, samples_c)
+
+    return result
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cdef void render_tile(image_output_type *result, const render_geometry *g,
+                      int tile, int tile_size, int n_tiles_x,
+                      const np.int64_t *items, long n_items, long n_part, long n_wrap_y,
+                      const float *wrap_x, const float *wrap_y,
+                      fused_input_type_1[:] x, fused_input_type_1[:] y, fused_input_type_1[:] z,
+                      fused_input_type_2[:] sm, fused_input_type_3[:, :] qty,
+                      fused_input_type_4[:] mass, fused_input_type_5[:] rho,
+                      int num_samples, image_output_type *samples_c,
+                      fixed_input_type *qty_i) noexcept nogil :
+    """Render the listed (wrap offset, particle) items into the pixels belonging to one tile, using
+    qty_i (which must hold one value per channel) as scratch space"""
+    cdef int tile_x_start = (tile%n_tiles_x)*tile_size
+    cdef int tile_y_start = (tile//n_tiles_x)*tile_size
+    cdef particle_footprint fp
+    cdef int c, n_channels = qty.shape[0]
+    cdef fixed_input_type x_i, y_i, z_i, sm_i
+    cdef long j, i, w
+
+    for j in range(n_items) :
+        i = items[j]%n_part
+        w = items[j]//n_part
+        x_i = x[i]+wrap_x[w//n_wrap_y]; y_i = y[i]+wrap_y[w%n_wrap_y]
+        z_i = z[i]; sm_i = sm[i]
+        # binning only listed accepted items, but checking again lets the compiler see fp is set
+        if not get_particle_footprint(g, x_i, y_i, z_i, sm_i, &fp) :
+            continue
+        for c in range(n_channels) :
+            qty_i[c] = qty[c,i]*mass[i]/rho[i]
+        add_particle_to_image(result, n_channels, g, &fp,
+                              max(fp.x_pix_start, tile_x_start), min(fp.x_pix_stop, tile_x_start+tile_size),
+                              max(fp.y_pix_start, tile_y_start), min(fp.y_pix_stop, tile_y_start+tile_size),
+                              x_i, y_i, z_i, qty_i, num_samples, samples_c)
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def render_image_tiled(int nx, int ny,
+                       np.ndarray[fused_input_type_1,ndim=1] x,
+                       np.ndarray[fused_input_type_1,ndim=1] y,
+                       np.ndarray[fused_input_type_1,ndim=1] z,
+                       np.ndarray[fused_input_type_2,ndim=1] sm,
+                       fixed_input_type x1,fixed_input_type x2,fixed_input_type y1,
+                       fixed_input_type y2,fixed_input_type z_camera, fixed_input_type z0,
+                       np.ndarray[fused_input_type_3,ndim=2] qty,
+                       np.ndarray[fused_input_type_4,ndim=1] mass,
+                       np.ndarray[fused_input_type_5,ndim=1] rho,
+                       fixed_input_type smooth_lo, fixed_input_type smooth_hi,
+                       kernel,
+                       wrap_offsets_x=[0], wrap_offsets_y=[0],
+                       int num_threads=1, int tile_size=64) :
+    """Parallel version of render_image, taking the same arguments plus the number of threads.
+
+    The image is divided into tile_size x tile_size pixel tiles, and the particles are binned by the
+    tiles that their kernels overlap. Each thread then owns whole tiles, so that no two threads ever
+    write to the same pixel. Within a tile, particles are visited in the same order as by render_image,
+    so the result is bitwise identical to the serial render regardless of the number of threads."""
+
+    cdef render_geometry g = get_render_geometry(nx, ny, x1, x2, y1, y2, z_camera, z0,
+                                                 smooth_lo, smooth_hi, kernel)
+    cdef particle_footprint fp
+    cdef long n_part = len(x)
+    cdef fixed_input_type x_i, y_i
+
+    cdef np.ndarray[np.float32_t,ndim=1] wrap_x = np.asarray(wrap_offsets_x, dtype=np.float32)
+    cdef np.ndarray[np.float32_t,ndim=1] wrap_y = np.asarray(wrap_offsets_y, dtype=np.float32)
+    cdef long n_wrap_y = len(wrap_y)
+    cdef long n_items = len(wrap_x)*n_wrap_y*n_part
+
+    cdef int n_tiles_x = (nx+tile_size-1)//tile_size
+    cdef int n_tiles_y = (ny+tile_size-1)//tile_size
+    cdef int n_tiles = n_tiles_x*n_tiles_y
+    cdef int tile, tile_x, tile_y
+
+    cdef np.ndarray[np.int64_t,ndim=1] tile_start = np.zeros(n_tiles+1, dtype=np.int64)
+    cdef np.ndarray[np.int64_t,ndim=1] tile_fill
+    cdef np.ndarray[np.int64_t,ndim=1] tile_items
+    cdef np.int64_t *tile_start_c = <np.int64_t*>tile_start.data
+    cdef np.int64_t *tile_fill_c
+    cdef np.int64_t *tile_items_c
+    cdef long item, i, w
+
+    # typed views are needed to hand the arrays to render_tile without the GIL
+    cdef fused_input_type_1[:] x_view = x, y_view = y, z_view = z
+    cdef fused_input_type_2[:] sm_view = sm
+    cdef fused_input_type_3[:, :] qty_view = qty
+    cdef fused_input_type_4[:] mass_view = mass
+    cdef fused_input_type_5[:] rho_view = rho
+
+    cdef np.ndarray[image_output_type,ndim=1] samples = kernel.get_samples(dtype=np_image_output_type)
+    cdef int num_samples = len(samples)
+    cdef image_output_type* samples_c = <image_output_type*>samples.data
+
+    cdef np.ndarray[image_output_type,ndim=3] result = np.zeros((qty.shape[0],ny,nx),dtype=np_image_output_type)
+    cdef image_output_type* result_c = <image_output_type*>result.data
+
+    assert len(x) == len(y) == len(z) == len(sm) == qty.shape[1] == len(mass) == len(rho), "Inconsistent array lengths passed to render_image_core"
+    assert tile_size>0, "Tile size must be positive"
+
+    # scratch space for each tile's weighted quantities, allocated here rather than by the workers
+    cdef int n_channels = qty.shape[0]
+    cdef np.ndarray[fixed_input_type,ndim=2] qty_i_buf = np.empty((n_tiles, n_channels))
+    cdef fixed_input_type* qty_i_c = <fixed_input_type*>qty_i_buf.data
+
+    # Items are (wrap offset, particle) pairs, numbered in the order that render_image visits them.
+    # Bin them by tile with a counting sort, which keeps each tile's list in that same order.
+    with nogil:
+        for item in range(n_items) :
+            i = item%n_part
+            w = item//n_part
+            x_i = x[i]+wrap_x[w//n_wrap_y]; y_i = y[i]+wrap_y[w%n_wrap_y]
+            if get_particle_footprint(&g, x_i, y_i, z[i], sm[i], &fp) :
+                for tile_y in range(fp.y_pix_start//tile_size, (fp.y_pix_stop-1)//tile_size+1) :
+                    for tile_x in range(fp.x_pix_start//tile_size, (fp.x_pix_stop-1)//tile_size+1) :
+                        tile_start_c[tile_y*n_tiles_x+tile_x+1]+=1
+
+        for tile in range(n_tiles) :
+            tile_start_c[tile+1]+=tile_start_c[tile]
+
+    tile_fill = tile_start[:n_tiles].copy()
+    tile_fill_c = <np.int64_t*>tile_fill.data
+    tile_items = np.empty(tile_start[n_tiles], dtype=np.int64)
+    tile_items_c = <np.int64_t*>tile_items.data
+
+    with nogil:
+        for item in range(n_items) :
+            i = item%n_part
+            w = item//n_part
+            x_i = x[i]+wrap_x[w//n_wrap_y]; y_i = y[i]+wrap_y[w%n_wrap_y]
+            if get_particle_footprint(&g, x_i, y_i, z[i], sm[i], &fp) :
+                for tile_y in range(fp.y_pix_start//tile_size, (fp.y_pix_stop-1)//tile_size+1) :
+                    for tile_x in range(fp.x_pix_start//tile_size, (fp.x_pix_stop-1)//tile_size+1) :
+                        tile = tile_y*n_tiles_x+tile_x
+                        tile_items_c[tile_fill_c[tile]] = item
+                        tile_fill_c[tile]+=1
+
+        for tile in prange(n_tiles, schedule='dynamic', chunksize=1, num_threads=num_threads) :
+            render_tile(result_c, &g, tile, tile_size, n_tiles_x,
+                        &tile_items_c[tile_start_c[tile]], tile_start_c[tile+1]-tile_start_c[tile],
+                        n_part, n_wrap_y, <float*>wrap_x.data, <float*>wrap_y.data,
+                        x_view, y_view, z_view, sm_view, qty_view, mass_view, rho_view,
+                        num_samples, samples_c, &qty_i_c[tile*n_channels])
+
+    return result
+
+
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cdef void render_frame(image_output_type *result, const render_geometry *g,
+                       const fixed_input_type *rotation, const fixed_input_type *centre,
+                       fused_input_type_1[:] x, fused_input_type_1[:] y, fused_input_type_1[:] z,
+                       fused_input_type_2[:] sm, const fixed_input_type *qty_weighted,
+                       int num_samples, image_output_type *samples_c) noexcept nogil :
+    """Render all particles, with positions transformed to rotation.(pos-centre), into one frame"""
+    cdef particle_footprint fp
+    cdef fixed_input_type dx, dy, dz, x_i, y_i, z_i
+    cdef long i
+
+    for i in range(x.shape[0]) :
+        dx = x[i]-centre[0]; dy = y[i]-centre[1]; dz = z[i]-centre[2]
+        x_i = rotation[0]*dx+rotation[1]*dy+rotation[2]*dz
+        y_i = rotation[3]*dx+rotation[4]*dy+rotation[5]*dz
+        z_i = rotation[6]*dx+rotation[7]*dy+rotation[8]*dz
+        if get_particle_footprint(g, x_i, y_i, z_i, sm[i], &fp) :
+            add_particle_to_image(result, 1, g, &fp,
+                                  fp.x_pix_start, fp.x_pix_stop, fp.y_pix_start, fp.y_pix_stop,
+                                  x_i, y_i, z_i, &qty_weighted[i], num_samples, samples_c)
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def render_frames(int nx, int ny,
+                  np.ndarray[fused_input_type_1,ndim=1] x,
+                  np.ndarray[fused_input_type_1,ndim=1] y,
+                  np.ndarray[fused_input_type_1,ndim=1] z,
+                  np.ndarray[fused_input_type_2,ndim=1] sm,
+                  fixed_input_type x1,fixed_input_type x2,fixed_input_type y1,
+                  fixed_input_type y2,fixed_input_type z_camera, fixed_input_type z0,
+                  np.ndarray[fused_input_type_3,ndim=1] qty,
+                  np.ndarray[fused_input_type_4,ndim=1] mass,
+                  np.ndarray[fused_input_type_5,ndim=1] rho,
+                  fixed_input_type smooth_lo, fixed_input_type smooth_hi,
+                  kernel,
+                  np.ndarray[fixed_input_type,ndim=3] rotations,
+                  np.ndarray[fixed_input_type,ndim=2] centres,
+                  int num_threads=1) :
+    """Render a sequence of frames, returning an array of shape (len(rotations), ny, nx).
+
+    Frame k is what render_image would give with the positions transformed to rotations[k].(pos-centres[k]);
+    the remaining arguments are as for render_image. The particle data is prepared once, and whole frames
+    are then shared out between threads."""
+
+    cdef render_geometry g = get_render_geometry(nx, ny, x1, x2, y1, y2, z_camera, z0,
+                                                 smooth_lo, smooth_hi, kernel)
+    cdef long n_part = len(x)
+    cdef int n_frames = rotations.shape[0]
+    cdef int frame
+    cdef long i
+
+    cdef np.ndarray[fixed_input_type,ndim=3] rotations_c = np.ascontiguousarray(rotations)
+    cdef np.ndarray[fixed_input_type,ndim=2] centres_c = np.ascontiguousarray(centres)
+    cdef fixed_input_type *rotations_ptr = <fixed_input_type*>rotations_c.data
+    cdef fixed_input_type *centres_ptr = <fixed_input_type*>centres_c.data
+
+    # typed views are needed to hand the arrays to render_frame without the GIL
+    cdef fused_input_type_1[:] x_view = x, y_view = y, z_view = z
+    cdef fused_input_type_2[:] sm_view = sm
+
+    cdef np.ndarray[fixed_input_type,ndim=1] qty_weighted = np.empty(n_part)
+    cdef fixed_input_type *qty_weighted_c = <fixed_input_type*>qty_weighted.data
+
+    cdef np.ndarray[image_output_type,ndim=1] samples = kernel.get_samples(dtype=np_image_output_type)
+    cdef int num_samples = len(samples)
+    cdef image_output_type* samples_c = <image_output_type*>samples.data
+
+    cdef np.ndarray[image_output_type,ndim=3] result = np.zeros((n_frames,ny,nx),dtype=np_image_output_type)
+    cdef image_output_type* result_c = <image_output_type*>result.data
+
+    assert len(x) == len(y) == len(z) == len(sm) == len(qty) == len(mass) == len(rho), "Inconsistent array lengths passed to render_frames"
+    assert rotations.shape[1] == rotations.shape[2] == centres.shape[1] == 3 and centres.shape[0] == n_frames, "Need a 3x3 rotation and a centre for each frame"
+
+    with nogil:
+        for i in range(n_part) :
+            qty_weighted_c[i] = qty[i]*mass[i]/rho[i]
+
+        for frame in prange(n_frames, schedule='dynamic', chunksize=1, num_threads=num_threads) :
+            render_frame(&result_c[<long>frame*nx*ny], &g, &rotations_ptr[9*frame], &centres_ptr[3*frame],
+                         x_view, y_view, z_view, sm_view, qty_weighted_c, num_samples, samples_c)
 
     return result
 
 
+cdef struct grid_geometry:
+    int nx, ny, nz
+    fixed_input_type x1, x2, y1, y2, z1, z2
+    fixed_input_type pixel_dx, pixel_dy, pixel_dz, x_start, y_start, z_start
+    fixed_input_type smooth_lo, smooth_hi, max_d_over_h
+    int kernel_dim
+
+
+cdef struct grid_footprint:
+    fixed_input_type kernel_max_2
+    image_output_type sm_to_kdim
+    # range of cells touched by the particle, clipped to the grid
+    int x_pix_start, x_pix_stop, y_pix_start, y_pix_stop, z_pix_start, z_pix_stop
+
+
+cdef grid_geometry get_grid_geometry(int nx, int ny, int nz,
+                                     fixed_input_type x1, fixed_input_type x2,
+                                     fixed_input_type y1, fixed_input_type y2,
+                                     fixed_input_type z1, fixed_input_type z2,
+                                     fixed_input_type smooth_lo, fixed_input_type smooth_hi,
+                                     kernel):
+    cdef grid_geometry g
+    g.nx = nx
+    g.ny = ny
+    g.nz = nz
+    g.x1 = x1
+    g.x2 = x2
+    g.y1 = y1
+    g.y2 = y2
+    g.z1 = z1
+    g.z2 = z2
+    g.pixel_dx = (x2-x1)/nx
+    g.pixel_dy = (y2-y1)/ny
+    g.pixel_dz = (z2-z1)/nz
+    g.x_start = x1+g.pixel_dx/2
+    g.y_start = y1+g.pixel_dy/2
+    g.z_start = z1+g.pixel_dz/2
+    g.smooth_lo = smooth_lo
+    g.smooth_hi = smooth_hi
+    g.max_d_over_h = kernel.max_d
+    g.kernel_dim = kernel.h_power
+
+    if g.kernel_dim<3:
+        raise ValueError, \
+          "Cannot render to 3D grid without 3-dimensional kernel or greater"
+    return g
+
+
+@cython.cdivision(True)
+cdef inline bint get_grid_footprint(const grid_geometry *g,
+                                    fixed_input_type x_i, fixed_input_type y_i,
+                                    fixed_input_type z_i, fixed_input_type sm_i,
+                                    grid_footprint *fp) noexcept nogil :
+    """Work out which cells particle i contributes to, returning False if it is not gridded at all"""
+    cdef fixed_input_type max_d_over_h = g.max_d_over_h
+    cdef int x_pos, y_pos, z_pos
+
+    # check particle smoothing is within specified range
+    if sm_i<g.pixel_dx*g.smooth_lo or sm_i>g.pixel_dx*g.smooth_hi :
+        return False
+
+    # check particle is within bounds
+    if not (z_i>g.z1-2*sm_i and z_i<g.z2+2*sm_i \
+            and x_i>g.x1-2*sm_i and x_i<g.x2+2*sm_i \
+            and y_i>g.y1-2*sm_i and y_i<g.y2+2*sm_i) :
+        return False
+
+    # pre-cache sm^kdim and (sm*max_d_over_h)**2; tests showed massive speedups when doing this
+    fp.sm_to_kdim = sm_i*sm_i*sm_i
+    fp.kernel_max_2 = (sm_i*sm_i)*(max_d_over_h*max_d_over_h)
+
+    # decide whether this is a single cell or a multi-cell particle
+    if (max_d_over_h*sm_i/g.pixel_dx<1 and max_d_over_h*sm_i/g.pixel_dy<1) :
+        # single cell, get cell location
+        x_pos = <int>((x_i-g.x1)/g.pixel_dx)
+        y_pos = <int>((y_i-g.y1)/g.pixel_dy)
+        z_pos = <int>((z_i-g.z1)/g.pixel_dz)
+
+        # final bounds check
+        if not (x_pos>=0 and x_pos<g.nx and y_pos>=0 and y_pos<g.ny and z_pos>=0 and z_pos<g.nz) :
+            return False
+        fp.x_pix_start = x_pos
+        fp.x_pix_stop = x_pos+1
+        fp.y_pix_start = y_pos
+        fp.y_pix_stop = y_pos+1
+        fp.z_pix_start = z_pos
+        fp.z_pix_stop = z_pos+1
+    else :
+        # multi-cell
+        fp.x_pix_start = <int>((x_i-max_d_over_h*sm_i-g.x1)/g.pixel_dx)
+        fp.x_pix_stop =  <int>((x_i+max_d_over_h*sm_i-g.x1)/g.pixel_dx)
+        fp.y_pix_start = <int>((y_i-max_d_over_h*sm_i-g.y1)/g.pixel_dy)
+        fp.y_pix_stop =  <int>((y_i+max_d_over_h*sm_i-g.y1)/g.pixel_dy)
+        fp.z_pix_start = <int>((z_i-max_d_over_h*sm_i-g.z1)/g.pixel_dz)
+        fp.z_pix_stop =  <int>((z_i+max_d_over_h*sm_i-g.z1)/g.pixel_dz)
+        if fp.x_pix_start<0 : fp.x_pix_start = 0
+        if fp.x_pix_stop>g.nx : fp.x_pix_stop = g.nx
+        if fp.y_pix_start<0 : fp.y_pix_start = 0
+        if fp.y_pix_stop>g.ny : fp.y_pix_stop = g.ny
+        if fp.z_pix_start<0 : fp.z_pix_start = 0
+        if fp.z_pix_stop>g.nz : fp.z_pix_stop = g.nz
+
+    return fp.x_pix_start<fp.x_pix_stop and fp.y_pix_start<fp.y_pix_stop and fp.z_pix_start<fp.z_pix_stop
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cdef void grid_slab(image_output_type *result, const grid_geometry *g, int x_offset,
+                    int x_lo, int x_hi,
+                    const np.int64_t *items, long n_items, long n_part, long n_wrap_y, long n_wrap_z,
+                    const float *wrap_x, const float *wrap_y, const float *wrap_z,
+                    fused_input_type_1[:] x, fused_input_type_1[:] y, fused_input_type_1[:] z,
+                    fused_input_type_2[:] sm, fused_input_type_3[:] qty,
+                    fused_input_type_4[:] mass, fused_input_type_5[:] rho,
+                    int num_samples, image_output_type *samples_c) noexcept nogil :
+    """Grid the listed (wrap offset, particle) items into the cells with x index in [x_lo, x_hi).
+
+    Cell (x_pos, y_pos, z_pos) is stored at result[((x_pos-x_offset)*ny+y_pos)*nz+z_pos]."""
+    cdef grid_footprint fp
+    cdef fixed_input_type x_i, y_i, z_i, qty_i
+    cdef fixed_input_type x_pixel, y_pixel, z_pixel
+    cdef int x_pos, y_pos, z_pos
+    cdef long j, i, w
+    cdef image_output_type *row
+
+    for j in range(n_items) :
+        i = items[j]%n_part
+        w = items[j]//n_part
+        x_i = x[i]+wrap_x[w//(n_wrap_y*n_wrap_z)]
+        y_i = y[i]+wrap_y[(w//n_wrap_z)%n_wrap_y]
+        z_i = z[i]+wrap_z[w%n_wrap_z]
+        # binning only listed accepted items, but checking again lets the compiler see fp is set
+        if not get_grid_footprint(g, x_i, y_i, z_i, sm[i], &fp) :
+            continue
+        qty_i = qty[i]*mass[i]/rho[i]
+
+        for x_pos in range(max(fp.x_pix_start, x_lo), min(fp.x_pix_stop, x_hi)) :
+            x_pixel = g.pixel_dx*<fixed_input_type>(x_pos)+g.x_start
+            for y_pos in range(fp.y_pix_start, fp.y_pix_stop) :
+                y_pixel = g.pixel_dy*<fixed_input_type>(y_pos)+g.y_start
+                row = &result[(<long>(x_pos-x_offset)*g.ny+y_pos)*g.nz]
+                for z_pos in range(fp.z_pix_start, fp.z_pix_stop) :
+                    z_pixel = g.pixel_dz*<fixed_input_type>(z_pos)+g.z_start
+                    row[z_pos]+=qty_i*get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, z_i-z_pixel,
+                                                     fp.kernel_max_2, fp.sm_to_kdim, num_samples, samples_c)
 
 
 @cython.boundscheck(False)
@@ -286,116 +928,300 @@ def to_3d_grid(int nx, int ny, int nz,
                  np.ndarray[fused_input_type_5,ndim=1] rho,
                  fixed_input_type smooth_lo, fixed_input_type smooth_hi,
                  kernel,
-                 wrap_offsets_x=[0], wrap_offsets_y=[0],wrap_offsets_z=[0]) :
-
-
-
-    cdef fixed_input_type pixel_dx = (x2-x1)/nx
-    cdef fixed_input_type pixel_dy = (y2-y1)/ny
-    cdef fixed_input_type pixel_dz = (z2-z1)/ny
-    cdef fixed_input_type x_start = x1+pixel_dx/2
-    cdef fixed_input_type y_start = y1+pixel_dy/2
-    cdef fixed_input_type z_start = z1+pixel_dz/2
-    cdef int n_part = len(x)
-    cdef int nn=0, i=0
-    cdef fixed_input_type x_i, y_i, z_i, sm_i, qty_i
-    cdef fixed_input_type x_pixel, y_pixel, z_pixel
-    cdef int x_pos, y_pos, z_pos
-    cdef int x_pix_start, x_pix_stop, y_pix_start, y_pix_stop, z_pix_start, z_pix_stop
-
-    cdef int kernel_dim = kernel.h_power
-    cdef fixed_input_type max_d_over_h = kernel.max_d
+                 wrap_offsets_x=[0], wrap_offsets_y=[0],wrap_offsets_z=[0],
+                 int num_threads=1, int x_pix_lo=0, x_pix_hi=None, int slab_width=0) :
+    """Grid the particles onto nx x ny x nz cells spanning x1..x2, y1..y2, z1..z2.
+
+    Only the cells with x index in [x_pix_lo, x_pix_hi) are computed, and these are returned as an
+    array of shape (x_pix_hi-x_pix_lo, ny, nz); by default that is the whole grid. This range is divided
+    into slabs slab_width cells thick (by default, enough for four slabs per thread) and the particles
+    are binned by the slabs that their kernels overlap. Each thread then owns whole slabs, visiting
+    particles in the same order as a serial pass, so the result does not depend on the number of threads."""
+
+    cdef grid_geometry g = get_grid_geometry(nx, ny, nz, x1, x2, y1, y2, z1, z2,
+                                             smooth_lo, smooth_hi, kernel)
+    cdef grid_footprint fp
+    cdef long n_part = len(x)
+    cdef fixed_input_type x_i, y_i, z_i
+
+    cdef np.ndarray[np.float32_t,ndim=1] wrap_x = np.asarray(wrap_offsets_x, dtype=np.float32)
+    cdef np.ndarray[np.float32_t,ndim=1] wrap_y = np.asarray(wrap_offsets_y, dtype=np.float32)
+    cdef np.ndarray[np.float32_t,ndim=1] wrap_z = np.asarray(wrap_offsets_z, dtype=np.float32)
+    cdef long n_wrap_y = len(wrap_y), n_wrap_z = len(wrap_z)
+    cdef long n_items = len(wrap_x)*n_wrap_y*n_wrap_z*n_part
+
+    cdef int x_hi = nx if x_pix_hi is None else x_pix_hi
+    cdef int n_slabs, slab, slab_lo, slab_hi
+    cdef long item, i, w
+
+    # typed views are needed to hand the arrays to grid_slab without the GIL
+    cdef fused_input_type_1[:] x_view = x, y_view = y, z_view = z
+    cdef fused_input_type_2[:] sm_view = sm
+    cdef fused_input_type_3[:] qty_view = qty
+    cdef fused_input_type_4[:] mass_view = mass
+    cdef fused_input_type_5[:] rho_view = rho
 
     cdef np.ndarray[image_output_type,ndim=1] samples = kernel.get_samples(dtype=np_image_output_type)
     cdef int num_samples = len(samples)
     cdef image_output_type* samples_c = <image_output_type*>samples.data
-    cdef image_output_type sm_to_kdim   # minimize casting when same type as output
 
-    cdef fixed_input_type kernel_max_2 # minimize casting when same type as input
+    assert len(x) == len(y) == len(z) == len(sm) == \
+            len(qty) == len(mass) == len(rho), \
+            "Inconsistent array lengths passed to to_3d_grid"
+    assert 0 <= x_pix_lo <= x_hi <= nx, "Requested x range lies outside the grid"
+
+    if slab_width<=0 :
+        slab_width = max(1, (x_hi-x_pix_lo)//(4*num_threads))
+    n_slabs = (x_hi-x_pix_lo+slab_width-1)//slab_width
+
+    cdef np.ndarray[np.int64_t,ndim=1] slab_start = np.zeros(n_slabs+1, dtype=np.int64)
+    cdef np.ndarray[np.int64_t,ndim=1] slab_fill
+    cdef np.ndarray[np.int64_t,ndim=1] slab_items
+    cdef np.int64_t *slab_start_c = <np.int64_t*>slab_start.data
+    cdef np.int64_t *slab_fill_c
+    cdef np.int64_t *slab_items_c
+
+    cdef np.ndarray[image_output_type,ndim=3] result = np.zeros((x_hi-x_pix_lo,ny,nz),dtype=np_image_output_type)
+    cdef image_output_type* result_c = <image_output_type*>result.data
+
+    # Items are (wrap offset, particle) pairs, numbered in the order of a serial pass over the wrap
+    # offsets and then the particles. Bin them by slab with a counting sort, which keeps each slab's
+    # list in that same order.
+    with nogil:
+        for item in range(n_items) :
+            i = item%n_part
+            w = item//n_part
+            x_i = x[i]+wrap_x[w//(n_wrap_y*n_wrap_z)]
+            y_i = y[i]+wrap_y[(w//n_wrap_z)%n_wrap_y]
+            z_i = z[i]+wrap_z[w%n_wrap_z]
+            if get_grid_footprint(&g, x_i, y_i, z_i, sm[i], &fp) :
+                slab_lo = max(fp.x_pix_start, x_pix_lo)
+                slab_hi = min(fp.x_pix_stop, x_hi)
+                if slab_lo<slab_hi :
+                    for slab in range((slab_lo-x_pix_lo)//slab_width, (slab_hi-1-x_pix_lo)//slab_width+1) :
+                        slab_start_c[slab+1]+=1
+
+        for slab in range(n_slabs) :
+            slab_start_c[slab+1]+=slab_start_c[slab]
+
+    slab_fill = slab_start[:n_slabs].copy()
+    slab_fill_c = <np.int64_t*>slab_fill.data
+    slab_items = np.empty(slab_start[n_slabs], dtype=np.int64)
+    slab_items_c = <np.int64_t*>slab_items.data
+
+    with nogil:
+        for item in range(n_items) :
+            i = item%n_part
+            w = item//n_part
+            x_i = x[i]+wrap_x[w//(n_wrap_y*n_wrap_z)]
+            y_i = y[i]+wrap_y[(w//n_wrap_z)%n_wrap_y]
+            z_i = z[i]+wrap_z[w%n_wrap_z]
+            if get_grid_footprint(&g, x_i, y_i, z_i, sm[i], &fp) :
+                slab_lo = max(fp.x_pix_start, x_pix_lo)
+                slab_hi = min(fp.x_pix_stop, x_hi)
+                if slab_lo<slab_hi :
+                    for slab in range((slab_lo-x_pix_lo)//slab_width, (slab_hi-1-x_pix_lo)//slab_width+1) :
+                        slab_items_c[slab_fill_c[slab]] = item
+                        slab_fill_c[slab]+=1
+
+        for slab in prange(n_slabs, schedule='dynamic', chunksize=1, num_threads=num_threads) :
+            grid_slab(result_c, &g, x_pix_lo,
+                      x_pix_lo+slab*slab_width, min(x_pix_lo+(slab+1)*slab_width, x_hi),
+                      &slab_items_c[slab_start_c[slab]], slab_start_c[slab+1]-slab_start_c[slab],
+                      n_part, n_wrap_y, n_wrap_z,
+                      <float*>wrap_x.data, <float*>wrap_y.data, <float*>wrap_z.data,
+                      x_view, y_view, z_view, sm_view, qty_view, mass_view, rho_view,
+                      num_samples, samples_c)
 
-    cdef np.ndarray[image_output_type,ndim=3] result = np.zeros((nx,ny,nz),dtype=np_image_output_type)
+    return result
 
-    cdef int total_ptcls = 0
 
-    cdef int use_z = 1 if kernel_dim>=3 else 0
+@cython.cdivision(True)
+cdef inline double voigt_hjerting(double a, double u) noexcept nogil :
+    """The Voigt-Hjerting function H(a, u), in the approximation of Tepper-Garcia (2006, MNRAS 369, 2025),
+    which is accurate for the small damping parameters a of astrophysical absorption lines"""
+    cdef double u2 = u*u, h0 = cmath.exp(-u2), q
+    if u2<1e-4 :
+        # limit of the expression below, which otherwise loses precision
+        return h0-2*a/cmath.sqrt(cmath.M_PI)
+    q = 1.5/u2
+    return h0-a/(cmath.sqrt(cmath.M_PI)*u2)*(h0*h0*(4*u2*u2+7*u2+4+q)-q-1)
 
-    cdef float wrap_offset_x, wrap_offset_y, wrap_offset_z
 
-    if kernel_dim<3:
-        raise ValueError, \
-          "Cannot render to 3D grid without 3-dimensional kernel or greater"
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cdef void add_line_profile(double *tau, int nvel, double v1, double dvel, double v0, double b,
+                           double damping, double column) noexcept nogil :
+    """Add column times the normalised line profile centred on v0 with Doppler parameter b to tau.
+
+    With no damping, the profile is a Gaussian averaged over each velocity bin; otherwise it is a
+    Voigt profile with damping parameter damping/b, sampled at the bin centres."""
+    cdef int k, k_start, k_stop
+    cdef double erf_lo, erf_hi
+
+    if b<=0 :
+        # unresolved line
+        k = <int>cmath.floor((v0-v1)/dvel)
+        if k>=0 and k<nvel :
+            tau[k]+=column/dvel
+        return
+
+    if damping>0 :
+        for k in range(nvel) :
+            tau[k]+=column*voigt_hjerting(damping/b, (v1+(k+0.5)*dvel-v0)/b)/(cmath.sqrt(cmath.M_PI)*b)
+        return
+
+    # beyond 6b the Gaussian is below 1e-15 of its peak
+    k_start = max(<int>cmath.floor((v0-6*b-v1)/dvel), 0)
+    k_stop = min(<int>cmath.floor((v0+6*b-v1)/dvel)+1, nvel)
+    if k_start>=k_stop :
+        return
+    erf_lo = cmath.erf((v1+k_start*dvel-v0)/b)
+    for k in range(k_start, k_stop) :
+        erf_hi = cmath.erf((v1+(k+1)*dvel-v0)/b)
+        tau[k]+=column*(erf_hi-erf_lo)/(2*dvel)
+        erf_lo = erf_hi
 
-    assert len(x) == len(y) == len(z) == len(sm) == \
-            len(qty) == len(mass) == len(rho), \
-            "Inconsistent array lengths passed to render_image_core"
 
-    for wrap_offset_x in wrap_offsets_x :
-        for wrap_offset_y in wrap_offsets_y :
-            for wrap_offset_z in wrap_offsets_z :
-                with nogil:
-                    for i in range(n_part) :
-                        # load particle details
-                        x_i = x[i]+wrap_offset_x; y_i=y[i]+wrap_offset_y; z_i=z[i]+wrap_offset_z
-                        sm_i = sm[i]
-                        qty_i = qty[i]*mass[i]/rho[i]
-
-                        # check particle smoothing is within specified range
-                        if sm_i<pixel_dx*smooth_lo or sm_i>pixel_dx*smooth_hi : continue
-
-                        total_ptcls+=1
-
-                        # check particle is within bounds
-                        if not (z_i>z1-2*sm_i and z_i<z2+2*sm_i \
-                                and x_i>x1-2*sm_i and x_i<x2+2*sm_i \
-                                and y_i>y1-2*sm_i and y_i<y2+2*sm_i) :
-                            continue
-
-                        # pre-cache sm^kdim and (sm*max_d_over_h)**2; tests showed massive speedups when doing this
-                        if kernel_dim==2 :
-                            sm_to_kdim = sm_i*sm_i
-                        else :
-                            sm_to_kdim = sm_i*sm_i*sm_i
-                            # only 2, 3 supported
-
-                        kernel_max_2 = (sm_i*sm_i)*(max_d_over_h*max_d_over_h)
-
-                        # decide whether this is a single pixel or a multi-pixel particle
-                        if (max_d_over_h*sm_i/pixel_dx<1 and max_d_over_h*sm_i/pixel_dy<1) :
-                            # single pixel, get pixel location
-                            x_pos = int((x_i-x1)/pixel_dx)
-                            y_pos = int((y_i-y1)/pixel_dy)
-                            z_pos = int((z_i-z1)/pixel_dz)
-
-                            # work out pixel centre
-                            x_pixel = (pixel_dx*<fixed_input_type>(x_pos)+x_start)
-                            y_pixel = (pixel_dy*<fixed_input_type>(y_pos)+y_start)
-                            z_pixel = (pixel_dz*<fixed_input_type>(z_pos)+z_start)
-
-                            # final bounds check
-                            if x_pos>=0 and x_pos<nx and y_pos>=0 and y_pos<ny \
-                               and z_pos>=0 and z_pos<nz :
-                                result[x_pos,y_pos,z_pos]+=qty_i*get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, (z_i-z_pixel)*use_z, kernel_max_2 ,sm_to_kdim,num_samples,samples_c)
-                        else :
-                            # multi-pixel
-                            x_pix_start = int((x_i-max_d_over_h*sm_i-x1)/pixel_dx)
-                            x_pix_stop =  int((x_i+max_d_over_h*sm_i-x1)/pixel_dx)
-                            y_pix_start = int((y_i-max_d_over_h*sm_i-y1)/pixel_dy)
-                            y_pix_stop =  int((y_i+max_d_over_h*sm_i-y1)/pixel_dy)
-                            z_pix_start = int((z_i-max_d_over_h*sm_i-z1)/pixel_dz)
-                            z_pix_stop =  int((z_i+max_d_over_h*sm_i-z1)/pixel_dz)
-                            if x_pix_start<0 : x_pix_start = 0
-                            if x_pix_stop>nx : x_pix_stop = nx
-                            if y_pix_start<0 : y_pix_start = 0
-                            if y_pix_stop>ny : y_pix_stop = ny
-                            if z_pix_start<0 : z_pix_start = 0
-                            if z_pix_stop>nz : z_pix_stop = nz
-                            for x_pos in range(x_pix_start, x_pix_stop) :
-                                x_pixel = pixel_dx*<fixed_input_type>(x_pos)+x_start
-                                for y_pos in range(y_pix_start, y_pix_stop) :
-                                    y_pixel = pixel_dy*<fixed_input_type>(y_pos)+y_start
-
-                                    for z_pos in range(z_pix_start,z_pix_stop) :
-                                        z_pixel = pixel_dz*<fixed_input_type>(z_pos)+z_start
-                                        result[x_pos,y_pos,z_pos]+=qty_i*get_kernel_xyz(x_i-x_pixel, y_i-y_pixel, (z_i-z_pixel), kernel_max_2 ,sm_to_kdim,num_samples,samples_c)
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cdef void render_sightline(double *tau, int nvel, double v1, double dvel, double los_x, double los_y,
+                           const np.int64_t *items, long n_items,
+                           fused_input_type_1[:] x, fused_input_type_1[:] y, fused_input_type_1[:] vz,
+                           fused_input_type_2[:] sm, const double *b, const double *column,
+                           double max_d_over_h, double damping,
+                           int num_samples, image_output_type *samples_c) noexcept nogil :
+    """Add the profiles of the listed particles, which may overlap the sightline at (los_x, los_y), to tau"""
+    cdef long j, i
+    cdef double dx, dy, sm_i, weight
+
+    for j in range(n_items) :
+        i = items[j]
+        dx = x[i]-los_x
+        dy = y[i]-los_y
+        sm_i = sm[i]
+        weight = get_kernel(dx*dx+dy*dy, sm_i*sm_i*max_d_over_h*max_d_over_h, sm_i*sm_i, num_samples, samples_c)
+        if weight>0 :
+            add_line_profile(tau, nvel, v1, dvel, vz[i], b[i], damping, column[i]*weight)
 
-    return result
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def render_spectra(np.ndarray[fused_input_type_1,ndim=1] x,
+                   np.ndarray[fused_input_type_1,ndim=1] y,
+                   np.ndarray[fused_input_type_1,ndim=1] vz,
+                   np.ndarray[fused_input_type_2,ndim=1] sm,
+                   np.ndarray[fused_input_type_3,ndim=1] qty,
+                   np.ndarray[fused_input_type_4,ndim=1] mass,
+                   np.ndarray[fused_input_type_5,ndim=1] rho,
+                   np.ndarray[fixed_input_type,ndim=1] b,
+                   np.ndarray[fixed_input_type,ndim=1] los_x,
+                   np.ndarray[fixed_input_type,ndim=1] los_y,
+                   fixed_input_type v1, fixed_input_type v2, int nvel,
+                   fixed_input_type damping, kernel, int num_threads=1) :
+    """Project the particles onto sightlines parallel to the z axis, returning an array of shape
+    (len(los_x), nvel) of the column density per unit velocity in nvel bins spanning v1..v2.
+
+    Each particle contributes its column qty*mass/rho*W(d/sm)/sm^2, for the projected kernel W and the
+    distance d of the sightline, spread over a line profile centred on vz with Doppler parameter b (see
+    add_line_profile; damping is zero for a Gaussian profile, otherwise it is the Voigt damping parameter
+    times b). The particles are binned in a grid of cells covering the sightlines, according to the cells
+    their kernels overlap, and each thread then takes whole sightlines, so the result does not depend on
+    the number of threads."""
+
+    cdef long n_part = len(x), n_los = len(los_x)
+    cdef int max_cells = 1024
+    cdef int n_cells_x, n_cells_y, ix, iy, ix_start, ix_stop, iy_start, iy_stop, cell
+    cdef double los_x_min, los_x_max, los_y_min, los_y_max, cell_dx, cell_dy
+    cdef double max_d_over_h = kernel.max_d, radius, d2
+    cdef long i, j, s
+    cdef double dvel = (v2-v1)/nvel
+
+    cdef np.ndarray[image_output_type,ndim=1] samples = kernel.get_samples(dtype=np_image_output_type)
+    cdef int num_samples = len(samples)
+    cdef image_output_type* samples_c = <image_output_type*>samples.data
+
+    cdef np.ndarray[fixed_input_type,ndim=2] tau = np.zeros((n_los, nvel))
+    cdef fixed_input_type *tau_c = <fixed_input_type*>tau.data
+
+    cdef np.ndarray[fixed_input_type,ndim=1] column_c = np.empty(n_part)
+    cdef fixed_input_type *column = <fixed_input_type*>column_c.data
+    cdef np.ndarray[fixed_input_type,ndim=1] b_contiguous = np.ascontiguousarray(b)
+    cdef fixed_input_type *b_c = <fixed_input_type*>b_contiguous.data
+
+    # typed views are needed to hand the arrays to render_sightline without the GIL
+    cdef fused_input_type_1[:] x_view = x, y_view = y, vz_view = vz
+    cdef fused_input_type_2[:] sm_view = sm
+
+    cdef np.ndarray[np.int64_t,ndim=1] cell_start, cell_fill, cell_items
+    cdef np.ndarray[np.int64_t,ndim=1] los_cell = np.empty(n_los, dtype=np.int64)
+    cdef np.int64_t *los_cell_c = <np.int64_t*>los_cell.data
+    cdef np.int64_t *cell_start_c
+    cdef np.int64_t *cell_fill_c
+    cdef np.int64_t *cell_items_c
+
+    assert len(x) == len(y) == len(vz) == len(sm) == len(qty) == len(mass) == len(rho) == len(b), \
+        "Inconsistent array lengths passed to render_spectra"
+    assert len(los_x) == len(los_y), "Need an x and y coordinate for each sightline"
+    assert kernel.h_power == 2, "Spectra need a projected (2D) kernel"
+
+    if n_los==0 :
+        return tau
+
+    los_x_min, los_x_max = los_x.min(), los_x.max()
+    los_y_min, los_y_max = los_y.min(), los_y.max()
+    n_cells_x = n_cells_y = max(1, min(max_cells, <int>cmath.ceil(cmath.sqrt(n_los))))
+    if los_x_max==los_x_min : n_cells_x = 1
+    if los_y_max==los_y_min : n_cells_y = 1
+    cell_dx = (los_x_max-los_x_min)/n_cells_x if n_cells_x>1 else 1.0
+    cell_dy = (los_y_max-los_y_min)/n_cells_y if n_cells_y>1 else 1.0
+
+    cell_start = np.zeros(n_cells_x*n_cells_y+1, dtype=np.int64)
+    cell_start_c = <np.int64_t*>cell_start.data
+
+    # Bin the particles by the cells that their kernels overlap with a counting sort, which keeps
+    # each cell's list in particle order
+    with nogil:
+        for i in range(n_part) :
+            column[i] = qty[i]*mass[i]/rho[i]
+            radius = max_d_over_h*sm[i]
+            if x[i]+radius<los_x_min or x[i]-radius>los_x_max or y[i]+radius<los_y_min or y[i]-radius>los_y_max :
+                continue
+            for iy in range(max(<int>((y[i]-radius-los_y_min)/cell_dy), 0), min(<int>((y[i]+radius-los_y_min)/cell_dy), n_cells_y-1)+1) :
+                for ix in range(max(<int>((x[i]-radius-los_x_min)/cell_dx), 0), min(<int>((x[i]+radius-los_x_min)/cell_dx), n_cells_x-1)+1) :
+                    cell_start_c[iy*n_cells_x+ix+1]+=1
+
+        for cell in range(n_cells_x*n_cells_y) :
+            cell_start_c[cell+1]+=cell_start_c[cell]
+
+    cell_fill = cell_start[:n_cells_x*n_cells_y].copy()
+    cell_fill_c = <np.int64_t*>cell_fill.data
+    cell_items = np.empty(cell_start[n_cells_x*n_cells_y], dtype=np.int64)
+    cell_items_c = <np.int64_t*>cell_items.data
+
+    with nogil:
+        for i in range(n_part) :
+            radius = max_d_over_h*sm[i]
+            if x[i]+radius<los_x_min or x[i]-radius>los_x_max or y[i]+radius<los_y_min or y[i]-radius>los_y_max :
+                continue
+            for iy in range(max(<int>((y[i]-radius-los_y_min)/cell_dy), 0), min(<int>((y[i]+radius-los_y_min)/cell_dy), n_cells_y-1)+1) :
+                for ix in range(max(<int>((x[i]-radius-los_x_min)/cell_dx), 0), min(<int>((x[i]+radius-los_x_min)/cell_dx), n_cells_x-1)+1) :
+                    cell = iy*n_cells_x+ix
+                    cell_items_c[cell_fill_c[cell]] = i
+                    cell_fill_c[cell]+=1
+
+        for s in range(n_los) :
+            los_cell_c[s] = min(<int>((los_y[s]-los_y_min)/cell_dy), n_cells_y-1)*n_cells_x \
+                            +min(<int>((los_x[s]-los_x_min)/cell_dx), n_cells_x-1)
+
+        for s in prange(n_los, schedule='dynamic', chunksize=16, num_threads=num_threads) :
+            render_sightline(&tau_c[s*nvel], nvel, v1, dvel, los_x[s], los_y[s],
+                             &cell_items_c[cell_start_c[los_cell_c[s]]],
+                             cell_start_c[los_cell_c[s]+1]-cell_start_c[los_cell_c[s]],
+                             x_view, y_view, vz_view, sm_view, b_c, column, max_d_over_h, damping,
+                             num_samples, samples_c)
+
+    return tau
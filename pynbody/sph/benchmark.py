@@ -0,0 +1,154 @@
+"""
+
+sph.benchmark
+=============
+
+Thread-scaling benchmark for the SPH smoothing code.
+
+A synthetic cosmological box is generated by applying the Zel'dovich
+approximation to a uniform grid, so that the particle distribution has
+realistic clustering (and hence realistic load imbalance between threads).
+The smoothing length and density passes are then timed for a range of thread
+counts, with and without the NUMA-aware mode (see the ``numa-aware`` option
+in the ``[sph]`` config section).
+
+Run from the command line, e.g.::
+
+  python -m pynbody.sph.benchmark --grid 128 --threads 1,2,4,8,16,32,64,128
+
+"""
+
+import argparse
+import json
+import sys
+import time
+
+import numpy as np
+
+from .. import config
+from . import kdtree
+
+
+def cosmological_box(grid=64, boxsize=1.0, sigma_displacement=0.5, spectral_index=-2.0, seed=0, dtype=np.float64):
+    """Return positions and masses for a clustered periodic box of grid**3 particles.
+
+    The displacement field is a Gaussian random field with power spectrum P(k) ~ k**spectral_index,
+    normalised so that the rms displacement is *sigma_displacement* grid cells."""
+
+    rng = np.random.default_rng(seed)
+    k = np.fft.fftfreq(grid) * grid
+    kx, ky, kz = np.meshgrid(k, k, k[:grid // 2 + 1], indexing='ij')
+    k2 = kx ** 2 + ky ** 2 + kz ** 2
+    k2[0, 0, 0] = 1.0
+
+    # potential phi_k with <|phi_k|^2> ~ P(k)/k^4; displacement is -grad phi
+    amplitude = np.sqrt(k2 ** (spectral_index / 2) / k2 ** 2)
+    amplitude[0, 0, 0] = 0.0
+    noise = np.fft.rfftn(rng.standard_normal((grid, grid, grid)))
+    phi_k = noise * amplitude
+
+    displacement = np.empty((grid ** 3, 3))
+    for i, ki in enumerate((kx, ky, kz)):
+        displacement[:, i] = np.fft.irfftn(-1j * ki * phi_k, s=(grid, grid, grid)).ravel()
+    displacement *= sigma_displacement / displacement.std()
+
+    q = (np.indices((grid, grid, grid)).reshape(3, -1).T + 0.5)
+    pos = ((q + displacement) % grid) * (boxsize / grid)
+    mass = np.ones(grid ** 3) / grid ** 3
+    return pos.astype(dtype), mass.astype(dtype)
+
+
+def _time_smooth(tree, n_particles, nsmooth, numa, dtype):
+    smooth = np.empty(n_particles, dtype=dtype)
+    rho = np.empty(n_particles, dtype=dtype)
+    tree.set_array_ref('smooth', smooth)
+    tree.set_array_ref('rho', rho)
+
+    start = time.perf_counter()
+    tree.populate('hsm', nsmooth, numa=numa)
+    t_hsm = time.perf_counter() - start
+
+    start = time.perf_counter()
+    tree.populate('rho', nsmooth, numa=numa)
+    t_rho = time.perf_counter() - start
+
+    return t_hsm, t_rho, smooth, rho
+
+
+def run(grid=64, threads=(1, 2, 4, 8), numa_modes=(False, True), nsmooth=None, repeat=1, dtype=np.float64,
+        out=sys.stdout):
+    """Time the hsm and rho passes for each thread count and NUMA mode.
+
+    Returns a list of dictionaries, one per (threads, numa) combination, holding the best wall time over
+    *repeat* runs of each pass along with the speed-up relative to the first entry."""
+
+    if nsmooth is None:
+        nsmooth = config['sph']['smooth-particles']
+
+    pos, mass = cosmological_box(grid, dtype=dtype)
+    n_particles = len(pos)
+
+    start = time.perf_counter()
+    tree = kdtree.KDTree(pos, mass, leafsize=config['sph']['tree-leafsize'], boxsize=1.0)
+    t_build = time.perf_counter() - start
+
+    print(f"# {n_particles} particles, nsmooth={nsmooth}, tree built in {t_build:.3f}s", file=out)
+    print(f"# {'threads':>7s} {'numa':>5s} {'hsm/s':>9s} {'rho/s':>9s} {'speedup':>8s} {'effcy':>6s}", file=out)
+
+    old_threads = config['number_of_threads']
+    results = []
+    reference = None
+    reference_time = None
+    try:
+        for n_threads in threads:
+            config['number_of_threads'] = n_threads
+            for numa in numa_modes:
+                t_hsm = t_rho = np.inf
+                for _ in range(repeat):
+                    this_hsm, this_rho, smooth, rho = _time_smooth(tree, n_particles, nsmooth, numa, dtype)
+                    t_hsm = min(t_hsm, this_hsm)
+                    t_rho = min(t_rho, this_rho)
+
+                # the result must not depend on the threading (beyond float32 rounding of distances)
+                if reference is None:
+                    reference = (smooth, rho)
+                    reference_time = t_hsm + t_rho
+                else:
+                    np.testing.assert_allclose(smooth, reference[0], rtol=1e-5)
+                    np.testing.assert_allclose(rho, reference[1], rtol=1e-5)
+
+                speedup = reference_time / (t_hsm + t_rho)
+                results.append({'threads': n_threads, 'numa': bool(numa), 'hsm': t_hsm, 'rho': t_rho,
+                                'speedup': speedup, 'efficiency': speedup / n_threads})
+                print(f"  {n_threads:7d} {str(bool(numa)):>5s} {t_hsm:9.3f} {t_rho:9.3f} "
+                      f"{speedup:8.2f} {speedup / n_threads:6.2f}", file=out)
+    finally:
+        config['number_of_threads'] = old_threads
+
+    return results
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Thread-scaling benchmark for pynbody SPH smoothing")
+    parser.add_argument("--grid", type=int, default=64, help="particles per side of the synthetic box")
+    parser.add_argument("--threads", type=str, default="1,2,4,8,16,32,64,128",
+                        help="comma-separated list of thread counts")
+    parser.add_argument("--numa", choices=["on", "off", "both"], default="both")
+    parser.add_argument("--nsmooth", type=int, default=None)
+    parser.add_argument("--repeat", type=int, default=1, help="runs per configuration; the fastest is reported")
+    parser.add_argument("--float32", action="store_true", help="use single precision positions and masses")
+    parser.add_argument("--json", type=str, default=None, help="also write the results to this file")
+    args = parser.parse_args(argv)
+
+    numa_modes = {"on": (True,), "off": (False,), "both": (False, True)}[args.numa]
+    threads = [int(t) for t in args.threads.split(",")]
+    results = run(args.grid, threads, numa_modes, args.nsmooth, args.repeat,
+                  np.float32 if args.float32 else np.float64)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,198 @@
+"""
+
+sph.cache
+=========
+
+An opt-in cache of rendered images, for interactive sessions in which the same
+frame is drawn over and over (e.g. while adjusting a colour map or re-running a
+notebook cell).
+
+Switch it on with the ``render-cache`` option in the ``[sph]`` section of your
+configuration. Images are then stored per particle selection (see
+:attr:`~pynbody.snapshot.simsnap.SimSnap._inclusion_hash`), keyed on every
+parameter of :func:`~pynbody.sph.render_image`, the kernel, and the version
+counter (:meth:`~pynbody.snapshot.simsnap.SimSnap._array_version`) and units of
+each array that the render reads. Translations and rotations modify the
+positions in place, as does any other change to an array, so an image is never
+returned once the data it was drawn from has changed.
+
+If ``render-cache-directory`` is set, images are also written there and can be
+found again in later sessions. Version counters start afresh with every session,
+so on-disk images are instead keyed on a digest of the contents of the arrays,
+which is computed once for each version of each array.
+
+"""
+
+import collections
+import functools
+import hashlib
+import inspect
+import os
+import threading
+
+import numpy as np
+
+from .. import array, config_parser, units
+
+# parameters which affect how an image is computed, but not the result
+_ignored_parameters = ['force_quiet', 'threaded']
+
+_local = threading.local()
+
+
+def enabled():
+    return config_parser.getboolean('sph', 'render-cache')
+
+
+def _max_images():
+    return config_parser.getint('sph', 'render-cache-size')
+
+
+def _directory():
+    return config_parser.get('sph', 'render-cache-directory').strip() or None
+
+
+def clear(snap=None, disk=False):
+    """Forget the images held in memory for *snap* (if given) and, if *disk* is True, remove
+    every image in the configured cache directory."""
+    if snap is not None:
+        for v in snap.ancestor._persistent_objects.values():
+            v.pop('_render_cache', None)
+    if disk and _directory() is not None and os.path.isdir(_directory()):
+        for name in os.listdir(_directory()):
+            if name.endswith('.npz'):
+                os.remove(os.path.join(_directory(), name))
+
+
+def _kernel_key(kernel):
+    return (type(kernel).__module__, type(kernel).__qualname__, kernel.h_power, kernel.max_d,
+            _kernel_key(kernel.k_orig) if hasattr(kernel, 'k_orig') else None)
+
+
+def _parameter_key(value):
+    if isinstance(value, units.UnitBase):
+        return str(value)
+    elif hasattr(value, 'h_power') and hasattr(value, 'max_d'):
+        return _kernel_key(value)
+    elif isinstance(value, np.ndarray):
+        return (value.dtype.str, value.shape, value.tobytes(), str(getattr(value, 'units', None)))
+    else:
+        return repr(value)
+
+
+def _array_digest(snap, name):
+    """Digest of the contents of the named array in *snap*, reused for as long as the array is unchanged"""
+    digests = _store(snap)['digests']
+    version = snap._array_version(name)
+    if name not in digests or digests[name][0] != version:
+        ar = np.ascontiguousarray(snap[name])
+        h = hashlib.sha1(repr((ar.dtype.str, ar.shape)).encode())
+        h.update(ar.view(np.uint8).reshape(-1))
+        digests[name] = (version, h.hexdigest())
+    return digests[name][1]
+
+
+def _store(snap):
+    store = snap.ancestor._get_persist(snap._inclusion_hash, '_render_cache')
+    if store is None:
+        store = {'images': collections.OrderedDict(), 'digests': {}}
+        snap.ancestor._set_persist(snap._inclusion_hash, '_render_cache', store)
+    return store
+
+
+def _keys(snap, array_names, parameters, on_disk):
+    """The in-memory and (if *on_disk*) on-disk keys for an image rendered from the named arrays"""
+    array_names = sorted(set(array_names))
+    # fetching each array also derives any which are missing, so that their versions are settled
+    array_units = [str(snap[n].units) for n in array_names]
+    common = (sorted((k, _parameter_key(v)) for k, v in parameters.items()),
+              array_names, array_units, repr(snap.properties.get('boxsize', None)),
+              repr(sorted(snap.conversion_context().items())))
+
+    memory_key = repr((common, [snap._array_version(n) for n in array_names]))
+    if on_disk:
+        disk_key = hashlib.sha1(repr((common, [_array_digest(snap, n) for n in array_names])).encode()).hexdigest()
+    else:
+        disk_key = None
+    return memory_key, disk_key
+
+
+def _lookup(snap, memory_key, disk_key):
+    images = _store(snap)['images']
+    if memory_key in images:
+        images.move_to_end(memory_key)
+        return images[memory_key]
+
+    if disk_key is not None:
+        filename = os.path.join(_directory(), disk_key + ".npz")
+        if os.path.exists(filename):
+            with np.load(filename) as f:
+                im = array.SimArray(f['image'])
+                if str(f['units']):
+                    im.units = units.Unit(str(f['units']))
+            im.sim = snap
+            _remember(snap, memory_key, im)
+            return im
+
+    return None
+
+
+def _remember(snap, memory_key, im):
+    images = _store(snap)['images']
+    images[memory_key] = im
+    while len(images) > _max_images():
+        images.popitem(last=False)
+
+
+def _save(disk_key, im):
+    directory = _directory()
+    os.makedirs(directory, exist_ok=True)
+    filename = os.path.join(directory, disk_key + ".npz")
+    # write then rename, so that another process never reads a partial file
+    tmp_filename = filename + ".%d.tmp" % os.getpid()
+    with open(tmp_filename, 'wb') as f:
+        np.savez(f, image=im.view(np.ndarray), units=str(im.units) if units.has_units(im) else "")
+    os.replace(tmp_filename, filename)
+
+
+def cached_render(render_fn):
+    """Decorator which looks up (and stores) the images made by *render_fn* in the cache, when enabled.
+
+    *render_fn* must take the snapshot as its first argument, along with *qty*, *smooth* and
+    *kernel* parameters. Renders nested inside a cached render (e.g. the flat field used for
+    denoising) are not cached separately."""
+
+    signature = inspect.signature(render_fn)
+
+    @functools.wraps(render_fn)
+    def render_fn_with_cache(snap, *args, **kwargs):
+        if not enabled() or getattr(_local, 'rendering', False):
+            return render_fn(snap, *args, **kwargs)
+
+        parameters = signature.bind(snap, *args, **kwargs)
+        parameters.apply_defaults()
+        parameters = dict(parameters.arguments)
+        del parameters[next(iter(signature.parameters))]
+        for p in _ignored_parameters:
+            parameters.pop(p, None)
+
+        array_names = ['pos', parameters['smooth'], parameters['qty'], 'mass', 'rho']
+        on_disk = _directory() is not None
+
+        memory_key, disk_key = _keys(snap, array_names, parameters, on_disk)
+        im = _lookup(snap, memory_key, disk_key)
+
+        if im is None:
+            _local.rendering = True
+            try:
+                im = render_fn(snap, *args, **kwargs)
+            finally:
+                _local.rendering = False
+
+            _remember(snap, memory_key, im.copy())
+            if on_disk:
+                _save(disk_key, im)
+
+        return im.copy()
+
+    return render_fn_with_cache
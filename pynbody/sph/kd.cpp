@@ -18,11 +18,52 @@ int kdInit(KD *pkd,int nBucket)
 	kd->nBucket = nBucket;
 	kd->p = NULL;
 	kd->kdNodes = NULL;
+	kd->arPos = kdNullArray();
+	kd->arMass = kdNullArray();
+	kd->arSmooth = kdNullArray();
+	kd->arDen = kdNullArray();
+	kd->arQty = kdNullArray();
+	kd->arQtySmoothed = kdNullArray();
+	kd->fNodeSmoothMax = NULL;
 	*pkd = kd;
 	return(1);
 }
 
 
+KDARRAY kdArray(void *data, int ndim, const long *shape, const long *stride)
+{
+	KDARRAY ar;
+	int j;
+
+	assert(ndim==1 || ndim==2);
+	ar.data = (char*)data;
+	ar.ndim = ndim;
+	for (j=0;j<2;++j) {
+		ar.shape[j] = j<ndim ? shape[j] : 1;
+		ar.stride[j] = j<ndim ? stride[j] : 0;
+		}
+	return ar;
+}
+
+bool kdIsContiguous(const KDARRAY &ar, long itemsize, int ncol)
+{
+	// Unset arrays are never accessed, so are compatible with any view
+	if (ar.data==NULL) return true;
+	if (ar.shape[1]!=ncol || ar.stride[0]!=ncol*itemsize) return false;
+	return ncol==1 || ar.stride[1]==itemsize;
+}
+
+KDARRAY kdNullArray()
+{
+	KDARRAY ar;
+	ar.data = NULL;
+	ar.ndim = 0;
+	ar.shape[0] = ar.shape[1] = 0;
+	ar.stride[0] = ar.stride[1] = 0;
+	return ar;
+}
+
+
 void kdCombine(KDN *p1,KDN *p2,KDN *pOut)
 {
 	int j;
@@ -62,6 +103,7 @@ void kdFinish(KD kd)
 {
 	free(kd->p);
 	free(kd->kdNodes);
+	free(kd->fNodeSmoothMax);
 	free(kd);
 }
 
@@ -76,15 +118,15 @@ void kdSelect(KD kd,int d,int k,int l,int r)
 
 	p = kd->p;
 	while (r > l) {
-		v = GET2<T>(kd->pNumpyPos,p[k].iOrder,d);
+		v = GET2<T>(kd->arPos,p[k].iOrder,d);
 		t = p[r];
 		p[r] = p[k];
 		p[k] = t;
 		i = l - 1;
 		j = r;
 		while (1) {
-			while (i < j) if (GET2<T>(kd->pNumpyPos,p[++i].iOrder,d) >= v) break;
-			while (i < j) if (GET2<T>(kd->pNumpyPos,p[--j].iOrder,d) <= v) break;
+			while (i < j) if (GET2<T>(kd->arPos,p[++i].iOrder,d) >= v) break;
+			while (i < j) if (GET2<T>(kd->arPos,p[--j].iOrder,d) <= v) break;
 			t = p[i];
 			p[i] = p[j];
 			p[j] = t;
@@ -117,12 +159,12 @@ void kdUpPass(KD kd,int iCell)
 		l = c[iCell].pLower;
 		u = c[iCell].pUpper;
 		for (j=0;j<3;++j) {
-			c[iCell].bnd.fMin[j] = GET2<T>(kd->pNumpyPos,kd->p[u].iOrder,j);
+			c[iCell].bnd.fMin[j] = GET2<T>(kd->arPos,kd->p[u].iOrder,j);
 			c[iCell].bnd.fMax[j] = c[iCell].bnd.fMin[j];
 			}
 		for (pj=l;pj<u;++pj) {
 			for (j=0;j<3;++j) {
-				rj = GET2<T>(kd->pNumpyPos,kd->p[pj].iOrder,j);
+				rj = GET2<T>(kd->arPos,kd->p[pj].iOrder,j);
 				if (rj < c[iCell].bnd.fMin[j])
 					c[iCell].bnd.fMin[j] = rj;
 				if (rj > c[iCell].bnd.fMax[j])
@@ -152,11 +194,13 @@ void kdBuildTree(KD kd)
 	if (kd->kdNodes != NULL) free(kd->kdNodes);
 	kd->kdNodes = (KDN *)malloc(kd->nNodes*sizeof(KDN));
 	assert(kd->kdNodes != NULL);
+	free(kd->fNodeSmoothMax);
+	kd->fNodeSmoothMax = NULL;
 
 	// Calculate bounds
 	// Initialize with any particle:
 	for (j=0;j<3;++j) {
-		rj = GET2<T>(kd->pNumpyPos,kd->p[0].iOrder,j);
+		rj = GET2<T>(kd->arPos,kd->p[0].iOrder,j);
 		bnd.fMin[j] = rj;
 		bnd.fMax[j] = rj;
 	}
@@ -164,7 +208,7 @@ void kdBuildTree(KD kd)
 	// Expand to enclose all particles:
 	for (i=1;i<kd->nActive;++i) {
 		for (j=0;j<3;++j) {
-			rj = GET2<T>(kd->pNumpyPos,kd->p[i].iOrder,j);
+			rj = GET2<T>(kd->arPos,kd->p[i].iOrder,j);
 			if (bnd.fMin[j] > rj)
 				bnd.fMin[j] = rj;
 			else if (bnd.fMax[j] < rj)
@@ -229,7 +273,7 @@ void kdBuildNode(KD kd, int local_root) {
 			kdSelect<T>(kd,d,m,nodes[i].pLower,nodes[i].pUpper);
 
 			// Note split point based on median particle
-			nodes[i].fSplit = GET2<T>(kd->pNumpyPos,kd->p[m].iOrder,d);
+			nodes[i].fSplit = GET2<T>(kd->arPos,kd->p[m].iOrder,d);
 
 			// Set up lower cell
 			nodes[LOWER(i)].bnd = nodes[i].bnd;
@@ -308,6 +352,158 @@ void kdBuildNode(KD kd, int local_root) {
 }
 
 
+template<typename T>
+float kdNodeSmoothMaxPass(KD kd, const KDARRAY &arSmooth, int iCell)
+{
+	KDN *c = &kd->kdNodes[iCell];
+	float fMax, fLower, fUpper;
+	int pj;
+
+	if (c->iDim != -1) {
+		fLower = kdNodeSmoothMaxPass<T>(kd,arSmooth,LOWER(iCell));
+		fUpper = kdNodeSmoothMaxPass<T>(kd,arSmooth,UPPER(iCell));
+		fMax = fLower > fUpper ? fLower : fUpper;
+		}
+	else {
+		fMax = 0;
+		for (pj=c->pLower;pj<=c->pUpper;++pj) {
+			float h = GET<T>(arSmooth,kd->p[pj].iOrder);
+			if (h > fMax) fMax = h;
+			}
+		}
+	kd->fNodeSmoothMax[iCell] = fMax;
+	return fMax;
+}
+
+template<typename T>
+void kdNodeSmoothMax(KD kd, const KDARRAY &arSmooth)
+{
+	// Store the largest smoothing length in each node, so that whole subtrees
+	// can be culled against a region by kdParticlesInBox
+	if (kd->fNodeSmoothMax == NULL) {
+		kd->fNodeSmoothMax = (float *)malloc(kd->nNodes*sizeof(float));
+		assert(kd->fNodeSmoothMax != NULL);
+		}
+	kdNodeSmoothMaxPass<T>(kd,arSmooth,ROOT);
+}
+
+template<typename T>
+void kdParticlesInBoxNode(KD kd, const KDARRAY &arSmooth, int iCell, const double *fMin,
+						  const double *fMax, const double *fSmoothScale, std::vector<long> &index)
+{
+	KDN *c = &kd->kdNodes[iCell];
+	float fSmooth = kd->fNodeSmoothMax[iCell];
+	bool bInside = true;
+	int j, pj;
+
+	for (j=0;j<3;++j) {
+		double fPad = fSmoothScale[j]*fSmooth;
+		if (c->bnd.fMax[j]+fPad < fMin[j] || c->bnd.fMin[j]-fPad > fMax[j]) return;
+		if (c->bnd.fMin[j] < fMin[j] || c->bnd.fMax[j] > fMax[j]) bInside = false;
+		}
+
+	if (bInside) {
+		// every particle in the node is itself inside the region
+		for (pj=c->pLower;pj<=c->pUpper;++pj) index.push_back(kd->p[pj].iOrder);
+		}
+	else if (c->iDim == -1) {
+		for (pj=c->pLower;pj<=c->pUpper;++pj) {
+			long i = kd->p[pj].iOrder;
+			double h = GET<T>(arSmooth,i);
+			for (j=0;j<3;++j) {
+				double r = GET2<T>(kd->arPos,i,j);
+				if (r+fSmoothScale[j]*h < fMin[j] || r-fSmoothScale[j]*h > fMax[j]) break;
+				}
+			if (j==3) index.push_back(i);
+			}
+		}
+	else {
+		kdParticlesInBoxNode<T>(kd,arSmooth,LOWER(iCell),fMin,fMax,fSmoothScale,index);
+		kdParticlesInBoxNode<T>(kd,arSmooth,UPPER(iCell),fMin,fMax,fSmoothScale,index);
+		}
+}
+
+template<typename T>
+void kdParticlesInBox(KD kd, const KDARRAY &arSmooth, const double *fMin, const double *fMax,
+					  const double *fSmoothScale, std::vector<long> &index)
+{
+	// Append to index the particles i for which, along each axis j, the interval
+	// [x_ij - fSmoothScale[j]*h_i, x_ij + fSmoothScale[j]*h_i] overlaps [fMin[j], fMax[j]].
+	// The region may be infinite along any axis. Needs kdNodeSmoothMax to have been
+	// called with the same smoothing lengths. The node bounds are stored in single
+	// precision, so the region is padded slightly: a few particles just outside it
+	// may be returned, but none inside it are missed.
+	double fMinPadded[3], fMaxPadded[3];
+	int j;
+
+	assert(kd->fNodeSmoothMax != NULL);
+	for (j=0;j<3;++j) {
+		double fSlack = 0;
+		if (isfinite(fMin[j])) fSlack += 1e-5*fabs(fMin[j]);
+		if (isfinite(fMax[j])) fSlack += 1e-5*fabs(fMax[j]);
+		fMinPadded[j] = fMin[j]-fSlack;
+		fMaxPadded[j] = fMax[j]+fSlack;
+		}
+	kdParticlesInBoxNode<T>(kd,arSmooth,ROOT,fMinPadded,fMaxPadded,fSmoothScale,index);
+}
+
+
+template<typename T>
+void kdParticlesInShellNode(KD kd, const KDARRAY &arSmooth, int iCell, const double *fCentre,
+							double fRMin, double fRMax, double fSmoothScale, std::vector<long> &index)
+{
+	KDN *c = &kd->kdNodes[iCell];
+	double fPad = fSmoothScale*kd->fNodeSmoothMax[iCell];
+	double fNear2 = 0, fFar2 = 0;
+	int j, pj;
+
+	// nearest and furthest points of the node's bounding box from the centre
+	for (j=0;j<3;++j) {
+		double lo = c->bnd.fMin[j]-fCentre[j], hi = c->bnd.fMax[j]-fCentre[j];
+		if (lo > 0) fNear2 += lo*lo;
+		else if (hi < 0) fNear2 += hi*hi;
+		fFar2 += fmax(lo*lo,hi*hi);
+		}
+	double fNear = sqrt(fNear2), fFar = sqrt(fFar2);
+	if (fNear-fPad > fRMax || fFar+fPad < fRMin) return;
+
+	if (fNear >= fRMin && fFar <= fRMax) {
+		// every particle in the node is itself inside the shell
+		for (pj=c->pLower;pj<=c->pUpper;++pj) index.push_back(kd->p[pj].iOrder);
+		}
+	else if (c->iDim == -1) {
+		for (pj=c->pLower;pj<=c->pUpper;++pj) {
+			long i = kd->p[pj].iOrder;
+			double h = fSmoothScale*GET<T>(arSmooth,i);
+			double r2 = 0;
+			for (j=0;j<3;++j) {
+				double dx = GET2<T>(kd->arPos,i,j)-fCentre[j];
+				r2 += dx*dx;
+				}
+			double r = sqrt(r2);
+			if (r-h <= fRMax && r+h >= fRMin) index.push_back(i);
+			}
+		}
+	else {
+		kdParticlesInShellNode<T>(kd,arSmooth,LOWER(iCell),fCentre,fRMin,fRMax,fSmoothScale,index);
+		kdParticlesInShellNode<T>(kd,arSmooth,UPPER(iCell),fCentre,fRMin,fRMax,fSmoothScale,index);
+		}
+}
+
+template<typename T>
+void kdParticlesInShell(KD kd, const KDARRAY &arSmooth, const double *fCentre, double fRMin, double fRMax,
+						double fSmoothScale, std::vector<long> &index)
+{
+	// Append to index the particles i for which the sphere of radius fSmoothScale*h_i about the
+	// particle overlaps the spherical shell fRMin <= |x - fCentre| <= fRMax. Needs kdNodeSmoothMax
+	// to have been called with the same smoothing lengths. As for kdParticlesInBox, the shell is
+	// padded slightly to allow for the single precision node bounds.
+	double fSlack = 1e-5*(fabs(fCentre[0])+fabs(fCentre[1])+fabs(fCentre[2])+fabs(fRMax));
+
+	assert(kd->fNodeSmoothMax != NULL);
+	kdParticlesInShellNode<T>(kd,arSmooth,ROOT,fCentre,fRMin-fSlack,fRMax+fSlack,fSmoothScale,index);
+}
+
 // instantiate the actual functions that are available:
 
 template
@@ -341,3 +537,25 @@ void kdBuildNodeRemote<float>(struct KDargs *a);
 
 template
 void kdBuildNode<float>(KD kd, int local_root);
+
+template
+void kdNodeSmoothMax<double>(KD kd, const KDARRAY &arSmooth);
+
+template
+void kdParticlesInBox<double>(KD kd, const KDARRAY &arSmooth, const double *fMin, const double *fMax,
+							  const double *fSmoothScale, std::vector<long> &index);
+
+template
+void kdNodeSmoothMax<float>(KD kd, const KDARRAY &arSmooth);
+
+template
+void kdParticlesInBox<float>(KD kd, const KDARRAY &arSmooth, const double *fMin, const double *fMax,
+							 const double *fSmoothScale, std::vector<long> &index);
+
+template
+void kdParticlesInShell<double>(KD kd, const KDARRAY &arSmooth, const double *fCentre, double fRMin,
+								double fRMax, double fSmoothScale, std::vector<long> &index);
+
+template
+void kdParticlesInShell<float>(KD kd, const KDARRAY &arSmooth, const double *fCentre, double fRMin,
+							   double fRMax, double fSmoothScale, std::vector<long> &index);
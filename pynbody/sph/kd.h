@@ -1,12 +1,14 @@
 #ifndef KD_HINCLUDED
 #define KD_HINCLUDED
 
-#include <Python.h>
-#include <numpy/arrayobject.h>
+#include <stdio.h>
+#include <vector>
 
 #ifdef KDT_THREADING
 #pragma message("KDT_THREADING is ON")
+#ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200112L
+#endif
 #include <pthread.h>
 #endif
 
@@ -37,6 +39,15 @@ typedef struct bndBound {
 	float fMax[3];
 	} BND;
 
+// Non-owning view of a 1D or 2D array of floats or doubles, e.g. the data of
+// a numpy array. Strides are in bytes; data is NULL if the array is not set.
+typedef struct kdArray {
+	char *data;
+	long stride[2];
+	long shape[2];
+	int ndim;
+	} KDARRAY;
+
 typedef struct kdNode {
 	float fSplit;
 	BND bnd;
@@ -59,12 +70,14 @@ typedef struct kdContext {
 	int uMicro;
 
 	int nBitDepth;
-	PyObject *pNumpyPos;  // Nx3 Numpy array of positions
-	PyObject *pNumpyMass; // Nx1 Numpy array of masses
-	PyObject *pNumpySmooth;
-	PyObject *pNumpyDen;  // Nx1 Numpy array of density
-	PyObject *pNumpyQty;  // Nx1 Numpy array of density
-	PyObject *pNumpyQtySmoothed;  // Nx1 Numpy array of density
+	KDARRAY arPos;  // Nx3 array of positions
+	KDARRAY arMass; // N array of masses
+	KDARRAY arSmooth; // N array of smoothing lengths
+	KDARRAY arDen;  // N array of densities
+	KDARRAY arQty;  // N or Nx3 array of the quantity to smooth
+	KDARRAY arQtySmoothed;  // N or Nx3 array for the smoothed result
+
+	float *fNodeSmoothMax; // per-node maximum smoothing length; NULL until kdNodeSmoothMax is called
 	} * KD;
 
 
@@ -179,38 +192,90 @@ void kdCombine(KDN *p1,KDN *p2,KDN *pOut);
 
 
 template<typename T>
-T GET(PyObject *ar, int i) {
-	return *((T*)PyArray_GETPTR1(ar, i));
+void kdNodeSmoothMax(KD, const KDARRAY &arSmooth);
+template<typename T>
+void kdParticlesInBox(KD, const KDARRAY &arSmooth, const double *fMin, const double *fMax,
+					  const double *fSmoothScale, std::vector<long> &index);
+template<typename T>
+void kdParticlesInShell(KD, const KDARRAY &arSmooth, const double *fCentre, double fRMin, double fRMax,
+						double fSmoothScale, std::vector<long> &index);
+
+KDARRAY kdArray(void *data, int ndim, const long *shape, const long *stride);
+KDARRAY kdNullArray();
+
+template<typename T>
+inline T GET(const KDARRAY &ar, int i) {
+	return *((T*)(ar.data + i*ar.stride[0]));
 }
 
 template<typename T>
-T GET2(PyObject *ar, int i, int j) {
-	return *((T*)PyArray_GETPTR2(ar, i, j));
+inline T GET2(const KDARRAY &ar, int i, int j) {
+	return *((T*)(ar.data + i*ar.stride[0] + j*ar.stride[1]));
 }
 
 template<typename T>
-void SET(PyObject *ar, int i, T val) {
-	*((T*)PyArray_GETPTR1(ar, i)) = val;
+inline void SET(const KDARRAY &ar, int i, T val) {
+	*((T*)(ar.data + i*ar.stride[0])) = val;
 }
 
 template<typename T>
-void SET2(PyObject *ar, int i, int j, T val) {
-	*((T*)PyArray_GETPTR2(ar, i,j)) = val;
+inline void SET2(const KDARRAY &ar, int i, int j, T val) {
+	*((T*)(ar.data + i*ar.stride[0] + j*ar.stride[1])) = val;
 }
 
 template<typename T>
-void ACCUM(PyObject *ar, int i, T val) {
-	(*((T*)PyArray_GETPTR1(ar, i))) += val;
+inline void ACCUM(const KDARRAY &ar, int i, T val) {
+	*((T*)(ar.data + i*ar.stride[0])) += val;
 }
 
 template<typename T>
-void ACCUM2(PyObject *ar, int i, int j, T val) {
-	(*((T*)PyArray_GETPTR2(ar, i, j))) += val;
+inline void ACCUM2(const KDARRAY &ar, int i, int j, T val) {
+	*((T*)(ar.data + i*ar.stride[0] + j*ar.stride[1])) += val;
 }
 
 
-#define GETSMOOTH(T, pid) GET<T>(kd->pNumpySmooth, kd->p[pid].iOrder)
-#define SETSMOOTH(T, pid, val) SET<T>(kd->pNumpySmooth, kd->p[pid].iOrder, val)
+// Typed views of a KDARRAY for the inner loops of the smoothing kernels. They
+// are built once per smoothing call, so the data pointer and strides can stay
+// in registers rather than being reloaded from the KD context on every access.
+
+template<typename T>
+struct StridedView {
+	char *data;
+	long stride0, stride1;
+
+	StridedView(const KDARRAY &ar) : data(ar.data), stride0(ar.stride[0]), stride1(ar.stride[1]) { }
+
+	inline T& operator()(long i) const {
+		return *((T*)(data + i*stride0));
+	}
+
+	inline T& operator()(long i, int j) const {
+		return *((T*)(data + i*stride0 + j*stride1));
+	}
+};
+
+// View of a C-contiguous array with NCOL columns (NCOL=1 for 1D arrays).
+// Only valid if kdIsContiguous(ar, sizeof(T), NCOL) is true.
+template<typename T, int NCOL>
+struct ContiguousView {
+	T *data;
+
+	ContiguousView(const KDARRAY &ar) : data((T*)ar.data) { }
+
+	inline T& operator()(long i) const {
+		return data[i*NCOL];
+	}
+
+	inline T& operator()(long i, int j) const {
+		return data[i*NCOL+j];
+	}
+};
+
+bool kdIsContiguous(const KDARRAY &ar, long itemsize, int ncol);
+
+
+#define GETSMOOTH(T, pid) GET<T>(kd->arSmooth, kd->p[pid].iOrder)
+#define SETSMOOTH(T, pid, val) SET<T>(kd->arSmooth, kd->p[pid].iOrder, val)
 
 
 #endif
@@ -0,0 +1,297 @@
+// kd_bench: standalone benchmark for the kd-tree and SPH smoothing core
+// (kd.cpp, smooth.cpp), with no python in the loop. Useful for profiling
+// and for comparing compilers and flags.
+//
+// Build with cmake from the top of the repository:
+//
+//   cmake -S . -B build && cmake --build build
+//   ./build/kd_bench --n 1000000 --threads 8 --dist all
+//
+// For each particle distribution this times the tree build, the smoothing
+// length pass (with both the snake and the dual-tree search), the density
+// pass and a 1D mean-quantity pass, and reports the throughput of each stage
+// in particles per second. The density and mean-quantity passes use the
+// smoothing lengths from the dual-tree search.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <random>
+
+#include "kd.h"
+#include "smooth.h"
+
+struct BenchOptions {
+	long n;
+	int nSmooth;
+	int nBucket;
+	int nThreads;
+	int nRepeat;
+	bool bFloat;
+	bool bNuma;
+	const char *dist;
+	};
+
+/*==========================================================================*/
+/* Particle distributions                                                   */
+/*==========================================================================*/
+
+static void randomDirection(std::mt19937_64 &rng, double r, double *x)
+{
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double cth = 2*uniform(rng)-1;
+	double sth = sqrt(1-cth*cth);
+	double phi = 2*M_PI*uniform(rng);
+	x[0] = r*sth*cos(phi);
+	x[1] = r*sth*sin(phi);
+	x[2] = r*cth;
+}
+
+static double nfwMass(double x)
+{
+	return log(1+x) - x/(1+x);
+}
+
+static void makeParticles(const char *dist, long n, double *pos, unsigned long seed)
+{
+	std::mt19937_64 rng(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	long i;
+
+	if(strcmp(dist,"uniform")==0) {
+		for(i=0;i<3*n;++i) pos[i] = uniform(rng);
+	} else if(strcmp(dist,"plummer")==0) {
+		// unit scale radius; truncate at 99.9% of the mass
+		for(i=0;i<n;++i) {
+			double u = 0.999*uniform(rng) + 1e-12;
+			double r = 1.0/sqrt(pow(u,-2.0/3.0)-1.0);
+			randomDirection(rng, r, &pos[3*i]);
+		}
+	} else if(strcmp(dist,"nfw")==0) {
+		// unit scale radius, concentration 10; invert M(<r) by bisection
+		const double c = 10.0;
+		for(i=0;i<n;++i) {
+			double target = uniform(rng)*nfwMass(c);
+			double lo = 0.0, hi = c;
+			for(int k=0;k<50;++k) {
+				double mid = 0.5*(lo+hi);
+				if(nfwMass(mid)<target) lo = mid;
+				else hi = mid;
+			}
+			randomDirection(rng, 0.5*(lo+hi), &pos[3*i]);
+		}
+	} else {
+		fprintf(stderr, "Unknown distribution %s\n", dist);
+		exit(1);
+	}
+}
+
+/*==========================================================================*/
+/* Driving the smoothing core                                               */
+/*==========================================================================*/
+
+template<typename T>
+struct BenchThreadArgs {
+	SMX smx;
+	int propid;
+	int procid;
+	bool numa;
+	bool ok;
+	};
+
+template<typename T>
+void *benchThread(void *p)
+{
+	BenchThreadArgs<T> *a = (BenchThreadArgs<T>*)p;
+	a->ok = smPopulate<T,T>(a->smx, a->propid, a->procid, false, a->numa, false);
+	return NULL;
+}
+
+template<typename T>
+double runSmoothStage(KD kd, const BenchOptions &opt, int propid)
+{
+	SMX smx;
+	float fPeriod[3] = {1e37f, 1e37f, 1e37f};
+	int nThreads = opt.nThreads;
+	double tStart = smWallTime();
+	bool ok = true;
+
+	if(!smInit(&smx, kd, opt.nSmooth, fPeriod)) {
+		fprintf(stderr, "Unable to create smoothing context\n");
+		exit(1);
+	}
+
+#ifndef KDT_THREADING
+	nThreads = 1;
+#endif
+
+	smSmoothInitStep(smx, nThreads);
+	if(propid==PROPID_HSM)
+		smDomainDecomposition<T>(kd, nThreads);
+
+#ifdef KDT_THREADING
+	pthread_t *threads = (pthread_t*)malloc(nThreads*sizeof(pthread_t));
+	BenchThreadArgs<T> *args = (BenchThreadArgs<T>*)malloc(nThreads*sizeof(BenchThreadArgs<T>));
+	for(int i=0;i<nThreads;++i) {
+		args[i].smx = smx;
+		args[i].propid = propid;
+		args[i].procid = i;
+		args[i].numa = opt.bNuma;
+		pthread_create(&threads[i], NULL, benchThread<T>, &args[i]);
+	}
+	for(int i=0;i<nThreads;++i) {
+		pthread_join(threads[i], NULL);
+		ok = ok && args[i].ok;
+	}
+	free(threads);
+	free(args);
+#else
+	ok = smPopulate<T,T>(smx, propid, 0, false, false, false);
+#endif
+
+	smFinish(smx);
+
+	if(!ok) {
+		fprintf(stderr, "Neighbour buffer overflow in smoothing stage %d\n", propid);
+		exit(1);
+	}
+	return smWallTime()-tStart;
+}
+
+static void report(const BenchOptions &opt, const char *dist, const char *stage, double t)
+{
+	printf("%-8s %10ld %3d %-6s %-9s %10.4f %12.4g\n", dist, opt.n, opt.nThreads,
+		   opt.bFloat ? "float" : "double", stage, t, opt.n/t);
+	fflush(stdout);
+}
+
+template<typename T>
+void benchDistribution(const BenchOptions &opt, const char *dist)
+{
+	long n = opt.n, i;
+	double *pos_d = (double*)malloc(3*n*sizeof(double));
+	T *pos = (T*)malloc(3*n*sizeof(T));
+	T *mass = (T*)malloc(n*sizeof(T));
+	T *smooth = (T*)malloc(n*sizeof(T));
+	T *rho = (T*)malloc(n*sizeof(T));
+	T *qty = (T*)malloc(n*sizeof(T));
+	T *qty_sm = (T*)malloc(n*sizeof(T));
+	assert(pos_d && pos && mass && smooth && rho && qty && qty_sm);
+
+	makeParticles(dist, n, pos_d, 42);
+	for(i=0;i<3*n;++i) pos[i] = pos_d[i];
+	for(i=0;i<n;++i) {
+		mass[i] = 1.0/n;
+		qty[i] = pos_d[3*i];
+	}
+	free(pos_d);
+
+	long shape2[2] = {n, 3}, stride2[2] = {(long)(3*sizeof(T)), (long)sizeof(T)};
+	long shape1[1] = {n}, stride1[1] = {(long)sizeof(T)};
+
+	for(int rep=0; rep<opt.nRepeat; ++rep) {
+		KD kd;
+		double t0;
+
+		kdInit(&kd, opt.nBucket);
+		kd->nParticles = n;
+		kd->nActive = n;
+		kd->nBitDepth = 8*sizeof(T);
+		kd->arPos = kdArray(pos, 2, shape2, stride2);
+		kd->arMass = kdArray(mass, 1, shape1, stride1);
+		kd->arSmooth = kdArray(smooth, 1, shape1, stride1);
+		kd->arDen = kdArray(rho, 1, shape1, stride1);
+		kd->arQty = kdArray(qty, 1, shape1, stride1);
+		kd->arQtySmoothed = kdArray(qty_sm, 1, shape1, stride1);
+
+		t0 = smWallTime();
+		kd->p = (PARTICLE *)malloc(n*sizeof(PARTICLE));
+		assert(kd->p != NULL);
+		for(i=0;i<n;++i) {
+			kd->p[i].iOrder = i;
+			kd->p[i].iMark = 1;
+		}
+		kdBuildTree<T>(kd);
+		report(opt, dist, "build", smWallTime()-t0);
+
+		report(opt, dist, "hsm", runSmoothStage<T>(kd, opt, PROPID_HSM));
+		report(opt, dist, "hsm-dual", runSmoothStage<T>(kd, opt, PROPID_HSM_DUALTREE));
+		report(opt, dist, "rho", runSmoothStage<T>(kd, opt, PROPID_RHO));
+		report(opt, dist, "mean-qty", runSmoothStage<T>(kd, opt, PROPID_QTYMEAN_1D));
+
+		kdFinish(kd);
+	}
+
+	// sanity check on the result of the last repetition
+	double mean_rho = 0;
+	for(i=0;i<n;++i) {
+		if(!(smooth[i]>0) || !(rho[i]>0)) {
+			fprintf(stderr, "Invalid result for particle %ld (smooth=%g, rho=%g)\n", i, (double)smooth[i], (double)rho[i]);
+			exit(1);
+		}
+		mean_rho += rho[i];
+	}
+	fprintf(stderr, "# %s: mean density %g\n", dist, mean_rho/n);
+
+	free(pos);
+	free(mass);
+	free(smooth);
+	free(rho);
+	free(qty);
+	free(qty_sm);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [--n N] [--nsmooth K] [--bucket B] [--threads T] [--repeat R]\n"
+		"          [--dist uniform|plummer|nfw|all] [--float] [--numa]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opt;
+	opt.n = 1000000;
+	opt.nSmooth = 32;
+	opt.nBucket = 16;
+	opt.nThreads = 1;
+	opt.nRepeat = 1;
+	opt.bFloat = false;
+	opt.bNuma = false;
+	opt.dist = "all";
+
+	for(int i=1;i<argc;++i) {
+		bool hasValue = i+1<argc;
+		if(strcmp(argv[i],"--n")==0 && hasValue) opt.n = atol(argv[++i]);
+		else if(strcmp(argv[i],"--nsmooth")==0 && hasValue) opt.nSmooth = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--bucket")==0 && hasValue) opt.nBucket = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--threads")==0 && hasValue) opt.nThreads = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--repeat")==0 && hasValue) opt.nRepeat = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--dist")==0 && hasValue) opt.dist = argv[++i];
+		else if(strcmp(argv[i],"--float")==0) opt.bFloat = true;
+		else if(strcmp(argv[i],"--numa")==0) opt.bNuma = true;
+		else usage(argv[0]);
+	}
+
+	if(opt.n<opt.nSmooth || opt.nThreads<1 || opt.nRepeat<1) usage(argv[0]);
+
+	const char *all[] = {"uniform", "plummer", "nfw"};
+	int nDist = 3;
+	const char **dists = all;
+	if(strcmp(opt.dist,"all")!=0) {
+		dists = &opt.dist;
+		nDist = 1;
+	}
+
+	printf("# %-6s %10s %3s %-6s %-9s %10s %12s\n", "dist", "N", "thr", "type", "stage", "time/s", "particles/s");
+	for(int d=0; d<nDist; ++d) {
+		if(opt.bFloat)
+			benchDistribution<float>(opt, dists[d]);
+		else
+			benchDistribution<double>(opt, dists[d]);
+	}
+	return 0;
+}
@@ -54,6 +54,12 @@ PyObject *domain_decomposition(PyObject *self, PyObject *args);
 PyObject *set_arrayref(PyObject *self, PyObject *args);
 PyObject *get_arrayref(PyObject *self, PyObject *args);
 PyObject *has_threading(PyObject *self, PyObject *args);
+PyObject *get_stats(PyObject *self, PyObject *args);
+PyObject *set_knn_output(PyObject *self, PyObject *args);
+PyObject *smooth_bounds(PyObject *self, PyObject *args);
+PyObject *particles_in_box(PyObject *self, PyObject *args);
+PyObject *particles_in_shell(PyObject *self, PyObject *args);
+PyObject *node_structure(PyObject *self, PyObject *args);
 
 template<typename T>
 int checkArray(PyObject *check, const char *name);
@@ -61,15 +67,33 @@ int checkArray(PyObject *check, const char *name);
 int getBitDepth(PyObject *check);
 
 /*==========================================================================*/
-#define PROPID_HSM      1
-#define PROPID_RHO      2
-#define PROPID_QTYMEAN_1D    3
-#define PROPID_QTYMEAN_ND    4
-#define PROPID_QTYDISP_1D    5
-#define PROPID_QTYDISP_ND    6
-#define PROPID_QTYDIV        7
-#define PROPID_QTYCURL       8
+/* The tree as seen from python: the core context, plus references to the   */
+/* numpy arrays its KDARRAY views point into, keeping them alive.           */
 /*==========================================================================*/
+typedef struct kdPythonContext {
+    KD kd;
+    PyObject *pNumpyPos;  // Nx3 Numpy array of positions
+    PyObject *pNumpyMass; // Nx1 Numpy array of masses
+    PyObject *pNumpySmooth;
+    PyObject *pNumpyDen;  // Nx1 Numpy array of density
+    PyObject *pNumpyQty;  // Nx1 or Nx3 Numpy array of quantity to smooth
+    PyObject *pNumpyQtySmoothed;  // Nx1 or Nx3 Numpy array of smoothed quantity
+} *KDPY;
+
+KDARRAY arrayFromNumpy(PyObject *ar) {
+    long shape[2], stride[2];
+    int ndim = PyArray_NDIM((PyArrayObject*)ar);
+    if(ndim>2) ndim=2;
+    for(int j=0; j<ndim; ++j) {
+        shape[j] = PyArray_DIM((PyArrayObject*)ar, j);
+        stride[j] = PyArray_STRIDE((PyArrayObject*)ar, j);
+    }
+    return kdArray(PyArray_DATA((PyArrayObject*)ar), ndim, shape, stride);
+}
+
+KDPY getPythonContext(PyObject *kdobj) {
+    return (KDPY)PyCapsule_GetPointer(kdobj, NULL);
+}
 
 static PyMethodDef kdmain_methods[] =
 {
@@ -86,6 +110,13 @@ static PyMethodDef kdmain_methods[] =
     {"domain_decomposition", domain_decomposition, METH_VARARGS, "domain_decomposition"},
 
     {"populate",  populate,  METH_VARARGS, "populate"},
+    {"get_stats", get_stats, METH_VARARGS, "get_stats"},
+    {"set_knn_output", set_knn_output, METH_VARARGS, "set_knn_output"},
+
+    {"smooth_bounds", smooth_bounds, METH_VARARGS, "smooth_bounds"},
+    {"particles_in_box", particles_in_box, METH_VARARGS, "particles_in_box"},
+    {"particles_in_shell", particles_in_shell, METH_VARARGS, "particles_in_shell"},
+    {"node_structure", node_structure, METH_VARARGS, "node_structure"},
 
     {"has_threading",  has_threading,  METH_VARARGS, "populate"},
 
@@ -110,7 +141,9 @@ initkdmain(void)
 #endif
 {
   #if PY_MAJOR_VERSION>=3
-    return PyModule_Create(&ourdef);
+    PyObject *module = PyModule_Create(&ourdef);
+    import_array();
+    return module;
   #else
     (void)Py_InitModule("kdmain", kdmain_methods);
   #endif
@@ -158,7 +191,7 @@ PyObject *kdinit(PyObject *self, PyObject *args)
         if(checkArray<float>(mass, "mass")) return NULL;
     }
 
-    KD kd = (KD)malloc(sizeof(*kd));
+    KD kd;
     kdInit(&kd, nBucket);
 
     int nbodies = PyArray_DIM(pos, 0);
@@ -166,12 +199,17 @@ PyObject *kdinit(PyObject *self, PyObject *args)
     kd->nParticles = nbodies;
     kd->nActive = nbodies;
     kd->nBitDepth = bitdepth;
-    kd->pNumpyPos = pos;
-    kd->pNumpyMass = mass;
-    kd->pNumpySmooth = NULL;
-    kd->pNumpyDen = NULL;
-    kd->pNumpyQty = NULL;
-    kd->pNumpyQtySmoothed = NULL;
+    kd->arPos = arrayFromNumpy(pos);
+    kd->arMass = arrayFromNumpy(mass);
+
+    KDPY kdpy = (KDPY)malloc(sizeof(*kdpy));
+    kdpy->kd = kd;
+    kdpy->pNumpyPos = pos;
+    kdpy->pNumpyMass = mass;
+    kdpy->pNumpySmooth = NULL;
+    kdpy->pNumpyDen = NULL;
+    kdpy->pNumpyQty = NULL;
+    kdpy->pNumpyQtySmoothed = NULL;
 
     Py_INCREF(pos);
     Py_INCREF(mass);
@@ -197,7 +235,7 @@ PyObject *kdinit(PyObject *self, PyObject *args)
 
     Py_END_ALLOW_THREADS
 
-    return PyCapsule_New((void *)kd, NULL, NULL);
+    return PyCapsule_New((void *)kdpy, NULL, NULL);
 }
 
 /*==========================================================================*/
@@ -205,18 +243,21 @@ PyObject *kdinit(PyObject *self, PyObject *args)
 /*==========================================================================*/
 PyObject *kdfree(PyObject *self, PyObject *args)
 {
-    KD kd;
+    KDPY kdpy;
     PyObject *kdobj;
 
     PyArg_ParseTuple(args, "O", &kdobj);
-    kd = (KD)PyCapsule_GetPointer(kdobj, NULL);
-
-    kdFinish(kd);
-    Py_XDECREF(kd->pNumpyPos);
-    Py_XDECREF(kd->pNumpyMass);
-    Py_XDECREF(kd->pNumpySmooth);
-    Py_XDECREF(kd->pNumpyDen);
-    return Py_None;
+    kdpy = getPythonContext(kdobj);
+
+    kdFinish(kdpy->kd);
+    Py_XDECREF(kdpy->pNumpyPos);
+    Py_XDECREF(kdpy->pNumpyMass);
+    Py_XDECREF(kdpy->pNumpySmooth);
+    Py_XDECREF(kdpy->pNumpyDen);
+    Py_XDECREF(kdpy->pNumpyQty);
+    Py_XDECREF(kdpy->pNumpyQtySmoothed);
+    free(kdpy);
+    Py_RETURN_NONE;
 }
 
 #define BIGFLOAT ((float)1.0e37)
@@ -238,14 +279,14 @@ PyObject *nn_start(PyObject *self, PyObject *args)
     float period = BIGFLOAT;
 
     PyArg_ParseTuple(args, "Oii|f", &kdobj, &nSmooth, &nProcs, &period);
-    kd = (KD)PyCapsule_GetPointer(kdobj, NULL);
+    kd = getPythonContext(kdobj)->kd;
 
     if(period<=0)
         period = BIGFLOAT;
 
     float fPeriod[3] = {period, period, period};
 
-    if(nSmooth>PyArray_DIM(kd->pNumpyPos,0)) {
+    if(nSmooth>kd->nActive) {
         PyErr_SetString(PyExc_ValueError, "Number of smoothing particles exceeds number of particles in tree");
         return NULL;
     }
@@ -288,7 +329,7 @@ PyObject *nn_next(PyObject *self, PyObject *args)
     PyObject *retList;
 
     PyArg_ParseTuple(args, "OO", &kdobj, &smxobj);
-    kd  = (KD)PyCapsule_GetPointer(kdobj, NULL);
+    kd  = getPythonContext(kdobj)->kd;
     smx = (SMX)PyCapsule_GetPointer(smxobj, NULL);
 
     Py_BEGIN_ALLOW_THREADS
@@ -338,7 +379,7 @@ PyObject *nn_stop(PyObject *self, PyObject *args)
     PyObject *kdobj, *smxobj;
 
     PyArg_ParseTuple(args, "OO", &kdobj, &smxobj);
-    kd  = (KD)PyCapsule_GetPointer(kdobj,NULL);
+    kd  = getPythonContext(kdobj)->kd;
     smx = (SMX)PyCapsule_GetPointer(smxobj,NULL);
 
     smFinish(smx);
@@ -415,6 +456,8 @@ int checkArray(PyObject *check, const char* name) {
 PyObject *set_arrayref(PyObject *self, PyObject *args) {
     int arid;
     PyObject *kdobj, *arobj, **existing;
+    KDARRAY *view;
+    KDPY kdpy;
     KD kd;
 
     const char *name0="smooth";
@@ -426,30 +469,35 @@ PyObject *set_arrayref(PyObject *self, PyObject *args) {
     const char *name;
 
     PyArg_ParseTuple(args, "OiO", &kdobj, &arid, &arobj);
-    kd  = (KD)PyCapsule_GetPointer(kdobj, NULL);
-    if(!kd) return NULL;
-
+    kdpy = getPythonContext(kdobj);
+    if(!kdpy) return NULL;
+    kd = kdpy->kd;
 
 
     switch(arid) {
     case 0:
-        existing = &(kd->pNumpySmooth);
+        existing = &(kdpy->pNumpySmooth);
+        view = &(kd->arSmooth);
         name = name0;
         break;
     case 1:
-        existing = &(kd->pNumpyDen);
+        existing = &(kdpy->pNumpyDen);
+        view = &(kd->arDen);
         name = name1;
         break;
     case 2:
-        existing = &(kd->pNumpyMass);
+        existing = &(kdpy->pNumpyMass);
+        view = &(kd->arMass);
         name = name2;
         break;
     case 3:
-        existing = &(kd->pNumpyQty);
+        existing = &(kdpy->pNumpyQty);
+        view = &(kd->arQty);
         name = name3;
         break;
     case 4:
-        existing = &(kd->pNumpyQtySmoothed);
+        existing = &(kdpy->pNumpyQtySmoothed);
+        view = &(kd->arQtySmoothed);
         name = name4;
         break;
     default:
@@ -475,62 +523,64 @@ PyObject *set_arrayref(PyObject *self, PyObject *args) {
     Py_XDECREF(*existing);
     (*existing) = arobj;
     Py_INCREF(arobj);
-    return Py_None;
+    (*view) = arrayFromNumpy(arobj);
+    Py_RETURN_NONE;
 }
 
 PyObject *get_arrayref(PyObject *self, PyObject *args) {
     int arid;
-    PyObject *kdobj, *arobj, **existing;
-    KD kd;
+    PyObject *kdobj, **existing;
+    KDPY kdpy;
 
     PyArg_ParseTuple(args, "Oi", &kdobj, &arid);
-    kd  = (KD)PyCapsule_GetPointer(kdobj, NULL);
-    if(!kd) return NULL;
+    kdpy = getPythonContext(kdobj);
+    if(!kdpy) return NULL;
 
     switch(arid) {
     case 0:
-        existing = &(kd->pNumpySmooth);
+        existing = &(kdpy->pNumpySmooth);
         break;
     case 1:
-        existing = &(kd->pNumpyDen);
+        existing = &(kdpy->pNumpyDen);
         break;
     case 2:
-        existing = &(kd->pNumpyMass);
+        existing = &(kdpy->pNumpyMass);
         break;
     case 3:
-        existing = &(kd->pNumpyQty);
+        existing = &(kdpy->pNumpyQty);
         break;
     case 4:
-        existing = &(kd->pNumpyQtySmoothed);
+        existing = &(kdpy->pNumpyQtySmoothed);
         break;
     default:
         PyErr_SetString(PyExc_ValueError, "Unknown array to get from KD tree");
         return NULL;
     }
 
-    Py_INCREF(*existing);
-
     if(*existing==NULL)
-        return Py_None;
-    else
-        return (*existing);
+        Py_RETURN_NONE;
+
+    Py_INCREF(*existing);
+    return (*existing);
 
 }
 
 PyObject *domain_decomposition(PyObject *self, PyObject *args) {
     int nproc;
-    PyObject *smxobj;
+    PyObject *kdobj;
+    KDPY kdpy;
     KD kd;
 
-    PyArg_ParseTuple(args, "Oi", &smxobj, &nproc);
+    PyArg_ParseTuple(args, "Oi", &kdobj, &nproc);
 
-    kd  = (KD)PyCapsule_GetPointer(smxobj, NULL);
-    if(!kd) return NULL;
+    kdpy = getPythonContext(kdobj);
+    if(!kdpy) return NULL;
+    kd = kdpy->kd;
 
     if(kd->nBitDepth==32) {
-        if(checkArray<float>(kd->pNumpySmooth, "smooth")) return NULL;
+        if(checkArray<float>(kdpy->pNumpySmooth, "smooth")) return NULL;
     } else {
-        if(checkArray<double>(kd->pNumpySmooth, "smooth")) return NULL;
+        if(checkArray<double>(kdpy->pNumpySmooth, "smooth")) return NULL;
     }
 
     if(nproc<0) {
@@ -543,139 +593,48 @@ PyObject *domain_decomposition(PyObject *self, PyObject *args) {
     else
         smDomainDecomposition<double>(kd,nproc);
 
-    return Py_None;
+    Py_RETURN_NONE;
 }
 
 template<typename Tf, typename Tq>
 PyObject *typed_populate(PyObject *self, PyObject *args)
 {
-
-    long i,nCnt;
     long procid;
-    KD kd;
-    SMX smx_global, smx_local;
+    KDPY kdpy;
+    SMX smx_global;
     int propid;
-    float ri[3];
-    float hsm;
     int Wendland;
-
-    void (*pSmFn)(SMX ,int ,int ,int *,float *, bool)=NULL;
+    int numa = 0, stats = 0;
+    bool ok;
 
     PyObject *kdobj, *smxobj;
 
-    PyArg_ParseTuple(args, "OOiii", &kdobj, &smxobj, &propid, &procid, &Wendland);
-    kd  = (KD)PyCapsule_GetPointer(kdobj, NULL);
+    PyArg_ParseTuple(args, "OOiii|ii", &kdobj, &smxobj, &propid, &procid, &Wendland, &numa, &stats);
+    kdpy = getPythonContext(kdobj);
     smx_global = (SMX)PyCapsule_GetPointer(smxobj, NULL);
-    #define BIGFLOAT ((float)1.0e37)
 
-    long nbodies = PyArray_DIM(kd->pNumpyPos, 0);
+    bool neighboursOnly = propid==PROPID_HSM || propid==PROPID_HSM_DUALTREE || propid==PROPID_KNN;
 
-
-    if (checkArray<Tf>(kd->pNumpySmooth,"smooth")) return NULL;
-    if(propid>PROPID_HSM) {
-      if (checkArray<Tf>(kd->pNumpyDen,"rho")) return NULL;
-      if (checkArray<Tf>(kd->pNumpyMass,"mass")) return NULL;
+    if (checkArray<Tf>(kdpy->pNumpySmooth,"smooth")) return NULL;
+    if(!neighboursOnly) {
+      if (checkArray<Tf>(kdpy->pNumpyDen,"rho")) return NULL;
+      if (checkArray<Tf>(kdpy->pNumpyMass,"mass")) return NULL;
     }
-    if(propid>PROPID_RHO) {
-        if (checkArray<Tq>(kd->pNumpyQty,"qty")) return NULL;
-        if (checkArray<Tq>(kd->pNumpyQtySmoothed,"qty_sm")) return NULL;
+    if(!neighboursOnly && propid>PROPID_RHO) {
+        if (checkArray<Tq>(kdpy->pNumpyQty,"qty")) return NULL;
+        if (checkArray<Tq>(kdpy->pNumpyQtySmoothed,"qty_sm")) return NULL;
     }
 
-#ifdef KDT_THREADING
-    smx_local = smInitThreadLocalCopy(smx_global);
-    smx_local->warnings=false;
-    smx_local->pi = 0;
-#else
-    smx_global = smx_local;
-#endif
-
-    smx_global->warnings=false;
-
-    int total_particles=0;
-
+    Py_BEGIN_ALLOW_THREADS
+    ok = smPopulate<Tf,Tq>(smx_global, propid, procid, Wendland, numa, stats);
+    Py_END_ALLOW_THREADS
 
-    switch(propid)
-    {
-        case PROPID_RHO:
-            pSmFn = &smDensity<Tf>;
-            break;
-        case PROPID_QTYMEAN_ND:
-            pSmFn = &smMeanQtyND<Tf,Tq>;
-            break;
-        case PROPID_QTYDISP_ND:
-            pSmFn = &smDispQtyND<Tf,Tq>;
-            break;
-        case PROPID_QTYMEAN_1D:
-            pSmFn = &smMeanQty1D<Tf,Tq>;
-            break;
-        case PROPID_QTYDISP_1D:
-            pSmFn = &smDispQty1D<Tf,Tq>;
-            break;
-        case PROPID_QTYDIV:
-            pSmFn = &smDivQty<Tf,Tq>;
-            break;
-        case PROPID_QTYCURL:
-            pSmFn = &smCurlQty<Tf,Tq>;
-            break;
+    if(!ok) {
+        PyErr_SetString(PyExc_RuntimeError,"Buffer overflow in smoothing operation. This probably means that your smoothing lengths are too large compared to the number of neighbours you specified.");
+        return NULL;
     }
 
-
-    if(propid==PROPID_HSM)
-    {
-          Py_BEGIN_ALLOW_THREADS
-            for (i=0; i < nbodies; i++)
-              {
-                nCnt = smSmoothStep<Tf>(smx_local, procid);
-                if(nCnt==-1)
-                  break; // nothing more to do
-                total_particles+=1;
-              }
-          Py_END_ALLOW_THREADS
-
-    } else {
-
-      i=smGetNext(smx_local);
-
-      Py_BEGIN_ALLOW_THREADS
-      while(i<nbodies)
-        {
-            // make a copy of the position of this particle
-            for(int j=0; j<3; ++j) {
-              ri[j] = GET2<Tf>(kd->pNumpyPos,kd->p[i].iOrder,j);
-            }
-
-            // retrieve the existing smoothing length
-            hsm = GETSMOOTH(Tf,i);
-
-            // use it to get nearest neighbours
-            nCnt = smBallGather<Tf>(smx_local,4*hsm*hsm,ri);
-
-            // calculate the density
-            (*pSmFn)(smx_local, i, nCnt, smx_local->pList,smx_local->fList, Wendland);
-
-            // select next particle in coordination with other threads
-            i=smGetNext(smx_local);
-
-            if(smx_global->warnings)
-                break;
-        }
-      Py_END_ALLOW_THREADS
-  }
-
-
-  if(smx_local->warnings) {
-#ifdef KDT_THREADING
-    smFinishThreadLocalCopy(smx_local);
-#endif
-    PyErr_SetString(PyExc_RuntimeError,"Buffer overflow in smoothing operation. This probably means that your smoothing lengths are too large compared to the number of neighbours you specified.");
-    return NULL;
-  } else {
-#ifdef KDT_THREADING
-    smFinishThreadLocalCopy(smx_local);
-#endif
-    return Py_None;
-  }
-
+    Py_RETURN_NONE;
 }
 
 PyObject *populate(PyObject *self, PyObject *args)
@@ -683,20 +642,20 @@ PyObject *populate(PyObject *self, PyObject *args)
     // this is really a shell function that works out what
     // template parameters to adopt
 
-    KD kd;
+    KDPY kdpy;
     PyObject *kdobj, *smxobj;
     int propid, procid, nF, nQ;
-    int Wendland;
+    int Wendland, numa=0, stats=0;
 
-    PyArg_ParseTuple(args, "OOiii", &kdobj, &smxobj, &propid, &procid, &Wendland);
-    kd  = (KD)PyCapsule_GetPointer(kdobj, NULL);
+    PyArg_ParseTuple(args, "OOiii|ii", &kdobj, &smxobj, &propid, &procid, &Wendland, &numa, &stats);
+    kdpy = getPythonContext(kdobj);
 
 
-    nF = kd->nBitDepth;
+    nF = kdpy->kd->nBitDepth;
     nQ = 32;
 
-    if(kd->pNumpyQty!=NULL) {
-        nQ=getBitDepth(kd->pNumpyQty);
+    if(kdpy->pNumpyQty!=NULL) {
+        nQ=getBitDepth(kdpy->pNumpyQty);
     }
 
     if(nF==64 && nQ==64)
@@ -712,3 +671,247 @@ PyObject *populate(PyObject *self, PyObject *args)
         return NULL;
     }
 }
+
+/*==========================================================================*/
+/* set_knn_output                                                           */
+/*==========================================================================*/
+PyObject *set_knn_output(PyObject *self, PyObject *args)
+{
+    // Give the smoothing context the arrays that a PROPID_KNN populate call
+    // fills: C-contiguous (N, nSmooth) arrays of int64 indices and float32
+    // distances. The caller must keep them alive until populate returns.
+    PyObject *smxobj;
+    PyArrayObject *index, *dist;
+    SMX smx;
+
+    if(!PyArg_ParseTuple(args, "OO!O!", &smxobj, &PyArray_Type, &index, &PyArray_Type, &dist))
+        return NULL;
+    smx = (SMX)PyCapsule_GetPointer(smxobj, NULL);
+    if(!smx) return NULL;
+
+    if(PyArray_TYPE(index)!=NPY_INT64 || PyArray_TYPE(dist)!=NPY_FLOAT32 || sizeof(long)!=8) {
+        PyErr_SetString(PyExc_TypeError, "Neighbour index and distance arrays must be int64 and float32");
+        return NULL;
+    }
+
+    PyArrayObject *arrays[2] = {index, dist};
+    for(PyArrayObject *ar : arrays) {
+        if(PyArray_NDIM(ar)!=2 || PyArray_DIM(ar,0)!=smx->kd->nActive || PyArray_DIM(ar,1)!=smx->nSmooth ||
+           !PyArray_IS_C_CONTIGUOUS(ar)) {
+            PyErr_SetString(PyExc_ValueError, "Neighbour arrays must be C-contiguous with shape (N, nn)");
+            return NULL;
+        }
+    }
+
+    smx->pKnnIndex = (long*)PyArray_DATA(index);
+    smx->pKnnDist = (float*)PyArray_DATA(dist);
+
+    Py_RETURN_NONE;
+}
+
+/*==========================================================================*/
+/* get_stats                                                                */
+/*==========================================================================*/
+PyObject *get_stats(PyObject *self, PyObject *args)
+{
+    // Return the per-thread counters recorded by the last populate call(s)
+    // with stats enabled, as a dictionary of lists indexed by thread
+    PyObject *smxobj;
+    SMX smx;
+
+    if(!PyArg_ParseTuple(args, "O", &smxobj))
+        return NULL;
+    smx = (SMX)PyCapsule_GetPointer(smxobj, NULL);
+    if(!smx) return NULL;
+
+    int n = smx->nThreadStats;
+    const char *names[] = {"nodes_opened", "buckets_scanned", "distance_evaluations", "queue_replacements",
+                           "snake_restarts", "snake_continuations", "work_units", "particles",
+                           "time_setup", "time_search", "time_kernel", "time_total"};
+    const int nNames = sizeof(names)/sizeof(names[0]);
+
+    PyObject *result = PyDict_New();
+    for(int k=0; k<nNames; ++k) {
+        PyObject *values = PyList_New(n);
+        for(int i=0; i<n; ++i) {
+            SMSTATS *st = &smx->pThreadStats[i];
+            PyObject *val;
+            switch(k) {
+                case 0: val = PyLong_FromLong(st->nNodesOpened); break;
+                case 1: val = PyLong_FromLong(st->nBucketsScanned); break;
+                case 2: val = PyLong_FromLong(st->nDistanceEvals); break;
+                case 3: val = PyLong_FromLong(st->nQueueReplacements); break;
+                case 4: val = PyLong_FromLong(st->nSnakeRestarts); break;
+                case 5: val = PyLong_FromLong(st->nSnakeContinuations); break;
+                case 6: val = PyLong_FromLong(st->nWorkUnits); break;
+                case 7: val = PyLong_FromLong(st->nParticles); break;
+                case 8: val = PyFloat_FromDouble(st->tSetup); break;
+                case 9: val = PyFloat_FromDouble(st->tSearch); break;
+                case 10: val = PyFloat_FromDouble(st->tKernel); break;
+                default: val = PyFloat_FromDouble(st->tTotal); break;
+            }
+            PyList_SetItem(values, i, val);
+        }
+        PyDict_SetItemString(result, names[k], values);
+        Py_DECREF(values);
+    }
+    return result;
+}
+
+/*==========================================================================*/
+/* smooth_bounds, particles_in_box                                          */
+/*==========================================================================*/
+int checkSmoothArray(KD kd, PyObject *smooth)
+{
+    if(!PyArray_Check(smooth) || PyArray_NDIM((PyArrayObject*)smooth)!=1 ||
+       PyArray_DIM((PyArrayObject*)smooth,0)!=kd->nParticles) {
+        PyErr_SetString(PyExc_ValueError, "Smoothing array must be 1D with one entry per particle in the tree");
+        return 1;
+    }
+    if(kd->nBitDepth==64)
+        return checkArray<double>(smooth, "smooth");
+    else
+        return checkArray<float>(smooth, "smooth");
+}
+
+PyObject *smooth_bounds(PyObject *self, PyObject *args)
+{
+    // Record the maximum smoothing length within each tree node, for later
+    // calls to particles_in_box with the same smoothing array
+    PyObject *kdobj, *smooth;
+    KD kd;
+
+    if(!PyArg_ParseTuple(args, "OO", &kdobj, &smooth))
+        return NULL;
+    kd = getPythonContext(kdobj)->kd;
+    if(checkSmoothArray(kd, smooth)) return NULL;
+
+    KDARRAY arSmooth = arrayFromNumpy(smooth);
+
+    Py_BEGIN_ALLOW_THREADS
+    if(kd->nBitDepth==64)
+        kdNodeSmoothMax<double>(kd, arSmooth);
+    else
+        kdNodeSmoothMax<float>(kd, arSmooth);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+PyObject *particles_in_box(PyObject *self, PyObject *args)
+{
+    // Return an int64 array of the (unsorted) indices of particles whose
+    // smoothing region, scaled along each axis by smooth_scale, overlaps the box
+    PyObject *kdobj, *smooth;
+    double fMin[3], fMax[3], fScale[3];
+    KD kd;
+
+    if(!PyArg_ParseTuple(args, "OO(ddd)(ddd)(ddd)", &kdobj, &smooth, &fMin[0], &fMin[1], &fMin[2],
+                         &fMax[0], &fMax[1], &fMax[2], &fScale[0], &fScale[1], &fScale[2]))
+        return NULL;
+    kd = getPythonContext(kdobj)->kd;
+    if(checkSmoothArray(kd, smooth)) return NULL;
+    if(kd->fNodeSmoothMax==NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "smooth_bounds must be called before particles_in_box");
+        return NULL;
+    }
+
+    KDARRAY arSmooth = arrayFromNumpy(smooth);
+    std::vector<long> index;
+
+    Py_BEGIN_ALLOW_THREADS
+    if(kd->nBitDepth==64)
+        kdParticlesInBox<double>(kd, arSmooth, fMin, fMax, fScale, index);
+    else
+        kdParticlesInBox<float>(kd, arSmooth, fMin, fMax, fScale, index);
+    Py_END_ALLOW_THREADS
+
+    npy_intp n = index.size();
+    PyObject *result = PyArray_SimpleNew(1, &n, NPY_INT64);
+    if(!result) return NULL;
+    for(npy_intp i=0; i<n; ++i)
+        ((npy_int64*)PyArray_DATA((PyArrayObject*)result))[i] = index[i];
+    return result;
+}
+
+PyObject *particles_in_shell(PyObject *self, PyObject *args)
+{
+    // Return an int64 array of the (unsorted) indices of particles whose
+    // smoothing sphere, scaled by smooth_scale, overlaps the shell r_min..r_max
+    // about the centre
+    PyObject *kdobj, *smooth;
+    double fCentre[3], fRMin, fRMax, fScale;
+    KD kd;
+
+    if(!PyArg_ParseTuple(args, "OO(ddd)ddd", &kdobj, &smooth, &fCentre[0], &fCentre[1], &fCentre[2],
+                         &fRMin, &fRMax, &fScale))
+        return NULL;
+    kd = getPythonContext(kdobj)->kd;
+    if(checkSmoothArray(kd, smooth)) return NULL;
+    if(kd->fNodeSmoothMax==NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "smooth_bounds must be called before particles_in_shell");
+        return NULL;
+    }
+
+    KDARRAY arSmooth = arrayFromNumpy(smooth);
+    std::vector<long> index;
+
+    Py_BEGIN_ALLOW_THREADS
+    if(kd->nBitDepth==64)
+        kdParticlesInShell<double>(kd, arSmooth, fCentre, fRMin, fRMax, fScale, index);
+    else
+        kdParticlesInShell<float>(kd, arSmooth, fCentre, fRMin, fRMax, fScale, index);
+    Py_END_ALLOW_THREADS
+
+    npy_intp n = index.size();
+    PyObject *result = PyArray_SimpleNew(1, &n, NPY_INT64);
+    if(!result) return NULL;
+    for(npy_intp i=0; i<n; ++i)
+        ((npy_int64*)PyArray_DATA((PyArrayObject*)result))[i] = index[i];
+    return result;
+}
+
+/*==========================================================================*/
+/* node_structure                                                           */
+/*==========================================================================*/
+PyObject *node_structure(PyObject *self, PyObject *args)
+{
+    // Return (order, lower, upper, bound_min, bound_max) describing the tree.
+    // order[i] is the index of the i-th particle in tree order; node k (numbered
+    // from ROOT=1, with children 2k and 2k+1) owns order[lower[k]:upper[k]+1]
+    // and has bounding box bound_min[k]..bound_max[k]. Entry 0 is unused.
+    PyObject *kdobj;
+    KD kd;
+
+    if(!PyArg_ParseTuple(args, "O", &kdobj))
+        return NULL;
+    kd = getPythonContext(kdobj)->kd;
+
+    npy_intp n = kd->nActive, nNodes = kd->nNodes, bndShape[2] = {kd->nNodes, 3};
+    PyArrayObject *order = (PyArrayObject*)PyArray_SimpleNew(1, &n, NPY_INT64);
+    PyArrayObject *lower = (PyArrayObject*)PyArray_SimpleNew(1, &nNodes, NPY_INT64);
+    PyArrayObject *upper = (PyArrayObject*)PyArray_SimpleNew(1, &nNodes, NPY_INT64);
+    PyArrayObject *bndMin = (PyArrayObject*)PyArray_SimpleNew(2, bndShape, NPY_FLOAT32);
+    PyArrayObject *bndMax = (PyArrayObject*)PyArray_SimpleNew(2, bndShape, NPY_FLOAT32);
+    if(!order || !lower || !upper || !bndMin || !bndMax) {
+        Py_XDECREF(order); Py_XDECREF(lower); Py_XDECREF(upper);
+        Py_XDECREF(bndMin); Py_XDECREF(bndMax);
+        return NULL;
+    }
+
+    for(npy_intp i=0; i<n; ++i)
+        ((npy_int64*)PyArray_DATA(order))[i] = kd->p[i].iOrder;
+
+    for(npy_intp k=0; k<nNodes; ++k) {
+        KDN *node = &kd->kdNodes[k];
+        bool used = k>=ROOT;
+        ((npy_int64*)PyArray_DATA(lower))[k] = used ? node->pLower : 0;
+        ((npy_int64*)PyArray_DATA(upper))[k] = used ? node->pUpper : -1;
+        for(int j=0; j<3; ++j) {
+            ((float*)PyArray_DATA(bndMin))[3*k+j] = used ? node->bnd.fMin[j] : 0.f;
+            ((float*)PyArray_DATA(bndMax))[3*k+j] = used ? node->bnd.fMax[j] : 0.f;
+        }
+    }
+
+    return Py_BuildValue("NNNNN", order, lower, upper, bndMin, bndMax);
+}
@@ -12,7 +12,7 @@ import warnings
 
 import numpy as np
 
-from .. import array as ar, config
+from .. import array as ar, config, config_parser
 from . import kdmain
 
 logger = logging.getLogger("pynbody.sph.kdtree")
@@ -29,6 +29,8 @@ class KDTree:
     PROPID_QTYDISP_ND = 6
     PROPID_QTYDIV  = 7
     PROPID_QTYCURL = 8
+    PROPID_HSM_DUALTREE = 9
+    PROPID_KNN = 10
 
     def __init__(self, pos, mass, leafsize=32, boxsize=None):
         """
@@ -49,6 +51,8 @@ class KDTree:
         self._pos = pos
         self.s_len = len(pos)
         self.flags = {"WRITEABLE": False}
+        self._smooth_bounds_key = None
+        self._derived_objects = {}
 
     def nn(self, nn=None):
         """Generator of neighbour list.
@@ -126,6 +130,8 @@ class KDTree:
     def smooth_operation_to_id(self, name):
         if name == "hsm":
             return self.PROPID_HSM
+        elif name == "knn":
+            return self.PROPID_KNN
         elif name == "rho":
             return self.PROPID_RHO
         elif name == "qty_mean":
@@ -157,7 +163,117 @@ class KDTree:
         else:
             raise ValueError("Unknown smoothing request %s" % name)
 
-    def populate(self, mode, nn, kernel = 'CubicSpline'):
+    def knn(self, nn=None, kernel='CubicSpline', numa=None):
+        """Find the *nn* nearest neighbours of every particle, using the dual-tree search.
+
+        The neighbours of each particle include the particle itself. As a side effect, the smoothing lengths
+        (half the distance to the furthest of the neighbours) are written to the tree's 'smooth' array, which
+        is created if it has not been set.
+
+        Returns
+        -------
+        dist : numpy.ndarray
+            (N, nn) float32 array of distances, in increasing order along each row.
+        index : numpy.ndarray
+            (N, nn) int64 array of the corresponding particle indices.
+        """
+        if nn is None:
+            nn = 64
+        if self.get_array_ref("smooth") is None:
+            self.set_array_ref("smooth", np.empty(self.s_len, dtype=self._pos.dtype))
+        index = np.empty((self.s_len, nn), dtype=np.int64)
+        dist = np.empty((self.s_len, nn), dtype=np.float32)
+        self._populate(self.PROPID_KNN, nn, kernel, numa, False, (index, dist))
+        return dist, index
+
+    def particles_in_box(self, smooth, fmin, fmax, smooth_scale, smooth_name=None):
+        """Find the particles whose smoothing region overlaps a box, culling whole subtrees at a time.
+
+        Particle i is selected if, along each axis j, the interval pos[i,j] +/- smooth_scale[j]*smooth[i]
+        overlaps [fmin[j], fmax[j]]. The box may be infinite along any axis. A few particles just outside this
+        region may also be selected, but none inside it are missed.
+
+        The largest smoothing length in each tree node is computed the first time a given smoothing array is
+        used, and reused until the array named *smooth_name* is reported as modified (see array_changed)
+        or the smoothing lengths are recomputed by this tree.
+
+        Returns
+        -------
+        index : numpy.ndarray
+            int64 array of the selected particles' indices, in no particular order.
+        """
+        key = (smooth_name, smooth.__array_interface__['data'][0], smooth.strides)
+        if key != self._smooth_bounds_key:
+            kdmain.smooth_bounds(self.kdtree, smooth)
+            self._smooth_bounds_key = key
+        return kdmain.particles_in_box(self.kdtree, smooth, tuple(fmin), tuple(fmax), tuple(smooth_scale))
+
+    def particles_in_shell(self, smooth, centre, r_min, r_max, smooth_scale, smooth_name=None):
+        """Find the particles whose smoothing region overlaps a spherical shell, culling whole subtrees at a time.
+
+        Particle i is selected if the sphere of radius smooth_scale*smooth[i] about pos[i] overlaps the shell
+        r_min <= |x - centre| <= r_max. As for particles_in_box, a few particles just outside this region may
+        also be selected, and the per-node smoothing lengths are cached in the same way.
+
+        Returns
+        -------
+        index : numpy.ndarray
+            int64 array of the selected particles' indices, in no particular order.
+        """
+        key = (smooth_name, smooth.__array_interface__['data'][0], smooth.strides)
+        if key != self._smooth_bounds_key:
+            kdmain.smooth_bounds(self.kdtree, smooth)
+            self._smooth_bounds_key = key
+        return kdmain.particles_in_shell(self.kdtree, smooth, tuple(centre), float(r_min), float(r_max),
+                                         float(smooth_scale))
+
+    def node_structure(self):
+        """Return the layout of the tree nodes, for algorithms that work level-by-level in numpy.
+
+        Nodes are numbered from 1 (the root), with the children of node k being 2k and 2k+1; every
+        leaf is at the same depth.
+
+        Returns
+        -------
+        order : numpy.ndarray
+            int64 array of particle indices, in tree order
+        lower, upper : numpy.ndarray
+            int64 arrays such that node k owns particles order[lower[k]:upper[k]+1]
+        bound_min, bound_max : numpy.ndarray
+            float32 Nx3 arrays of the bounding box of each node's particles
+        """
+        return kdmain.node_structure(self.kdtree)
+
+    def derived_object(self, key, depends_on, factory):
+        """Return an object computed from this tree and some snapshot arrays, building it with *factory()*
+        the first time it is requested under *key*.
+
+        The object is discarded when any of the arrays named in *depends_on* is reported as modified (see
+        array_changed), and along with the tree itself when the positions change."""
+        if key not in self._derived_objects:
+            self._derived_objects[key] = (frozenset(depends_on), factory())
+        return self._derived_objects[key][1]
+
+    def array_changed(self, name):
+        """Discard the per-node smoothing bounds and derived objects that were computed from the array *name*."""
+        if self._smooth_bounds_key is not None and self._smooth_bounds_key[0] == name:
+            self._smooth_bounds_key = None
+        self._derived_objects = {k: v for k, v in self._derived_objects.items() if name not in v[0]}
+
+    def _hsm_algorithm(self, hsm_algorithm):
+        if hsm_algorithm is None:
+            hsm_algorithm = config_parser.get("sph", "hsm-algorithm")
+        if hsm_algorithm == "auto":
+            # The dual-tree search needs every particle in the tree to be a query point, which is
+            # always the case here. It opens far fewer tree nodes than the snake, but in benchmarks
+            # (see kd_bench) the snake's reuse of the previous neighbour queue still makes it
+            # faster overall, especially for centrally concentrated distributions.
+            hsm_algorithm = "snake"
+        if hsm_algorithm not in ("dual-tree", "snake"):
+            raise ValueError("Unknown hsm algorithm %r; choose 'dual-tree', 'snake' or 'auto'" % hsm_algorithm)
+        return hsm_algorithm
+
+    def populate(self, mode, nn, kernel = 'CubicSpline', numa=None, stats=False, hsm_algorithm=None):
         """Create the KDTree and perform the operation specified by `mode`.
 
         Parameters
@@ -168,7 +284,30 @@ class KDTree:
             Number of neighbours to be considered when smoothing.
         kernel : str
             Keyword to specify the smoothing kernel. Options: 'CubicSpline', 'WendlandC2'
+        numa : bool, optional
+            If True, pin the smoothing threads to NUMA nodes and give each node its own copy of the tree and
+            of the tree-ordered positions. If None (default), use the numa-aware option in the [sph] config section.
+            Has no effect when running on a single thread.
+        stats : bool, optional
+            If True, record per-thread counters (tree nodes opened, buckets scanned, distance evaluations,
+            priority queue replacements, snake restarts and continuations, work units taken and particles
+            processed) and wall-clock times for the set-up, neighbour search and kernel evaluation phases.
+        hsm_algorithm : str, optional
+            Search used for the 'hsm' mode: 'snake' (a single-tree search per particle, reusing the previous
+            particle's neighbour queue), 'dual-tree' (walks subtrees of query particles against the tree
+            together), or 'auto'. If None (default), use the hsm-algorithm option in the [sph] config section.
+
+        Returns
+        -------
+        stats : dict or None
+            If *stats* is True, a dictionary mapping each counter name to a numpy array with one entry per thread.
         """
+        propid = self.smooth_operation_to_id(mode)
+        if propid == self.PROPID_HSM and self._hsm_algorithm(hsm_algorithm) == "dual-tree":
+            propid = self.PROPID_HSM_DUALTREE
+        return self._populate(propid, nn, kernel, numa, stats)
+
+    def _populate(self, propid, nn, kernel, numa, stats, knn_output=None):
         from . import _thread_map
 
         n_proc = config["number_of_threads"]
@@ -185,11 +324,17 @@ class KDTree:
 
         smx = kdmain.nn_start(self.kdtree, int(nn), n_proc, self.boxsize)
 
-        propid = self.smooth_operation_to_id(mode)
-
         if propid == self.PROPID_HSM:
             kdmain.domain_decomposition(self.kdtree, n_proc)
 
+        if propid in (self.PROPID_HSM, self.PROPID_HSM_DUALTREE, self.PROPID_KNN):
+            # the smoothing lengths are about to be overwritten
+            self._smooth_bounds_key = None
+            self.array_changed('smooth')
+
+        if knn_output is not None:
+            kdmain.set_knn_output(smx, *knn_output)
+
         if kernel == 'CubicSpline':
             kernel = 0
         elif kernel == 'WendlandC2':
@@ -199,8 +344,11 @@ class KDTree:
                 "Kernel keyword %s not recognised. Please choose either 'CubicSpline' or 'WendlandC2'." % kernel
             )
 
+        if numa is None:
+            numa = config_parser.getboolean("sph", "numa-aware")
+
         if n_proc == 1:
-            kdmain.populate(self.kdtree, smx, propid, 0, kernel)
+            kdmain.populate(self.kdtree, smx, propid, 0, kernel, 0, int(stats))
         else:
             _thread_map(
                 kdmain.populate,
@@ -208,12 +356,21 @@ class KDTree:
                 [smx] * n_proc,
                 [propid] * n_proc,
                 list(range(0, n_proc)),
-                [kernel] * n_proc
+                [kernel] * n_proc,
+                [int(numa)] * n_proc,
+                [int(stats)] * n_proc
             )
 
+        if stats:
+            stats = {k: np.asarray(v) for k, v in kdmain.get_stats(smx).items()}
+        else:
+            stats = None
+
         # Free C-structures memory
         kdmain.nn_stop(self.kdtree, smx)
 
+        return stats
+
     def sph_mean(self, array, nsmooth=64, kernel = 'CubicSpline'):
         r"""Calculate the SPH mean of a simulation array.
 
@@ -279,9 +436,10 @@ class KDTree:
         Returns
         -------
         output : pynbody.array.SimArray
-            The dispersion of the input array.
+            The dispersion of the input array. For a vector array this is the dispersion of the vectors,
+            i.e. one value per particle, as for the derived array ``v_disp``.
         """
-        output = np.empty_like(array)
+        output = np.empty(len(array), dtype=array.dtype)
         if hasattr(array, "units"):
             output = output.view(ar.SimArray)
             output.units = array.units
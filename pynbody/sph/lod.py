@@ -0,0 +1,181 @@
+"""
+
+sph.lod
+=======
+
+Level-of-detail particle hierarchy for multi-scale SPH rendering.
+
+Every node of a snapshot's kd-tree is merged into a single pseudo-particle
+which conserves the node's mass, momentum and volume integral of the rendered
+quantity. Its smoothing length is chosen so that (for the cubic spline kernel)
+the pseudo-particle has the same spatial spread as the particles it replaces.
+
+To render a frame, the tree is cut just above the pixel scale: any node whose
+kernel, along with those of everything beneath it, fits within a pixel is drawn as one
+pseudo-particle, while larger structures are opened. The cost of a frame then
+scales with the number of pixels it resolves rather than the number of
+particles. The hierarchy is cached on the tree, so it is reused for every
+frame and image width until one of the arrays it was built from changes.
+
+"""
+
+import numpy as np
+
+from .. import array
+
+# Variance along each axis of the cubic spline kernel, in units of h^2
+_KERNEL_VARIANCE = 0.3
+
+
+class ParticleHierarchy:
+    """Pseudo-particles for every node of a snapshot's kd-tree, in which the snapshot's particles are
+    merged so as to conserve mass, momentum and the volume integral of the quantity *qty*."""
+
+    def __init__(self, snap, qty='rho', smooth='smooth'):
+        order, lower, upper, self._bound_min, self._bound_max = snap.kdtree.node_structure()
+
+        pos_ar = snap['pos']
+        smooth_ar = snap[smooth]
+        if smooth_ar.units != pos_ar.units:
+            smooth_ar = smooth_ar.in_units(pos_ar.units)
+
+        self._qty = qty
+        self._smooth = smooth
+        self._template = {'pos': pos_ar, smooth: smooth_ar, qty: snap[qty],
+                          'mass': snap['mass'], 'rho': snap['rho']}
+        # the pseudo-particle property to use for each array; where qty is also one of the other arrays,
+        # the later entries take precedence
+        self._level_keys = {'pos': 'pos', smooth: 'smooth', qty: 'qty', 'mass': 'mass', 'rho': 'rho'}
+        if 'vel' in snap.keys():
+            self._template['vel'] = snap['vel']
+            self._level_keys['vel'] = 'vel'
+
+        self._order = order
+        n_leaves = len(lower) // 2
+        self._leaf_counts = upper[n_leaves:] - lower[n_leaves:] + 1
+
+        level = self._merge_particles(lower[n_leaves:], order)
+        self._levels = [level]
+        while len(level['mass']) > 1:
+            level = self._merge_pairs(level)
+            self._levels.insert(0, level)
+
+    def _merge_particles(self, starts, order):
+        """Pseudo-particles for the leaves of the tree, which own order[starts[i]:starts[i+1]]"""
+        mass = np.asarray(self._template['mass'], dtype=np.float64)[order]
+        pos = np.asarray(self._template['pos'], dtype=np.float64)[order]
+        smooth = np.asarray(self._template[self._smooth], dtype=np.float64)[order]
+        volume = mass / np.asarray(self._template['rho'], dtype=np.float64)[order]
+
+        level = {'mass': np.add.reduceat(mass, starts)}
+        level['pos'] = np.add.reduceat(mass[:, np.newaxis] * pos, starts) / level['mass'][:, np.newaxis]
+        offset = pos - np.repeat(level['pos'], self._leaf_counts, axis=0)
+        level['spread'] = np.add.reduceat(mass * (offset ** 2).sum(axis=1), starts)
+        level['smooth_sq'] = np.add.reduceat(mass * smooth ** 2, starts)
+        level['volume'] = np.add.reduceat(volume, starts)
+        level['qty_volume'] = np.add.reduceat(
+            np.asarray(self._template[self._qty], dtype=np.float64)[order] * volume, starts)
+        if 'vel' in self._template:
+            vel = np.asarray(self._template['vel'], dtype=np.float64)[order]
+            level['momentum'] = np.add.reduceat(mass[:, np.newaxis] * vel, starts)
+
+        self._finish_level(level, np.maximum.reduceat(smooth, starts))
+        return level
+
+    def _merge_pairs(self, children):
+        """Pseudo-particles for the level above *children*, in which the children of node k are 2k and 2k+1"""
+        mass_a, mass_b = children['mass'][0::2], children['mass'][1::2]
+        pos_a, pos_b = children['pos'][0::2], children['pos'][1::2]
+
+        level = {'mass': mass_a + mass_b}
+        level['pos'] = (mass_a[:, np.newaxis] * pos_a + mass_b[:, np.newaxis] * pos_b) / level['mass'][:, np.newaxis]
+        # second moment about the new centre of mass, by the parallel axis theorem
+        level['spread'] = children['spread'][0::2] + children['spread'][1::2] + \
+                          mass_a * ((pos_a - level['pos']) ** 2).sum(axis=1) + \
+                          mass_b * ((pos_b - level['pos']) ** 2).sum(axis=1)
+        for name in 'smooth_sq', 'volume', 'qty_volume', 'momentum':
+            if name in children:
+                level[name] = children[name][0::2] + children[name][1::2]
+
+        self._finish_level(level, np.maximum(children['size'][0::2], children['size'][1::2]))
+        return level
+
+    @staticmethod
+    def _finish_level(level, children_size):
+        """Derive the rendered properties of a level's pseudo-particles from the conserved sums"""
+        level['smooth'] = np.sqrt((level['smooth_sq'] + level['spread'] / (3 * _KERNEL_VARIANCE)) / level['mass'])
+        level['rho'] = level['mass'] / level['volume']
+        level['qty'] = level['qty_volume'] / level['volume']
+        if 'momentum' in level:
+            level['vel'] = level['momentum'] / level['mass'][:, np.newaxis]
+        # the largest smoothing length at or below each node, so that if a node is smaller than a pixel
+        # then so are all of its descendants
+        level['size'] = np.maximum(level['smooth'], children_size)
+
+    def _node_overlaps(self, depth, size, boxes, smooth_scale):
+        nodes = slice(2 ** depth, 2 ** (depth + 1))
+        extent = np.multiply(smooth_scale, size[:, np.newaxis])
+        lo = self._bound_min[nodes] - extent
+        hi = self._bound_max[nodes] + extent
+        overlaps = np.zeros(len(size), dtype=bool)
+        for fmin, fmax in boxes:
+            overlaps |= np.all((hi >= fmin) & (lo <= fmax), axis=1)
+        return overlaps
+
+    def select(self, pixel_size, boxes=None, smooth_scale=(2.0, 2.0, 2.0), kernel_radius=2.0):
+        """Return the arrays to render at the given pixel size (in the snapshot's position units).
+
+        Nodes whose kernel support (*kernel_radius* times the smoothing length of the pseudo-particle
+        and of everything beneath it) fits within *pixel_size* are replaced by their pseudo-particle.
+        If *boxes* (a list of (fmin, fmax) pairs of 3-tuples) is given, nodes whose particles, each
+        extended by *smooth_scale* times its smoothing length along each axis, cannot overlap any of
+        the boxes are dropped.
+
+        Returns
+        -------
+        arrays : dict
+            SimArrays of 'pos', 'x', 'y', 'z', 'mass', 'rho', the smoothing length, the quantity and, if the
+            snapshot's velocities were loaded when the hierarchy was built, 'vel'. The snapshot's own
+            particles come last, in their usual order.
+        """
+        chosen = {name: [] for name in self._template}
+        reached = np.ones(1, dtype=bool)
+        for depth, level in enumerate(self._levels):
+            active = reached
+            if boxes is not None:
+                active = active & self._node_overlaps(depth, level['size'], boxes, smooth_scale)
+            fine = kernel_radius * level['size'] <= pixel_size
+            accept = active & fine
+
+            for name, level_key in self._level_keys.items():
+                chosen[name].append(level[level_key][accept])
+
+            opened = active & ~fine
+            reached = np.repeat(opened, 2)
+
+        # particles in leaves that are still open are rendered individually
+        particles = np.sort(self._order[np.repeat(opened, self._leaf_counts)])
+
+        result = {}
+        for name, template in self._template.items():
+            values = np.concatenate(chosen[name] + [np.asarray(template)[particles]]).astype(template.dtype)
+            result[name] = values.view(array.SimArray)
+            result[name].units = template.units
+        for i, name in enumerate('xyz'):
+            result[name] = result['pos'][:, i]
+        return result
+
+    def __len__(self):
+        """The number of pseudo-particles in the hierarchy"""
+        return sum(len(level['mass']) for level in self._levels)
+
+
+def particle_hierarchy(snap, qty='rho', smooth='smooth'):
+    """Return the ParticleHierarchy for rendering *qty* from *snap*, building it if necessary.
+
+    The hierarchy is cached on the snapshot's kd-tree (which must already exist) until the positions or
+    any array it was built from change."""
+    qty_nd = snap._array_name_1D_to_ND(qty) or qty
+    depends_on = {'mass', 'rho', 'vel', qty_nd, smooth}
+    return snap.kdtree.derived_object(('lod', qty, smooth), depends_on,
+                                      lambda: ParticleHierarchy(snap, qty, smooth))
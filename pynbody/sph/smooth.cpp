@@ -3,9 +3,20 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <float.h>
 #include "smooth.h"
 #include "kd.h"
 #include <iostream>
+#include <time.h>
+
+#ifdef KDT_THREADING
+#include <sched.h>
+#endif
+
+#if defined(KDT_THREADING) && defined(__linux__)
+#include <unistd.h>
+#define KDT_NUMA
+#endif
 
 bool smCheckFits(KD kd, float *fPeriod) {
 	KDN *root;
@@ -40,10 +51,10 @@ int smInit(SMX *psmx,KD kd,int nSmooth,float *fPeriod)
 	 */
 	for (j=0;j<3;++j) {
 		if (root->bnd.fMax[j] - root->bnd.fMin[j] > fPeriod[j]) {
-		    PyErr_SetString(PyExc_ValueError, "The particles span a region larger than the specified boxsize");
 			bError = 1;
 			}
 		}
+	if (bError) return(0);
 
 	assert(nSmooth <= kd->nActive);
 	smx = (SMX)malloc(sizeof(struct smContext)); assert(smx != NULL);
@@ -58,9 +69,22 @@ int smInit(SMX *psmx,KD kd,int nSmooth,float *fPeriod)
 
 	for (j=0;j<3;++j) smx->fPeriod[j] = fPeriod[j];
 
+	smx->nProcs = 1;
+	smx->nCurrent = 0;
+	smx->kdNodes = kd->kdNodes;
+	smx->pTreePos = NULL;
+	smx->pKnnIndex = NULL;
+	smx->pKnnDist = NULL;
+	smx->nThreadStats = 0;
+	smx->pThreadStats = NULL;
+	smResetStats(smx, false);
 
 #ifdef KDT_THREADING
-	smx->nCurrent=0;
+
+	smx->nReplicas = 0;
+	smx->pNodeReplicas = NULL;
+	smx->pPosReplicas = NULL;
+	smx->pReplicaState = NULL;
 
 	smx->pMutex = (pthread_mutex_t*)(malloc(sizeof(pthread_mutex_t)));
 
@@ -114,8 +138,20 @@ SMX smInitThreadLocalCopy(SMX from) {
 	for (pi=0;pi<smx->kd->nActive;++pi) {
 		smx->iMark[pi] = 0;
 	}
+	smx->nProcs = from->nProcs;
+	smx->kdNodes = from->kdNodes;
+	smx->pTreePos = from->pTreePos;
+	smx->pKnnIndex = from->pKnnIndex;
+	smx->pKnnDist = from->pKnnDist;
 	smx->pMutex = from->pMutex;
 	smx->pReady = from->pReady;
+	smx->nReplicas = 0;
+	smx->pNodeReplicas = NULL;
+	smx->pPosReplicas = NULL;
+	smx->pReplicaState = NULL;
+	smx->nThreadStats = 0;
+	smx->pThreadStats = NULL;
+	smResetStats(smx, from->bStats);
 	from->nLocals++;
 
 	smx->smx_global = from;
@@ -170,6 +206,7 @@ int smGetNext(SMX smx_local) {
 		i = smx_local->nCurrent;
 		smx_local->smx_global->nCurrent+=WORKUNIT;
 		pthread_mutex_unlock(smx_local->pMutex);
+		smx_local->stats.nWorkUnits++;
 	}
 
 	// i now has the next thing to be processed
@@ -188,15 +225,49 @@ int smGetNext(SMX smx_local) {
 
 #endif
 
+double smWallTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void smResetStats(SMX smx, bool bStats) {
+	memset(&smx->stats, 0, sizeof(SMSTATS));
+	smx->bStats = bStats;
+	if(bStats && smx->pThreadStats!=NULL)
+		memset(smx->pThreadStats, 0, smx->nThreadStats*sizeof(SMSTATS));
+}
+
+void smStoreStats(SMX smx_local, int procid) {
+	// Copy a thread's stats into the per-thread table of the global context
+#ifdef KDT_THREADING
+	SMX smxg = smx_local->smx_global ? smx_local->smx_global : smx_local;
+#else
+	SMX smxg = smx_local;
+#endif
+	if(!smx_local->bStats || smxg->pThreadStats==NULL) return;
+	if(procid<0 || procid>=smxg->nThreadStats) return;
+	smxg->pThreadStats[procid] = smx_local->stats;
+}
+
 
 void smFinish(SMX smx)
 {
+	free(smx->pThreadStats);
 	free(smx->iMark);
 	free(smx->pq);
 	free(smx->fList);
 	free(smx->pList);
 
 #ifdef KDT_THREADING
+	for(int i=0; i<smx->nReplicas; ++i) {
+		free(smx->pNodeReplicas[i]);
+		free(smx->pPosReplicas[i]);
+	}
+	free(smx->pNodeReplicas);
+	free(smx->pPosReplicas);
+	free((void*)smx->pReplicaState);
+
 	pthread_mutex_destroy(smx->pMutex);
 	pthread_cond_destroy(smx->pReady);
 	free(smx->pMutex);
@@ -208,20 +279,19 @@ void smFinish(SMX smx)
 }
 
 
-
 template <typename T>
 void smBallSearch(SMX smx,float fBall2,float *ri)
 {
 	KDN *c;
-	PARTICLE *p;
 	KD kd;
 	int cell,cp,ct,pj;
 	T fDist2,dx,dy,dz,lx,ly,lz,sx,sy,sz,x,y,z;
 	PQ *pq;
+	long nOpened=0, nBuckets=1, nDist=0, nReplaced=0;
 
 	kd = smx->kd;
-	c = smx->kd->kdNodes;
-	p = smx->kd->p;
+	c = smx->kdNodes;
+	const T *pTreePos = (const T*)smx->pTreePos;
 	pq = smx->pqHead;
 	x = ri[0];
 	y = ri[1];
@@ -241,10 +311,11 @@ void smBallSearch(SMX smx,float fBall2,float *ri)
 	/*
 	 ** Now start the search from the bucket given by cell!
 	 */
+	nDist += c[cell].pUpper-c[cell].pLower+1;
 	for (pj=c[cell].pLower;pj<=c[cell].pUpper;++pj) {
-		dx = x - GET2<T>(kd->pNumpyPos,p[pj].iOrder,0);
-		dy = y - GET2<T>(kd->pNumpyPos,p[pj].iOrder,1);
-		dz = z - GET2<T>(kd->pNumpyPos,p[pj].iOrder,2);
+		dx = x - smTreePos<T>(kd,pTreePos,pj,0);
+		dy = y - smTreePos<T>(kd,pTreePos,pj,1);
+		dz = z - smTreePos<T>(kd,pTreePos,pj,2);
 		fDist2 = dx*dx + dy*dy + dz*dz;
 		if (fDist2 < fBall2) {
 			if (smx->iMark[pj]) continue;
@@ -257,6 +328,7 @@ void smBallSearch(SMX smx,float fBall2,float *ri)
 			pq->az = 0.0;
 			PQ_REPLACE(pq);
 			fBall2 = pq->fKey;
+			++nReplaced;
 			}
 		}
 	while (cell != ROOT) {
@@ -268,15 +340,18 @@ void smBallSearch(SMX smx,float fBall2,float *ri)
 			/*
 			 ** We have an intersection to test.
 			 */
+			++nOpened;
 			if (cp < smx->kd->nSplit) {
 				cp = LOWER(cp);
 				continue;
 				}
 			else {
+				++nBuckets;
+				nDist += c[cp].pUpper-c[cp].pLower+1;
 				for (pj=c[cp].pLower;pj<=c[cp].pUpper;++pj) {
-					dx = sx - GET2<T>(kd->pNumpyPos,p[pj].iOrder,0);
-					dy = sy - GET2<T>(kd->pNumpyPos,p[pj].iOrder,1);
-					dz = sz - GET2<T>(kd->pNumpyPos,p[pj].iOrder,2);
+					dx = sx - smTreePos<T>(kd,pTreePos,pj,0);
+					dy = sy - smTreePos<T>(kd,pTreePos,pj,1);
+					dz = sz - smTreePos<T>(kd,pTreePos,pj,2);
 					fDist2 = dx*dx + dy*dy + dz*dz;
 					if (fDist2 < fBall2) {
 						if (smx->iMark[pj]) continue;
@@ -289,6 +364,7 @@ void smBallSearch(SMX smx,float fBall2,float *ri)
 						pq->az = sz - z;
 						PQ_REPLACE(pq);
 						fBall2 = pq->fKey;
+						++nReplaced;
 						}
 					}
 				}
@@ -299,22 +375,27 @@ void smBallSearch(SMX smx,float fBall2,float *ri)
 		cell = PARENT(cell);
 		}
 	smx->pqHead = pq;
-	}
-
 
+	if(smx->bStats) {
+		smx->stats.nNodesOpened += nOpened;
+		smx->stats.nBucketsScanned += nBuckets;
+		smx->stats.nDistanceEvals += nDist;
+		smx->stats.nQueueReplacements += nReplaced;
+	}
+	}
 
 
 template<typename T>
 int smBallGather(SMX smx,float fBall2,float *ri)
 {
 	KDN *c;
-	PARTICLE *p;
 	KD kd=smx->kd;
 	int pj,nCnt,cp,nSplit;
 	float dx,dy,dz,x,y,z,lx,ly,lz,sx,sy,sz,fDist2;
+	long nOpened=0, nBuckets=0, nDist=0;
 
-	c = smx->kd->kdNodes;
-	p = smx->kd->p;
+	c = smx->kdNodes;
+	const T *pTreePos = (const T*)smx->pTreePos;
 	nSplit = smx->kd->nSplit;
 	lx = smx->fPeriod[0];
 	ly = smx->fPeriod[1];
@@ -329,15 +410,18 @@ int smBallGather(SMX smx,float fBall2,float *ri)
 		/*
 		 ** We have an intersection to test.
 		 */
+		++nOpened;
 		if (cp < nSplit) {
 			cp = LOWER(cp);
 			continue;
 			}
 		else {
+			++nBuckets;
+			nDist += c[cp].pUpper-c[cp].pLower+1;
 			for (pj=c[cp].pLower;pj<=c[cp].pUpper;++pj) {
-				dx = sx - GET2<T>(kd->pNumpyPos,p[pj].iOrder,0);
-				dy = sy - GET2<T>(kd->pNumpyPos,p[pj].iOrder,1);
-				dz = sz - GET2<T>(kd->pNumpyPos,p[pj].iOrder,2);
+				dx = sx - smTreePos<T>(kd,pTreePos,pj,0);
+				dy = sy - smTreePos<T>(kd,pTreePos,pj,1);
+				dz = sz - smTreePos<T>(kd,pTreePos,pj,2);
 				fDist2 = dx*dx + dy*dy + dz*dz;
 				if (fDist2 <= fBall2) {
 				  if(nCnt>=smx->nListSize) {
@@ -358,13 +442,16 @@ int smBallGather(SMX smx,float fBall2,float *ri)
 		if (cp == ROOT) break;
 		}
 	assert(nCnt <= smx->nListSize);
+
+	if(smx->bStats) {
+		smx->stats.nNodesOpened += nOpened;
+		smx->stats.nBucketsScanned += nBuckets;
+		smx->stats.nDistanceEvals += nDist;
+	}
 	return(nCnt);
 	}
 
 
-
-
-
 void smSmoothInitStep(SMX smx, int nProcs_for_smooth)
 {
 
@@ -376,25 +463,148 @@ void smSmoothInitStep(SMX smx, int nProcs_for_smooth)
 		smx->iMark[pi] = 0;
 	}
 
+	smx->nProcs = nProcs_for_smooth>0 ? nProcs_for_smooth : 1;
+
+	free(smx->pThreadStats);
+	smx->nThreadStats = smx->nProcs;
+	smx->pThreadStats = (SMSTATS*)calloc(smx->nThreadStats, sizeof(SMSTATS));
+	assert(smx->pThreadStats!=NULL);
+
 	smInitPriorityQueue(smx);
 }
 
+int smDomainStart(KD kd, int procid, int nprocs) {
+	// First tree-ordered particle owned by procid, i.e. the smallest pi for which
+	// pi*nprocs/nActive == procid (see smDomainDecomposition)
+	return (int)(((long)procid*kd->nActive + nprocs - 1)/nprocs);
+}
+
+int smNumaNodeCount() {
+#ifdef KDT_NUMA
+	// Count the nodes the kernel exposes; without the sysfs tree, treat the machine as a single node
+	int n = 0;
+	char path[64];
+	while(n<1024) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+		if(access(path, F_OK)!=0) break;
+		++n;
+	}
+	return n>0 ? n : 1;
+#else
+	return 1;
+#endif
+}
+
+bool smPinThreadToNode(int node) {
+	// Restrict the calling thread to the CPUs of the given NUMA node. Returns
+	// false (leaving the affinity untouched) if this is not possible.
+#ifdef KDT_NUMA
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *f = fopen(path, "r");
+	if(f==NULL) return false;
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	int nCpus = 0;
+	int lo, hi;
+	char sep;
+	// cpulist has the form "0-3,8-11"
+	while(fscanf(f, "%d", &lo)==1) {
+		hi = lo;
+		sep = fgetc(f);
+		if(sep=='-') {
+			if(fscanf(f, "%d", &hi)!=1) break;
+			sep = fgetc(f);
+		}
+		for(int cpu=lo; cpu<=hi && cpu<CPU_SETSIZE; ++cpu) {
+			CPU_SET(cpu, &cpus);
+			++nCpus;
+		}
+		if(sep!=',') break;
+	}
+	fclose(f);
+
+	if(nCpus==0) return false;
+	return sched_setaffinity(0, sizeof(cpus), &cpus)==0;
+#else
+	return false;
+#endif
+}
+
+template<typename T>
+T *smMakeTreePos(KD kd) {
+	// Gather the positions into tree order. Whichever thread calls this
+	// touches the pages first, so on Linux they end up on that thread's NUMA node.
+	T *pos = (T*)malloc(3*sizeof(T)*(size_t)kd->nActive);
+	assert(pos!=NULL);
+	for(int pj=0; pj<kd->nActive; ++pj) {
+		for(int d=0; d<3; ++d)
+			pos[3*pj+d] = GET2<T>(kd->arPos, kd->p[pj].iOrder, d);
+	}
+	return pos;
+}
+
+#ifdef KDT_THREADING
+
+template<typename T>
+void smUseNumaReplica(SMX smx_local, int procid) {
+	// Pin this thread to a NUMA node and point it at that node's copy of the
+	// read-only tree and tree-ordered positions, building the copy on first use.
+	// Neighbouring domains (consecutive procids) share a node.
+	SMX smxg = smx_local->smx_global;
+	KD kd = smx_local->kd;
+	int node, state;
+
+	pthread_mutex_lock(smxg->pMutex);
+	if(smxg->nReplicas==0) {
+		smxg->nReplicas = smNumaNodeCount();
+		if(smxg->nReplicas>smxg->nProcs) smxg->nReplicas = smxg->nProcs;
+		smxg->pNodeReplicas = (KDN**)calloc(smxg->nReplicas, sizeof(KDN*));
+		smxg->pPosReplicas = (void**)calloc(smxg->nReplicas, sizeof(void*));
+		smxg->pReplicaState = (volatile int*)calloc(smxg->nReplicas, sizeof(int));
+		assert(smxg->pNodeReplicas!=NULL && smxg->pPosReplicas!=NULL && smxg->pReplicaState!=NULL);
+	}
+	node = (int)(((long)procid*smxg->nReplicas)/smxg->nProcs);
+	if(node>=smxg->nReplicas) node = smxg->nReplicas-1;
+	state = smxg->pReplicaState[node];
+	if(state==0) smxg->pReplicaState[node] = 1; // we will build it
+	pthread_mutex_unlock(smxg->pMutex);
+
+	if(smxg->nReplicas>1)
+		smPinThreadToNode(node);
+
+	if(state==0) {
+		KDN *nodes = (KDN*)malloc(kd->nNodes*sizeof(KDN));
+		assert(nodes!=NULL);
+		memcpy(nodes, kd->kdNodes, kd->nNodes*sizeof(KDN));
+		smxg->pNodeReplicas[node] = nodes;
+		smxg->pPosReplicas[node] = smMakeTreePos<T>(kd);
+		__atomic_store_n(&smxg->pReplicaState[node], 2, __ATOMIC_RELEASE);
+	} else {
+		while(__atomic_load_n(&smxg->pReplicaState[node], __ATOMIC_ACQUIRE)!=2)
+			sched_yield();
+	}
+
+	smx_local->kdNodes = smxg->pNodeReplicas[node];
+	smx_local->pTreePos = smxg->pPosReplicas[node];
+}
+
+#endif
+
 template<typename T>
 void smDomainDecomposition(KD kd, int nprocs) {
 
-	// AP 31/8/2014 - Here is the domain decomposition for nProcs>1
-	// In principle one should do better by localizing the
-	// domains -- the current approach is a seriously naive decomposition.
-	// This will result in more snake collisions than necessary.
-	// However in practice, up to nCpu = 8, the scaling is looking
-	// pretty linear anyway so I'm leaving that for future.
+	// Each thread owns a contiguous range of the tree-ordered particle list,
+	// i.e. (up to the rounding at the edges) a set of complete subtrees. This
+	// keeps each snake inside a compact spatial region, minimising collisions
+	// between threads and keeping each thread's working set local to it.
 
-	PARTICLE *p;
 	int pi;
 
 	if(nprocs>0) {
 		for (pi=0;pi<kd->nActive;++pi) {
-			SETSMOOTH(T,pi,-(float)(1+pi%nprocs));
+			SETSMOOTH(T,pi,-(float)(1+((long)pi*nprocs)/kd->nActive));
 		}
 	}
 }
@@ -411,7 +621,7 @@ void smInitPriorityQueue(SMX smx) {
 
 	pqLast = &smx->pq[smx->nSmooth-1];
 	pin = 0;
-	pNext = 1;
+	pNext = 0;
 	ax = 0.0;
 	ay = 0.0;
 	az = 0.0;
@@ -423,6 +633,7 @@ void smInitPriorityQueue(SMX smx) {
 		pq->ay = ay;
 		pq->az = az;
 	}
+  smx->pqHead = NULL; // no snake yet; smSmoothStep will start afresh from pNext
   smx->pin = pin;
   smx->pNext = pNext;
   smx->ax = ax;
@@ -435,7 +646,6 @@ template<typename T>
 int smSmoothStep(SMX smx, int procid)
 {
 	KDN *c;
-	PARTICLE *p;
 	PQ *pq,*pqLast;
 	KD kd=smx->kd;
 	int cell;
@@ -446,8 +656,8 @@ int smSmoothStep(SMX smx, int procid)
 	float proc_signal = -(float)(procid)-1.0;
 	float ri[3];
 
-	c = smx->kd->kdNodes;
-	p = smx->kd->p;
+	c = smx->kdNodes;
+	const T *pTreePos = (const T*)smx->pTreePos;
 	pqLast = &smx->pq[smx->nSmooth-1];
 	nSmooth = smx->nSmooth;
 	pin = smx->pin;
@@ -457,9 +667,9 @@ int smSmoothStep(SMX smx, int procid)
 	az = smx->az;
 
 
-	if (GETSMOOTH(T,pin) >= 0) {
-		// the first particle we are supposed to smooth is
-		// actually already done. We need to search for another
+	if (smx->pqHead==NULL || GETSMOOTH(T,pin) >= 0) {
+		// either this is the first step, or the first particle we are supposed
+		// to smooth is actually already done. We need to search for another
 		// suitable candidate. Preferably a long way away from other
 		// threads, if this is threaded.
 
@@ -482,19 +692,20 @@ int smSmoothStep(SMX smx, int procid)
 		// N.B. a race condition here doesn't matter since duplicating a bit of
 		// work is more efficient than using a mutex (verified).
 		SETSMOOTH(T,pNext,10);
+		smx->stats.nSnakeRestarts++;
 
 		pi = pNext;
 		++pNext;
-		x = GET2<T>(kd->pNumpyPos,p[pi].iOrder,0);
-		y = GET2<T>(kd->pNumpyPos,p[pi].iOrder,1);
-		z = GET2<T>(kd->pNumpyPos,p[pi].iOrder,2);
+		x = smTreePos<T>(kd,pTreePos,pi,0);
+		y = smTreePos<T>(kd,pTreePos,pi,1);
+		z = smTreePos<T>(kd,pTreePos,pi,2);
 		/*
 		** First find the "local" Bucket.
 		** This could merely be the closest bucket to ri[3].
 		*/
 		cell = ROOT;
 		while (cell < smx->kd->nSplit) {
-			if (GET2<T>(kd->pNumpyPos,p[pi].iOrder,c[cell].iDim) <c[cell].fSplit)
+			if (smTreePos<T>(kd,pTreePos,pi,c[cell].iDim) <c[cell].fSplit)
 				cell = LOWER(cell);
 			else
 				cell = UPPER(cell);
@@ -512,15 +723,16 @@ int smSmoothStep(SMX smx, int procid)
 			pj = smx->kd->nActive - nSmooth;
 		for (pq=smx->pq;pq<=pqLast;++pq) {
 			smx->iMark[pj] = 1;
-			dx = x - GET2<T>(kd->pNumpyPos,p[pj].iOrder,0);
-			dy = y - GET2<T>(kd->pNumpyPos,p[pj].iOrder,1);
-			dz = z - GET2<T>(kd->pNumpyPos,p[pj].iOrder,2);
+			dx = x - smTreePos<T>(kd,pTreePos,pj,0);
+			dy = y - smTreePos<T>(kd,pTreePos,pj,1);
+			dz = z - smTreePos<T>(kd,pTreePos,pj,2);
 			pq->fKey = dx*dx + dy*dy + dz*dz;
 			pq->p = pj++;
 			pq->ax = 0.0;
 			pq->ay = 0.0;
 			pq->az = 0.0;
 		}
+		smx->stats.nDistanceEvals += nSmooth;
 		PQ_BUILD(smx->pq,nSmooth,smx->pqHead);
 	} else {
 		// Calculate priority queue using existing particles
@@ -528,21 +740,23 @@ int smSmoothStep(SMX smx, int procid)
 
 		// Mark - see comment above
 		SETSMOOTH(T,pi,10);
+		smx->stats.nSnakeContinuations++;
 
-		x = GET2<T>(kd->pNumpyPos,p[pi].iOrder,0);
-		y = GET2<T>(kd->pNumpyPos,p[pi].iOrder,1);
-		z = GET2<T>(kd->pNumpyPos,p[pi].iOrder,2);
+		x = smTreePos<T>(kd,pTreePos,pi,0);
+		y = smTreePos<T>(kd,pTreePos,pi,1);
+		z = smTreePos<T>(kd,pTreePos,pi,2);
 
 		smx->pqHead = NULL;
 		for (pq=smx->pq;pq<=pqLast;++pq) {
 			pq->ax -= ax;
 			pq->ay -= ay;
 			pq->az -= az;
-			dx = x + pq->ax - GET2<T>(kd->pNumpyPos,p[pq->p].iOrder,0);
-			dy = y + pq->ay - GET2<T>(kd->pNumpyPos,p[pq->p].iOrder,1);
-			dz = z + pq->az - GET2<T>(kd->pNumpyPos,p[pq->p].iOrder,2);
+			dx = x + pq->ax - smTreePos<T>(kd,pTreePos,pq->p,0);
+			dy = y + pq->ay - smTreePos<T>(kd,pTreePos,pq->p,1);
+			dz = z + pq->az - smTreePos<T>(kd,pTreePos,pq->p,2);
 			pq->fKey = dx*dx + dy*dy + dz*dz;
 		}
+		smx->stats.nDistanceEvals += nSmooth;
 		PQ_BUILD(smx->pq,nSmooth,smx->pqHead);
 		ax = 0.0;
 		ay = 0.0;
@@ -550,7 +764,7 @@ int smSmoothStep(SMX smx, int procid)
 	}
 
 	for(int j=0; j<3; ++j) {
-		ri[j] = GET2<T>(kd->pNumpyPos,p[pi].iOrder,j);
+		ri[j] = smTreePos<T>(kd,pTreePos,pi,j);
 	}
 
 	smBallSearch<T>(smx,smx->pqHead->fKey,ri);
@@ -583,7 +797,6 @@ int smSmoothStep(SMX smx, int procid)
 		smx->fList[nCnt++] = pq->fKey;
 
 
-
 		if (GETSMOOTH(T,pq->p) >= 0) continue; // already done, don't re-do
 
 
@@ -598,7 +811,6 @@ int smSmoothStep(SMX smx, int procid)
 	}
 
 
-
 	smx->pi = pi;
 	smx->pin = pin;
 	smx->pNext = pNext;
@@ -610,6 +822,340 @@ int smSmoothStep(SMX smx, int procid)
 }
 
 
+/*
+ ** Dual-tree k-nearest neighbours. Used for the hsm pass and for full
+ ** neighbour lists when every particle is a query point. The tree is
+ ** cut into query subtrees small enough for their neighbour heaps to stay in cache.
+ ** Each query subtree is walked against the whole tree as the reference
+ ** tree. A node pair is pruned when the boxes are further apart than the
+ ** largest current kth-neighbour distance of any query particle in the
+ ** node. Those bounds are cached per query node.
+ */
+
+// Upper limit on the number of heap entries (particles times neighbours) in a
+// query subtree, so that the heaps stay in cache
+#define DUALTREE_HEAP_ENTRIES 65536
+
+template<typename T>
+struct smDualTree {
+	KD kd;
+	KDN *c;
+	const T *pTreePos;
+	int nSplit;
+	int k;
+	int pOffset; // tree-order index of the first particle in the current query subtree
+	float fPeriod[3];
+	float *fBound; // per-node bound on the kth-neighbour distance squared
+	float *fMinKth; // per-node smallest kth-neighbour distance (not squared)
+	float *fHeapKey; // k entries per query particle: max-heap of distances squared...
+	int *pHeap; // ... and the corresponding particles
+	int *nHeap; // number of entries used in each heap
+	long nOpened, nBuckets, nDist, nReplaced;
+};
+
+template<typename T>
+static inline float smPointNodeDist2(const T *r, const KDN *a, const float *fPeriod, T *rImage)
+{
+	// Minimum squared distance between a point and the box of a node. Also
+	// returns in rImage the periodic image of the point nearest the box.
+	float fDist2 = 0, d, gap;
+	for (int j=0;j<3;++j) {
+		d = r[j] - 0.5f*(a->bnd.fMin[j]+a->bnd.fMax[j]);
+		rImage[j] = r[j];
+		if (d > 0.5f*fPeriod[j]) {
+			d -= fPeriod[j];
+			rImage[j] -= fPeriod[j];
+			}
+		else if (d < -0.5f*fPeriod[j]) {
+			d += fPeriod[j];
+			rImage[j] += fPeriod[j];
+			}
+		gap = fabs(d) - 0.5f*(a->bnd.fMax[j]-a->bnd.fMin[j]);
+		if (gap > 0) fDist2 += gap*gap;
+		}
+	return fDist2;
+}
+
+static inline float smNodeDiagonal(const KDN *a)
+{
+	float d2 = 0, d;
+	for (int j=0;j<3;++j) {
+		d = a->bnd.fMax[j]-a->bnd.fMin[j];
+		d2 += d*d;
+		}
+	return sqrt(d2);
+}
+
+static inline float smNodeCentreDist2(const KDN *a, const KDN *b, const float *fPeriod)
+{
+	float fDist2 = 0, d;
+	for (int j=0;j<3;++j) {
+		d = fabs(0.5f*(a->bnd.fMin[j]+a->bnd.fMax[j]) - 0.5f*(b->bnd.fMin[j]+b->bnd.fMax[j]));
+		if (d > 0.5f*fPeriod[j]) d = fPeriod[j]-d;
+		fDist2 += d*d;
+		}
+	return fDist2;
+}
+
+static inline float smNodeDist2(const KDN *a, const KDN *b, const float *fPeriod)
+{
+	// Minimum squared distance between the boxes of two nodes, allowing for
+	// periodic images
+	float fDist2 = 0, d, gap;
+	for (int j=0;j<3;++j) {
+		d = fabs(0.5f*(a->bnd.fMin[j]+a->bnd.fMax[j]) - 0.5f*(b->bnd.fMin[j]+b->bnd.fMax[j]));
+		if (d > 0.5f*fPeriod[j]) d = fPeriod[j]-d;
+		gap = d - 0.5f*(a->bnd.fMax[j]-a->bnd.fMin[j]) - 0.5f*(b->bnd.fMax[j]-b->bnd.fMin[j]);
+		if (gap > 0) fDist2 += gap*gap;
+		}
+	return fDist2;
+}
+
+static inline void smHeapReplaceTop(float *fKey, int *p, int n, float fNewKey, int pNew)
+{
+	// Replace the largest element of a max-heap of n elements and restore the heap
+	int i=0, child;
+	while ((child = 2*i+1) < n) {
+		if (child+1 < n && fKey[child+1] > fKey[child]) ++child;
+		if (fKey[child] <= fNewKey) break;
+		fKey[i] = fKey[child];
+		p[i] = p[child];
+		i = child;
+		}
+	fKey[i] = fNewKey;
+	p[i] = pNew;
+}
+
+static inline void smHeapPush(float *fKey, int *p, int n, float fNewKey, int pNew)
+{
+	// Add an element to a max-heap currently holding n elements
+	int i=n, parent;
+	while (i > 0 && fKey[parent = (i-1)/2] < fNewKey) {
+		fKey[i] = fKey[parent];
+		p[i] = p[parent];
+		i = parent;
+		}
+	fKey[i] = fNewKey;
+	p[i] = pNew;
+}
+
+template<typename T>
+static inline void smDualTreeTightenBound(smDualTree<T> *dt, int q)
+{
+	// Every particle in q is within the box diagonal of the particle with the
+	// smallest kth-neighbour distance, so none can have its kth neighbour
+	// further than that distance plus the diagonal
+	float fBound2;
+	if (dt->fMinKth[q] < FLT_MAX) {
+		fBound2 = dt->fMinKth[q] + smNodeDiagonal(&dt->c[q]);
+		fBound2 *= fBound2;
+		if (fBound2 < dt->fBound[q]) dt->fBound[q] = fBound2;
+		}
+}
+
+template<typename T>
+static void smDualTreeBase(smDualTree<T> *dt, int q, int r)
+{
+	KD kd = dt->kd;
+	KDN *c = dt->c;
+	int pi,pj,k=dt->k,n,slot;
+	T r0[3],ri[3],dx,dy,dz;
+	float fDist2, fBound=0, fMinKth2=FLT_MAX;
+	float *fKey;
+	int *p;
+
+	dt->nBuckets++;
+	for (pi=c[q].pLower;pi<=c[q].pUpper;++pi) {
+		slot = pi-dt->pOffset;
+		fKey = &dt->fHeapKey[(long)slot*k];
+		p = &dt->pHeap[(long)slot*k];
+		n = dt->nHeap[slot];
+		for (int j=0;j<3;++j) r0[j] = smTreePos<T>(kd,dt->pTreePos,pi,j);
+		if (smPointNodeDist2<T>(r0,&c[r],dt->fPeriod,ri) > fKey[0] && n==k) {
+			// nothing in this bucket can be closer than the current neighbours
+			if (fKey[0] > fBound) fBound = fKey[0];
+			if (fKey[0] < fMinKth2) fMinKth2 = fKey[0];
+			continue;
+			}
+		dt->nDist += c[r].pUpper-c[r].pLower+1;
+		for (pj=c[r].pLower;pj<=c[r].pUpper;++pj) {
+			dx = ri[0] - smTreePos<T>(kd,dt->pTreePos,pj,0);
+			dy = ri[1] - smTreePos<T>(kd,dt->pTreePos,pj,1);
+			dz = ri[2] - smTreePos<T>(kd,dt->pTreePos,pj,2);
+			fDist2 = dx*dx + dy*dy + dz*dz;
+			if (n < k) {
+				smHeapPush(fKey, p, n++, fDist2, pj);
+				++dt->nReplaced;
+				}
+			else if (fDist2 < fKey[0]) {
+				smHeapReplaceTop(fKey, p, k, fDist2, pj);
+				++dt->nReplaced;
+				}
+			}
+		dt->nHeap[slot] = n;
+		if (n < k) fBound = FLT_MAX;
+		else {
+			if (fKey[0] > fBound) fBound = fKey[0];
+			if (fKey[0] < fMinKth2) fMinKth2 = fKey[0];
+			}
+		}
+	dt->fMinKth[q] = fMinKth2 < FLT_MAX ? sqrt(fMinKth2) : FLT_MAX;
+	dt->fBound[q] = fBound;
+	smDualTreeTightenBound<T>(dt, q);
+}
+
+template<typename T>
+static void smDualTreeRecurse(smDualTree<T> *dt, int q, int r)
+{
+	KDN *c = dt->c;
+	int r1, r2;
+	float d1, d2;
+
+	if (smNodeDist2(&c[q], &c[r], dt->fPeriod) > dt->fBound[q]) return;
+	dt->nOpened++;
+
+	if (q >= dt->nSplit && r >= dt->nSplit) {
+		smDualTreeBase<T>(dt, q, r);
+		return;
+		}
+
+	if (q >= dt->nSplit || (r < dt->nSplit &&
+			c[r].pUpper-c[r].pLower > c[q].pUpper-c[q].pLower)) {
+		// descend the reference tree, nearer child first
+		r1 = LOWER(r);
+		r2 = UPPER(r);
+		d1 = smNodeDist2(&c[q], &c[r1], dt->fPeriod);
+		d2 = smNodeDist2(&c[q], &c[r2], dt->fPeriod);
+		if (d1 == d2) {
+			// boxes touching or overlapping q; prefer the one whose centre is closer
+			d1 = smNodeCentreDist2(&c[q], &c[r1], dt->fPeriod);
+			d2 = smNodeCentreDist2(&c[q], &c[r2], dt->fPeriod);
+			}
+		if (d2 < d1) {
+			r1 = UPPER(r);
+			r2 = LOWER(r);
+			}
+		smDualTreeRecurse<T>(dt, q, r1);
+		smDualTreeRecurse<T>(dt, q, r2);
+		}
+	else {
+		// descend the query tree
+		smDualTreeRecurse<T>(dt, LOWER(q), r);
+		smDualTreeRecurse<T>(dt, UPPER(q), r);
+		dt->fBound[q] = dt->fBound[LOWER(q)] > dt->fBound[UPPER(q)] ?
+			dt->fBound[LOWER(q)] : dt->fBound[UPPER(q)];
+		dt->fMinKth[q] = dt->fMinKth[LOWER(q)] < dt->fMinKth[UPPER(q)] ?
+			dt->fMinKth[LOWER(q)] : dt->fMinKth[UPPER(q)];
+		smDualTreeTightenBound<T>(dt, q);
+		}
+}
+
+template<typename T>
+static void smDualTreeResetBounds(smDualTree<T> *dt, int q)
+{
+	dt->fBound[q] = FLT_MAX;
+	dt->fMinKth[q] = FLT_MAX;
+	if (q < dt->nSplit) {
+		smDualTreeResetBounds<T>(dt, LOWER(q));
+		smDualTreeResetBounds<T>(dt, UPPER(q));
+		}
+}
+
+static int smGetNextQueryRoot(SMX smx_local)
+{
+	int i;
+#ifdef KDT_THREADING
+	pthread_mutex_lock(smx_local->pMutex);
+	i = smx_local->smx_global->nCurrent++;
+	pthread_mutex_unlock(smx_local->pMutex);
+#else
+	i = smx_local->nCurrent++;
+#endif
+	smx_local->stats.nWorkUnits++;
+	return i;
+}
+
+template<typename T>
+long smDualTreeKnn(SMX smx)
+{
+	// Find the nSmooth nearest neighbours (including itself) of every
+	// particle, sharing the work with any other threads using the same
+	// global context. Sets the smoothing lengths, and also stores the
+	// neighbour lists if smx->pKnnIndex is set. Returns the number of
+	// particles processed by this thread.
+
+	KD kd = smx->kd;
+	smDualTree<T> dt;
+	int q0, qStart, iRoot, slot, j, n, nMax = 0;
+	long nProcessed = 0;
+	float *fKey;
+	int *p;
+
+	dt.kd = kd;
+	dt.c = smx->kdNodes;
+	dt.pTreePos = (const T*)smx->pTreePos;
+	dt.nSplit = kd->nSplit;
+	dt.k = smx->nSmooth;
+	for (j=0;j<3;++j) dt.fPeriod[j] = smx->fPeriod[j];
+	dt.nOpened = dt.nBuckets = dt.nDist = dt.nReplaced = 0;
+
+	// query subtrees are the nodes on the first level that is small enough
+	qStart = ROOT;
+	while (qStart < kd->nSplit && (long)(dt.c[qStart].pUpper-dt.c[qStart].pLower+1)*dt.k > DUALTREE_HEAP_ENTRIES)
+		qStart = LOWER(qStart);
+	for (q0=qStart;q0<2*qStart;++q0)
+		if (dt.c[q0].pUpper-dt.c[q0].pLower+1 > nMax) nMax = dt.c[q0].pUpper-dt.c[q0].pLower+1;
+
+	dt.fBound = (float*)malloc(kd->nNodes*sizeof(float));          assert(dt.fBound != NULL);
+	dt.fMinKth = (float*)malloc(kd->nNodes*sizeof(float));         assert(dt.fMinKth != NULL);
+	dt.fHeapKey = (float*)malloc((long)nMax*dt.k*sizeof(float));   assert(dt.fHeapKey != NULL);
+	dt.pHeap = (int*)malloc((long)nMax*dt.k*sizeof(int));          assert(dt.pHeap != NULL);
+	dt.nHeap = (int*)malloc(nMax*sizeof(int));                     assert(dt.nHeap != NULL);
+
+	while ((iRoot = smGetNextQueryRoot(smx)) < qStart) {
+		q0 = qStart+iRoot;
+		n = dt.c[q0].pUpper-dt.c[q0].pLower+1;
+		dt.pOffset = dt.c[q0].pLower;
+		for (slot=0;slot<n;++slot) dt.nHeap[slot] = 0;
+		smDualTreeResetBounds<T>(&dt, q0);
+
+		smDualTreeRecurse<T>(&dt, q0, ROOT);
+
+		for (slot=0;slot<n;++slot) {
+			int pi = dt.pOffset+slot;
+			int iOrder = kd->p[pi].iOrder;
+			fKey = &dt.fHeapKey[(long)slot*dt.k];
+			p = &dt.pHeap[(long)slot*dt.k];
+			assert(dt.nHeap[slot] == dt.k);
+			SETSMOOTH(T, pi, 0.5*sqrt(fKey[0]));
+			if (smx->pKnnIndex) {
+				// write out in order of increasing distance by draining the heap
+				for (j=dt.k-1;j>=0;--j) {
+					smx->pKnnIndex[(long)iOrder*dt.k+j] = kd->p[p[0]].iOrder;
+					smx->pKnnDist[(long)iOrder*dt.k+j] = sqrt(fKey[0]);
+					smHeapReplaceTop(fKey, p, j, fKey[j], p[j]);
+					}
+				}
+			}
+		nProcessed += n;
+		}
+
+	free(dt.fBound);
+	free(dt.fMinKth);
+	free(dt.fHeapKey);
+	free(dt.pHeap);
+	free(dt.nHeap);
+
+	if (smx->bStats) {
+		smx->stats.nNodesOpened += dt.nOpened;
+		smx->stats.nBucketsScanned += dt.nBuckets;
+		smx->stats.nDistanceEvals += dt.nDist;
+		smx->stats.nQueueReplacements += dt.nReplaced;
+		}
+	return nProcessed;
+}
+
+
 template<typename T>
 T cubicSpline(SMX smx, T r2)
 {
@@ -646,7 +1192,6 @@ T Wendland_kernel(SMX smx, T r2, int nSmooth)
 }
 
 
-
 template<typename T>
 void smDensitySym(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
 {
@@ -668,24 +1213,24 @@ void smDensitySym(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendl
 			rs = cubicSpline(smx, r2);
 		}
 			rs *= fNorm;
-		ACCUM<T>(kd->pNumpyDen,kd->p[pi].iOrder,rs*GET<T>(kd->pNumpyMass,kd->p[pj].iOrder));
-		ACCUM<T>(kd->pNumpyDen,kd->p[pj].iOrder,rs*GET<T>(kd->pNumpyMass,kd->p[pi].iOrder));
+		ACCUM<T>(kd->arDen,kd->p[pi].iOrder,rs*GET<T>(kd->arMass,kd->p[pj].iOrder));
+		ACCUM<T>(kd->arDen,kd->p[pj].iOrder,rs*GET<T>(kd->arMass,kd->p[pi].iOrder));
   }
 
 }
 
-template<typename T>
-void smDensity(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
+template<typename Tf, typename Tq, typename Views>
+void smDensity(SMX smx,const smArrays<Tf,Tq,Views> &ar,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
 {
-	T fNorm,ih2,r2,rs,ih;
+	Tf fNorm,ih2,r2,rs,ih,rho;
 	int j,pj,pi_iord ;
 	KD kd = smx->kd;
 
 	pi_iord = kd->p[pi].iOrder;
-	ih = 1.0/GET<T>(kd->pNumpySmooth, pi_iord);
+	ih = 1.0/ar.smooth(pi_iord);
 	ih2 = ih*ih;
 	fNorm = M_1_PI*ih*ih2;
-	SET<T>(kd->pNumpyDen,pi_iord,0.0);
+	rho = 0.0;
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
 		r2 = fList[j]*ih2;
@@ -696,27 +1241,30 @@ void smDensity(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland
 			rs = cubicSpline(smx, r2);
 		}
 		rs *= fNorm;
-		ACCUM<T>(kd->pNumpyDen,pi_iord,rs*GET<T>(kd->pNumpyMass,kd->p[pj].iOrder));
+		rho += rs*ar.mass(kd->p[pj].iOrder);
 	}
+	ar.den(pi_iord) = rho;
 
 }
 
-template<typename Tf, typename Tq>
-void smMeanQty1D(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
+template<typename Tf, typename Tq, typename Views>
+void smMeanQty1D(SMX smx,const smArrays<Tf,Tq,Views> &ar,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
 {
 	Tf fNorm,ih2,r2,rs,ih,mass,rho;
-	int j,pj,pi_iord ;
+	int j,pj,pj_iord,pi_iord ;
 	KD kd = smx->kd;
+	Tq sum;
 
 	pi_iord = kd->p[pi].iOrder;
-	ih = 1.0/GET<Tf>(kd->pNumpySmooth, pi_iord);
+	ih = 1.0/ar.smooth(pi_iord);
 	ih2 = ih*ih;
 	fNorm = M_1_PI*ih*ih2;
 
-	SET<Tq>(kd->pNumpyQtySmoothed,pi_iord,0.0);
+	sum = 0.0;
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
+		pj_iord = kd->p[pj].iOrder;
 		r2 = fList[j]*ih2;
 		if (Wendland) {
 			rs = Wendland_kernel(smx, r2, nSmooth);
@@ -725,31 +1273,34 @@ void smMeanQty1D(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 			rs = cubicSpline(smx, r2);
 		}
 		rs *= fNorm;
-		mass=GET<Tf>(kd->pNumpyMass,kd->p[pj].iOrder);
-		rho=GET<Tf>(kd->pNumpyDen,kd->p[pj].iOrder);
-		ACCUM<Tq>(kd->pNumpyQtySmoothed,pi_iord,
-			  rs*mass*GET<Tq>(kd->pNumpyQty,kd->p[pj].iOrder)/rho);
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
+		sum += rs*mass*ar.qty1(pj_iord)/rho;
 	}
 
+	ar.qtySmoothed1(pi_iord) = sum;
+
 }
 
-template<typename Tf, typename Tq>
-void smMeanQtyND(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
+template<typename Tf, typename Tq, typename Views>
+void smMeanQtyND(SMX smx,const smArrays<Tf,Tq,Views> &ar,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
 {
 	Tf fNorm,ih2,r2,rs,ih,mass,rho;
-	int j,k,pj,pi_iord ;
+	int j,k,pj,pj_iord,pi_iord ;
 	KD kd = smx->kd;
+	Tq sum[3];
 
 	pi_iord = kd->p[pi].iOrder;
-	ih = 1.0/GET<Tf>(kd->pNumpySmooth, pi_iord);
+	ih = 1.0/ar.smooth(pi_iord);
 	ih2 = ih*ih;
 	fNorm = M_1_PI*ih*ih2;
 
 	for(k=0;k<3;++k)
-		SET2<Tq>(kd->pNumpyQtySmoothed,pi_iord,k,0.0);
+		sum[k] = 0.0;
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
+		pj_iord = kd->p[pj].iOrder;
 		r2 = fList[j]*ih2;
 		if (Wendland) {
 			rs = Wendland_kernel(smx, r2, nSmooth);
@@ -758,14 +1309,16 @@ void smMeanQtyND(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 			rs = cubicSpline(smx, r2);
 		}
 		rs *= fNorm;
-		mass=GET<Tf>(kd->pNumpyMass,kd->p[pj].iOrder);
-		rho=GET<Tf>(kd->pNumpyDen,kd->p[pj].iOrder);
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
 		for(k=0;k<3;++k) {
-			ACCUM2<Tq>(kd->pNumpyQtySmoothed,pi_iord,k,
-			    rs*mass*GET2<Tq>(kd->pNumpyQty,kd->p[pj].iOrder,k)/rho);
+			sum[k] += rs*mass*ar.qty3(pj_iord,k)/rho;
 		}
 	}
 
+	for(k=0;k<3;++k)
+		ar.qtySmoothed3(pi_iord,k) = sum[k];
+
 }
 
 template<typename Tf>
@@ -792,34 +1345,35 @@ Tf Wendland_gradient(Tf q, Tf r)
 }
 
 
-template<typename Tf, typename Tq>
-void smCurlQty(SMX smx,int pi, int nSmooth,int *pList,float *fList, bool Wendland)
+template<typename Tf, typename Tq, typename Views>
+void smCurlQty(SMX smx,const smArrays<Tf,Tq,Views> &ar,int pi, int nSmooth,int *pList,float *fList, bool Wendland)
 {
 	Tf fNorm,ih2,r2,r,rs,q2,q,ih,mass,rho, dqty[3], qty_i[3];
 	int j,k,pj,pi_iord, pj_iord;
 	KD kd = smx->kd;
 	Tf curl[3], x,y,z,dx,dy,dz;
+	Tq sum[3];
 
 	pi_iord = kd->p[pi].iOrder;
-	ih = 1.0/GET<Tf>(kd->pNumpySmooth, pi_iord);
+	ih = 1.0/ar.smooth(pi_iord);
 	ih2 = ih*ih;
 	fNorm = M_1_PI*ih2*ih2;
 
 	for(k=0;k<3;++k) {
-		SET2<Tq>(kd->pNumpyQtySmoothed, pi_iord, k, 0.0);
-		qty_i[k] = GET2<Tq>(kd->pNumpyQty, pi_iord, k);
+		sum[k] = 0.0;
+		qty_i[k] = ar.qty3(pi_iord, k);
 	}
 
-	x = GET2<Tf>(kd->pNumpyPos, pi_iord, 0);
-	y = GET2<Tf>(kd->pNumpyPos, pi_iord, 1);
-	z = GET2<Tf>(kd->pNumpyPos, pi_iord, 2);
+	x = ar.pos(pi_iord, 0);
+	y = ar.pos(pi_iord, 1);
+	z = ar.pos(pi_iord, 2);
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
 		pj_iord = kd->p[pj].iOrder;
-		dx = x - GET2<Tf>(kd->pNumpyPos, pj_iord, 0);
-		dy = y - GET2<Tf>(kd->pNumpyPos, pj_iord, 1);
-		dz = z - GET2<Tf>(kd->pNumpyPos, pj_iord, 2);
+		dx = x - ar.pos(pj_iord, 0);
+		dy = y - ar.pos(pj_iord, 1);
+		dz = z - ar.pos(pj_iord, 2);
 
 		r2 = fList[j];
 		q2 = r2*ih2;
@@ -836,50 +1390,54 @@ void smCurlQty(SMX smx,int pi, int nSmooth,int *pList,float *fList, bool Wendlan
 
 		rs *= fNorm;
 
-		mass=GET<Tf>(kd->pNumpyMass, pj_iord);
-		rho=GET<Tf>(kd->pNumpyDen, pj_iord);
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
 
 		for(k=0;k<3;++k)
-			dqty[k] = GET2<Tq>(kd->pNumpyQty, pj_iord, k) - qty_i[k];
+			dqty[k] = ar.qty3(pj_iord, k) - qty_i[k];
 
 		curl[0] = dy * dqty[2] - dz * dqty[1];
 		curl[1] = dz * dqty[0] - dx * dqty[2];
 		curl[2] = dx * dqty[1] - dy * dqty[0];
 
 		for(k=0;k<3;++k) {
-			ACCUM2<Tq>(kd->pNumpyQtySmoothed, pi_iord, k, rs*curl[k]*mass/rho);
+			sum[k] += rs*curl[k]*mass/rho;
 		}
 	}
+
+	for(k=0;k<3;++k)
+		ar.qtySmoothed3(pi_iord, k) = sum[k];
 }
 
-template<typename Tf, typename Tq>
-void smDivQty(SMX smx,int pi, int nSmooth,int *pList,float *fList, bool Wendland)
+template<typename Tf, typename Tq, typename Views>
+void smDivQty(SMX smx,const smArrays<Tf,Tq,Views> &ar,int pi, int nSmooth,int *pList,float *fList, bool Wendland)
 {
 	Tf fNorm,ih2,r2,r,rs,q2,q,ih,mass,rho, div, dqty[3], qty_i[3];
 	int j,k,pj,pi_iord, pj_iord;
 	KD kd = smx->kd;
 	Tf x,y,z,dx,dy,dz;
+	Tq sum;
 
 	pi_iord = kd->p[pi].iOrder;
-	ih = 1.0/GET<Tf>(kd->pNumpySmooth, pi_iord);
+	ih = 1.0/ar.smooth(pi_iord);
 	ih2 = ih*ih;
 	fNorm = M_1_PI*ih2*ih2;
 
-	SET<Tq>(kd->pNumpyQtySmoothed, pi_iord, 0.0);
+	sum = 0.0;
 
-	x = GET2<Tf>(kd->pNumpyPos, pi_iord, 0);
-	y = GET2<Tf>(kd->pNumpyPos, pi_iord, 1);
-	z = GET2<Tf>(kd->pNumpyPos, pi_iord, 2);
+	x = ar.pos(pi_iord, 0);
+	y = ar.pos(pi_iord, 1);
+	z = ar.pos(pi_iord, 2);
 
 	for(k=0;k<3;++k)
-		qty_i[k] = GET2<Tq>(kd->pNumpyQty, pi_iord, k);
+		qty_i[k] = ar.qty3(pi_iord, k);
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
 		pj_iord = kd->p[pj].iOrder;
-		dx = x - GET2<Tf>(kd->pNumpyPos, pj_iord, 0);
-		dy = y - GET2<Tf>(kd->pNumpyPos, pj_iord, 1);
-		dz = z - GET2<Tf>(kd->pNumpyPos, pj_iord, 2);
+		dx = x - ar.pos(pj_iord, 0);
+		dy = y - ar.pos(pj_iord, 1);
+		dz = z - ar.pos(pj_iord, 2);
 
 		r2 = fList[j];
 		q2 = r2*ih2;
@@ -895,34 +1453,35 @@ void smDivQty(SMX smx,int pi, int nSmooth,int *pList,float *fList, bool Wendland
 
 		rs *= fNorm;
 
-		mass=GET<Tf>(kd->pNumpyMass, pj_iord);
-		rho=GET<Tf>(kd->pNumpyDen, pj_iord);
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
 
 		for(k=0;k<3;++k)
-			dqty[k] = GET2<Tq>(kd->pNumpyQty, pj_iord, k) - qty_i[k];
+			dqty[k] = ar.qty3(pj_iord, k) - qty_i[k];
 
 		div = dx * dqty[0] + dy * dqty[1] + dz * dqty[2];
 
-		ACCUM<Tq>(kd->pNumpyQtySmoothed, pi_iord, rs*div*mass/rho);
+		sum += rs*div*mass/rho;
 	}
+
+	ar.qtySmoothed1(pi_iord) = sum;
 }
 
-template<typename Tf, typename Tq>
-void smDispQtyND(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
+template<typename Tf, typename Tq, typename Views>
+void smDispQtyND(SMX smx,const smArrays<Tf,Tq,Views> &ar,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
 {
 	float fNorm,ih2,r2,rs,ih,mass,rho;
-	int j,k,pj,pi_iord ;
+	int j,k,pj,pj_iord,pi_iord ;
 	KD kd = smx->kd;
 	float mean[3], tdiff;
+	Tq sum;
 
 	pi_iord = kd->p[pi].iOrder;
-	ih = 1.0/GET<Tf>(kd->pNumpySmooth, pi_iord);
+	ih = 1.0/ar.smooth(pi_iord);
 	ih2 = ih*ih;
 	fNorm = M_1_PI*ih*ih2;
 
-
-
-	SET<Tq>(kd->pNumpyQtySmoothed,pi_iord,0.0);
+	sum = 0.0;
 
 	for(k=0;k<3;++k) {
 
@@ -933,6 +1492,7 @@ void smDispQtyND(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
+		pj_iord = kd->p[pj].iOrder;
 		r2 = fList[j]*ih2;
 		if (Wendland) {
 			rs = Wendland_kernel(smx, r2, nSmooth);
@@ -941,16 +1501,17 @@ void smDispQtyND(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 			rs = cubicSpline(smx, r2);
 		}
 		rs *= fNorm;
-		mass=GET<Tf>(kd->pNumpyMass,kd->p[pj].iOrder);
-		rho=GET<Tf>(kd->pNumpyDen,kd->p[pj].iOrder);
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
 		for(k=0;k<3;++k)
-			mean[k]+=rs*mass*GET2<Tq>(kd->pNumpyQty,kd->p[pj].iOrder,k)/rho;
+			mean[k]+=rs*mass*ar.qty3(pj_iord,k)/rho;
 	}
 
 	// pass 2: get variance
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
+		pj_iord = kd->p[pj].iOrder;
 		r2 = fList[j]*ih2;
 		if (Wendland) {
 			rs = Wendland_kernel(smx, r2, nSmooth);
@@ -959,39 +1520,35 @@ void smDispQtyND(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 			rs = cubicSpline(smx, r2);
 		}
 		rs *= fNorm;
-		mass=GET<Tf>(kd->pNumpyMass,kd->p[pj].iOrder);
-		rho=GET<Tf>(kd->pNumpyDen,kd->p[pj].iOrder);
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
 		for(k=0;k<3;++k) {
-			tdiff = mean[k]-GET2<Tq>(kd->pNumpyQty,kd->p[pj].iOrder,k);
-			ACCUM<Tq>(kd->pNumpyQtySmoothed,pi_iord,
-				rs*mass*tdiff*tdiff/rho);
+			tdiff = mean[k]-ar.qty3(pj_iord,k);
+			sum += rs*mass*tdiff*tdiff/rho;
 		}
 	}
 
 	// finally: take square root to get dispersion
 
-	SET<Tq>(kd->pNumpyQtySmoothed,pi_iord,sqrt(GET<Tq>(kd->pNumpyQtySmoothed,pi_iord)));
+	ar.qtySmoothed1(pi_iord) = sqrt(sum);
 
 }
 
 
-
-template<typename Tf, typename Tq>
-void smDispQty1D(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
+template<typename Tf, typename Tq, typename Views>
+void smDispQty1D(SMX smx,const smArrays<Tf,Tq,Views> &ar,int pi,int nSmooth,int *pList,float *fList, bool Wendland)
 {
 	float fNorm,ih2,r2,rs,ih,mass,rho;
-	int j,pj,pi_iord ;
+	int j,pj,pj_iord,pi_iord ;
 	KD kd = smx->kd;
-	Tq mean, tdiff;
+	Tq mean, tdiff, sum;
 
 	pi_iord = kd->p[pi].iOrder;
-	ih = 1.0/GET<Tf>(kd->pNumpySmooth, pi_iord);
+	ih = 1.0/ar.smooth(pi_iord);
 	ih2 = ih*ih;
 	fNorm = M_1_PI*ih*ih2;
 
-
-
-	SET<Tq>(kd->pNumpyQtySmoothed,pi_iord,0.0);
+	sum = 0.0;
 
 	mean=0;
 
@@ -999,6 +1556,7 @@ void smDispQty1D(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
+		pj_iord = kd->p[pj].iOrder;
 		r2 = fList[j]*ih2;
 		if (Wendland) {
 			rs = Wendland_kernel(smx, r2, nSmooth);
@@ -1008,15 +1566,16 @@ void smDispQty1D(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 		}
 
 		rs *= fNorm;
-		mass=GET<Tf>(kd->pNumpyMass,kd->p[pj].iOrder);
-		rho=GET<Tf>(kd->pNumpyDen,kd->p[pj].iOrder);
-		mean+=rs*mass*GET<Tq>(kd->pNumpyQty,kd->p[pj].iOrder)/rho;
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
+		mean+=rs*mass*ar.qty1(pj_iord)/rho;
 	}
 
 	// pass 2: get variance
 
 	for (j=0;j<nSmooth;++j) {
 		pj = pList[j];
+		pj_iord = kd->p[pj].iOrder;
 		r2 = fList[j]*ih2;
 		if (Wendland) {
 			rs = Wendland_kernel(smx, r2, nSmooth);
@@ -1025,138 +1584,232 @@ void smDispQty1D(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendla
 			rs = cubicSpline(smx, r2);
 		}
 		rs *= fNorm;
-		mass=GET<Tf>(kd->pNumpyMass,kd->p[pj].iOrder);
-		rho=GET<Tf>(kd->pNumpyDen,kd->p[pj].iOrder);
-		tdiff = mean-GET<Tq>(kd->pNumpyQty,kd->p[pj].iOrder);
-		ACCUM<Tq>(kd->pNumpyQtySmoothed,pi_iord,rs*mass*tdiff*tdiff/rho);
+		mass=ar.mass(pj_iord);
+		rho=ar.den(pj_iord);
+		tdiff = mean-ar.qty1(pj_iord);
+		sum += rs*mass*tdiff*tdiff/rho;
 	}
 
 	// finally: take square root to get dispersion
 
-	SET<Tq>(kd->pNumpyQtySmoothed,pi_iord,sqrt(GET<Tq>(kd->pNumpyQtySmoothed,pi_iord)));
+	ar.qtySmoothed1(pi_iord) = sqrt(sum);
 
 }
 
 
+template<typename Tf, typename Tq>
+bool smArraysContiguous(KD kd, int propid)
+{
+	// Whether all the arrays read or written by operation propid can be
+	// accessed through smContiguousViews
+	bool ndQty = propid==PROPID_QTYMEAN_ND || propid==PROPID_QTYDISP_ND ||
+		propid==PROPID_QTYDIV || propid==PROPID_QTYCURL;
+	bool ndResult = propid==PROPID_QTYMEAN_ND || propid==PROPID_QTYCURL;
 
-// instantiate the actual functions that are available:
-
-template
-void smBallSearch<double>(SMX smx,float fBall2,float *ri);
-
-template
-int smBallGather<double>(SMX smx,float fBall2,float *ri);
+	if (!kdIsContiguous(kd->arPos, sizeof(Tf), 3) || !kdIsContiguous(kd->arMass, sizeof(Tf), 1) ||
+		!kdIsContiguous(kd->arSmooth, sizeof(Tf), 1) || !kdIsContiguous(kd->arDen, sizeof(Tf), 1))
+		return false;
 
-template
-void smDomainDecomposition<double>(KD kd, int nprocs);
+	if (propid==PROPID_HSM || propid==PROPID_RHO || propid==PROPID_HSM_DUALTREE || propid==PROPID_KNN)
+		return true;
 
-template
-int smSmoothStep<double>(SMX smx, int procid);
+	return kdIsContiguous(kd->arQty, sizeof(Tq), ndQty ? 3 : 1) &&
+		kdIsContiguous(kd->arQtySmoothed, sizeof(Tq), ndResult ? 3 : 1);
+}
 
-template
-void smDensitySym<double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+template<typename Tf, typename Tq, typename Views>
+bool smPopulateWithViews(SMX smx_global, int propid, int procid, bool Wendland, bool numa, bool stats)
+{
+	long i,nCnt;
+	KD kd = smx_global->kd;
+	SMX smx_local;
+	float ri[3];
+	float hsm;
+	long nbodies = kd->nActive;
+	long total_particles=0;
+	double tStart = smWallTime(), t0 = 0, t1 = 0;
+	bool ok;
 
-template
-void smDensity<double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+	smArrays<Tf,Tq,Views> ar(kd);
+	void (*pSmFn)(SMX, const smArrays<Tf,Tq,Views> &, int ,int ,int *,float *, bool)=NULL;
 
+#ifdef KDT_THREADING
+	smx_local = smInitThreadLocalCopy(smx_global);
+	smResetStats(smx_local, stats);
+	smx_local->warnings=false;
+	smx_local->pi = 0;
+	// start the snake at the beginning of this thread's own domain
+	smx_local->pNext = smDomainStart(kd, procid%smx_global->nProcs, smx_global->nProcs);
+
+	if(numa)
+		smUseNumaReplica<Tf>(smx_local, procid);
+#else
+	smx_local = smx_global;
+	smResetStats(smx_local, stats);
+#endif
 
+	smx_global->warnings=false;
+	smx_local->stats.tSetup = smWallTime()-tStart;
 
-template
-void smBallSearch<float>(SMX smx,float fBall2,float *ri);
+	switch(propid)
+	{
+		case PROPID_RHO:
+			pSmFn = &smDensity<Tf,Tq,Views>;
+			break;
+		case PROPID_QTYMEAN_ND:
+			pSmFn = &smMeanQtyND<Tf,Tq,Views>;
+			break;
+		case PROPID_QTYDISP_ND:
+			pSmFn = &smDispQtyND<Tf,Tq,Views>;
+			break;
+		case PROPID_QTYMEAN_1D:
+			pSmFn = &smMeanQty1D<Tf,Tq,Views>;
+			break;
+		case PROPID_QTYDISP_1D:
+			pSmFn = &smDispQty1D<Tf,Tq,Views>;
+			break;
+		case PROPID_QTYDIV:
+			pSmFn = &smDivQty<Tf,Tq,Views>;
+			break;
+		case PROPID_QTYCURL:
+			pSmFn = &smCurlQty<Tf,Tq,Views>;
+			break;
+	}
 
-template
-int smBallGather<float>(SMX smx,float fBall2,float *ri);
+	if(propid==PROPID_HSM) {
+		t0 = smWallTime();
+		for (i=0; i < nbodies; i++) {
+			nCnt = smSmoothStep<Tf>(smx_local, procid);
+			if(nCnt==-1)
+				break; // nothing more to do
+			total_particles+=1;
+		}
+		smx_local->stats.tSearch = smWallTime()-t0;
+	} else if(propid==PROPID_HSM_DUALTREE || propid==PROPID_KNN) {
+		t0 = smWallTime();
+		total_particles = smDualTreeKnn<Tf>(smx_local);
+		smx_local->stats.tSearch = smWallTime()-t0;
+	} else {
+		i=smGetNext(smx_local);
 
-template
-void smDomainDecomposition<float>(KD kd, int nprocs);
+		while(i<nbodies) {
+			// make a copy of the position of this particle
+			for(int j=0; j<3; ++j) {
+				ri[j] = ar.pos(kd->p[i].iOrder,j);
+			}
 
-template
-int smSmoothStep<float>(SMX smx, int procid);
+			// retrieve the existing smoothing length
+			hsm = ar.smooth(kd->p[i].iOrder);
 
-template
-void smDensitySym<float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+			// use it to get nearest neighbours
+			if(stats) t0 = smWallTime();
+			nCnt = smBallGather<Tf>(smx_local,4*hsm*hsm,ri);
+			if(stats) t1 = smWallTime();
 
-template
-void smDensity<float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+			// calculate the density
+			(*pSmFn)(smx_local, ar, i, nCnt, smx_local->pList,smx_local->fList, Wendland);
 
+			if(stats) {
+				smx_local->stats.tSearch += t1-t0;
+				smx_local->stats.tKernel += smWallTime()-t1;
+			}
+			total_particles+=1;
 
+			// select next particle in coordination with other threads
+			i=smGetNext(smx_local);
 
+			if(smx_global->warnings)
+				break;
+		}
+	}
 
-template
-void smMeanQty1D<double, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+	smx_local->stats.nParticles = total_particles;
+	smx_local->stats.tTotal = smWallTime()-tStart;
+	smStoreStats(smx_local, procid);
 
-template
-void smMeanQtyND<double, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+	ok = !smx_local->warnings;
 
-template
-void smDispQty1D<double, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+#ifdef KDT_THREADING
+	smFinishThreadLocalCopy(smx_local);
+#endif
 
-template
-void smDispQtyND<double, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+	return ok;
+}
 
-template
-void smCurlQty<double, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+template<typename Tf, typename Tq>
+bool smPopulate(SMX smx_global, int propid, int procid, bool Wendland, bool numa, bool stats)
+{
+	// Carry out this thread's share of the smoothing operation propid (one of
+	// the PROPID_* values), with procid identifying the thread. Returns false
+	// if the neighbour buffer overflowed, in which case results are incomplete.
+
+	if (smArraysContiguous<Tf,Tq>(smx_global->kd, propid))
+		return smPopulateWithViews<Tf,Tq,smContiguousViews>(smx_global, propid, procid, Wendland, numa, stats);
+	else
+		return smPopulateWithViews<Tf,Tq,smStridedViews>(smx_global, propid, procid, Wendland, numa, stats);
+}
 
-template
-void smDivQty<double, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
 
+// instantiate the actual functions that are available:
 
 template
-void smMeanQty1D<double, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smBallSearch<double>(SMX smx,float fBall2,float *ri);
 
 template
-void smMeanQtyND<double, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+int smBallGather<double>(SMX smx,float fBall2,float *ri);
 
 template
-void smDispQty1D<double, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smDomainDecomposition<double>(KD kd, int nprocs);
 
 template
-void smDispQtyND<double, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+double *smMakeTreePos<double>(KD kd);
 
 template
-void smCurlQty<double, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+int smSmoothStep<double>(SMX smx, int procid);
 
 template
-void smDivQty<double, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smDensitySym<double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
 
 
 template
-void smMeanQty1D<float, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smBallSearch<float>(SMX smx,float fBall2,float *ri);
 
 template
-void smMeanQtyND<float, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+int smBallGather<float>(SMX smx,float fBall2,float *ri);
 
 template
-void smDispQty1D<float, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smDomainDecomposition<float>(KD kd, int nprocs);
 
 template
-void smDispQtyND<float, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+float *smMakeTreePos<float>(KD kd);
 
 template
-void smCurlQty<float, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+int smSmoothStep<float>(SMX smx, int procid);
 
 template
-void smDivQty<float, double>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smDensitySym<float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
 
 
+#ifdef KDT_THREADING
 template
-void smMeanQty1D<float, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smUseNumaReplica<double>(SMX smx_local, int procid);
 
 template
-void smMeanQtyND<float, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+void smUseNumaReplica<float>(SMX smx_local, int procid);
+#endif
 
-template
-void smDispQty1D<float, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
 
 template
-void smDispQtyND<float, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+bool smPopulate<double, double>(SMX smx_global, int propid, int procid, bool Wendland, bool numa, bool stats);
 
 template
-void smCurlQty<float, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+bool smPopulate<double, float>(SMX smx_global, int propid, int procid, bool Wendland, bool numa, bool stats);
 
 template
-void smDivQty<float, float>(SMX smx,int pi,int nSmooth,int *pList,float *fList, bool Wendland);
+bool smPopulate<float, double>(SMX smx_global, int propid, int procid, bool Wendland, bool numa, bool stats);
 
+template
+bool smPopulate<float, float>(SMX smx_global, int propid, int procid, bool Wendland, bool numa, bool stats);
 
 
 /*
@@ -1274,7 +1927,6 @@ void smVelDisp(SMX smx,int pi,int nSmooth,int *pList,float *fList)
 }
 
 
-
 void smVelDispSym(SMX smx,int pi,int nSmooth,int *pList,float *fList)
 {
 	float fNorm,ih2,r2,rs,tv2;
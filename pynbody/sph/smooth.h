@@ -7,6 +7,18 @@
 
 #define RESMOOTH_SAFE  500
 
+// Smoothing operations understood by smPopulate
+#define PROPID_HSM      1
+#define PROPID_RHO      2
+#define PROPID_QTYMEAN_1D    3
+#define PROPID_QTYMEAN_ND    4
+#define PROPID_QTYDISP_1D    5
+#define PROPID_QTYDISP_ND    6
+#define PROPID_QTYDIV        7
+#define PROPID_QTYCURL       8
+#define PROPID_HSM_DUALTREE  9 // as PROPID_HSM, but using the dual-tree search
+#define PROPID_KNN           10 // as PROPID_HSM_DUALTREE, also storing neighbour lists
+
 #define M_1_PI  0.31830988618379067154
 
 typedef struct pqNode {
@@ -22,6 +34,23 @@ typedef struct pqNode {
 	} PQ;
 
 
+// Hot-path counters and timers for one thread. Counters are accumulated
+// locally in the walk routines and only written here if bStats is set.
+typedef struct smStats {
+	long nNodesOpened; // tree cells that were not pruned by the ball test
+	long nBucketsScanned;
+	long nDistanceEvals;
+	long nQueueReplacements; // priority queue updates during ball searches
+	long nSnakeRestarts; // hsm steps that had to start a fresh queue
+	long nSnakeContinuations; // hsm steps that reused the previous particle's queue
+	long nWorkUnits; // blocks of particles taken from the shared counter
+	long nParticles; // particles processed by this thread
+	double tSetup; // wall-clock seconds in thread set up (incl. NUMA replicas)
+	double tSearch; // ... finding neighbours
+	double tKernel; // ... evaluating the smoothing function
+	double tTotal;
+	} SMSTATS;
+
 typedef struct smContext {
 	KD kd;
 	int nSmooth;
@@ -33,10 +62,21 @@ typedef struct smContext {
 	float *fList;
 	int *pList;
 	int nCurrent; // current particle index for distributed loops
+	int nProcs; // number of threads the domain decomposition is made for
+
+	KDN *kdNodes; // nodes used by tree walks; either kd->kdNodes or a NUMA-local replica
+	void *pTreePos; // tree-ordered 3xN copy of the positions, or NULL to read through iOrder
+	long *pKnnIndex; // output for PROPID_KNN: nSmooth neighbour indices per particle, or NULL
+	float *pKnnDist; // output for PROPID_KNN: the corresponding distances
 
 #ifdef KDT_THREADING
 	pthread_mutex_t *pMutex;
 
+	int nReplicas; // number of NUMA nodes holding replicas (global context only)
+	KDN **pNodeReplicas;
+	void **pPosReplicas;
+	volatile int *pReplicaState; // 0: not built; 1: building; 2: ready
+
 	int nLocals; // number of local copies if this is a global smooth context
 	int nReady; // number of local copies that are "ready" for the next stage
 	pthread_cond_t *pReady; // synchronizing condition
@@ -47,6 +87,11 @@ typedef struct smContext {
     int pin,pi,pNext;
     float ax,ay,az;
     bool warnings; //  keep track of whether a memory-overrun  warning has been issued
+
+    bool bStats; // whether to record stats below
+    SMSTATS stats; // this thread's stats
+    int nThreadStats;
+    SMSTATS *pThreadStats; // per-thread stats, gathered in the global context
 	} * SMX;
 
 
@@ -127,21 +172,45 @@ void smSmoothInitStep(SMX smx, int nProcs);
 template<typename T>
 void smDensitySym(SMX,int,int,int *,float *, bool);
 
-template<typename T>
-void smDensity(SMX,int,int,int *,float *, bool);
+// Views of all the arrays a smoothing kernel may touch. Views is one of the
+// two layouts below; smPopulate picks smContiguousViews when every array the
+// requested operation uses is C-contiguous, and smStridedViews otherwise.
+struct smStridedViews {
+	template<typename T, int NCOL> using View = StridedView<T>;
+};
+
+struct smContiguousViews {
+	template<typename T, int NCOL> using View = ContiguousView<T, NCOL>;
+};
+
+template<typename Tf, typename Tq, typename Views>
+struct smArrays {
+	typename Views::template View<Tf,3> pos;
+	typename Views::template View<Tf,1> mass, smooth, den;
+	typename Views::template View<Tq,1> qty1, qtySmoothed1; // for 1D quantities
+	typename Views::template View<Tq,3> qty3, qtySmoothed3; // for 3D quantities
+
+	smArrays(KD kd) : pos(kd->arPos), mass(kd->arMass), smooth(kd->arSmooth), den(kd->arDen),
+		qty1(kd->arQty), qtySmoothed1(kd->arQtySmoothed), qty3(kd->arQty), qtySmoothed3(kd->arQtySmoothed) { }
+};
 
 template<typename Tf, typename Tq>
-void smMeanQtyND(SMX,int,int,int *,float *, bool);
-template<typename Tf, typename Tq>
-void smDispQtyND(SMX,int,int,int *,float *, bool);
-template<typename Tf, typename Tq>
-void smMeanQty1D(SMX,int,int,int *,float *, bool);
-template<typename Tf, typename Tq>
-void smDispQty1D(SMX,int,int,int *,float *, bool);
-template<typename Tf, typename Tq>
-void smDivQty(SMX,int,int,int *,float *, bool);
-template<typename Tf, typename Tq>
-void smCurlQty(SMX,int,int,int *,float *, bool);
+bool smArraysContiguous(KD kd, int propid);
+
+template<typename Tf, typename Tq, typename Views>
+void smDensity(SMX,const smArrays<Tf,Tq,Views> &,int,int,int *,float *, bool);
+template<typename Tf, typename Tq, typename Views>
+void smMeanQtyND(SMX,const smArrays<Tf,Tq,Views> &,int,int,int *,float *, bool);
+template<typename Tf, typename Tq, typename Views>
+void smDispQtyND(SMX,const smArrays<Tf,Tq,Views> &,int,int,int *,float *, bool);
+template<typename Tf, typename Tq, typename Views>
+void smMeanQty1D(SMX,const smArrays<Tf,Tq,Views> &,int,int,int *,float *, bool);
+template<typename Tf, typename Tq, typename Views>
+void smDispQty1D(SMX,const smArrays<Tf,Tq,Views> &,int,int,int *,float *, bool);
+template<typename Tf, typename Tq, typename Views>
+void smDivQty(SMX,const smArrays<Tf,Tq,Views> &,int,int,int *,float *, bool);
+template<typename Tf, typename Tq, typename Views>
+void smCurlQty(SMX,const smArrays<Tf,Tq,Views> &,int,int,int *,float *, bool);
 
 bool smCheckFits(KD kd, float *fPeriod);
 
@@ -169,8 +238,38 @@ void smVelDispNBSym(SMX,int,int,int *,float *);
 template<typename T>
 void smDomainDecomposition(KD kd, int nprocs);
 
+int smDomainStart(KD kd, int procid, int nprocs);
+
+int smNumaNodeCount();
+bool smPinThreadToNode(int node);
+
+template<typename T>
+T *smMakeTreePos(KD kd);
+
+#ifdef KDT_THREADING
+template<typename T>
+void smUseNumaReplica(SMX smx_local, int procid);
+#endif
+
+template<typename T>
+inline T smTreePos(KD kd, const T *pTreePos, int pj, int d) {
+	// Position of the pj-th particle in tree order, from the tree-ordered copy if one exists
+	if(pTreePos) return pTreePos[3*pj+d];
+	else return GET2<T>(kd->arPos, kd->p[pj].iOrder, d);
+}
+
 int smGetNext(SMX smx_local);
 
+template<typename T>
+long smDualTreeKnn(SMX smx);
+
+template<typename Tf, typename Tq>
+bool smPopulate(SMX smx_global, int propid, int procid, bool Wendland, bool numa, bool stats);
+
+double smWallTime();
+void smResetStats(SMX smx, bool bStats);
+void smStoreStats(SMX smx_local, int procid);
+
 #ifdef KDT_THREADING
 void smReset(SMX smx_local);
 SMX smInitThreadLocalCopy(SMX smx_global);
@@ -106,9 +106,21 @@ ext_modules.append(kdmain)
 gravity = Extension('pynbody.gravity._gravity',
                         sources = ["pynbody/gravity/_gravity.pyx"],
                         include_dirs=incdir,
-                        extra_compile_args=openmp_args,
+                        # allow the direct-summation kernel's square roots to be vectorised
+                        extra_compile_args=openmp_args + ['-fno-math-errno'],
                         extra_link_args=openmp_args)
 
+pkdgrav = Extension('pynbody.gravity.pkdgrav',
+                    sources = ['pynbody/gravity/main.c', 'pynbody/gravity/serialtree.c',
+                               'pynbody/gravity/walk.c', 'pynbody/gravity/grav.c', 'pynbody/gravity/fmm.c',
+                               'pynbody/gravity/moments.c'],
+                    include_dirs=incdir,
+                    undef_macros=['DEBUG'],
+                    # allow the mixed precision tree walk's square roots, and the selections between the
+                    # branches of its softening kernels, to be vectorised
+                    extra_compile_args=openmp_args + ['-fno-math-errno', '-fno-trapping-math'],
+                    extra_link_args=openmp_args)
+
 omp_commands = Extension('pynbody.openmp',
                         sources = ["pynbody/"+openmp_module_source+".pyx"],
                         include_dirs=incdir,
@@ -121,7 +133,9 @@ chunkscan = Extension('pynbody.chunk.scan',
 
 sph_render = Extension('pynbody.sph._render',
                   sources=['pynbody/sph/_render.pyx'],
-                  include_dirs=incdir)
+                  include_dirs=incdir,
+                  extra_compile_args=openmp_args,
+                  extra_link_args=openmp_args)
 
 halo_pyx = Extension('pynbody.analysis._com',
                      sources=['pynbody/analysis/_com.pyx'],
@@ -151,7 +165,7 @@ interpolate3d_pyx = Extension('pynbody.analysis._interpolate3d',
                               extra_link_args=openmp_args)
 
 
-ext_modules += [gravity, chunkscan, sph_render, halo_pyx, bridge_pyx, util_pyx,
+ext_modules += [gravity, pkdgrav, chunkscan, sph_render, halo_pyx, bridge_pyx, util_pyx,
                 cython_fortran_file, interpolate3d_pyx, omp_commands]
 
 install_requires = [
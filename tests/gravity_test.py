@@ -1,5 +1,6 @@
 import numpy as np
 import numpy.testing as npt
+import pytest
 
 import pynbody
 
@@ -25,7 +26,7 @@ def test_gravity():
         247.00831007,  244.89573797,  240.35616032,  238.19548506,
         233.91552211,  229.68799203])
 
-    v_circ = pro['v_circ'].in_units('km s^-1')
+    v_circ = pro['v_circ,direct'].in_units('km s^-1')
 
     npt.assert_allclose(v_circ, v_circ_correct,atol=1e-5)
 
@@ -69,3 +70,493 @@ def test_eps_retrieval_number():
                             -0.06739005, -0.06748439, -0.0695245,
                             -0.06803885, -0.0679833,  -0.07277965, -0.07189107])
     npt.assert_allclose(f['phi'][:10], true_phi_10)
+
+
+@pytest.fixture
+def cusp():
+    rng = np.random.default_rng(1)
+    n = 3000
+    direction = rng.normal(size=(n, 3))
+    direction /= np.linalg.norm(direction, axis=1)[:, np.newaxis]
+    f = pynbody.new(dm=n)
+    f['pos'] = direction * rng.uniform(size=n)[:, np.newaxis] ** 1.5
+    f['mass'] = rng.uniform(0.5, 1.5, size=n) / n
+    f['eps'] = np.full(n, 0.01)
+    f['pos'].units = 'kpc'
+    f['mass'].units = 'Msol'
+    f['eps'].units = 'kpc'
+    yield f
+
+
+def test_direct_gravity_matches_pairwise_sum(cusp):
+    f = cusp
+    f['pos'] += 1000.0  # far from the origin, to check the single precision kernel's centring
+    ipos = f['pos'][::29].view(np.ndarray)  # not a whole number of target groups
+    sep = f['pos'].view(np.ndarray)[np.newaxis, :, :] - ipos[:, np.newaxis, :]
+    dir = 1 / np.sqrt((sep ** 2).sum(axis=2) + f['eps'].view(np.ndarray) ** 2)
+    G = float(pynbody.units.G.in_units("kpc km^2 s^-2 Msol^-1"))
+    phi_ref = -G * (f['mass'].view(np.ndarray) * dir).sum(axis=1)
+    acc_ref = G * np.einsum('ij,ijk->ik', f['mass'].view(np.ndarray) * dir ** 3, sep)
+
+    phi, acc = pynbody.gravity.calc.direct(f, ipos)
+    npt.assert_allclose(phi.in_units("km^2 s^-2"), phi_ref, rtol=1e-12)
+    npt.assert_allclose(acc.in_units("km^2 s^-2 kpc^-1"), acc_ref, rtol=1e-10, atol=1e-12 * np.abs(acc_ref).max())
+
+    phi, acc = pynbody.gravity.calc.direct(f, ipos, mixed_precision=True)
+    npt.assert_allclose(phi.in_units("km^2 s^-2"), phi_ref, rtol=1e-5)
+    npt.assert_allclose(acc.in_units("km^2 s^-2 kpc^-1"), acc_ref, rtol=1e-4, atol=1e-5 * np.abs(acc_ref).max())
+
+
+def test_tree_gravity_accuracy_vs_theta(cusp):
+    f = cusp
+    phi_direct, acc_direct = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray))
+    acc_scale = np.median(np.linalg.norm(acc_direct, axis=1))
+
+    acc_errors = []
+    for theta in [0.0, 0.3, 0.5, 0.7]:
+        phi, acc = pynbody.gravity.calc.treecalc(f, f['pos'].view(np.ndarray), theta=theta)
+        assert phi.units == phi_direct.units
+        assert acc.units == acc_direct.units
+        acc_errors.append(np.median(np.linalg.norm(acc - acc_direct, axis=1)) / acc_scale)
+        npt.assert_allclose(phi, phi_direct, rtol=1e-12 if theta == 0 else 1e-2)
+
+    # opening every cell is direct summation; otherwise errors grow with the opening angle
+    assert acc_errors[0] < 1e-12
+    assert all(np.diff(acc_errors) > 0)
+    assert acc_errors[-1] < 1e-3
+
+
+def test_tree_of_particles_one_ulp_apart():
+    # the middle of the longest side rounds to its lower end, so no split is possible
+    pos = np.zeros((40, 3))
+    pos[:20, 0] = 1.0
+    pos[20:, 0] = np.nextafter(1.0, 2.0)
+    gtree = pynbody.gravity.tree.GravTree(pos, np.ones(40), np.full(40, 0.1), leafsize=4)
+    acc, pot = gtree.calc(pos)
+    npt.assert_allclose(pot, -400.0)
+    npt.assert_allclose(acc, 0.0, atol=1e-10)
+
+
+def test_mixed_precision_tree_gravity(cusp):
+    f = cusp
+    f['pos'] += 1000.0  # far from the origin, to check that the interactions are relative to each bucket
+    ipos = f['pos'].view(np.ndarray)
+    for softening in ["plummer", "spline"]:
+        phi, acc = pynbody.gravity.calc.treecalc(f, ipos, softening=softening)
+        phi_mixed, acc_mixed = pynbody.gravity.calc.treecalc(f, ipos, softening=softening, mixed_precision=True)
+        assert phi_mixed.units == phi.units and acc_mixed.units == acc.units
+        npt.assert_allclose(phi_mixed, phi, rtol=1e-5)
+        acc_errors = np.linalg.norm(acc_mixed - acc, axis=1) / np.linalg.norm(acc, axis=1)
+        assert np.median(acc_errors) < 1e-6 and acc_errors.max() < 1e-3
+
+    phi_threaded, acc_threaded = pynbody.gravity.calc.treecalc(f, ipos, softening="spline", mixed_precision=True,
+                                                               num_threads=3)
+    npt.assert_array_equal(phi_threaded, phi_mixed)
+    npt.assert_array_equal(acc_threaded, acc_mixed)
+
+    with pytest.raises(ValueError):
+        pynbody.gravity.tree.GravTree(ipos, f['mass'], f['eps']).calc(ipos, fmm=True, mixed_precision=True)
+
+
+def test_tree_gravity_with_single_softening_length(cusp):
+    f = cusp
+    ipos = f['pos'].view(np.ndarray)[::10]
+    phi_direct, acc_direct = pynbody.gravity.calc.direct(f, ipos, eps=0.02)
+    for calc in (pynbody.gravity.calc.treecalc, pynbody.gravity.calc.fmm):
+        phi, acc = calc(f, ipos, eps=0.02, theta=0.0)
+        npt.assert_allclose(phi, phi_direct, rtol=1e-12)
+        npt.assert_allclose(acc, acc_direct, rtol=1e-9, atol=1e-12 * np.abs(acc_direct).max())
+
+
+def test_threaded_tree_gravity_matches_serial(cusp):
+    f = cusp
+    ipos = np.random.default_rng(2).uniform(-1, 1, size=(500, 3))
+    phi, acc = pynbody.gravity.calc.treecalc(f, ipos, num_threads=1)
+    phi_threaded, acc_threaded = pynbody.gravity.calc.treecalc(f, ipos, num_threads=3)
+    npt.assert_array_equal(phi, phi_threaded)
+    npt.assert_array_equal(acc, acc_threaded)
+
+
+def test_tree_rotation_curve(cusp):
+    f = cusp
+    r = np.linspace(0.1, 1.0, 5)
+    vc_direct = pynbody.gravity.calc.midplane_rot_curve(f, r, mode='direct')
+    vc_tree = pynbody.gravity.calc.midplane_rot_curve(f, r, mode='tree')
+    assert vc_tree.units == vc_direct.units
+    npt.assert_allclose(vc_tree, vc_direct, rtol=1e-3)
+
+    pynbody.gravity.calc.all_tree(f, theta=0.0)
+    phi_direct, acc_direct = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray))
+    npt.assert_allclose(f['phi'], phi_direct, rtol=1e-12)
+    npt.assert_allclose(f['acc'], acc_direct, rtol=1e-10, atol=1e-10 * np.abs(acc_direct).max())
+
+
+def test_pm_gravity_isolated(cusp):
+    f = cusp
+    r = np.linspace(1.2, 2.0, 4)
+    # outside the cusp, where the mesh softening and the discreteness of particles do not matter
+    ipos = np.concatenate([r[:, np.newaxis] * direction for direction in np.eye(3)])
+    phi_direct, acc_direct = pynbody.gravity.calc.direct(f, ipos)
+    for assignment in 'cic', 'tsc':
+        phi, acc = pynbody.gravity.calc.pm(f, ipos, ngrid=64, assignment=assignment)
+        assert phi.units == phi_direct.units
+        assert acc.units == acc_direct.units
+        npt.assert_allclose(phi, phi_direct, rtol=2e-3)
+        npt.assert_allclose(acc, acc_direct, atol=5e-3 * np.abs(acc_direct).max())
+
+    vc_direct = pynbody.gravity.calc.midplane_rot_curve(f, r, mode='direct')
+    vc_pm = pynbody.gravity.calc.midplane_rot_curve(f, r, mode='pm')
+    npt.assert_allclose(vc_pm, vc_direct, rtol=5e-3)
+
+
+def test_pm_gravity_periodic():
+    # a sinusoidal density perturbation sampled on the mesh, whose acceleration is known exactly
+    boxsize, ngrid, amplitude = 10.0, 32, 0.3
+    k = 2 * np.pi / boxsize
+    x = (np.arange(ngrid) + 0.5) * boxsize / ngrid
+    f = pynbody.new(dm=ngrid ** 3)
+    f['pos'] = np.stack(np.meshgrid(x, x, x, indexing='ij'), axis=-1).reshape((-1, 3))
+    f['mass'] = (1 + amplitude * np.cos(k * f['pos'][:, 0].view(np.ndarray))) * (boxsize / ngrid) ** 3
+    f['pos'].units = 'kpc'
+    f['mass'].units = 'Msol'
+    f.properties['boxsize'] = boxsize * pynbody.units.kpc
+
+    ipos = np.random.default_rng(3).uniform(-boxsize, 2 * boxsize, size=(200, 3))
+    phi, acc = pynbody.gravity.calc.pm(f, ipos, ngrid=ngrid)
+    G = float(pynbody.units.G.in_units("kpc km^2 s^-2 Msol^-1"))
+    acc_x = -4 * np.pi * G * amplitude / k * np.sin(k * ipos[:, 0])
+    phi_expected = -4 * np.pi * G * amplitude / k ** 2 * np.cos(k * ipos[:, 0])
+
+    acc = acc.in_units("km^2 s^-2 kpc^-1")
+    npt.assert_allclose(acc[:, 0], acc_x, atol=1e-2 * np.abs(acc_x).max())
+    npt.assert_allclose(acc[:, 1:], 0, atol=1e-6 * np.abs(acc_x).max())
+    npt.assert_allclose(phi.in_units("km^2 s^-2"), phi_expected, atol=1e-2 * np.abs(phi_expected).max())
+
+
+def test_threaded_pm_matches_serial(cusp):
+    f = cusp
+    ipos = np.random.default_rng(2).uniform(-1, 1, size=(500, 3))
+    for periodic in False, True:
+        f.properties['boxsize'] = 3.0 * pynbody.units.kpc
+        phi, acc = pynbody.gravity.calc.pm(f, ipos, ngrid=37, periodic=periodic, assignment='tsc', num_threads=1)
+        phi_threaded, acc_threaded = pynbody.gravity.calc.pm(f, ipos, ngrid=37, periodic=periodic,
+                                                             assignment='tsc', num_threads=3)
+        npt.assert_array_equal(phi, phi_threaded)
+        npt.assert_array_equal(acc, acc_threaded)
+
+
+def _ewald_sum(pos, mass, ipos, boxsize):
+    """Potential and acceleration (G=1) of point masses in a periodic box, by brute-force Ewald summation"""
+    from scipy.special import erfc
+    alpha = 2.0 / boxsize
+    images = np.arange(-3, 4)
+    shifts = boxsize * np.stack(np.meshgrid(images, images, images, indexing='ij'), axis=-1).reshape((-1, 3))
+    modes = np.arange(-6, 7)
+    k = 2 * np.pi / boxsize * np.stack(np.meshgrid(modes, modes, modes, indexing='ij'), axis=-1).reshape((-1, 3))
+    k = k[(k ** 2).sum(axis=1) > 0]
+    k2 = (k ** 2).sum(axis=1)
+    weight = 4 * np.pi / boxsize ** 3 * np.exp(-k2 / (4 * alpha ** 2)) / k2
+
+    phi = np.full(len(ipos), np.pi * mass.sum() / (boxsize ** 3 * alpha ** 2))
+    acc = np.zeros((len(ipos), 3))
+    for i, x in enumerate(ipos):
+        sep = (x - pos)[np.newaxis, :, :] + shifts[:, np.newaxis, :]
+        r = np.linalg.norm(sep, axis=2)
+        phi[i] -= (mass * erfc(alpha * r) / r).sum()
+        force = mass * (erfc(alpha * r) / r ** 3 + 2 * alpha / np.sqrt(np.pi) * np.exp(-(alpha * r) ** 2) / r ** 2)
+        acc[i] -= (force[:, :, np.newaxis] * sep).sum(axis=(0, 1))
+
+        phase = (x - pos) @ k.T
+        phi[i] -= (mass[:, np.newaxis] * weight * np.cos(phase)).sum()
+        acc[i] -= (mass[:, np.newaxis] * weight * np.sin(phase)).sum(axis=0) @ k
+    return phi, acc
+
+
+@pytest.fixture
+def periodic_box():
+    rng = np.random.default_rng(4)
+    f = pynbody.new(dm=20)
+    f['pos'] = rng.uniform(0, 5.0, size=(20, 3))
+    f['mass'] = rng.uniform(0.5, 1.5, size=20)
+    f['eps'] = np.full(20, 1e-4)
+    f['pos'].units = 'kpc'
+    f['mass'].units = 'Msol'
+    f['eps'].units = 'kpc'
+    f.properties['boxsize'] = 5.0 * pynbody.units.kpc
+    yield f
+
+
+def test_treepm_gravity_matches_ewald_sum(periodic_box):
+    f = periodic_box
+    ipos = np.random.default_rng(5).uniform(-5.0, 10.0, size=(10, 3))
+    phi_ewald, acc_ewald = _ewald_sum(f['pos'].view(np.ndarray), f['mass'].view(np.ndarray), ipos, 5.0)
+    G = float(pynbody.units.G.in_units("kpc km^2 s^-2 Msol^-1"))
+
+    phi, acc = pynbody.gravity.calc.treepm(f, ipos, ngrid=64, theta=0.3)
+    npt.assert_allclose(phi.in_units("km^2 s^-2"), G * phi_ewald, atol=5e-3 * G * np.abs(phi_ewald).max())
+    acc_error = np.linalg.norm(acc.in_units("km^2 s^-2 kpc^-1") - G * acc_ewald, axis=1)
+    assert (acc_error < 1e-2 * G * np.linalg.norm(acc_ewald, axis=1)).all()
+
+
+def test_threaded_treepm_matches_serial(periodic_box):
+    f = periodic_box
+    ipos = np.random.default_rng(5).uniform(0, 5.0, size=(500, 3))
+    phi, acc = pynbody.gravity.calc.treepm(f, ipos, num_threads=1)
+    phi_threaded, acc_threaded = pynbody.gravity.calc.treepm(f, ipos, num_threads=3)
+    npt.assert_array_equal(phi, phi_threaded)
+    npt.assert_array_equal(acc, acc_threaded)
+
+
+def test_mixed_precision_treepm(periodic_box):
+    f = periodic_box
+    ipos = np.random.default_rng(5).uniform(-5.0, 10.0, size=(50, 3))
+    phi, acc = pynbody.gravity.calc.treepm(f, ipos, ngrid=32)
+    phi_mixed, acc_mixed = pynbody.gravity.calc.treepm(f, ipos, ngrid=32, mixed_precision=True)
+    npt.assert_allclose(phi_mixed, phi, rtol=1e-4, atol=1e-5 * np.abs(phi).max())
+    acc_errors = np.linalg.norm(acc_mixed - acc, axis=1) / np.linalg.norm(acc, axis=1)
+    assert np.median(acc_errors) < 1e-5
+
+
+def test_derived_gravity(periodic_box):
+    f = periodic_box
+    phi, acc = pynbody.gravity.calc.treepm(f, f['pos'].view(np.ndarray))
+    assert 'phi' in f.derivable_keys()
+    npt.assert_array_equal(f[::3]['phi'], phi[::3])
+    npt.assert_array_equal(f['acc'], acc)
+    assert f['phi'].units == phi.units
+
+    f['pos'][0] += 1.0
+    assert f['phi'][0] != phi[0]
+
+
+def test_fmm_gravity_accuracy_vs_theta(cusp):
+    f = cusp
+    phi_direct, acc_direct = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray))
+    acc_scale = np.median(np.linalg.norm(acc_direct, axis=1))
+
+    acc_errors = []
+    for theta in [0.0, 0.3, 0.5, 0.7]:
+        phi, acc = pynbody.gravity.calc.fmm(f, f['pos'].view(np.ndarray), theta=theta)
+        assert phi.units == phi_direct.units
+        assert acc.units == acc_direct.units
+        acc_errors.append(np.median(np.linalg.norm(acc - acc_direct, axis=1)) / acc_scale)
+        npt.assert_allclose(phi, phi_direct, rtol=1e-12 if theta == 0 else 1e-2)
+
+    assert acc_errors[0] < 1e-12
+    assert all(np.diff(acc_errors) > 0)
+    assert acc_errors[2] < 1e-3
+
+    vc_direct = pynbody.gravity.calc.midplane_rot_curve(f, np.linspace(0.1, 1.0, 5), mode='direct')
+    vc_fmm = pynbody.gravity.calc.midplane_rot_curve(f, np.linspace(0.1, 1.0, 5), mode='fmm')
+    npt.assert_allclose(vc_fmm, vc_direct, rtol=1e-3)
+
+
+def test_threaded_fmm_matches_serial(cusp):
+    f = cusp
+    ipos = np.random.default_rng(2).uniform(-1, 1, size=(50000, 3))
+    phi, acc = pynbody.gravity.calc.fmm(f, ipos, num_threads=1)
+    phi_threaded, acc_threaded = pynbody.gravity.calc.fmm(f, ipos, num_threads=3)
+    npt.assert_array_equal(phi, phi_threaded)
+    npt.assert_array_equal(acc, acc_threaded)
+
+
+def test_multipole_rotation_curve_converges(cusp):
+    f = cusp
+    f['pos'][:, 2] *= 0.5  # flattened, so that the higher orders matter
+    r = np.linspace(0.1, 1.0, 5)
+    vc_direct = pynbody.gravity.calc.midplane_rot_curve(f, r, mode='direct')
+
+    vc_errors = []
+    for lmax in [0, 2, 4, 8]:
+        multipole = lambda f, ipos, eps: pynbody.gravity.calc.multipole(f, ipos, lmax=lmax)
+        vc = pynbody.gravity.calc.midplane_rot_curve(f, r, mode=multipole)
+        assert vc.units == vc_direct.units
+        vc_errors.append(np.abs(vc / vc_direct - 1).max())
+
+    assert all(np.diff(vc_errors) < 0)
+    assert vc_errors[-1] < 1e-2
+
+    f['vel'].units = 'km s^-1'
+    pro = pynbody.analysis.profile.Profile(f, nbins=5, rmin=0.1, rmax=1.0)
+    npt.assert_allclose(pro['v_circ'], pro['v_circ,direct'], rtol=5e-2)
+    npt.assert_allclose(pro['pot'], pro['pot,direct'], rtol=1e-2)
+
+
+@pytest.fixture
+def halo_with_interlopers(cusp):
+    f = cusp
+    G = float(pynbody.units.G.in_units("kpc km^2 s^-2 Msol^-1"))
+    phi, _ = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray))
+    v_esc = np.sqrt(-2 * phi.in_units("km^2 s^-2"))
+    rng = np.random.default_rng(6)
+    direction = rng.normal(size=(len(f), 3))
+    direction /= np.linalg.norm(direction, axis=1)[:, np.newaxis]
+    # most particles move at a fraction of the escape speed, every tenth well above it
+    speed = v_esc * np.where(np.arange(len(f)) % 10 == 0, rng.uniform(1.2, 3.0, len(f)), rng.uniform(0, 0.5, len(f)))
+    f['vel'] = direction * speed[:, np.newaxis]
+    f['vel'].units = 'km s^-1'
+    yield f
+
+
+def test_potential_minimum_without_phi(cusp):
+    f = cusp
+    phi_direct, _ = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray))
+    sub = f[::2]
+    phi_sub, _ = pynbody.gravity.calc.direct(sub, sub['pos'].view(np.ndarray))
+    phi_sub += (sub['mass'] / sub['eps']).view(np.ndarray)  # without each particle's own softened potential
+    npt.assert_allclose(pynbody.gravity.calc.self_potential(sub), phi_sub, rtol=5e-3)
+    npt.assert_array_equal(pynbody.analysis.halo.potential_minimum(sub), sub['pos'][phi_sub.argmin()])
+    assert 'phi' not in f.keys()
+
+
+@pytest.mark.parametrize("mode", ["direct", "tree", "fmm"])
+def test_self_potential_excludes_self_interaction(mode):
+    single = pynbody.new(dm=1)
+    single['mass'] = np.array([2.0])
+    single['eps'] = np.array([0.1])
+    npt.assert_array_equal(pynbody.gravity.calc.self_potential(single, mode=mode), [0.0])
+
+    pair = pynbody.new(dm=2)
+    pair['pos'] = np.array([[0.0, 0.0, 0.0], [0.3, 0.4, 0.0]])
+    pair['mass'] = np.array([2.0, 3.0])
+    pair['eps'] = np.array([0.1, 0.2])
+    # the pair is softened with the larger softening length, here with the Plummer kernel
+    phi_pair = -np.array([3.0, 2.0]) / np.sqrt(0.5 ** 2 + 0.2 ** 2)
+    npt.assert_allclose(pynbody.gravity.calc.self_potential(pair, mode=mode), phi_pair, rtol=1e-12)
+
+
+def test_unbind_matches_brute_force(halo_with_interlopers):
+    f = halo_with_interlopers
+    index = np.arange(len(f))
+    while True:
+        bound = f[index]
+        phi, _ = pynbody.gravity.calc.direct(bound, bound['pos'].view(np.ndarray))
+        vel = bound['vel'].view(np.ndarray)
+        mass = bound['mass'].view(np.ndarray)
+        phi += mass / bound['eps'].view(np.ndarray)  # without each particle's own softened potential
+        vcen = (mass[:, np.newaxis] * vel).sum(axis=0) / mass.sum()
+        keep = 0.5 * ((vel - vcen) ** 2).sum(axis=1) + phi.in_units("km^2 s^-2") < 0
+        if keep.all():
+            break
+        index = index[keep]
+
+    assert 0.85 * len(f) < len(index) < 0.95 * len(f)
+    bound = pynbody.analysis.halo.unbind(f, mode='direct')
+    npt.assert_array_equal(bound.get_index_list(f), index)
+
+    bound = pynbody.analysis.halo.unbind(f)
+    assert len(np.setxor1d(bound.get_index_list(f), index)) < 0.002 * len(f)
+
+
+def test_benchmark(tmp_path):
+    import io
+    import json
+
+    from pynbody.gravity import benchmark
+
+    results = benchmark.run(n=(2000,), thetas=(0.5,), threads=(1, 2), n_reference=200, out=io.StringIO())
+    runs = {(r['set'], r['mode'], r['threads']) for r in results}
+    assert ('hernquist', 'tree', 2) in runs and ('cosmological', 'treepm', 2) in runs
+    assert ('nfw_disc', 'multipole', None) in runs and ('cosmological', 'tree', 1) not in runs
+
+    for r in results:
+        assert r['force_error_p50'] <= r['force_error_p90'] <= r['force_error_p99'] <= r['force_error_max']
+        if r['mode'] == 'direct':
+            assert r['force_error_max'] < 1e-10
+        elif r['mode'] in ('tree', 'fmm', 'treepm'):
+            assert r['force_error_p50'] < 1e-2
+
+    benchmark.main(['--sets', 'hernquist', '--n', '500', '--modes', 'direct,fmm', '--theta', '0.3,0.7',
+                    '--threads', '1', '--nref', '50', '--json', str(tmp_path / 'gravity.json')])
+    with open(tmp_path / 'gravity.json') as f:
+        written = json.load(f)
+    assert written['metadata']['pynbody'] == pynbody.__version__
+    assert [(r['mode'], r['theta']) for r in written['results']] == [('direct', None), ('fmm', 0.3), ('fmm', 0.7)]
+
+
+@pytest.mark.parametrize("softening", ["plummer", "spline", "wendland"])
+def test_softening_kernels(cusp, softening):
+    from pynbody.gravity import softening as softening_kernels
+
+    point = pynbody.new(dm=1)
+    point['mass'] = np.array([1.0])
+    point['eps'] = np.array([0.1])
+    r = np.linspace(0.01, 0.5, 50)
+    ipos = np.column_stack((r, np.zeros_like(r), np.zeros_like(r)))
+    phi, acc = pynbody.gravity.calc.direct(point, ipos, eps=0.1, softening=softening)
+    dir, dir3 = softening_kernels.potential_and_force(r, 0.1, softening)
+    npt.assert_allclose(phi, -dir, rtol=1e-12)
+    npt.assert_allclose(acc[:, 0], -dir3 * r, rtol=1e-12)
+    if softening != 'plummer':
+        newtonian = r >= softening_kernels.SUPPORT[softening] * 0.1
+        npt.assert_allclose(phi[newtonian], -1 / r[newtonian], rtol=1e-12)
+
+    # checks of the compiled kernel which do not rely on the polynomials of potential_and_force
+    def potential_and_force_at(r):
+        ipos = np.column_stack((r, np.zeros_like(r), np.zeros_like(r)))
+        phi, acc = pynbody.gravity.calc.direct(point, ipos, eps=0.1, softening=softening)
+        return phi.view(np.ndarray), acc[:, 0].view(np.ndarray)
+
+    phi_0, _ = potential_and_force_at(np.array([0.0]))
+    npt.assert_allclose(phi_0, -1 / 0.1, rtol=1e-12)
+
+    dr = 1e-5
+    _, acc = potential_and_force_at(r)
+    phi_plus, _ = potential_and_force_at(r + dr)
+    phi_minus, _ = potential_and_force_at(r - dr)
+    npt.assert_allclose(acc, -(phi_plus - phi_minus) / (2 * dr), rtol=1e-6)
+
+    if softening != 'plummer':
+        h = softening_kernels.SUPPORT[softening] * 0.1
+        for edge in (0.5 * h, h):
+            phi_in, acc_in = potential_and_force_at(np.array([edge * (1 - 1e-10)]))
+            phi_out, acc_out = potential_and_force_at(np.array([edge * (1 + 1e-10)]))
+            npt.assert_allclose(phi_in, phi_out, rtol=1e-8)
+            npt.assert_allclose(acc_in, acc_out, rtol=1e-8)
+        # the whole of the unit mass is enclosed by the support
+        _, acc_h = potential_and_force_at(np.array([h]))
+        npt.assert_allclose(-acc_h * h ** 2, 1.0, rtol=1e-12)
+
+    # with every cell opened, the tree and fmm sum the same pairs as direct summation
+    f = cusp
+    phi_direct, acc_direct = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray), softening=softening)
+    for calc in (pynbody.gravity.calc.treecalc, pynbody.gravity.calc.fmm):
+        phi, acc = calc(f, f['pos'].view(np.ndarray), theta=0.0, softening=softening)
+        npt.assert_allclose(phi, phi_direct, rtol=1e-12)
+        npt.assert_allclose(acc, acc_direct, rtol=1e-9, atol=1e-12 * np.abs(acc_direct).max())
+
+    with pytest.raises(ValueError):
+        pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray), softening='gaussian')
+
+
+@pytest.mark.parametrize("softening", ["spline", "wendland"])
+def test_compact_softening_tree_accuracy(cusp, softening):
+    # with softening lengths comparable to the cells, a cell's multipole (which is unsoftened for the
+    # compact kernels) must only be used once all of its particles are beyond the kernel's support
+    f = cusp
+    f['eps'] = np.full(len(f), 0.2)
+    phi_direct, acc_direct = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray), softening=softening)
+    phi, acc = pynbody.gravity.calc.treecalc(f, f['pos'].view(np.ndarray), theta=0.55, softening=softening)
+    err = np.sqrt(((acc - acc_direct) ** 2).sum(axis=1) / (acc_direct ** 2).sum(axis=1))
+    assert err.max() < 3e-4
+
+
+@pytest.mark.parametrize("rule", ["max", "mean"])
+def test_pairwise_softening_conserves_momentum(cusp, rule):
+    f = cusp
+    f['eps'][::2] = 0.05  # two populations with different softening lengths
+    eps = f['eps'].view(np.ndarray)
+    for softening in ["plummer", "spline"]:
+        _, acc = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray), softening=softening, ieps=eps,
+                                             softening_rule=rule)
+        momentum = (f['mass'].view(np.ndarray)[:, np.newaxis] * acc).sum(axis=0)
+        assert np.abs(momentum).max() < 1e-10 * np.abs(acc).max() * f['mass'].view(np.ndarray).sum()
+
+        _, acc_tree = pynbody.gravity.calc.treecalc(f, f['pos'].view(np.ndarray), theta=0.0, softening=softening,
+                                                    ieps=eps, softening_rule=rule)
+        npt.assert_allclose(acc_tree, acc, rtol=1e-9, atol=1e-12 * np.abs(acc).max())
+
+    # softening each target with only the source's length breaks the symmetry
+    _, acc = pynbody.gravity.calc.direct(f, f['pos'].view(np.ndarray))
+    momentum = (f['mass'].view(np.ndarray)[:, np.newaxis] * acc).sum(axis=0)
+    assert np.abs(momentum).max() > 1e-6 * np.abs(acc).max() * f['mass'].view(np.ndarray).sum()
@@ -0,0 +1,195 @@
+import numpy as np
+import numpy.testing as npt
+import pytest
+
+import pynbody
+from pynbody.sph import benchmark, kdtree
+
+
+@pytest.fixture
+def clustered_box():
+    pos, mass = benchmark.cosmological_box(24, seed=1)
+    yield pos, mass
+
+
+def _smooth_and_rho(pos, mass, n_threads, numa):
+    old_threads = pynbody.config['number_of_threads']
+    pynbody.config['number_of_threads'] = n_threads
+    try:
+        tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+        smooth = np.empty(len(pos))
+        rho = np.empty(len(pos))
+        tree.set_array_ref('smooth', smooth)
+        tree.set_array_ref('rho', rho)
+        tree.populate('hsm', 32, numa=numa)
+        tree.populate('rho', 32, numa=numa)
+    finally:
+        pynbody.config['number_of_threads'] = old_threads
+    return smooth, rho
+
+
+@pytest.mark.parametrize("n_threads, numa", [(4, False), (4, True), (7, True)])
+def test_threaded_smooth_matches_serial(clustered_box, n_threads, numa):
+    smooth_serial, rho_serial = _smooth_and_rho(*clustered_box, 1, False)
+    smooth, rho = _smooth_and_rho(*clustered_box, n_threads, numa)
+
+    npt.assert_allclose(smooth, smooth_serial, rtol=1e-5)
+    npt.assert_allclose(rho, rho_serial, rtol=1e-5)
+
+
+@pytest.mark.parametrize("n_threads", [1, 3])
+def test_populate_stats(clustered_box, n_threads):
+    pos, mass = clustered_box
+    old_threads = pynbody.config['number_of_threads']
+    pynbody.config['number_of_threads'] = n_threads
+    try:
+        tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+        tree.set_array_ref('smooth', np.empty(len(pos)))
+        tree.set_array_ref('rho', np.empty(len(pos)))
+        hsm_stats = tree.populate('hsm', 32, stats=True, hsm_algorithm='snake')
+        rho_stats = tree.populate('rho', 32, stats=True)
+        assert tree.populate('rho', 32) is None
+    finally:
+        pynbody.config['number_of_threads'] = old_threads
+
+    for stats in hsm_stats, rho_stats:
+        assert all(len(v) == n_threads for v in stats.values())
+        assert stats['nodes_opened'].sum() > 0
+        assert stats['distance_evaluations'].sum() >= stats['buckets_scanned'].sum() > 0
+        assert (stats['time_total'] >= stats['time_search']).all()
+
+    # threads may occasionally duplicate a particle, but never skip one
+    assert hsm_stats['snake_restarts'].sum() + hsm_stats['snake_continuations'].sum() >= len(pos)
+    assert hsm_stats['queue_replacements'].sum() > 0
+    assert rho_stats['particles'].sum() == len(pos)
+    assert rho_stats['time_kernel'].sum() > 0
+    if n_threads > 1:
+        assert rho_stats['work_units'].sum() >= len(pos) // 1000
+
+
+def _smooth_all_operators(pos, mass, vel):
+    tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+    tree.set_array_ref('smooth', np.empty(len(pos)))
+    tree.set_array_ref('rho', np.empty(len(pos)))
+    tree.populate('hsm', 32)
+    tree.populate('rho', 32)
+    return [tree.sph_mean(vel[:, 0], 32), tree.sph_mean(vel, 32),
+            tree.sph_dispersion(vel[:, 0], 32), tree.sph_dispersion(vel, 32),
+            tree.sph_divergence(vel, 32), tree.sph_curl(vel, 32)]
+
+
+def test_strided_arrays_match_contiguous(clustered_box):
+    pos, mass = clustered_box
+    vel = np.random.default_rng(2).normal(size=pos.shape)
+
+    # the same data, viewed through non-contiguous strides
+    pos_padded = np.zeros((len(pos), 4))
+    pos_padded[:, :3] = pos
+    vel_interleaved = np.zeros((len(pos), 6))
+    vel_interleaved[:, ::2] = vel
+    assert not pos_padded[:, :3].flags['C_CONTIGUOUS']
+
+    contiguous = _smooth_all_operators(pos, mass, vel)
+    strided = _smooth_all_operators(pos_padded[:, :3], mass, vel_interleaved[:, ::2])
+
+    for a, b in zip(contiguous, strided):
+        npt.assert_array_equal(a, b)
+
+
+def test_vector_dispersion_has_one_value_per_particle(clustered_box):
+    pos, mass = clustered_box
+    vel = np.random.default_rng(2).normal(size=pos.shape)
+    tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+    tree.set_array_ref('smooth', np.empty(len(pos)))
+    tree.set_array_ref('rho', np.empty(len(pos)))
+    tree.populate('hsm', 32)
+    tree.populate('rho', 32)
+
+    disp = tree.sph_dispersion(vel, 32)
+    assert disp.shape == (len(pos),)
+    disp_squared = sum(tree.sph_dispersion(np.ascontiguousarray(vel[:, k]), 32) ** 2 for k in range(3))
+    npt.assert_allclose(disp ** 2, disp_squared, rtol=1e-5)
+
+
+@pytest.mark.parametrize("n_threads", [1, 3])
+def test_dual_tree_hsm_matches_snake(clustered_box, n_threads):
+    pos, mass = clustered_box
+    old_threads = pynbody.config['number_of_threads']
+    pynbody.config['number_of_threads'] = n_threads
+    try:
+        tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+        smooth_snake = np.empty(len(pos))
+        smooth_dual = np.empty(len(pos))
+        tree.set_array_ref('smooth', smooth_snake)
+        tree.populate('hsm', 32, hsm_algorithm='snake')
+        tree.set_array_ref('smooth', smooth_dual)
+        stats = tree.populate('hsm', 32, stats=True, hsm_algorithm='dual-tree')
+    finally:
+        pynbody.config['number_of_threads'] = old_threads
+
+    npt.assert_allclose(smooth_dual, smooth_snake, rtol=1e-5)
+    assert stats['particles'].sum() == len(pos)
+
+
+def test_knn_matches_brute_force():
+    rng = np.random.default_rng(3)
+    pos = rng.uniform(size=(3000, 3))
+    pos[:1000] = 0.5 + 0.05 * rng.normal(size=(1000, 3))
+    mass = np.ones(len(pos))
+    tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+    dist, index = tree.knn(20)
+
+    delta = pos[:, np.newaxis, :] - pos[np.newaxis, :, :]
+    delta -= np.round(delta)  # periodic minimum image
+    all_dist = np.sqrt((delta ** 2).sum(axis=2))
+    expected = np.sort(all_dist, axis=1)[:, :20]
+
+    npt.assert_allclose(dist, expected, rtol=1e-5, atol=1e-7)
+    npt.assert_allclose(np.take_along_axis(all_dist, index, axis=1), dist, rtol=1e-5, atol=1e-7)
+    assert (index[:, 0] == np.arange(len(pos))).all()
+    npt.assert_allclose(tree.get_array_ref('smooth'), 0.5 * dist[:, -1], rtol=1e-6)
+
+
+def _overlapping_brute_force(pos, smooth, fmin, fmax, scale):
+    extent = np.multiply(scale, smooth[:, np.newaxis])
+    return np.where(np.all((pos + extent >= fmin) & (pos - extent <= fmax), axis=1))[0]
+
+
+@pytest.mark.parametrize("fmin, fmax, scale", [((0.2, 0.3, 0.45), (0.5, 0.35, 0.45), (2.0, 2.0, 1.0)),
+                                               ((0.2, 0.3, -np.inf), (0.5, 0.35, np.inf), (2.0, 2.0, 0.0)),
+                                               ((0.1, 0.1, 0.1), (0.3, 0.3, 0.3), (2.0, 2.0, 2.0))])
+def test_particles_in_box_matches_brute_force(clustered_box, fmin, fmax, scale):
+    pos, mass = clustered_box
+    smooth, _ = _smooth_and_rho(pos, mass, 1, False)
+    tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+
+    index = np.sort(tree.particles_in_box(smooth, fmin, fmax, scale, "smooth"))
+    expected = _overlapping_brute_force(pos, smooth, fmin, fmax, scale)
+
+    # a few particles just outside the region may be included, but none inside it are missed
+    assert np.all(np.isin(expected, index))
+    assert len(index) < len(expected) + 10
+    assert len(np.unique(index)) == len(index)
+
+    # the per-node bounds must follow changes to the smoothing lengths
+    smooth *= 2
+    tree.array_changed("smooth")
+    index = tree.particles_in_box(smooth, fmin, fmax, scale, "smooth")
+    assert np.all(np.isin(_overlapping_brute_force(pos, smooth, fmin, fmax, scale), index))
+
+
+@pytest.mark.parametrize("centre, r_min, r_max, scale", [((0.5, 0.5, 0.5), 0.2, 0.2, 2.0),
+                                                         ((0.5, 0.5, 0.5), 0.0, 0.1, 0.0),
+                                                         ((0.1, 0.2, 0.3), 0.25, 0.4, 1.0)])
+def test_particles_in_shell_matches_brute_force(clustered_box, centre, r_min, r_max, scale):
+    pos, mass = clustered_box
+    smooth, _ = _smooth_and_rho(pos, mass, 1, False)
+    tree = kdtree.KDTree(pos, mass, leafsize=16, boxsize=1.0)
+
+    index = np.sort(tree.particles_in_shell(smooth, centre, r_min, r_max, scale, "smooth"))
+    r = np.sqrt(((pos - centre) ** 2).sum(axis=1))
+    expected = np.where((r - scale * smooth <= r_max) & (r + scale * smooth >= r_min))[0]
+
+    assert np.all(np.isin(expected, index))
+    assert len(index) < len(expected) + 10
+    assert len(np.unique(index)) == len(index)
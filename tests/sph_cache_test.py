@@ -0,0 +1,111 @@
+import numpy as np
+import numpy.testing as npt
+import pytest
+
+import pynbody
+from pynbody.sph import cache
+
+
+@pytest.fixture
+def gas():
+    rng = np.random.default_rng(4)
+    f = pynbody.new(gas=2000)
+    f['pos'] = 0.3 * rng.normal(size=(2000, 3))
+    f['mass'] = np.ones(2000) / 2000
+    f['temp'] = 1.0 + rng.uniform(size=2000)
+    f['pos'].units = 'kpc'
+    f['mass'].units = 'Msol'
+    f['temp'].units = 'K'
+    yield f
+
+
+@pytest.fixture
+def render_cache(tmp_path):
+    pynbody.config_parser.set('sph', 'render-cache', 'True')
+    pynbody.config_parser.set('sph', 'render-cache-directory', '')
+    try:
+        yield tmp_path
+    finally:
+        pynbody.config_parser.set('sph', 'render-cache', 'False')
+        pynbody.config_parser.set('sph', 'render-cache-directory', '')
+
+
+def _count_renders(monkeypatch):
+    calls = []
+    original = pynbody.sph._render_image
+
+    def counting_render(*args, **kwargs):
+        calls.append(1)
+        return original(*args, **kwargs)
+
+    monkeypatch.setattr(pynbody.sph, '_render_image', counting_render)
+    return calls
+
+
+def test_array_versions(gas):
+    version = gas._array_version('pos')
+    gas['x'] += 1
+    assert gas._array_version('pos') > version
+
+    version = gas._array_version('temp')
+    gas.gas['temp'][:10] = 0
+    assert gas._array_version('temp') > version
+
+    version = gas._array_version('temp')
+    del gas['temp']
+    assert gas._array_version('temp') > version
+
+
+def test_cached_image_reused_until_data_changes(gas, render_cache, monkeypatch):
+    calls = _count_renders(monkeypatch)
+    kwargs = dict(qty='temp', nx=40, x2=1.0, approximate_fast=False)
+
+    im = pynbody.sph.render_image(gas, **kwargs)
+    n_calls = len(calls)
+    again = pynbody.sph.render_image(gas.gas, threaded=False, **kwargs)
+    assert len(calls) == n_calls
+    assert again.units == im.units
+    npt.assert_array_equal(again, im)
+
+    # the caller may modify the image it gets back without affecting the cache
+    again[:] = 0
+    npt.assert_array_equal(pynbody.sph.render_image(gas, **kwargs), im)
+
+    # any change of parameters, selection, data or transform means a new render
+    pynbody.sph.render_image(gas, nx=41, **{k: v for k, v in kwargs.items() if k != 'nx'})
+    assert len(calls) > n_calls
+    n_calls = len(calls)
+
+    pynbody.sph.render_image(gas[::2], **kwargs)
+    assert len(calls) > n_calls
+    n_calls = len(calls)
+
+    gas['temp'] *= 2
+    npt.assert_allclose(pynbody.sph.render_image(gas, **kwargs), 2 * im, rtol=1e-6)
+    assert len(calls) > n_calls
+    n_calls = len(calls)
+
+    gas.rotate_z(90)
+    rotated = pynbody.sph.render_image(gas, **kwargs)
+    assert len(calls) > n_calls
+    assert not np.allclose(rotated, 2 * im)
+
+
+def test_disk_cache(gas, render_cache, monkeypatch):
+    pynbody.config_parser.set('sph', 'render-cache-directory', str(render_cache))
+    kwargs = dict(nx=30, x2=1.0, approximate_fast=False, kernel=pynbody.sph.Kernel2D())
+    im = pynbody.sph.render_image(gas, **kwargs)
+    assert len(list(render_cache.glob("*.npz"))) == 1
+
+    # a fresh copy of the same data, as if loaded in a new session, finds the image on disk
+    copy = pynbody.new(gas=len(gas))
+    for name in ['pos', 'mass', 'temp']:
+        copy[name] = gas[name]
+    calls = _count_renders(monkeypatch)
+    im_copy = pynbody.sph.render_image(copy, **kwargs)
+    assert len(calls) == 0
+    assert im_copy.units == im.units
+    npt.assert_array_equal(im_copy, im)
+
+    cache.clear(copy, disk=True)
+    assert len(list(render_cache.glob("*.npz"))) == 0
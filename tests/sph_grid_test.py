@@ -0,0 +1,71 @@
+import numpy as np
+import numpy.testing as npt
+import pytest
+
+import pynbody
+
+
+@pytest.fixture
+def gas():
+    # a clump in an otherwise empty box, so that most of a fine grid is empty
+    rng = np.random.default_rng(3)
+    f = pynbody.new(gas=5000)
+    f['pos'] = 0.2 * rng.normal(size=(5000, 3))
+    f['mass'] = np.ones(5000) / 5000
+    f['temp'] = 1.0 + rng.uniform(size=5000)
+    f['pos'].units = 'kpc'
+    f['mass'].units = 'Msol'
+    f['temp'].units = 'K'
+    yield f
+
+
+@pytest.mark.parametrize("qty", ['rho', 'temp'])
+def test_threaded_grid_matches_serial(gas, qty):
+    kwargs = dict(qty=qty, nx=24, ny=20, nz=28, x2=1.0, approximate_fast=False, denoise=False)
+    grid_serial = pynbody.sph.to_3d_grid(gas, threaded=False, **kwargs)
+    grid_threaded = pynbody.sph.to_3d_grid(gas, threaded=3, **kwargs)
+    assert grid_serial.shape == (24, 20, 28)
+    assert grid_threaded.units == grid_serial.units
+    npt.assert_array_equal(grid_serial, grid_threaded)
+
+
+def test_non_cubic_grid(gas):
+    # doubling the number of cells along z should halve each cell's depth, not stretch the grid
+    kwargs = dict(nx=30, x2=0.3, approximate_fast=False, denoise=False, threaded=False)
+    grid = pynbody.sph.to_3d_grid(gas, **kwargs)
+    grid_fine_z = pynbody.sph.to_3d_grid(gas, nz=60, **kwargs)
+    profile = np.asarray(grid.sum(axis=(0, 1)))
+    profile_fine_z = np.asarray(grid_fine_z.sum(axis=(0, 1)))
+    npt.assert_allclose(profile_fine_z.reshape(30, 2).mean(axis=1), profile, rtol=0.02)
+
+
+@pytest.mark.parametrize("denoise", [False, True])
+def test_streamed_and_sparse_grids_match_dense(gas, tmp_path, denoise):
+    kwargs = dict(nx=40, x2=1.0, approximate_fast=False, threaded=2, denoise=denoise)
+    grid = pynbody.sph.to_3d_grid(gas, **kwargs)
+    # empty cells are 0 (not 0/0 for the denoised grid) whichever path computes them
+    assert np.isfinite(grid).all()
+    assert (grid == 0).any()
+
+    # limit the memory so that the grid is computed in several slabs
+    small = 5 * 40 * 40 * 4 * (2 if denoise else 1)
+    streamed = pynbody.sph.to_3d_grid(gas, out_file=tmp_path / "grid.npy", max_memory=small, **kwargs)
+    assert streamed.units == grid.units
+    npt.assert_array_equal(streamed, grid)
+    del streamed
+    npt.assert_array_equal(np.load(tmp_path / "grid.npy"), grid)
+
+    sparse = pynbody.sph.to_3d_grid(gas, sparse_block_size=8, max_memory=small, **kwargs)
+    assert isinstance(sparse, pynbody.sph.SparseGrid)
+    assert sparse.units == grid.units
+    assert 0 < len(sparse.blocks) < 5 ** 3
+    npt.assert_array_equal(sparse.to_dense(), grid)
+
+
+def test_sparse_grid_with_several_blocks_per_slab(gas):
+    # at the default max_memory, the whole grid is one slab spanning several blocks in x
+    kwargs = dict(nx=32, x2=1.0, approximate_fast=False, threaded=False, denoise=False)
+    grid = pynbody.sph.to_3d_grid(gas, **kwargs)
+    sparse = pynbody.sph.to_3d_grid(gas, sparse_block_size=4, **kwargs)
+    assert len({i for i, j, k in sparse.blocks}) > 1
+    npt.assert_array_equal(sparse.to_dense(), grid)
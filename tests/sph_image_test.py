@@ -107,6 +107,103 @@ def test_approximate_images(compare2d, compare3d):
     assert abs(np.log10(im3d/compare3d)).mean()<0.03
 
 
+@pytest.mark.parametrize("z_camera", [None, 20.0])
+@pytest.mark.parametrize("approximate_fast", [False, True])
+def test_threaded_image_matches_serial(z_camera, approximate_fast):
+    global f
+    # threads own whole tiles of the image, so the result should be identical
+    # (not just close) to the single-threaded render
+    kwargs = dict(nx=300, ny=200, x2=10.0, z_camera=z_camera, approximate_fast=approximate_fast)
+    im_serial = pynbody.sph.render_image(f.gas, threaded=False, **kwargs)
+    im_threaded = pynbody.sph.render_image(f.gas, threaded=3, **kwargs)
+    npt.assert_array_equal(im_serial, im_threaded)
+
+
+def test_tree_culled_image_matches_full():
+    global f
+    pynbody.sph.build_tree(f.gas)
+    kwargs = dict(nx=200, x2=2.0, z_plane=0.3, approximate_fast=False, threaded=False)
+    try:
+        pynbody.config_parser.set('sph', 'tree-culling', 'False')
+        im_full = pynbody.sph.render_image(f.gas, **kwargs)
+        grid_full = pynbody.sph.to_3d_grid(f.gas, nx=40, x2=2.0, threaded=False)
+        pynbody.config_parser.set('sph', 'tree-culling', 'True')
+        im_culled = pynbody.sph.render_image(f.gas, **kwargs)
+        grid_culled = pynbody.sph.to_3d_grid(f.gas, nx=40, x2=2.0, threaded=False)
+    finally:
+        pynbody.config_parser.set('sph', 'tree-culling', 'True')
+
+    npt.assert_array_equal(im_full, im_culled)
+    npt.assert_array_equal(grid_full, grid_culled)
+
+
+@pytest.mark.parametrize("threaded", [False, 3])
+def test_slice_through_z_plane(threaded):
+    # a slice through z_plane should show the particles as a slice through z=0 would
+    # once they are moved down by z_plane
+    rng = np.random.default_rng(5)
+    g = pynbody.new(gas=5000)
+    g['pos'] = rng.uniform(-1.0, 1.0, size=(5000, 3))
+    g['mass'] = np.ones(5000) / 5000
+    g['pos'].units = 'kpc'
+    g['mass'].units = 'Msol'
+    g['smooth'] = pynbody.sph.smooth(g)
+    g['rho'] = pynbody.sph.rho(g)
+
+    kwargs = dict(nx=100, x2=0.5, approximate_fast=False, threaded=threaded)
+    im_plane = pynbody.sph.render_image(g, z_plane=0.25, **kwargs)
+    im_origin = pynbody.sph.render_image(g, z_plane=0.0, **kwargs)
+    g['z'] -= 0.25
+    im_moved = pynbody.sph.render_image(g, z_plane=0.0, **kwargs)
+
+    npt.assert_allclose(im_plane, im_moved, rtol=1e-4, atol=1e-6 * im_moved.max())
+    assert np.abs(im_plane - im_origin).max() > 0.1 * im_origin.max()
+
+
+@pytest.mark.parametrize("threaded", [False, 3])
+def test_multi_channel_image_matches_single(threaded):
+    global f
+    kwargs = dict(nx=200, x2=10.0, approximate_fast=False, threaded=threaded)
+    ims = pynbody.sph.render_image_multi(f.gas, ['rho', 'temp', 'rho'], **kwargs)
+    assert ims.shape == (3, 200, 200)
+    assert ims.units == pynbody.units.NoUnit()
+    # the stack has no overall units, so compare the bare values
+    ims = np.asarray(ims)
+    npt.assert_array_equal(ims[0], pynbody.sph.render_image(f.gas, 'rho', **kwargs).view(np.ndarray))
+    npt.assert_array_equal(ims[1], pynbody.sph.render_image(f.gas, 'temp', **kwargs).view(np.ndarray))
+    npt.assert_array_equal(ims[0], ims[2])
+
+    # a mass-weighted projection, with its normalisation rendered in the same pass
+    weighted = pynbody.sph.render_image_multi(f.gas, ['temp'], 'rho', kernel=pynbody.sph.Kernel2D(),
+                                              out_units='K', **kwargs)
+    f.gas['rho_temp'] = f.gas['rho'] * f.gas['temp']
+    try:
+        expected = pynbody.sph.render_image(f.gas, 'rho_temp', kernel=pynbody.sph.Kernel2D(), **kwargs) / \
+                   pynbody.sph.render_image(f.gas, 'rho', kernel=pynbody.sph.Kernel2D(), **kwargs)
+    finally:
+        del f.ancestor['rho_temp']
+    assert weighted.units == 'K'
+    npt.assert_allclose(weighted[0], expected, rtol=1e-5)
+
+
+@pytest.mark.parametrize("z_camera", [None, 20.0])
+def test_render_frames(z_camera):
+    global f
+    kwargs = dict(nx=100, x2=10.0, z_camera=z_camera, kernel=pynbody.sph.Kernel2D())
+    rotations = np.array([np.eye(3), np.diag([-1.0, -1.0, 1.0])])
+    frames = pynbody.sph.render_frames(f.gas, rotations, threaded=2, **kwargs)
+    assert frames.shape == (2, 100, 100)
+
+    im = pynbody.sph.render_image(f.gas, approximate_fast=False, threaded=False, **kwargs)
+    assert frames.units == im.units
+    npt.assert_array_equal(frames[0], im)
+    # rotating by 180 degrees about the line of sight flips the image, up to rounding in the
+    # kernel lookups for individual pixels
+    flipped = np.asarray(im)[::-1, ::-1]
+    npt.assert_allclose(frames[1].sum(), flipped.sum(), rtol=1e-3)
+    assert np.abs(np.asarray(frames[1]) - flipped).mean() < 0.01 * np.abs(flipped).mean()
+
+
 def test_denoise_projected_image_throws():
     global f
     # this should be fine:
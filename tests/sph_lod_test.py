@@ -0,0 +1,73 @@
+import numpy as np
+import numpy.testing as npt
+import pytest
+
+import pynbody
+from pynbody.sph import lod
+
+
+@pytest.fixture
+def clustered_gas():
+    # a dense clump, which is far smaller than a pixel, in a sparse background
+    rng = np.random.default_rng(2)
+    pos = rng.uniform(-0.5, 0.5, size=(20000, 3))
+    pos[:15000] = 0.1 + 0.01 * rng.normal(size=(15000, 3))
+    f = pynbody.new(gas=len(pos))
+    f['pos'] = pos
+    f['mass'] = np.ones(len(pos)) / len(pos)
+    f['vel'] = rng.normal(size=pos.shape)
+    f['temp'] = 1.0 + pos[:, 0]
+    f['pos'].units = 'kpc'
+    f['vel'].units = 'km s^-1'
+    f['mass'].units = 'Msol'
+    f['temp'].units = 'K'
+    pynbody.sph.build_tree(f)
+    yield f
+
+
+def test_hierarchy_conserves_totals(clustered_gas):
+    f = clustered_gas
+    hierarchy = lod.particle_hierarchy(f, 'temp')
+
+    # a pixel larger than the whole box selects only the root pseudo-particle
+    root = hierarchy.select(10.0)
+    assert len(root['mass']) == 1
+    npt.assert_allclose(root['mass'].sum(), f['mass'].sum(), rtol=1e-10)
+    npt.assert_allclose((root['mass'][:, np.newaxis] * root['vel']).sum(axis=0),
+                        (f['mass'][:, np.newaxis] * f['vel']).sum(axis=0), rtol=1e-8)
+    npt.assert_allclose((root['temp'] * root['mass'] / root['rho']).sum(),
+                        (f['temp'] * f['mass'] / f['rho']).sum(), rtol=1e-10)
+
+    # a pixel smaller than every particle selects the particles themselves, in order
+    particles = hierarchy.select(0.0)
+    npt.assert_array_equal(particles['pos'], f['pos'])
+    npt.assert_array_equal(particles['temp'], f['temp'])
+
+
+def test_hierarchy_is_cached_until_inputs_change(clustered_gas):
+    f = clustered_gas
+    hierarchy = lod.particle_hierarchy(f, 'temp')
+    assert lod.particle_hierarchy(f, 'temp') is hierarchy
+    assert lod.particle_hierarchy(f, 'rho') is not hierarchy
+
+    f['temp'] *= 2
+    new_hierarchy = lod.particle_hierarchy(f, 'temp')
+    assert new_hierarchy is not hierarchy
+    npt.assert_allclose(new_hierarchy.select(10.0)['temp'], 2 * hierarchy.select(10.0)['temp'])
+
+
+@pytest.mark.parametrize("kernel", [pynbody.sph.Kernel2D(), pynbody.sph.Kernel()])
+def test_level_of_detail_image_close_to_full(clustered_gas, kernel):
+    f = clustered_gas
+    kwargs = dict(qty='temp', nx=32, x2=0.5, kernel=kernel, approximate_fast=False, threaded=False)
+    im_full = pynbody.sph.render_image(f, **kwargs)
+    im_lod = pynbody.sph.render_image(f, level_of_detail=True, **kwargs)
+
+    # most of the clump is drawn as pseudo-particles...
+    assert len(lod.particle_hierarchy(f, 'temp').select(1.0 / 32)['mass']) < len(f) / 2
+
+    # ...but the image is only perturbed below the pixel scale
+    assert im_lod.units == im_full.units
+    if kernel.h_power == 2:
+        npt.assert_allclose(im_lod.sum(), im_full.sum(), rtol=0.02)
+    assert np.abs(np.log10(im_lod / im_full)).mean() < 0.05
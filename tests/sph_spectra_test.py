@@ -0,0 +1,73 @@
+import numpy as np
+import numpy.testing as npt
+import pytest
+import scipy.special
+
+import pynbody
+
+
+@pytest.fixture
+def gas():
+    rng = np.random.default_rng(5)
+    f = pynbody.new(gas=3000)
+    f['pos'] = rng.uniform(-1.0, 1.0, size=(3000, 3))
+    f['vel'] = 50.0 * rng.normal(size=(3000, 3))
+    f['mass'] = np.ones(3000) / 3000
+    f['temp'] = 10 ** rng.uniform(3.5, 5.0, size=3000)
+    f['pos'].units = 'kpc'
+    f['vel'].units = 'km s^-1'
+    f['mass'].units = 'Msol'
+    f['temp'].units = 'K'
+    yield f
+
+
+def test_spectrum_matches_brute_force(gas):
+    vels, tau = pynbody.sph.spectra(gas, x1=0.1, y1=-0.2, v2=300, nvel=150)
+    assert vels.shape == tau.shape == (150,)
+
+    # project each particle with the tabulated 2D kernel, and spread it over its thermal profile
+    kernel = pynbody.sph.Kernel2D()
+    samples = kernel.get_samples()
+    h = gas['smooth'].view(np.ndarray)
+    d2 = (gas['x'].view(np.ndarray) - 0.1) ** 2 + (gas['y'].view(np.ndarray) + 0.2) ** 2
+    index = (len(samples) * d2 / (4 * h ** 2)).astype(int)
+    weight = np.where(index < len(samples), samples[np.minimum(index, len(samples) - 1)] / h ** 2, 0)
+    column = gas['mass'] / gas['rho'] * gas['rho'] * weight
+
+    b = np.sqrt(2 * 1.3806503e-16 * gas['temp'].view(np.ndarray) / 1.67262158e-24) / 1e5
+    edges = np.linspace(-300, 300, 151)
+    profile = (scipy.special.erf((edges[np.newaxis, 1:] - gas['vz'].view(np.ndarray)[:, np.newaxis]) / b[:, np.newaxis]) -
+               scipy.special.erf((edges[np.newaxis, :-1] - gas['vz'].view(np.ndarray)[:, np.newaxis]) / b[:, np.newaxis])) / 2
+    expected = (np.asarray(column)[:, np.newaxis] * profile).sum(axis=0) / 4.0
+
+    # tau is proportional to the column per unit velocity
+    ratio = np.asarray(tau)[expected > 0] / expected[expected > 0]
+    npt.assert_allclose(ratio, ratio.mean(), rtol=1e-4)
+
+
+@pytest.mark.parametrize("profile", ['gaussian', 'voigt'])
+def test_many_sightlines_match_single(gas, profile):
+    rng = np.random.default_rng(6)
+    x, y = rng.uniform(-0.8, 0.8, size=(2, 50))
+    kwargs = dict(v2=300, nvel=100, profile=profile)
+    vels, tau = pynbody.sph.spectra(gas, x1=x, y1=y, threaded=3, **kwargs)
+    assert tau.shape == (50, 100)
+    for i in 0, 17, 49:
+        npt.assert_array_equal(tau[i], pynbody.sph.spectra(gas, x1=x[i], y1=y[i], threaded=False, **kwargs)[1])
+
+
+def test_voigt_profile_adds_damping_wings(gas):
+    # a single cool particle on the sightline, strong enough to have damping wings
+    f = gas[[0]]
+    f['temp'] = 1e4
+    f['vz'] = 0.0
+    kwargs = dict(x1=float(f['x'][0]), y1=float(f['y'][0]), v2=1000, nvel=2000, qty='rho')
+    _, tau_gauss = pynbody.sph.spectra(f, **kwargs)
+    _, tau_voigt = pynbody.sph.spectra(f, profile='voigt', **kwargs)
+
+    core = slice(995, 1005)
+    npt.assert_allclose(tau_voigt[core], tau_gauss[core], rtol=0.05)
+    assert tau_gauss[0] == 0
+    assert tau_voigt[0] > 0
+    # the wings fall off as the Lorentzian, 1/v^2
+    npt.assert_allclose(tau_voigt[200] / tau_voigt[0], ((1000 - 0.25) / (1000 - 200.25)) ** 2, rtol=0.01)
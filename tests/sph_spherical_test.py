@@ -0,0 +1,80 @@
+import numpy as np
+import numpy.testing as npt
+import pytest
+
+import pynbody
+
+
+def _ring_pixel_centres(nside):
+    # unit vectors to the HEALPix pixel centres in the RING scheme (Gorski et al. 2005, section 4)
+    z, phi = [], []
+    for ring in range(1, 4 * nside):
+        northern = min(ring, 4 * nside - ring)
+        if northern < nside:
+            n_pixels, shift = 4 * northern, 0.5
+            z_ring = np.sign(2 * nside - ring) * (1 - northern ** 2 / (3 * nside ** 2))
+        else:
+            n_pixels, shift = 4 * nside, 0.5 if (ring - nside) % 2 == 0 else 0.0
+            z_ring = 4 / 3 - 2 * ring / (3 * nside)
+        z.append(np.repeat(z_ring, n_pixels))
+        phi.append((np.arange(n_pixels) + shift) * 2 * np.pi / n_pixels)
+    z, phi = np.concatenate(z), np.concatenate(phi)
+    sin_theta = np.sqrt(1 - z ** 2)
+    return np.stack([sin_theta * np.cos(phi), sin_theta * np.sin(phi), z], axis=1)
+
+
+@pytest.mark.parametrize("nside", [1, 3, 8])
+def test_spherical_core_matches_brute_force(nside):
+    rng = np.random.default_rng(nside)
+    n = 200
+    pos = rng.normal(size=(n, 3))
+    pos[:2] = [[0, 0, 1], [0, 0, -1]]  # discs around the poles
+    r = np.sqrt((pos ** 2).sum(axis=1))
+    h = rng.uniform(0.01, 1.5, n)
+    qty = rng.uniform(size=n)
+    ds = np.array([0.5, 1.0, 1.5, 2.0])
+    weights = np.array([1.0, 2.0, 3.0, 4.0])
+
+    im, im_norm = pynbody.sph._render.render_spherical_image_core(np.ones(n), np.ones(n), qty, pos, r, h,
+                                                                   np.arange(n), ds, weights, nside)
+
+    # every pixel whose centre is within each disc gets the disc's contribution
+    centres = _ring_pixel_centres(nside)
+    expected = np.zeros(len(centres))
+    for i in range(n):
+        cos_distance = centres @ (pos[i] / r[i])
+        for d, w in zip(ds, weights):
+            angle = np.float32(np.arctan(h[i] * d / r[i]))
+            expected[cos_distance >= np.cos(angle)] += qty[i] * w / h[i] ** 2
+
+    npt.assert_allclose(im, expected, rtol=1e-5, atol=1e-5 * expected.max())
+
+    im_threaded, _ = pynbody.sph._render.render_spherical_image_core(np.ones(n), np.ones(n), qty, pos, r, h,
+                                                                      np.arange(n), ds, weights, nside,
+                                                                      num_threads=3)
+    # threads own whole rings of the map, so the result does not depend on their number
+    npt.assert_array_equal(im_threaded, im)
+
+
+@pytest.mark.parametrize("kernel", [pynbody.sph.Kernel(), pynbody.sph.Kernel2D()])
+def test_tree_culled_spherical_image_matches_full(kernel):
+    rng = np.random.default_rng(4)
+    f = pynbody.new(gas=5000)
+    f['pos'] = rng.uniform(-1.0, 1.0, size=(5000, 3))
+    f['mass'] = np.ones(5000) / 5000
+    f['pos'].units = 'kpc'
+    f['mass'].units = 'Msol'
+    pynbody.sph.build_tree(f)
+
+    kwargs = dict(nside=8, distance=0.5, kernel=kernel, denoise=False, threaded=False)
+    try:
+        pynbody.config_parser.set('sph', 'tree-culling', 'False')
+        im_full = pynbody.sph.render_spherical_image(f, **kwargs)
+        pynbody.config_parser.set('sph', 'tree-culling', 'True')
+        im_culled = pynbody.sph.render_spherical_image(f, **kwargs)
+    finally:
+        pynbody.config_parser.set('sph', 'tree-culling', 'True')
+
+    assert im_full.shape == (12 * 8 ** 2,)
+    assert (im_full > 0).all()
+    npt.assert_array_equal(im_culled, im_full)
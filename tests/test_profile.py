@@ -1,5 +1,6 @@
 import numpy as np
 import numpy.testing as npt
+import pytest
 
 import pynbody
 
@@ -62,6 +63,40 @@ def test_potential_profile_fp32():
     p['pot']
 
 
+@pytest.mark.filterwarnings("ignore:.*:RuntimeWarning")
+def test_decomp_rotation_curve_of_whole_halo():
+    # with no rotation curve on disk, decomp calculates it for the disc profile from the whole halo
+    n_star, n_dm = 4000, 8000
+    f = pynbody.new(dm=n_dm, star=n_star)
+    r = np.random.exponential(2.0, n_star)
+    az = np.random.uniform(0, 2*np.pi, n_star)
+    f.star['pos'] = np.column_stack((r*np.cos(az), r*np.sin(az), np.random.normal(0, 0.1, n_star)))
+    f.dm['pos'] = np.random.normal(0, 10.0, (n_dm, 3))
+    f['pos'].units = 'kpc'
+    f.star['mass'] = 1.e10/n_star
+    f.dm['mass'] = 1.e11/n_dm
+    f['mass'].units = 'Msol'
+    f['eps'] = 0.1
+    f['eps'].units = 'kpc'
+
+    G = 4.30091e-6 # kpc (km/s)^2 / Msol
+    radius = np.asarray(f['r'])
+    mass = np.asarray(f['mass'])
+    R = np.asarray(f.star['rxy'])
+    v = np.array([np.sqrt(G*mass[radius < x].sum()/x) for x in radius[n_dm:]])
+    f['vel'] = np.zeros((len(f), 3))
+    f.star['vel'] = np.column_stack((-v*np.asarray(f.star['y'])/R, v*np.asarray(f.star['x'])/R, np.zeros(n_star)))
+    f['vel'].units = 'km s^-1'
+
+    p = pynbody.analysis.decomp(f, aligned=True)
+
+    assert np.all(f.star['decomp'] > 0)
+    rbins = np.asarray(p['rbins'])
+    within = (rbins > 1) & (rbins < 10)
+    v_circ = np.array([np.sqrt(G*mass[radius < x].sum()/x) for x in rbins[within]])
+    npt.assert_allclose(p['v_circ'].in_units('km s^-1')[within], v_circ, rtol=0.15)
+
+
 def test_unique_hash_generation():
     f1 = pynbody.load("testdata/g15784.lr.01024")
     p1 = pynbody.analysis.profile.Profile(f1, nbins=50)